@@ -0,0 +1,180 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "circuit_breaker.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "config/config.h"
+#include "logging.h"
+#include "statistics.h"
+
+using namespace config;
+
+inline constexpr int OPERATIONS = 2;
+inline constexpr int FORMATS = static_cast<int>(CompressedFormat::GZIP) + 1;
+inline constexpr uint32_t MAX_BACKOFF_SHIFT = 10;
+
+struct CircuitBreaker {
+  std::atomic<uint32_t> consecutive_failures{0};
+  // Time until which the accelerator is skipped, 0 if the breaker is closed
+  std::atomic<uint64_t> open_until_ns{0};
+  // Number of failed probes since the breaker opened
+  std::atomic<uint32_t> backoff_shift{0};
+};
+
+// Indexed by path (QAT, IAA), operation and format
+static CircuitBreaker breakers[2][OPERATIONS][FORMATS];
+
+// Breakers whose probe was let through to a call of this thread, one bit per
+// breaker. Only the result of the probe extends the backoff time, not those of
+// calls that were already running when the breaker opened.
+static thread_local uint32_t pending_probes = 0;
+static_assert(sizeof(breakers) / sizeof(CircuitBreaker) <= 32,
+              "Too many breakers for the probe bits");
+
+static uint32_t GetProbeBit(const CircuitBreaker* breaker) {
+  return 1u << (breaker - &breakers[0][0][0]);
+}
+
+static CircuitBreaker* GetBreaker(ExecutionPath path, Operation operation,
+                                  CompressedFormat format) {
+  if ((path != QAT && path != IAA) || format == CompressedFormat::INVALID) {
+    return nullptr;
+  }
+  return &breakers[path == QAT ? 0 : 1][static_cast<int>(operation)]
+                  [static_cast<int>(format)];
+}
+
+static uint64_t GetBackoffNs(uint32_t backoff_shift) {
+  return static_cast<uint64_t>(configs[CIRCUIT_BREAKER_BACKOFF_MS]) * 1000000
+         << backoff_shift;
+}
+
+bool CircuitBreakerAllows(ExecutionPath path, Operation operation,
+                          CompressedFormat format) {
+  CircuitBreaker* breaker = GetBreaker(path, operation, format);
+  if (configs[CIRCUIT_BREAKER_THRESHOLD] == 0 || breaker == nullptr) {
+    return true;
+  }
+  uint64_t open_until_ns =
+      breaker->open_until_ns.load(std::memory_order_relaxed);
+  if (open_until_ns == 0) {
+    return true;
+  }
+  uint64_t now_ns = GetTimeNs();
+  if (now_ns < open_until_ns) {
+    INCREMENT_STAT(CIRCUIT_BREAKER_SKIP_COUNT);
+    return false;
+  }
+
+  // Half open: the caller that extends the open period sends the probe. If the
+  // probe result is never reported, another probe is sent after the extension.
+  uint32_t backoff_shift =
+      breaker->backoff_shift.load(std::memory_order_relaxed);
+  if (breaker->open_until_ns.compare_exchange_strong(
+          open_until_ns, now_ns + GetBackoffNs(backoff_shift),
+          std::memory_order_relaxed)) {
+    pending_probes |= GetProbeBit(breaker);
+    return true;
+  }
+  INCREMENT_STAT(CIRCUIT_BREAKER_SKIP_COUNT);
+  return false;
+}
+
+void RecordCircuitBreakerResult(ExecutionPath path, Operation operation,
+                                CompressedFormat format, bool success) {
+  CircuitBreaker* breaker = GetBreaker(path, operation, format);
+  if (configs[CIRCUIT_BREAKER_THRESHOLD] == 0 || breaker == nullptr) {
+    return;
+  }
+  bool probe = (pending_probes & GetProbeBit(breaker)) != 0;
+  pending_probes &= ~GetProbeBit(breaker);
+  if (success) {
+    breaker->consecutive_failures.store(0, std::memory_order_relaxed);
+    if (breaker->open_until_ns.load(std::memory_order_relaxed) != 0) {
+      breaker->open_until_ns.store(0, std::memory_order_relaxed);
+      breaker->backoff_shift.store(0, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  uint32_t failures =
+      breaker->consecutive_failures.fetch_add(1, std::memory_order_relaxed) +
+      1;
+  uint64_t open_until_ns =
+      breaker->open_until_ns.load(std::memory_order_relaxed);
+  uint32_t backoff_shift = 0;
+  if (open_until_ns != 0) {
+    if (!probe) {
+      return;
+    }
+    // Failed probe
+    backoff_shift = std::min(
+        breaker->backoff_shift.load(std::memory_order_relaxed) + 1,
+        MAX_BACKOFF_SHIFT);
+  } else if (failures < configs[CIRCUIT_BREAKER_THRESHOLD]) {
+    return;
+  }
+  breaker->backoff_shift.store(backoff_shift, std::memory_order_relaxed);
+  breaker->open_until_ns.store(GetTimeNs() + GetBackoffNs(backoff_shift),
+                               std::memory_order_relaxed);
+  INCREMENT_STAT(CIRCUIT_BREAKER_OPEN_COUNT);
+  Log(LogLevel::LOG_ERROR, "RecordCircuitBreakerResult Line ", __LINE__,
+      " circuit breaker open, path ", static_cast<int>(path), ", operation ",
+      static_cast<int>(operation), ", format ", static_cast<int>(format),
+      ", failures ", failures, "\n");
+}
+
+CircuitState GetCircuitState(ExecutionPath path, Operation operation,
+                             CompressedFormat format) {
+  CircuitBreaker* breaker = GetBreaker(path, operation, format);
+  if (breaker == nullptr) {
+    return CircuitState::CLOSED;
+  }
+  uint64_t open_until_ns =
+      breaker->open_until_ns.load(std::memory_order_relaxed);
+  if (open_until_ns == 0) {
+    return CircuitState::CLOSED;
+  }
+  return GetTimeNs() < open_until_ns ? CircuitState::OPEN
+                                     : CircuitState::HALF_OPEN;
+}
+
+void ResetCircuitBreakers() {
+  pending_probes = 0;
+  for (auto& path_breakers : breakers) {
+    for (auto& operation_breakers : path_breakers) {
+      for (auto& breaker : operation_breakers) {
+        breaker.consecutive_failures.store(0, std::memory_order_relaxed);
+        breaker.open_until_ns.store(0, std::memory_order_relaxed);
+        breaker.backoff_shift.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+std::string GetOpenCircuitBreakers() {
+  static const char* path_names[] = {"qat", "iaa"};
+  static const char* operation_names[OPERATIONS] = {"compress", "uncompress"};
+  static const char* format_names[FORMATS] = {"raw", "zlib", "gzip"};
+  std::string names;
+  for (int p = 0; p < 2; p++) {
+    for (int o = 0; o < OPERATIONS; o++) {
+      for (int f = 0; f < FORMATS; f++) {
+        CircuitState state =
+            GetCircuitState(p == 0 ? QAT : IAA, static_cast<Operation>(o),
+                            static_cast<CompressedFormat>(f));
+        if (state == CircuitState::CLOSED) {
+          continue;
+        }
+        names += names.empty() ? "" : " ";
+        names += std::string(path_names[p]) + "." + operation_names[o] + "." +
+                 format_names[f] +
+                 (state == CircuitState::OPEN ? "(open)" : "(half-open)");
+      }
+    }
+  }
+  return names.empty() ? "none" : names;
+}
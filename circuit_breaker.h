@@ -0,0 +1,47 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "scheduler.h"
+#include "utils.h"
+#include "zlib_accel.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Circuit breakers for the accelerators (circuit_breaker_threshold option).
+// There is one breaker per accelerator, operation and format. A breaker opens
+// after circuit_breaker_threshold consecutive failed calls, and the
+// accelerator is then skipped for that operation and format. When the backoff
+// time expires, a single call is let through to probe the accelerator. If the
+// probe succeeds, the breaker closes. Otherwise it opens again with twice the
+// backoff time, up to MAX_BACKOFF_SHIFT doublings. Failures of other calls
+// while the breaker is open (e.g., calls that started before it opened) do not
+// change the backoff time.
+// Breakers are shared by all threads and updated without locks.
+
+enum class CircuitState { CLOSED, OPEN, HALF_OPEN };
+
+// Returns whether a call can be sent to the accelerator. If the backoff time of
+// an open breaker has expired, only the first caller is allowed, as the probe.
+VISIBLE_FOR_TESTING bool CircuitBreakerAllows(ExecutionPath path,
+                                              Operation operation,
+                                              CompressedFormat format);
+
+// Reports the outcome of a call sent to the accelerator
+VISIBLE_FOR_TESTING void RecordCircuitBreakerResult(ExecutionPath path,
+                                                    Operation operation,
+                                                    CompressedFormat format,
+                                                    bool success);
+
+VISIBLE_FOR_TESTING CircuitState GetCircuitState(ExecutionPath path,
+                                                 Operation operation,
+                                                 CompressedFormat format);
+
+VISIBLE_FOR_TESTING void ResetCircuitBreakers();
+
+// Names of the breakers that are not closed, for statistics
+VISIBLE_FOR_TESTING std::string GetOpenCircuitBreakers();
@@ -6,6 +6,8 @@
 #include <climits>
 #include <filesystem>
 
+#include "../hedge.h"
+#include "../routing_policy.h"
 #include "config_reader.h"
 
 using namespace std;
@@ -28,10 +30,32 @@ uint32_t configs[CONFIG_MAX] = {
     0,   /*qat_periodical_polling*/
     1,   /*qat_compression_level*/
     0,   /*qat_compression_allow_chunking*/
+    0,   /*compression_level_mapping*/
+    0,   /*deflate_streaming*/
+    0,   /*inflate_buffer_input*/
+    0,   /*inflate_buffer_output*/
+    0,   /*deflate_buffer_output*/
+    0,   /*adaptive_scheduling*/
+    0,   /*occupancy_routing*/
+    0,   /*incompressible_check*/
+    0,   /*circuit_breaker_threshold*/
+    100, /*circuit_breaker_backoff_ms*/
+    0,   /*parallel_compression_threshold*/
+    4,   /*parallel_compression_threads*/
+    0,   /*zlib_parallel_threshold*/
+    0,   /*inflate_expansion_prediction*/
+    0,   /*ratio_guard_sample_percentage*/
+    90,  /*ratio_guard_floor*/
+    0,   /*result_cache_size_mb*/
+    0,   /*lazy_zlib_init*/
+    0,   /*zlib_state_pool_size*/
     2,   /*log_level*/
     1000 /*log_stats_samples*/
 };
 
+bool compress_passthrough = false;
+bool uncompress_passthrough = false;
+
 bool LoadConfigFile(std::string& file_content, const char* file_path) {
   // Initialize config_names within the function to avoid initialization order
   // problems. LoadConfigFile is called from the zlib-accel shared library
@@ -51,6 +75,25 @@ bool LoadConfigFile(std::string& file_content, const char* file_path) {
     "qat_periodical_polling",
     "qat_compression_level",
 	  "qat_compression_allow_chunking",
+    "compression_level_mapping",
+    "deflate_streaming",
+    "inflate_buffer_input",
+    "inflate_buffer_output",
+    "deflate_buffer_output",
+    "adaptive_scheduling",
+    "occupancy_routing",
+    "incompressible_check",
+    "circuit_breaker_threshold",
+    "circuit_breaker_backoff_ms",
+    "parallel_compression_threshold",
+    "parallel_compression_threads",
+    "zlib_parallel_threshold",
+    "inflate_expansion_prediction",
+    "ratio_guard_sample_percentage",
+    "ratio_guard_floor",
+    "result_cache_size_mb",
+    "lazy_zlib_init",
+    "zlib_state_pool_size",
     "log_level",
     "log_stats_samples"
   };
@@ -83,17 +126,76 @@ bool LoadConfigFile(std::string& file_content, const char* file_path) {
   trySetConfig(QAT_PERIODICAL_POLLING, 1, 0);
   trySetConfig(QAT_COMPRESSION_LEVEL, 9, 1);
   trySetConfig(QAT_COMPRESSION_ALLOW_CHUNKING, 1, 0);
+  trySetConfig(COMPRESSION_LEVEL_MAPPING, 1, 0);
+  trySetConfig(DEFLATE_STREAMING, 1, 0);
+  trySetConfig(INFLATE_BUFFER_INPUT, 1, 0);
+  trySetConfig(INFLATE_BUFFER_OUTPUT, 1, 0);
+  trySetConfig(DEFLATE_BUFFER_OUTPUT, 1, 0);
+  trySetConfig(ADAPTIVE_SCHEDULING, 1, 0);
+  trySetConfig(OCCUPANCY_ROUTING, 1, 0);
+  trySetConfig(INCOMPRESSIBLE_CHECK, 1, 0);
+  trySetConfig(CIRCUIT_BREAKER_THRESHOLD, 1000, 0);
+  trySetConfig(CIRCUIT_BREAKER_BACKOFF_MS, 60000, 1);
+  trySetConfig(PARALLEL_COMPRESSION_THRESHOLD, UINT32_MAX, 0);
+  trySetConfig(PARALLEL_COMPRESSION_THREADS, 64, 1);
+  trySetConfig(ZLIB_PARALLEL_THRESHOLD, UINT32_MAX, 0);
+  trySetConfig(INFLATE_EXPANSION_PREDICTION, 1, 0);
+  trySetConfig(RATIO_GUARD_SAMPLE_PERCENTAGE, 100, 0);
+  trySetConfig(RATIO_GUARD_FLOOR, 100, 1);
+  trySetConfig(RESULT_CACHE_SIZE_MB, 65536, 0);
+  trySetConfig(LAZY_ZLIB_INIT, 1, 0);
+  trySetConfig(ZLIB_STATE_POOL_SIZE, 64, 0);
   trySetConfig(LOG_LEVEL, 2, 0);
   trySetConfig(LOG_STATS_SAMPLES, UINT32_MAX, 0);
 
+  LoadRoutingPolicy(config_reader.GetValues("route."));
+  LoadDeadlines(config_reader.GetValues("deadline."));
+
   config_reader.GetValue("log_file", log_file);
   file_content.append(config_reader.DumpValues());
 
+  UpdatePassthrough();
   return true;
 }
 
-void SetConfig(ConfigOption option, uint32_t value) { configs[option] = value; }
+void SetConfig(ConfigOption option, uint32_t value) {
+  configs[option] = value;
+  UpdatePassthrough();
+}
+
+void UpdatePassthrough() {
+  bool accelerator_compress = false;
+  bool accelerator_uncompress = false;
+#ifdef USE_QAT
+  accelerator_compress |= configs[USE_QAT_COMPRESS] != 0;
+  accelerator_uncompress |= configs[USE_QAT_UNCOMPRESS] != 0;
+#endif
+#ifdef USE_IAA
+  accelerator_compress |= configs[USE_IAA_COMPRESS] != 0;
+  accelerator_uncompress |= configs[USE_IAA_UNCOMPRESS] != 0;
+#endif
+  // Calls are not logged in passthrough mode, so it is disabled when info
+  // messages are logged
+  bool log_calls = false;
+#ifdef DEBUG_LOG
+  log_calls = configs[LOG_LEVEL] <= 1;
+#endif
+
+  compress_passthrough = !accelerator_compress && !log_calls &&
+                         configs[USE_ZLIB_COMPRESS] != 0 &&
+                         configs[INCOMPRESSIBLE_CHECK] == 0 &&
+                         configs[PARALLEL_COMPRESSION_THRESHOLD] == 0 &&
+                         configs[ZLIB_PARALLEL_THRESHOLD] == 0 &&
+                         configs[RESULT_CACHE_SIZE_MB] == 0 &&
+                         configs[ZLIB_STATE_POOL_SIZE] == 0;
+  uncompress_passthrough = !accelerator_uncompress && !log_calls &&
+                           configs[USE_ZLIB_UNCOMPRESS] != 0 &&
+                           configs[RESULT_CACHE_SIZE_MB] == 0 &&
+                           configs[ZLIB_STATE_POOL_SIZE] == 0;
+}
 
 uint32_t GetConfig(ConfigOption option) { return configs[option]; }
 
+bool IsCompressPassthrough() { return compress_passthrough; }
+
 }  // namespace config
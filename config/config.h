@@ -23,6 +23,25 @@ enum ConfigOption {
   QAT_PERIODICAL_POLLING,
   QAT_COMPRESSION_LEVEL,
   QAT_COMPRESSION_ALLOW_CHUNKING,
+  COMPRESSION_LEVEL_MAPPING,
+  DEFLATE_STREAMING,
+  INFLATE_BUFFER_INPUT,
+  INFLATE_BUFFER_OUTPUT,
+  DEFLATE_BUFFER_OUTPUT,
+  ADAPTIVE_SCHEDULING,
+  OCCUPANCY_ROUTING,
+  INCOMPRESSIBLE_CHECK,
+  CIRCUIT_BREAKER_THRESHOLD,
+  CIRCUIT_BREAKER_BACKOFF_MS,
+  PARALLEL_COMPRESSION_THRESHOLD,
+  PARALLEL_COMPRESSION_THREADS,
+  ZLIB_PARALLEL_THRESHOLD,
+  INFLATE_EXPANSION_PREDICTION,
+  RATIO_GUARD_SAMPLE_PERCENTAGE,
+  RATIO_GUARD_FLOOR,
+  RESULT_CACHE_SIZE_MB,
+  LAZY_ZLIB_INIT,
+  ZLIB_STATE_POOL_SIZE,
   LOG_LEVEL,
   LOG_STATS_SAMPLES,
   CONFIG_MAX
@@ -32,9 +51,18 @@ extern std::string log_file;
 
 extern uint32_t configs[CONFIG_MAX];
 
+// Set when no accelerator or shim feature can handle compression
+// (compress_passthrough) or decompression (uncompress_passthrough) calls. These
+// calls are then passed straight to zlib. Updated when the configuration
+// changes.
+extern bool compress_passthrough;
+extern bool uncompress_passthrough;
+
 VISIBLE_FOR_TESTING bool LoadConfigFile(
     std::string& file_content, const char* file_path = "/etc/zlib-accel.conf");
 
 VISIBLE_FOR_TESTING void SetConfig(ConfigOption option, uint32_t value);
+VISIBLE_FOR_TESTING void UpdatePassthrough();
+VISIBLE_FOR_TESTING bool IsCompressPassthrough();
 VISIBLE_FOR_TESTING uint32_t GetConfig(ConfigOption option);
 }  // namespace config
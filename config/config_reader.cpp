@@ -67,6 +67,18 @@ bool ConfigReader::GetValue(const std::string& tag, std::string& value) {
   return true;
 }
 
+std::map<std::string, std::string> ConfigReader::GetValues(
+    const std::string& prefix) {
+  std::map<std::string, std::string> values;
+  for (auto it = config_settings_map.lower_bound(prefix);
+       it != config_settings_map.end() &&
+       it->first.compare(0, prefix.size(), prefix) == 0;
+       ++it) {
+    values.insert(*it);
+  }
+  return values;
+}
+
 bool ConfigReader::ParseFile(const std::string& file_name) {
   std::ifstream input_file(file_name);
 
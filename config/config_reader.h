@@ -22,6 +22,8 @@ class ConfigReader {
   bool GetValue(const std::string& tag, uint32_t& value,
                 uint32_t max_value = 100, uint32_t min_value = 0);
   bool GetValue(const std::string& tag, std::string& value);
+  // Returns all tags starting with prefix, with their values
+  std::map<std::string, std::string> GetValues(const std::string& prefix);
 
   std::string DumpValues();
 
@@ -0,0 +1,75 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "expansion_predictor.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "config/config.h"
+
+using namespace config;
+
+inline constexpr int FORMATS = static_cast<int>(CompressedFormat::GZIP) + 1;
+// Ratios are scaled by RATIO_SCALE
+inline constexpr uint64_t RATIO_SCALE = 256;
+// Max expansion of deflate
+inline constexpr uint64_t MAX_RATIO = 1032 * RATIO_SCALE;
+// Weight of a new sample in the moving average is 1/2^AVERAGE_SHIFT
+inline constexpr int AVERAGE_SHIFT = 2;
+inline constexpr uint32_t MIN_SAMPLES = 4;
+
+struct ExpansionEstimate {
+  uint64_t ratio = 0;
+  uint32_t samples = 0;
+};
+
+static thread_local ExpansionEstimate estimates[FORMATS];
+
+void RecordExpansion(CompressedFormat format, uint32_t input_length,
+                     uint32_t output_length) {
+  if (!configs[INFLATE_EXPANSION_PREDICTION] ||
+      format == CompressedFormat::INVALID || input_length == 0) {
+    return;
+  }
+  ExpansionEstimate* estimate = &estimates[static_cast<int>(format)];
+  uint64_t sample = std::min(
+      static_cast<uint64_t>(output_length) * RATIO_SCALE / input_length,
+      MAX_RATIO);
+  if (estimate->samples == 0) {
+    estimate->ratio = sample;
+  } else {
+    estimate->ratio = estimate->ratio - (estimate->ratio >> AVERAGE_SHIFT) +
+                      (sample >> AVERAGE_SHIFT);
+  }
+  if (estimate->samples < MIN_SAMPLES) {
+    estimate->samples++;
+  }
+}
+
+uint32_t PredictExpandedSize(CompressedFormat format, uint32_t input_length) {
+  if (!configs[INFLATE_EXPANSION_PREDICTION] ||
+      format == CompressedFormat::INVALID) {
+    return 0;
+  }
+  const ExpansionEstimate& estimate = estimates[static_cast<int>(format)];
+  if (estimate.samples < MIN_SAMPLES) {
+    return 0;
+  }
+  uint64_t size = input_length * estimate.ratio / RATIO_SCALE;
+  return static_cast<uint32_t>(std::min<uint64_t>(
+      std::max<uint64_t>(size, 1), std::numeric_limits<uint32_t>::max()));
+}
+
+bool PredictOutputOverflow(CompressedFormat format, uint32_t input_length,
+                           uint32_t output_length) {
+  uint64_t size = PredictExpandedSize(format, input_length);
+  // Streams are tried unless they are predicted to need a third more space
+  return size > 0 && size - size / 4 > output_length;
+}
+
+void ResetExpansionPredictor() {
+  for (ExpansionEstimate& estimate : estimates) {
+    estimate = ExpansionEstimate();
+  }
+}
@@ -0,0 +1,35 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+
+#include "utils.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Prediction of the decompressed size of streams without a size field
+// (inflate_expansion_prediction option). Each thread keeps, per format, a
+// moving average of the expansion ratio (decompressed size / compressed size)
+// of the streams it decompressed. Once enough streams were observed, the
+// decompressed size of a new stream is predicted from its compressed size.
+
+// Records the sizes of a decompressed stream
+VISIBLE_FOR_TESTING void RecordExpansion(CompressedFormat format,
+                                         uint32_t input_length,
+                                         uint32_t output_length);
+
+// Returns the predicted decompressed size, or 0 if there are not enough
+// samples
+VISIBLE_FOR_TESTING uint32_t PredictExpandedSize(CompressedFormat format,
+                                                 uint32_t input_length);
+
+// Returns whether the decompressed stream is predicted not to fit in
+// output_length bytes. A margin is applied, so that streams close to the
+// limit are still tried.
+VISIBLE_FOR_TESTING bool PredictOutputOverflow(CompressedFormat format,
+                                               uint32_t input_length,
+                                               uint32_t output_length);
+
+VISIBLE_FOR_TESTING void ResetExpansionPredictor();
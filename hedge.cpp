@@ -0,0 +1,232 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "hedge.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include "logging.h"
+#include "routing_policy.h"
+#include "statistics.h"
+
+inline constexpr int OPERATIONS = 2;
+inline constexpr int HEDGE_WORKERS = 8;
+// Max workers blocked on abandoned calls, in addition to HEDGE_WORKERS
+inline constexpr int MAX_BLOCKED_WORKERS = 8;
+
+static std::atomic<uint32_t> deadlines_us[OPERATIONS][SIZE_CLASSES];
+
+int LoadDeadlines(const std::map<std::string, std::string>& deadlines) {
+  uint32_t new_deadlines_us[OPERATIONS][SIZE_CLASSES] = {};
+  int valid = 0;
+  for (const auto& [tag, value] : deadlines) {
+    // deadline.<operation>.<size range>
+    const std::string prefix = "deadline.";
+    auto delimiter_pos = tag.find('.', prefix.size());
+    std::string operation = tag.substr(
+        prefix.size(), delimiter_pos == std::string::npos
+                           ? std::string::npos
+                           : delimiter_pos - prefix.size());
+    int o = operation == "compress" ? 0 : operation == "uncompress" ? 1 : -1;
+    int min_size_class;
+    int max_size_class;
+    if (tag.compare(0, prefix.size(), prefix) != 0 || o < 0 ||
+        delimiter_pos == std::string::npos ||
+        !ParseSizeRange(tag.substr(delimiter_pos + 1), &min_size_class,
+                        &max_size_class) ||
+        value.empty() || value.size() > 9 ||
+        value.find_first_not_of("0123456789") != std::string::npos) {
+      Log(LogLevel::LOG_ERROR, "LoadDeadlines Line ", __LINE__,
+          " invalid deadline ", tag.c_str(), " = ", value.c_str(), "\n");
+      continue;
+    }
+    for (int s = min_size_class; s <= max_size_class; s++) {
+      new_deadlines_us[o][s] = static_cast<uint32_t>(std::stoul(value));
+    }
+    valid++;
+  }
+
+  for (int o = 0; o < OPERATIONS; o++) {
+    for (int s = 0; s < SIZE_CLASSES; s++) {
+      deadlines_us[o][s].store(new_deadlines_us[o][s],
+                               std::memory_order_relaxed);
+    }
+  }
+  return valid;
+}
+
+uint32_t GetDeadlineUs(Operation operation, uint32_t input_length) {
+  return deadlines_us[static_cast<int>(operation)][GetSizeClass(input_length)]
+      .load(std::memory_order_relaxed);
+}
+
+// A call and copies of its buffers, shared by the caller and the worker until
+// both are done with it
+struct HedgeJob {
+  AcceleratorCall call;
+  std::unique_ptr<uint8_t[]> input;
+  std::unique_ptr<uint8_t[]> output;
+  uint32_t input_length = 0;
+  uint32_t output_length = 0;
+  bool end_of_stream = false;
+  int ret = 1;
+  // Protected by the pool mutex
+  bool done = false;
+  bool abandoned = false;
+};
+
+class HedgePool {
+ public:
+  // Queues a job if a worker is idle. Returns false otherwise.
+  bool Submit(const std::shared_ptr<HedgeJob>& job);
+  // Waits for a job until the deadline. Returns false if it has not finished,
+  // in which case the job is abandoned.
+  bool Wait(const std::shared_ptr<HedgeJob>& job,
+            std::chrono::steady_clock::time_point deadline);
+  bool HasAbandonedJobs();
+
+ private:
+  void Work();
+
+  std::mutex mutex_;
+  std::condition_variable job_queued_;
+  std::condition_variable job_done_;
+  std::deque<std::shared_ptr<HedgeJob>> queue_;
+  int workers_ = 0;
+  int idle_workers_ = 0;
+  // Abandoned jobs still running, each blocking a worker
+  int abandoned_jobs_ = 0;
+  // Workers do not survive fork, so the pool is restarted in the child
+  pid_t pid_ = 0;
+};
+
+bool HedgePool::Submit(const std::shared_ptr<HedgeJob>& job) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (pid_ != getpid()) {
+    pid_ = getpid();
+    workers_ = 0;
+    idle_workers_ = 0;
+    abandoned_jobs_ = 0;
+    queue_.clear();
+  }
+  if (idle_workers_ <= static_cast<int>(queue_.size())) {
+    // Workers blocked on abandoned calls are replaced
+    if (workers_ - abandoned_jobs_ >= HEDGE_WORKERS ||
+        workers_ >= HEDGE_WORKERS + MAX_BLOCKED_WORKERS) {
+      return false;
+    }
+    try {
+      std::thread(&HedgePool::Work, this).detach();
+    } catch (const std::system_error& e) {
+      return false;
+    }
+    workers_++;
+    idle_workers_++;
+  }
+  queue_.push_back(job);
+  job_queued_.notify_one();
+  return true;
+}
+
+bool HedgePool::Wait(const std::shared_ptr<HedgeJob>& job,
+                     std::chrono::steady_clock::time_point deadline) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (job_done_.wait_until(lock, deadline, [&job] { return job->done; })) {
+    return true;
+  }
+  job->abandoned = true;
+  abandoned_jobs_++;
+  return false;
+}
+
+bool HedgePool::HasAbandonedJobs() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return abandoned_jobs_ > 0;
+}
+
+void HedgePool::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    job_queued_.wait(lock, [this] { return !queue_.empty(); });
+    std::shared_ptr<HedgeJob> job = std::move(queue_.front());
+    queue_.pop_front();
+    idle_workers_--;
+    lock.unlock();
+
+    job->ret = job->call(job->input.get(), &job->input_length,
+                         job->output.get(), &job->output_length,
+                         &job->end_of_stream);
+
+    lock.lock();
+    job->done = true;
+    abandoned_jobs_ -= job->abandoned;
+    job_done_.notify_all();
+    // A worker that was replaced while blocked exits
+    if (workers_ - abandoned_jobs_ > HEDGE_WORKERS) {
+      workers_--;
+      return;
+    }
+    idle_workers_++;
+  }
+}
+
+// Never destroyed, as workers may still be running at exit
+static HedgePool* pool = new HedgePool();
+
+int RunWithDeadline(const AcceleratorCall& call, uint8_t* input,
+                    uint32_t* input_length, uint8_t* output,
+                    uint32_t* output_length, uint32_t output_bound,
+                    bool* end_of_stream, uint32_t deadline_us) {
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::microseconds(deadline_us);
+  auto job = std::make_shared<HedgeJob>();
+  job->call = call;
+  job->input_length = *input_length;
+  job->output_length = output_bound > 0
+                           ? std::min(*output_length, output_bound)
+                           : *output_length;
+  job->input.reset(new (std::nothrow) uint8_t[job->input_length]);
+  job->output.reset(new (std::nothrow) uint8_t[job->output_length]);
+  if (job->input == nullptr || job->output == nullptr) {
+    Log(LogLevel::LOG_INFO, "RunWithDeadline Line ", __LINE__,
+        " buffer allocation failed, input_length ", *input_length, "\n");
+    return HEDGE_NOT_RUN;
+  }
+  memcpy(job->input.get(), input, *input_length);
+
+  if (!pool->Submit(job)) {
+    // Workers may be blocked on hung calls, that the caller must not wait for
+    if (pool->HasAbandonedJobs()) {
+      return HEDGE_NOT_RUN;
+    }
+    return call(input, input_length, output, output_length, end_of_stream);
+  }
+  if (!pool->Wait(job, deadline)) {
+    INCREMENT_STAT(HEDGE_TIMEOUT_COUNT);
+    Log(LogLevel::LOG_INFO, "RunWithDeadline Line ", __LINE__,
+        " deadline expired, input_length ", *input_length, "\n");
+    return 1;
+  }
+
+  if (job->ret == 0) {
+    memcpy(output, job->output.get(), job->output_length);
+    *input_length = job->input_length;
+    *output_length = job->output_length;
+    if (end_of_stream != nullptr) {
+      *end_of_stream = job->end_of_stream;
+    }
+  }
+  return job->ret;
+}
@@ -0,0 +1,58 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+#include "scheduler.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Deadlines for accelerator calls, from the configuration file, in the form
+//   deadline.<operation>.<size range> = <microseconds>
+// - operation: compress or uncompress
+// - size range: <min>-<max>, <min>- or * (input size in bytes, rounded down to
+//   a power of two as for routing rules)
+// A call with a deadline runs on a hedge worker thread, on copies of the input
+// and output buffers. If it has not finished by the deadline, it is abandoned
+// and the caller falls back to zlib. The worker releases the buffers when the
+// abandoned call eventually returns. A worker blocked on an abandoned call is
+// replaced, up to a fixed number of blocked workers. When all workers are busy,
+// calls run on the calling thread without a deadline, or are not run if an
+// abandoned call is still running.
+
+// Replaces the deadlines. Invalid entries are logged and ignored. Returns the
+// number of valid entries.
+VISIBLE_FOR_TESTING int LoadDeadlines(
+    const std::map<std::string, std::string>& deadlines);
+
+// Returns the deadline for a call in microseconds, or 0 if none applies
+VISIBLE_FOR_TESTING uint32_t GetDeadlineUs(Operation operation,
+                                           uint32_t input_length);
+
+// Accelerator call on the given buffers. end_of_stream is only set by
+// decompression calls.
+using AcceleratorCall =
+    std::function<int(uint8_t* input, uint32_t* input_length, uint8_t* output,
+                      uint32_t* output_length, bool* end_of_stream)>;
+
+// Returned by RunWithDeadline when the call was not run, because its buffers
+// could not be allocated or the workers are blocked on abandoned calls. This
+// is not a failure of the accelerator.
+inline constexpr int HEDGE_NOT_RUN = -1000;
+
+// Runs an accelerator call on a hedge worker and waits for it until the
+// deadline. Returns the result of the call, 1 if the deadline expired, or
+// HEDGE_NOT_RUN. output_bound is the max output of the call, which sizes the
+// copy of the output buffer, or 0 if unknown. end_of_stream can be nullptr.
+VISIBLE_FOR_TESTING int RunWithDeadline(const AcceleratorCall& call,
+                                        uint8_t* input, uint32_t* input_length,
+                                        uint8_t* output,
+                                        uint32_t* output_length,
+                                        uint32_t output_bound,
+                                        bool* end_of_stream,
+                                        uint32_t deadline_us);
@@ -3,8 +3,12 @@
 
 #include "iaa.h"
 
+#include <algorithm>
+#include <limits>
+
 #include "config/config.h"
 #include "logging.h"
+#include "scheduler.h"
 #include "utils.h"
 
 using namespace config;
@@ -52,11 +56,26 @@ uint32_t GetFormatFlag(int window_bits) {
   return 0;
 }
 
+IAAJobSettings GetIAAJobSettings(int level, int strategy) {
+  IAAJobSettings settings{qpl_default_level, false};
+  if (!configs[COMPRESSION_LEVEL_MAPPING]) {
+    return settings;
+  }
+  // QPL has no Huffman-only or RLE mode. The default level is the fastest.
+  if (strategy != Z_HUFFMAN_ONLY && strategy != Z_RLE && level > 6) {
+    settings.level = qpl_high_level;
+  }
+  settings.fixed_huffman = (strategy == Z_FIXED);
+  return settings;
+}
+
 int CompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
                 uint32_t* output_length, qpl_path_t execution_path,
-                int window_bits, uint32_t max_compressed_size, bool gzip_ext) {
+                int window_bits, uint32_t max_compressed_size, bool gzip_ext,
+                int level, int strategy) {
   Log(LogLevel::LOG_INFO, "CompressIAA() Line ", __LINE__, " input_length ",
       *input_length, "\n");
+  InFlightJob in_flight_job(IAA);
 
   // State from previous job execution not ignored/reset correctly for zlib
   // format. Force job reinitialization.
@@ -76,11 +95,15 @@ int CompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
   job->available_in = *input_length;
   job->next_out_ptr = output;
   job->available_out = *output_length;
-  job->level = qpl_default_level;
+  IAAJobSettings settings = GetIAAJobSettings(level, strategy);
+  job->level = settings.level;
   job->op = qpl_op_compress;
   job->flags = QPL_FLAG_FIRST | QPL_FLAG_LAST;
   job->flags |= QPL_FLAG_OMIT_VERIFY;
-  job->flags |= QPL_FLAG_DYNAMIC_HUFFMAN;
+  // Without a Huffman table and the dynamic flag, QPL uses the fixed codes
+  if (!settings.fixed_huffman) {
+    job->flags |= QPL_FLAG_DYNAMIC_HUFFMAN;
+  }
   job->flags |= GetFormatFlag(window_bits);
   job->huffman_table = nullptr;
   job->dictionary = nullptr;
@@ -110,7 +133,20 @@ int CompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
     prepend_empty_block = true;
   }
 
+  uint8_t* next_out = job->next_out_ptr;
+  uint32_t available_out = job->available_out;
   qpl_status status = qpl_execute_job(job);
+  if (status != QPL_STS_OK && job->level == qpl_high_level) {
+    // The high level is not supported by all hardware generations
+    Log(LogLevel::LOG_INFO, "CompressIAA() Line ", __LINE__, " status ",
+        status, " with high level, retrying with default level\n");
+    job->next_in_ptr = input;
+    job->available_in = *input_length;
+    job->next_out_ptr = next_out;
+    job->available_out = available_out;
+    job->level = qpl_default_level;
+    status = qpl_execute_job(job);
+  }
   if (status != QPL_STS_OK) {
     Log(LogLevel::LOG_ERROR, "CompressIAA() Line ", __LINE__, " status ",
         status, "\n");
@@ -181,6 +217,7 @@ int UncompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
                   int window_bits, bool* end_of_stream, bool detect_gzip_ext) {
   Log(LogLevel::LOG_INFO, "UncompressIAA() Line ", __LINE__, " input_length ",
       *input_length, "\n");
+  InFlightJob in_flight_job(IAA);
 
   bool gzip_ext = false;
   uint32_t gzip_ext_src_size = 0;
@@ -233,6 +270,15 @@ int UncompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
   return 0;
 }
 
+uint32_t CompressBoundIAA(uint32_t input_length) {
+  // QPL does not fall back to stored blocks, so dynamic Huffman blocks of
+  // incompressible data can exceed the zlib bound
+  uint64_t bound = static_cast<uint64_t>(input_length) + (input_length >> 3) +
+                   64 + GZIP_EXT_HDRFTR_SIZE + PREPENDED_BLOCK_LENGTH;
+  return static_cast<uint32_t>(
+      std::min<uint64_t>(bound, std::numeric_limits<uint32_t>::max()));
+}
+
 bool SupportedOptionsIAA(int window_bits, uint32_t input_length,
                          uint32_t output_length) {
   if ((window_bits >= -15 && window_bits <= -8) ||
@@ -6,6 +6,8 @@
 #ifdef USE_IAA
 #define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
 
+#include <zlib.h>
+
 #include <memory>
 #include <vector>
 
@@ -48,10 +50,26 @@ class IAAJob {
   std::vector<QplJobPtr> jobs_;
 };
 
+// Compression settings of a QPL job
+struct IAAJobSettings {
+  qpl_compression_levels level;
+  bool fixed_huffman;
+};
+
+// Maps the zlib level and strategy of a stream to QPL settings. Without
+// compression_level_mapping, the QPL default level with dynamic Huffman codes
+// is used.
+VISIBLE_FOR_TESTING IAAJobSettings GetIAAJobSettings(int level, int strategy);
+
 int CompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
                 uint32_t* output_length, qpl_path_t execution_path,
                 int window_bits, uint32_t max_compressed_size = 0,
-                bool gzip_ext = false);
+                bool gzip_ext = false, int level = Z_DEFAULT_COMPRESSION,
+                int strategy = Z_DEFAULT_STRATEGY);
+
+// Upper bound of the compressed size, including the header and trailer of any
+// format and the prepended empty block
+uint32_t CompressBoundIAA(uint32_t input_length);
 
 int UncompressIAA(uint8_t* input, uint32_t* input_length, uint8_t* output,
                   uint32_t* output_length, qpl_path_t execution_path,
@@ -5,6 +5,7 @@
 
 #include "config/config.h"
 #include "logging.h"
+#include "scheduler.h"
 #include "utils.h"
 
 using namespace config;
@@ -33,61 +34,78 @@ void QATJob::QzSessionDeleter::operator()(QzSession_T *qzSession) const {
   delete qzSession;
 }
 
+QATSessionSettings GetQATSessionSettings(int level, int strategy) {
+  QATSessionSettings settings{static_cast<int>(configs[QAT_COMPRESSION_LEVEL]),
+                              false};
+  if (!configs[COMPRESSION_LEVEL_MAPPING]) {
+    return settings;
+  }
+  // QAT has no Huffman-only or RLE mode. The fastest level is the closest.
+  if (strategy == Z_HUFFMAN_ONLY || strategy == Z_RLE) {
+    settings.level = 1;
+  } else if (level >= 1 && level <= 9) {
+    settings.level = level;
+  }
+  settings.static_huffman = (strategy == Z_FIXED);
+  return settings;
+}
+
 QzSession_T *QATJob::GetQATSession(int window_bits, bool gzip_ext) {
+  return GetQATSession(
+      window_bits, gzip_ext,
+      GetQATSessionSettings(Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY));
+}
+
+QATJob::SessionKey QATJob::GetSessionKey(
+    int window_bits, bool gzip_ext, const QATSessionSettings &settings) const {
   CompressedFormat format = GetCompressedFormat(window_bits);
-  switch (format) {
-    case CompressedFormat::DEFLATE_RAW:
-      if (qzSession_deflate_raw == nullptr) {
-        Init(qzSession_deflate_raw, format);
-      }
-      return qzSession_deflate_raw.get();
-    case CompressedFormat::ZLIB:
-      if (qzSession_zlib == nullptr) {
-        Init(qzSession_zlib,
-             format);  // we do not have zlib format in public enum of qatzip
-      }
-      return qzSession_zlib.get();
-    case CompressedFormat::GZIP:
-      if (gzip_ext) {
-        if (qzSession_gzip_ext == nullptr) {
-          Init(qzSession_gzip_ext, format, true);
-        }
-        return qzSession_gzip_ext.get();
-      } else {
-        if (qzSession_gzip == nullptr) {
-          Init(qzSession_gzip, format);
+  // The gzip extended format only applies to gzip
+  gzip_ext = gzip_ext && format == CompressedFormat::GZIP;
+  return SessionKey(format, gzip_ext, settings.level, settings.static_huffman);
+}
+
+QzSession_T *QATJob::GetQATSession(int window_bits, bool gzip_ext,
+                                   const QATSessionSettings &settings) {
+  SessionKey key = GetSessionKey(window_bits, gzip_ext, settings);
+  auto it = sessions_.find(key);
+  if (it == sessions_.end()) {
+    CompressedFormat format = std::get<0>(key);
+    if (format == CompressedFormat::INVALID) {
+      return nullptr;
+    }
+    QzSessionPtr qzSession = nullptr;
+    Init(qzSession, format, std::get<1>(key), settings);
+    if (qzSession == nullptr) {
+      return nullptr;
+    }
+    if (sessions_.size() >= MAX_QAT_SESSIONS) {
+      auto oldest = sessions_.begin();
+      for (auto entry = sessions_.begin(); entry != sessions_.end(); ++entry) {
+        if (entry->second.last_use < oldest->second.last_use) {
+          oldest = entry;
         }
-        return qzSession_gzip.get();
       }
-    case CompressedFormat::INVALID:
-      return nullptr;
+      sessions_.erase(oldest);
+    }
+    it = sessions_.emplace(key, Session{std::move(qzSession), 0}).first;
   }
-  return nullptr;
+  it->second.last_use = ++uses_;
+  return it->second.qzSession.get();
 }
 
 void QATJob::CloseQATSession(int window_bits, bool gzip_ext) {
-  CompressedFormat format = GetCompressedFormat(window_bits);
-  switch (format) {
-    case CompressedFormat::DEFLATE_RAW:
-      qzSession_deflate_raw.reset();
-      break;
-    case CompressedFormat::ZLIB:
-      qzSession_zlib.reset();
-      break;
-    case CompressedFormat::GZIP:
-      if (gzip_ext) {
-        qzSession_gzip_ext.reset();
-      } else {
-        qzSession_gzip.reset();
-      }
-      break;
-    default:
-      break;
-  }
+  CloseQATSession(
+      window_bits, gzip_ext,
+      GetQATSessionSettings(Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY));
+}
+
+void QATJob::CloseQATSession(int window_bits, bool gzip_ext,
+                             const QATSessionSettings &settings) {
+  sessions_.erase(GetSessionKey(window_bits, gzip_ext, settings));
 }
 
 void QATJob::Init(QzSessionPtr &qzSession, CompressedFormat format,
-                  bool gzip_ext) {
+                  bool gzip_ext, const QATSessionSettings &settings) {
   QzSessionPtr session = nullptr;
   try {
     session = QzSessionPtr(new QzSession_T());
@@ -109,8 +127,7 @@ void QATJob::Init(QzSessionPtr &qzSession, CompressedFormat format,
 
   QzSessionParamsDeflateExt_T deflateExt = {{}, 0, 0};
   deflateExt.deflate_params.common_params.comp_algorithm = QZ_DEFLATE;
-  deflateExt.deflate_params.common_params.comp_lvl =
-      configs[QAT_COMPRESSION_LEVEL];
+  deflateExt.deflate_params.common_params.comp_lvl = settings.level;
   deflateExt.deflate_params.common_params.direction = QZ_DIR_BOTH;
   deflateExt.deflate_params.common_params.hw_buff_sz = QAT_HW_BUFF_SZ;
   deflateExt.deflate_params.common_params.input_sz_thrshold =
@@ -129,7 +146,8 @@ void QATJob::Init(QzSessionPtr &qzSession, CompressedFormat format,
   deflateExt.deflate_params.common_params.sw_backup = 0;
   deflateExt.deflate_params.common_params.wait_cnt_thrshold =
       QZ_WAIT_CNT_THRESHOLD_DEFAULT;
-  deflateExt.deflate_params.huffman_hdr = QZ_HUFF_HDR_DEFAULT;
+  deflateExt.deflate_params.huffman_hdr =
+      settings.static_huffman ? QZ_STATIC_HDR : QZ_HUFF_HDR_DEFAULT;
   deflateExt.stop_decompression_stream_end = 1;
   switch (format) {
     case CompressedFormat::DEFLATE_RAW:
@@ -164,25 +182,69 @@ void QATJob::Init(QzSessionPtr &qzSession, CompressedFormat format,
 
 static thread_local QATJob qat_job_;
 
+// QATzip splits inputs larger than the HW buffer into chunks. In zlib and gzip
+// format, each chunk would be a separate stream. The raw deflate session is
+// used instead, which emits the chunks as non-final blocks of one stream, and
+// the zlib or gzip header and trailer are written here. The gzip extended
+// format has a header per chunk, so it keeps one stream per chunk.
+static bool UseRawSession(int window_bits, bool gzip_ext,
+                          uint32_t input_length) {
+  return !gzip_ext &&
+         GetCompressedFormat(window_bits) != CompressedFormat::DEFLATE_RAW &&
+         input_length > QAT_HW_BUFF_SZ;
+}
+
 int CompressQAT(uint8_t *input, uint32_t *input_length, uint8_t *output,
-                uint32_t *output_length, int window_bits, bool gzip_ext) {
+                uint32_t *output_length, int window_bits, bool gzip_ext,
+                int level, int strategy) {
   Log(LogLevel::LOG_INFO, "CompressQAT() Line ", __LINE__, " input_length ",
       *input_length, " \n");
-  QzSession_T *qzSessObj = qat_job_.GetQATSession(window_bits, gzip_ext);
+  InFlightJob in_flight_job(QAT);
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  bool raw_session = UseRawSession(window_bits, gzip_ext, *input_length);
+  QATSessionSettings settings = GetQATSessionSettings(level, strategy);
+  int session_window_bits =
+      raw_session ? GetRawWindowBits(window_bits) : window_bits;
+  QzSession_T *qzSessObj =
+      qat_job_.GetQATSession(session_window_bits, gzip_ext, settings);
   if (qzSessObj == nullptr) {
     Log(LogLevel::LOG_ERROR, "CompressQAT() Line ", __LINE__,
         "  Error qzSessObj null \n");
     return 1;
   }
+
+  uint32_t header_length = 0;
+  uint32_t trailer_length = 0;
+  if (raw_session) {
+    header_length = GetHeaderLength(format);
+    trailer_length = GetTrailerLength(format);
+    if (*output_length < header_length + trailer_length) {
+      return 1;
+    }
+  }
   unsigned int src_buf_size = static_cast<unsigned int>(*input_length);
-  unsigned int dst_buf_size = static_cast<unsigned int>(*output_length);
+  unsigned int dst_buf_size = static_cast<unsigned int>(
+      *output_length - header_length - trailer_length);
   int rc = qzCompress(qzSessObj, (unsigned char *)input, &src_buf_size,
-                      (unsigned char *)output, &dst_buf_size, 1);
+                      (unsigned char *)output + header_length, &dst_buf_size,
+                      1);
   if (rc != QZ_OK) {
     Log(LogLevel::LOG_ERROR, "CompressQAT() Line ", __LINE__,
         " qzCompress returns status ", rc, " \n");
+    // Do not reuse a session left in an error state
+    qat_job_.CloseQATSession(session_window_bits, gzip_ext, settings);
     return rc;
   }
+
+  if (raw_session) {
+    // QAT uses a 32KB history, whatever the window size requested
+    WriteStreamHeader(output, format, 15, settings.level, strategy);
+    uint32_t checksum =
+        UpdateChecksum(format, InitialChecksum(format), input, src_buf_size);
+    WriteStreamTrailer(output + header_length + dst_buf_size, format, checksum,
+                       src_buf_size);
+    dst_buf_size += header_length + trailer_length;
+  }
   *input_length = src_buf_size;
   *output_length = dst_buf_size;
   Log(LogLevel::LOG_INFO, "CompressQAT() Line ", __LINE__, " compressed_size ",
@@ -190,11 +252,31 @@ int CompressQAT(uint8_t *input, uint32_t *input_length, uint8_t *output,
   return 0;
 }
 
+uint32_t CompressBoundQAT(uint32_t input_length, int window_bits,
+                          bool gzip_ext, int level, int strategy) {
+  bool raw_session = UseRawSession(window_bits, gzip_ext, input_length);
+  QzSession_T *qzSessObj = qat_job_.GetQATSession(
+      raw_session ? GetRawWindowBits(window_bits) : window_bits, gzip_ext,
+      GetQATSessionSettings(level, strategy));
+  if (qzSessObj == nullptr) {
+    return 0;
+  }
+  // Returns 0 if the bound overflows
+  uint32_t bound = qzMaxCompressedLength(input_length, qzSessObj);
+  if (raw_session && bound > 0) {
+    uint64_t framed_bound =
+        static_cast<uint64_t>(bound) + MAX_HEADER_SIZE + MAX_TRAILER_SIZE;
+    return framed_bound > UINT32_MAX ? 0 : static_cast<uint32_t>(framed_bound);
+  }
+  return bound;
+}
+
 int UncompressQAT(uint8_t *input, uint32_t *input_length, uint8_t *output,
                   uint32_t *output_length, int window_bits, bool *end_of_stream,
                   bool detect_gzip_ext) {
   Log(LogLevel::LOG_INFO, "UncompressQAT() Line ", __LINE__, " input_length ",
       *input_length, " \n");
+  InFlightJob in_flight_job(QAT);
 
   bool gzip_ext = false;
   uint32_t gzip_ext_src_size = 0;
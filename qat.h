@@ -7,18 +7,43 @@
 #define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
 
 #include <qatzip.h>
+#include <zlib.h>
 
+#include <map>
 #include <memory>
+#include <tuple>
+#include <utility>
 
 #include "utils.h"
 
 inline constexpr unsigned int QAT_HW_BUFF_SZ = QZ_HW_BUFF_MAX_SZ;
+// Sessions kept open per thread
+inline constexpr size_t MAX_QAT_SESSIONS = 8;
+
+// Compression settings of a QAT session
+struct QATSessionSettings {
+  int level;
+  bool static_huffman;
+};
+
+// Maps the zlib level and strategy of a stream to QAT settings. Without
+// compression_level_mapping, or for Z_DEFAULT_COMPRESSION, the level is
+// qat_compression_level.
+VISIBLE_FOR_TESTING QATSessionSettings GetQATSessionSettings(int level,
+                                                             int strategy);
 
 class QATJob {
  public:
   QATJob() {}
+  // Sessions are created on first use, for each format and compression
+  // settings. Decompression uses the sessions with the default settings.
+  // Beyond MAX_QAT_SESSIONS, the least recently used session is closed.
   QzSession_T* GetQATSession(int window_bits, bool gzip_ext);
+  QzSession_T* GetQATSession(int window_bits, bool gzip_ext,
+                             const QATSessionSettings& settings);
   void CloseQATSession(int window_bits, bool gzip_ext);
+  void CloseQATSession(int window_bits, bool gzip_ext,
+                       const QATSessionSettings& settings);
 
  private:
   struct QzSessionDeleter {
@@ -26,19 +51,33 @@ class QATJob {
   };
 
   using QzSessionPtr = std::unique_ptr<QzSession_T, QzSessionDeleter>;
+  // Format, gzip_ext, level and static_huffman
+  using SessionKey = std::tuple<CompressedFormat, bool, int, bool>;
 
-  void Init(QzSessionPtr& qzSession, CompressedFormat format,
-            bool gzip_ext = false);
+  struct Session {
+    QzSessionPtr qzSession;
+    uint64_t last_use = 0;
+  };
+
+  SessionKey GetSessionKey(int window_bits, bool gzip_ext,
+                           const QATSessionSettings& settings) const;
+  void Init(QzSessionPtr& qzSession, CompressedFormat format, bool gzip_ext,
+            const QATSessionSettings& settings);
 
-  QzSessionPtr qzSession_deflate_raw;
-  QzSessionPtr qzSession_gzip;
-  QzSessionPtr qzSession_gzip_ext;
-  QzSessionPtr qzSession_zlib;
+  std::map<SessionKey, Session> sessions_;
+  uint64_t uses_ = 0;
 };
 
 int CompressQAT(uint8_t* input, uint32_t* input_length, uint8_t* output,
                 uint32_t* output_length, int window_bits,
-                bool gzip_ext = false);
+                bool gzip_ext = false, int level = Z_DEFAULT_COMPRESSION,
+                int strategy = Z_DEFAULT_STRATEGY);
+
+// Upper bound of the compressed size reported by QATzip, or 0 if unknown
+uint32_t CompressBoundQAT(uint32_t input_length, int window_bits,
+                          bool gzip_ext = false,
+                          int level = Z_DEFAULT_COMPRESSION,
+                          int strategy = Z_DEFAULT_STRATEGY);
 
 int UncompressQAT(uint8_t* input, uint32_t* input_length, uint8_t* output,
                   uint32_t* output_length, int window_bits, bool* end_of_stream,
@@ -0,0 +1,179 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ratio_guard.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "config/config.h"
+#include "logging.h"
+#include "routing_policy.h"
+#include "statistics.h"
+
+using namespace config;
+
+inline constexpr int PATHS = IAA + 1;
+inline constexpr int FORMATS = static_cast<int>(CompressedFormat::GZIP) + 1;
+// Compressed sizes are relative to the input size, scaled by SIZE_RATIO_SCALE
+inline constexpr uint64_t SIZE_RATIO_SCALE = 4096;
+inline constexpr uint64_t MAX_SIZE_RATIO = 2 * SIZE_RATIO_SCALE;
+// Weight of a new sample in the moving averages is 1/2^AVERAGE_SHIFT
+inline constexpr int AVERAGE_SHIFT = 3;
+inline constexpr uint32_t MIN_SAMPLES = 4;
+inline constexpr uint32_t PROBE_INTERVAL = 64;
+
+struct SizeEstimate {
+  std::atomic<uint32_t> size_ratio{0};
+  std::atomic<uint32_t> samples{0};
+};
+
+struct GuardState {
+  std::atomic<bool> downgraded{false};
+  // Calls skipped since the last probe
+  std::atomic<uint32_t> skipped{0};
+};
+
+static SizeEstimate estimates[PATHS][FORMATS][SIZE_CLASSES];
+// Indexed by accelerator (QAT, IAA), format and size class
+static GuardState guards[2][FORMATS][SIZE_CLASSES];
+
+static bool IsGuardEnabled(CompressedFormat format) {
+  return configs[RATIO_GUARD_SAMPLE_PERCENTAGE] != 0 &&
+         format != CompressedFormat::INVALID;
+}
+
+static GuardState* GetGuard(ExecutionPath path, CompressedFormat format,
+                            int size_class) {
+  if (path != QAT && path != IAA) {
+    return nullptr;
+  }
+  return &guards[path == QAT ? 0 : 1][static_cast<int>(format)][size_class];
+}
+
+// Average size ratio, or 0 if there are not enough samples
+static uint32_t GetSizeRatio(ExecutionPath path, CompressedFormat format,
+                             int size_class) {
+  const SizeEstimate& estimate =
+      estimates[path][static_cast<int>(format)][size_class];
+  if (estimate.samples.load(std::memory_order_relaxed) < MIN_SAMPLES) {
+    return 0;
+  }
+  return estimate.size_ratio.load(std::memory_order_relaxed);
+}
+
+// Compares the accelerator ratio with the zlib ratio, and downgrades or
+// restores the accelerator
+static void UpdateGuard(ExecutionPath path, CompressedFormat format,
+                        int size_class) {
+  GuardState* guard = GetGuard(path, format, size_class);
+  uint64_t accelerator_ratio = GetSizeRatio(path, format, size_class);
+  uint64_t zlib_ratio = GetSizeRatio(ZLIB, format, size_class);
+  if (guard == nullptr || accelerator_ratio == 0 || zlib_ratio == 0) {
+    return;
+  }
+  // The compression ratio of the accelerator relative to zlib is the zlib
+  // compressed size divided by the accelerator compressed size
+  bool downgraded =
+      zlib_ratio * 100 < accelerator_ratio * configs[RATIO_GUARD_FLOOR];
+  if (guard->downgraded.exchange(downgraded, std::memory_order_relaxed) !=
+      downgraded) {
+    INCREMENT_STAT_COND(downgraded, RATIO_GUARD_DOWNGRADE_COUNT);
+    Log(LogLevel::LOG_INFO, "UpdateGuard Line ", __LINE__, " path ",
+        static_cast<int>(path), ", format ", static_cast<int>(format),
+        ", size class ", size_class, ", accelerator size ratio ",
+        accelerator_ratio, ", zlib size ratio ", zlib_ratio,
+        downgraded ? ", downgraded\n" : ", restored\n");
+  }
+}
+
+bool RatioGuardAllows(ExecutionPath path, CompressedFormat format,
+                      uint32_t input_length) {
+  if (!IsGuardEnabled(format)) {
+    return true;
+  }
+  GuardState* guard = GetGuard(path, format, GetSizeClass(input_length));
+  if (guard == nullptr ||
+      !guard->downgraded.load(std::memory_order_relaxed)) {
+    return true;
+  }
+  if (guard->skipped.fetch_add(1, std::memory_order_relaxed) + 1 >=
+      PROBE_INTERVAL) {
+    guard->skipped.store(0, std::memory_order_relaxed);
+    return true;
+  }
+  INCREMENT_STAT(RATIO_GUARD_SKIP_COUNT);
+  return false;
+}
+
+bool SampleRatioBaseline(ExecutionPath path, CompressedFormat format,
+                         uint32_t input_length) {
+  if (!IsGuardEnabled(format)) {
+    return false;
+  }
+  GuardState* guard = GetGuard(path, format, GetSizeClass(input_length));
+  if (guard == nullptr) {
+    return false;
+  }
+  return guard->downgraded.load(std::memory_order_relaxed) ||
+         FastRandom() % 100 < configs[RATIO_GUARD_SAMPLE_PERCENTAGE];
+}
+
+void RecordCompressedSize(ExecutionPath path, CompressedFormat format,
+                          uint32_t input_length, uint32_t output_length) {
+  if (!IsGuardEnabled(format) || path == UNDEFINED || input_length == 0) {
+    return;
+  }
+  int size_class = GetSizeClass(input_length);
+  SizeEstimate* estimate =
+      &estimates[path][static_cast<int>(format)][size_class];
+  uint32_t sample = static_cast<uint32_t>(
+      std::min(static_cast<uint64_t>(output_length) * SIZE_RATIO_SCALE /
+                   input_length,
+               MAX_SIZE_RATIO));
+  uint32_t ratio = estimate->size_ratio.load(std::memory_order_relaxed);
+  if (estimate->samples.load(std::memory_order_relaxed) == 0) {
+    ratio = sample;
+  } else {
+    ratio = ratio - (ratio >> AVERAGE_SHIFT) + (sample >> AVERAGE_SHIFT);
+  }
+  estimate->size_ratio.store(ratio, std::memory_order_relaxed);
+  if (estimate->samples.load(std::memory_order_relaxed) < MIN_SAMPLES) {
+    estimate->samples.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  if (path == ZLIB) {
+    UpdateGuard(QAT, format, size_class);
+    UpdateGuard(IAA, format, size_class);
+  } else {
+    UpdateGuard(path, format, size_class);
+  }
+}
+
+bool IsRatioGuardDowngraded(ExecutionPath path, CompressedFormat format,
+                            uint32_t input_length) {
+  if (format == CompressedFormat::INVALID) {
+    return false;
+  }
+  GuardState* guard = GetGuard(path, format, GetSizeClass(input_length));
+  return guard != nullptr && guard->downgraded.load(std::memory_order_relaxed);
+}
+
+void ResetRatioGuard() {
+  for (auto& path_estimates : estimates) {
+    for (auto& format_estimates : path_estimates) {
+      for (auto& estimate : format_estimates) {
+        estimate.size_ratio.store(0, std::memory_order_relaxed);
+        estimate.samples.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+  for (auto& path_guards : guards) {
+    for (auto& format_guards : path_guards) {
+      for (auto& guard : format_guards) {
+        guard.downgraded.store(false, std::memory_order_relaxed);
+        guard.skipped.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+}
@@ -0,0 +1,45 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+
+#include "utils.h"
+#include "zlib_accel.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Compression ratio guard (ratio_guard_sample_percentage option). For each
+// engine, format and size class, the guard keeps a moving average of the
+// compressed size relative to the input size. The zlib average is learned from
+// calls compressed by zlib, and from a sample of the calls compressed by an
+// accelerator, which are compressed again with zlib. An accelerator whose
+// compression ratio is below ratio_guard_floor percent of the zlib ratio is
+// downgraded: deflate and compress2 calls of that format and size class are
+// routed to other engines. One skipped call in PROBE_INTERVAL is still sent to
+// the accelerator, so that the guard can detect when its ratio recovers.
+// The averages are shared by all threads and updated without locks.
+
+// Returns whether a deflate or compress2 call can be sent to the accelerator
+VISIBLE_FOR_TESTING bool RatioGuardAllows(ExecutionPath path,
+                                          CompressedFormat format,
+                                          uint32_t input_length);
+
+// Returns whether the zlib size should be measured for a call compressed by the
+// accelerator. Calls sent to a downgraded accelerator are always measured.
+VISIBLE_FOR_TESTING bool SampleRatioBaseline(ExecutionPath path,
+                                             CompressedFormat format,
+                                             uint32_t input_length);
+
+// Reports the size of a whole stream compressed by an engine
+VISIBLE_FOR_TESTING void RecordCompressedSize(ExecutionPath path,
+                                              CompressedFormat format,
+                                              uint32_t input_length,
+                                              uint32_t output_length);
+
+VISIBLE_FOR_TESTING bool IsRatioGuardDowngraded(ExecutionPath path,
+                                                CompressedFormat format,
+                                                uint32_t input_length);
+
+VISIBLE_FOR_TESTING void ResetRatioGuard();
@@ -0,0 +1,219 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "result_cache.h"
+
+#include <atomic>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+
+#include "config/config.h"
+#include "statistics.h"
+
+using namespace config;
+
+inline constexpr int CACHE_SHARDS = 16;
+// An entry takes at most 1/MAX_ENTRY_FRACTION of a shard
+inline constexpr uint64_t MAX_ENTRY_FRACTION = 4;
+// Memory accounted for an entry in addition to its input and output
+inline constexpr uint64_t ENTRY_OVERHEAD = 128;
+
+static uint64_t Rotate(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t Mix(uint64_t value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+// 128-bit hash, processing 16 bytes per iteration in two lanes (same structure
+// as MurmurHash3 x64 128)
+static void Hash128(const uint8_t* data, uint32_t len, uint64_t seed,
+                    uint64_t* hash) {
+  constexpr uint64_t c1 = 0x87c37b91114253d5ULL;
+  constexpr uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = seed;
+  uint64_t h2 = seed;
+  uint32_t pos = 0;
+  for (; pos + 16 <= len; pos += 16) {
+    uint64_t k1;
+    uint64_t k2;
+    memcpy(&k1, data + pos, 8);
+    memcpy(&k2, data + pos + 8, 8);
+    h1 ^= Rotate(k1 * c1, 31) * c2;
+    h1 = (Rotate(h1, 27) + h2) * 5 + 0x52dce729;
+    h2 ^= Rotate(k2 * c2, 33) * c1;
+    h2 = (Rotate(h2, 31) + h1) * 5 + 0x38495ab5;
+  }
+  uint8_t tail[16] = {};
+  memcpy(tail, data + pos, len - pos);
+  uint64_t k1;
+  uint64_t k2;
+  memcpy(&k1, tail, 8);
+  memcpy(&k2, tail + 8, 8);
+  h1 ^= Rotate(k1 * c1, 31) * c2;
+  h2 ^= Rotate(k2 * c2, 33) * c1;
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = Mix(h1);
+  h2 = Mix(h2);
+  h1 += h2;
+  h2 += h1;
+  hash[0] = h1;
+  hash[1] = h2;
+}
+
+struct ResultCacheKeyHash {
+  size_t operator()(const ResultCacheKey& key) const {
+    return static_cast<size_t>(key.hash[0]);
+  }
+};
+
+struct CacheShard {
+  std::mutex mutex;
+  // Most recently used first
+  std::list<std::pair<ResultCacheKey, std::shared_ptr<const CachedResult>>>
+      lru;
+  std::unordered_map<ResultCacheKey, decltype(lru)::iterator,
+                     ResultCacheKeyHash>
+      index;
+  uint64_t bytes = 0;
+};
+
+static CacheShard shards[CACHE_SHARDS];
+static std::atomic<uint64_t> total_bytes{0};
+
+static uint64_t GetShardCapacity() {
+  return (static_cast<uint64_t>(configs[RESULT_CACHE_SIZE_MB]) << 20) /
+         CACHE_SHARDS;
+}
+
+static uint64_t EntryBytes(const CachedResult& result) {
+  return static_cast<uint64_t>(result.input_length) + result.output_length +
+         ENTRY_OVERHEAD;
+}
+
+static CacheShard* GetShard(const ResultCacheKey& key) {
+  return &shards[key.hash[1] % CACHE_SHARDS];
+}
+
+static void EvictLast(CacheShard* shard) {
+  auto& [key, result] = shard->lru.back();
+  uint64_t bytes = EntryBytes(*result);
+  shard->bytes -= bytes;
+  total_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+  shard->index.erase(key);
+  shard->lru.pop_back();
+}
+
+bool UseResultCache(uint32_t input_length) {
+  return configs[RESULT_CACHE_SIZE_MB] != 0 && input_length > 0 &&
+         input_length + ENTRY_OVERHEAD <=
+             GetShardCapacity() / MAX_ENTRY_FRACTION;
+}
+
+ResultCacheKey GetResultCacheKey(EntryPoint entry_point, int window_bits,
+                                 int level, int mem_level, int strategy,
+                                 const uint8_t* input, uint32_t input_length) {
+  ResultCacheKey key;
+  key.input_length = input_length;
+  key.params = static_cast<uint32_t>(entry_point) |
+               (static_cast<uint32_t>(window_bits + 16) & 0x3F) << 3 |
+               (static_cast<uint32_t>(level + 1) & 0xF) << 9 |
+               (static_cast<uint32_t>(mem_level) & 0xF) << 13 |
+               (static_cast<uint32_t>(strategy) & 0x7) << 17;
+  Hash128(input, input_length, key.params, key.hash);
+  return key;
+}
+
+std::shared_ptr<const CachedResult> LookupResult(const ResultCacheKey& key,
+                                                 const uint8_t* input) {
+  std::shared_ptr<const CachedResult> result;
+  CacheShard* shard = GetShard(key);
+  {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    auto it = shard->index.find(key);
+    if (it != shard->index.end()) {
+      shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+      result = it->second->second;
+    }
+  }
+  if (result == nullptr ||
+      memcmp(result->input.get(), input, key.input_length) != 0) {
+    INCREMENT_STAT(RESULT_CACHE_MISS_COUNT);
+    return nullptr;
+  }
+  INCREMENT_STAT(RESULT_CACHE_HIT_COUNT);
+  return result;
+}
+
+void InsertResult(const ResultCacheKey& key, const uint8_t* input,
+                  uint32_t input_consumed, const uint8_t* output,
+                  uint32_t output_length, uint32_t checksum) {
+  uint64_t capacity = GetShardCapacity();
+  auto result = std::make_shared<CachedResult>();
+  result->input_length = key.input_length;
+  result->input_consumed = input_consumed;
+  result->output_length = output_length;
+  result->checksum = checksum;
+  uint64_t bytes = EntryBytes(*result);
+  if (bytes > capacity / MAX_ENTRY_FRACTION) {
+    return;
+  }
+  result->input.reset(new (std::nothrow) uint8_t[key.input_length]);
+  result->output.reset(new (std::nothrow) uint8_t[output_length]);
+  if (result->input == nullptr || result->output == nullptr) {
+    return;
+  }
+  memcpy(result->input.get(), input, key.input_length);
+  memcpy(result->output.get(), output, output_length);
+
+  CacheShard* shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  auto it = shard->index.find(key);
+  if (it != shard->index.end()) {
+    // Inserted concurrently by another thread, or a hash collision. The newer
+    // entry replaces the older one.
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+    uint64_t old_bytes = EntryBytes(*it->second->second);
+    shard->bytes -= old_bytes;
+    total_bytes.fetch_sub(old_bytes, std::memory_order_relaxed);
+    it->second->second = std::move(result);
+  } else {
+    shard->lru.emplace_front(key, std::move(result));
+    shard->index.emplace(key, shard->lru.begin());
+  }
+  shard->bytes += bytes;
+  total_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  INCREMENT_STAT(RESULT_CACHE_INSERT_COUNT);
+  while (shard->bytes > capacity) {
+    EvictLast(shard);
+    INCREMENT_STAT(RESULT_CACHE_EVICT_COUNT);
+  }
+}
+
+uint64_t GetResultCacheBytes() {
+  return total_bytes.load(std::memory_order_relaxed);
+}
+
+void ResetResultCache() {
+  for (CacheShard& shard : shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.index.clear();
+    shard.lru.clear();
+    total_bytes.fetch_sub(shard.bytes, std::memory_order_relaxed);
+    shard.bytes = 0;
+  }
+}
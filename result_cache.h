@@ -0,0 +1,66 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "routing_policy.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Cache of compress and uncompress results (result_cache_size_mb option), for
+// applications that compress or decompress the same payloads repeatedly.
+// Entries are keyed by a 128-bit hash of the input and by the entry point and
+// parameters of the call, and evicted in LRU order from a fixed number of
+// shards, each with its own lock. The input is stored with the result and
+// compared on lookup, so that a hash collision cannot return the result of
+// another input.
+
+struct ResultCacheKey {
+  uint64_t hash[2];
+  uint32_t input_length;
+  // Entry point, window bits, level, memory level and strategy
+  uint32_t params;
+
+  bool operator==(const ResultCacheKey& other) const {
+    return hash[0] == other.hash[0] && hash[1] == other.hash[1] &&
+           input_length == other.input_length && params == other.params;
+  }
+};
+
+struct CachedResult {
+  std::unique_ptr<uint8_t[]> input;
+  uint32_t input_length;
+  // Input actually consumed, for decompression of input with trailing data
+  uint32_t input_consumed;
+  std::unique_ptr<uint8_t[]> output;
+  uint32_t output_length;
+  // strm->adler after the call, for deflate and inflate
+  uint32_t checksum;
+};
+
+// Returns whether results for inputs of this size are cached
+VISIBLE_FOR_TESTING bool UseResultCache(uint32_t input_length);
+
+VISIBLE_FOR_TESTING ResultCacheKey GetResultCacheKey(
+    EntryPoint entry_point, int window_bits, int level, int mem_level,
+    int strategy, const uint8_t* input, uint32_t input_length);
+
+// Returns the cached result for input, or nullptr. The result stays valid
+// while the caller holds it, even if it is evicted.
+VISIBLE_FOR_TESTING std::shared_ptr<const CachedResult> LookupResult(
+    const ResultCacheKey& key, const uint8_t* input);
+
+VISIBLE_FOR_TESTING void InsertResult(const ResultCacheKey& key,
+                                      const uint8_t* input,
+                                      uint32_t input_consumed,
+                                      const uint8_t* output,
+                                      uint32_t output_length,
+                                      uint32_t checksum);
+
+// Memory used by the cached entries, for statistics
+VISIBLE_FOR_TESTING uint64_t GetResultCacheBytes();
+
+VISIBLE_FOR_TESTING void ResetResultCache();
@@ -0,0 +1,242 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "routing_policy.h"
+
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+#include "logging.h"
+
+inline constexpr int ENTRY_POINTS = static_cast<int>(EntryPoint::GZREAD) + 1;
+inline constexpr int FORMATS = static_cast<int>(CompressedFormat::GZIP) + 1;
+
+static Route routes[ENTRY_POINTS][FORMATS][SIZE_CLASSES];
+
+int GetSizeClass(uint64_t size) {
+  int size_class = 0;
+  while (size > 0) {
+    size >>= 1;
+    size_class++;
+  }
+  return size_class;
+}
+
+static std::vector<std::string> Split(const std::string& str, char delimiter) {
+  std::vector<std::string> tokens;
+  std::stringstream stream(str);
+  std::string token;
+  while (std::getline(stream, token, delimiter)) {
+    token.erase(std::remove(token.begin(), token.end(), ' '), token.end());
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+static bool ParseNumber(const std::string& str, uint64_t* value) {
+  if (str.empty() || str.size() > 10 ||
+      str.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  *value = std::stoull(str);
+  return *value <= UINT32_MAX;
+}
+
+struct RoutingRule {
+  // Entry points, formats and size classes covered by the rule
+  bool entry_points[ENTRY_POINTS] = {};
+  bool formats[FORMATS] = {};
+  int min_size_class = 0;
+  int max_size_class = SIZE_CLASSES - 1;
+  int wildcards = 0;
+  Route route;
+};
+
+static bool ParseEntryPoints(const std::string& operation,
+                             const std::string& entry_point,
+                             RoutingRule* rule) {
+  static const char* entry_point_names[ENTRY_POINTS] = {
+      "deflate", "compress2", "gzwrite", "inflate", "uncompress2", "gzread"};
+  int first = 0;
+  if (operation == "uncompress") {
+    first = static_cast<int>(EntryPoint::INFLATE);
+  } else if (operation != "compress") {
+    return false;
+  }
+
+  bool found = false;
+  for (int i = first; i < first + ENTRY_POINTS / 2; i++) {
+    if (entry_point == "*" || entry_point == entry_point_names[i]) {
+      rule->entry_points[i] = true;
+      found = true;
+    }
+  }
+  rule->wildcards += (entry_point == "*");
+  return found;
+}
+
+static bool ParseFormats(const std::string& format, RoutingRule* rule) {
+  static const char* format_names[FORMATS] = {"raw", "zlib", "gzip"};
+  bool found = false;
+  for (int i = 0; i < FORMATS; i++) {
+    if (format == "*" || format == format_names[i]) {
+      rule->formats[i] = true;
+      found = true;
+    }
+  }
+  rule->wildcards += (format == "*");
+  return found;
+}
+
+bool ParseSizeRange(const std::string& range, int* min_size_class,
+                    int* max_size_class) {
+  if (range == "*") {
+    *min_size_class = 0;
+    *max_size_class = SIZE_CLASSES - 1;
+    return true;
+  }
+  auto delimiter_pos = range.find('-');
+  if (delimiter_pos == std::string::npos) {
+    return false;
+  }
+  uint64_t min_size = 0;
+  uint64_t max_size = UINT32_MAX;
+  std::string max_str = range.substr(delimiter_pos + 1);
+  if (!ParseNumber(range.substr(0, delimiter_pos), &min_size) ||
+      (!max_str.empty() && !ParseNumber(max_str, &max_size)) ||
+      min_size > max_size) {
+    return false;
+  }
+  *min_size_class = GetSizeClass(min_size);
+  *max_size_class = GetSizeClass(max_size);
+  return true;
+}
+
+static bool ParseEngines(const std::string& engines, Route* route) {
+  for (const std::string& engine : Split(engines, ',')) {
+    if (route->engine_count == MAX_ROUTE_ENGINES) {
+      return false;
+    }
+    std::vector<std::string> tokens = Split(engine, ':');
+    ExecutionPath path = UNDEFINED;
+    if (tokens.size() >= 1 && tokens[0] == "qat") {
+      path = QAT;
+    } else if (tokens.size() >= 1 && tokens[0] == "iaa") {
+      path = IAA;
+    } else if (tokens.size() >= 1 && tokens[0] == "zlib") {
+      path = ZLIB;
+    }
+    uint64_t weight = 1;
+    if (path == UNDEFINED || tokens.size() > 2 ||
+        (tokens.size() == 2 && !ParseNumber(tokens[1], &weight))) {
+      return false;
+    }
+    route->weighted |= (tokens.size() == 2);
+    route->engines[route->engine_count] = path;
+    route->weights[route->engine_count] = static_cast<uint32_t>(weight);
+    route->engine_count++;
+  }
+  return route->engine_count > 0;
+}
+
+// Parses a rule from a tag of the form
+// route.<operation>.<entry point>.<format>.<size range>
+static bool ParseRule(const std::string& tag, const std::string& value,
+                      RoutingRule* rule) {
+  std::vector<std::string> fields = Split(tag, '.');
+  if (fields.size() != 5 || fields[0] != "route") {
+    return false;
+  }
+  rule->wildcards += (fields[4] == "*");
+  return ParseEntryPoints(fields[1], fields[2], rule) &&
+         ParseFormats(fields[3], rule) &&
+         ParseSizeRange(fields[4], &rule->min_size_class,
+                        &rule->max_size_class) &&
+         ParseEngines(value, &rule->route);
+}
+
+int LoadRoutingPolicy(const std::map<std::string, std::string>& rules) {
+  std::vector<RoutingRule> parsed_rules;
+  for (const auto& [tag, value] : rules) {
+    RoutingRule rule;
+    if (ParseRule(tag, value, &rule)) {
+      parsed_rules.push_back(rule);
+    } else {
+      Log(LogLevel::LOG_ERROR, "LoadRoutingPolicy Line ", __LINE__,
+          " invalid routing rule ", tag.c_str(), " = ", value.c_str(), "\n");
+    }
+  }
+
+  // Rules with more wildcards are applied first, so that more specific rules
+  // overwrite them
+  std::stable_sort(parsed_rules.begin(), parsed_rules.end(),
+                   [](const RoutingRule& a, const RoutingRule& b) {
+                     return a.wildcards > b.wildcards;
+                   });
+
+  for (auto& entry_point_routes : routes) {
+    for (auto& format_routes : entry_point_routes) {
+      for (auto& route : format_routes) {
+        route = Route();
+      }
+    }
+  }
+  for (const RoutingRule& rule : parsed_rules) {
+    for (int e = 0; e < ENTRY_POINTS; e++) {
+      for (int f = 0; f < FORMATS; f++) {
+        if (!rule.entry_points[e] || !rule.formats[f]) {
+          continue;
+        }
+        for (int s = rule.min_size_class; s <= rule.max_size_class; s++) {
+          routes[e][f][s] = rule.route;
+        }
+      }
+    }
+  }
+  return static_cast<int>(parsed_rules.size());
+}
+
+const Route* GetRoute(EntryPoint entry_point, CompressedFormat format,
+                      uint32_t input_length) {
+  if (format == CompressedFormat::INVALID) {
+    return nullptr;
+  }
+  const Route* route = &routes[static_cast<int>(entry_point)]
+                              [static_cast<int>(format)]
+                              [GetSizeClass(input_length)];
+  return route->engine_count > 0 ? route : nullptr;
+}
+
+ExecutionPath SelectRouteEngine(const Route* route, bool iaa_available,
+                                bool qat_available, bool zlib_available) {
+  uint32_t total_weight = 0;
+  bool available[MAX_ROUTE_ENGINES];
+  for (int i = 0; i < route->engine_count; i++) {
+    ExecutionPath engine = route->engines[i];
+    available[i] = (engine == IAA && iaa_available) ||
+                   (engine == QAT && qat_available) ||
+                   (engine == ZLIB && zlib_available);
+    if (available[i] && !route->weighted) {
+      return engine;
+    }
+    if (available[i]) {
+      total_weight += route->weights[i];
+    }
+  }
+  if (total_weight == 0) {
+    return UNDEFINED;
+  }
+
+  uint32_t pick = FastRandom() % total_weight;
+  for (int i = 0; i < route->engine_count; i++) {
+    if (!available[i]) {
+      continue;
+    }
+    if (pick < route->weights[i]) {
+      return route->engines[i];
+    }
+    pick -= route->weights[i];
+  }
+  return UNDEFINED;
+}
@@ -0,0 +1,70 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "utils.h"
+#include "zlib_accel.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+enum class EntryPoint {
+  DEFLATE,
+  COMPRESS2,
+  GZWRITE,
+  INFLATE,
+  UNCOMPRESS2,
+  GZREAD
+};
+
+// Routing rules from the configuration file, in the form
+//   route.<operation>.<entry point>.<format>.<size range> = <engines>
+// - operation: compress or uncompress
+// - entry point: deflate, compress2, gzwrite (compress), inflate, uncompress2,
+//   gzread (uncompress) or *
+// - format: raw, zlib, gzip or *
+// - size range: <min>-<max>, <min>- or * (input size in bytes)
+// - engines: comma-separated list of qat, iaa and zlib. Without weights, the
+//   first engine that supports the call is selected. With weights
+//   (e.g. qat:3,iaa:1), engines that support the call are selected randomly in
+//   proportion to their weights.
+// Rules with fewer wildcards take precedence. Rules are compiled into a flat
+// table indexed by entry point, format and power-of-two size class, so size
+// boundaries are rounded down to a power of two.
+
+inline constexpr int MAX_ROUTE_ENGINES = 3;
+
+struct Route {
+  uint8_t engine_count = 0;
+  bool weighted = false;
+  ExecutionPath engines[MAX_ROUTE_ENGINES];
+  uint32_t weights[MAX_ROUTE_ENGINES];
+};
+
+// Size class 0 is for empty input, size class n for sizes in [2^(n-1), 2^n)
+inline constexpr int SIZE_CLASSES = 33;
+
+int GetSizeClass(uint64_t size);
+
+// Parses a size range of the form <min>-<max>, <min>- or * into the first and
+// last size classes it covers
+bool ParseSizeRange(const std::string& range, int* min_size_class,
+                    int* max_size_class);
+
+// Replaces the routing rules. Invalid rules are logged and ignored. Returns the
+// number of valid rules.
+VISIBLE_FOR_TESTING int LoadRoutingPolicy(
+    const std::map<std::string, std::string>& rules);
+
+// Returns the route for a call, or nullptr if no rule applies
+const Route* GetRoute(EntryPoint entry_point, CompressedFormat format,
+                      uint32_t input_length);
+
+// Selects an engine from a route, given the engines that support the call.
+// Returns UNDEFINED if none of the listed engines is available.
+ExecutionPath SelectRouteEngine(const Route* route, bool iaa_available,
+                                bool qat_available, bool zlib_available);
@@ -0,0 +1,241 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "scheduler.h"
+
+#include <time.h>
+
+#include <atomic>
+
+#include "circuit_breaker.h"
+#include "config/config.h"
+#include "ratio_guard.h"
+#include "utils.h"
+
+using namespace config;
+
+// Size ranges: < 4KB, < 16KB, < 64KB, ..., >= 16MB
+inline constexpr int SIZE_BUCKETS = 8;
+inline constexpr int OPERATIONS = 2;
+inline constexpr int PATHS = IAA + 1;
+// Weight of a new sample in the moving averages is 1/2^AVERAGE_SHIFT
+inline constexpr int AVERAGE_SHIFT = 3;
+inline constexpr uint32_t FAILURE_RATE_SCALE = 1024;
+// One call in EXPLORE_INTERVAL is sent to a random path, so that estimates
+// follow changes in load
+inline constexpr uint32_t EXPLORE_INTERVAL = 64;
+
+struct PathEstimate {
+  // 0 until the first sample
+  std::atomic<uint64_t> ns_per_kb{0};
+  // Scaled by FAILURE_RATE_SCALE
+  std::atomic<uint32_t> failure_rate{0};
+};
+
+static PathEstimate estimates[OPERATIONS][SIZE_BUCKETS][PATHS];
+
+static int GetSizeBucket(uint32_t input_length) {
+  uint32_t size = input_length >> 12;
+  int bucket = 0;
+  while (size > 0 && bucket < SIZE_BUCKETS - 1) {
+    size >>= 2;
+    bucket++;
+  }
+  return bucket;
+}
+
+static PathEstimate* GetEstimates(Operation operation, uint32_t input_length) {
+  return estimates[static_cast<int>(operation)][GetSizeBucket(input_length)];
+}
+
+// Expected latency per KB, including the zlib retry for failed calls
+static uint64_t ExpectedCost(PathEstimate* bucket, ExecutionPath path) {
+  uint64_t cost = bucket[path].ns_per_kb.load(std::memory_order_relaxed);
+  if (path == ZLIB) {
+    return cost;
+  }
+  uint64_t retry_cost = bucket[ZLIB].ns_per_kb.load(std::memory_order_relaxed);
+  if (retry_cost == 0) {
+    retry_cost = cost;
+  }
+  uint32_t failure_rate =
+      bucket[path].failure_rate.load(std::memory_order_relaxed);
+  return cost + retry_cost * failure_rate / FAILURE_RATE_SCALE;
+}
+
+ExecutionPath SchedulePath(Operation operation, bool iaa_available,
+                           bool qat_available, bool zlib_available,
+                           uint32_t input_length) {
+  ExecutionPath candidates[3];
+  int count = 0;
+  if (iaa_available) {
+    candidates[count++] = IAA;
+  }
+  if (qat_available) {
+    candidates[count++] = QAT;
+  }
+  if (zlib_available) {
+    candidates[count++] = ZLIB;
+  }
+  if (count == 0) {
+    return ZLIB;
+  }
+  if (count == 1) {
+    return candidates[0];
+  }
+
+  PathEstimate* bucket = GetEstimates(operation, input_length);
+  for (int i = 0; i < count; i++) {
+    if (bucket[candidates[i]].ns_per_kb.load(std::memory_order_relaxed) == 0) {
+      return candidates[i];
+    }
+  }
+  if (FastRandom() % EXPLORE_INTERVAL == 0) {
+    return candidates[FastRandom() % count];
+  }
+
+  ExecutionPath best = candidates[0];
+  uint64_t best_cost = ExpectedCost(bucket, best);
+  for (int i = 1; i < count; i++) {
+    uint64_t cost = ExpectedCost(bucket, candidates[i]);
+    if (cost < best_cost) {
+      best = candidates[i];
+      best_cost = cost;
+    }
+  }
+  return best;
+}
+
+void RecordPathResult(Operation operation, ExecutionPath path,
+                      uint32_t input_length, uint64_t latency_ns,
+                      bool success) {
+  if (path != ZLIB && path != QAT && path != IAA) {
+    return;
+  }
+  PathEstimate* estimate = &GetEstimates(operation, input_length)[path];
+
+  uint32_t failure_rate =
+      estimate->failure_rate.load(std::memory_order_relaxed);
+  uint32_t sample_rate = success ? 0 : FAILURE_RATE_SCALE;
+  failure_rate = failure_rate - (failure_rate >> AVERAGE_SHIFT) +
+                 (sample_rate >> AVERAGE_SHIFT);
+  estimate->failure_rate.store(failure_rate, std::memory_order_relaxed);
+
+  // The latency of failed calls does not include the retry, which is
+  // accounted for by the failure rate
+  uint64_t sample = latency_ns * 1024 / (input_length > 0 ? input_length : 1);
+  if (sample == 0) {
+    sample = 1;
+  }
+  uint64_t ns_per_kb = estimate->ns_per_kb.load(std::memory_order_relaxed);
+  if (ns_per_kb == 0) {
+    ns_per_kb = sample;
+  } else {
+    ns_per_kb = ns_per_kb - (ns_per_kb >> AVERAGE_SHIFT) +
+                (sample >> AVERAGE_SHIFT);
+  }
+  estimate->ns_per_kb.store(ns_per_kb > 0 ? ns_per_kb : 1,
+                            std::memory_order_relaxed);
+}
+
+void ResetScheduler() {
+  for (auto& operation_estimates : estimates) {
+    for (auto& bucket : operation_estimates) {
+      for (auto& estimate : bucket) {
+        estimate.ns_per_kb.store(0, std::memory_order_relaxed);
+        estimate.failure_rate.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+// Padded to a cache line, so that threads offloading to different
+// accelerators do not contend on the same line
+struct alignas(64) InFlightCounter {
+  std::atomic<uint32_t> jobs{0};
+};
+
+static InFlightCounter in_flight[PATHS];
+
+InFlightJob::InFlightJob(ExecutionPath path) : path_(path) {
+  in_flight[path_].jobs.fetch_add(1, std::memory_order_relaxed);
+}
+
+InFlightJob::~InFlightJob() {
+  in_flight[path_].jobs.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uint32_t GetInFlightJobs(ExecutionPath path) {
+  return in_flight[path].jobs.load(std::memory_order_relaxed);
+}
+
+ExecutionPath SelectPath(EntryPoint entry_point, int window_bits,
+                         bool iaa_available, bool qat_available,
+                         uint32_t input_length) {
+  Operation operation = entry_point < EntryPoint::INFLATE
+                            ? Operation::COMPRESS
+                            : Operation::UNCOMPRESS;
+  bool zlib_enabled = operation == Operation::COMPRESS
+                          ? configs[USE_ZLIB_COMPRESS]
+                          : configs[USE_ZLIB_UNCOMPRESS];
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  iaa_available =
+      iaa_available && CircuitBreakerAllows(IAA, operation, format);
+  qat_available =
+      qat_available && CircuitBreakerAllows(QAT, operation, format);
+  if (entry_point == EntryPoint::DEFLATE ||
+      entry_point == EntryPoint::COMPRESS2) {
+    iaa_available =
+        iaa_available && RatioGuardAllows(IAA, format, input_length);
+    qat_available =
+        qat_available && RatioGuardAllows(QAT, format, input_length);
+  }
+
+  const Route* route = GetRoute(entry_point, format, input_length);
+  if (route != nullptr) {
+    ExecutionPath path = SelectRouteEngine(route, iaa_available,
+                                           qat_available, zlib_enabled);
+    return path == UNDEFINED ? ZLIB : path;
+  }
+
+  // The gz functions fall back to zlib for the whole file
+  bool zlib_available = zlib_enabled && entry_point != EntryPoint::GZWRITE &&
+                        entry_point != EntryPoint::GZREAD;
+  if (configs[ADAPTIVE_SCHEDULING]) {
+    return SchedulePath(operation, iaa_available, qat_available,
+                        zlib_available, input_length);
+  }
+  if (iaa_available && qat_available) {
+    if (configs[OCCUPANCY_ROUTING]) {
+      uint32_t iaa_jobs = GetInFlightJobs(IAA);
+      uint32_t qat_jobs = GetInFlightJobs(QAT);
+      if (iaa_jobs != qat_jobs) {
+        return iaa_jobs < qat_jobs ? IAA : QAT;
+      }
+    }
+    if (entry_point == EntryPoint::COMPRESS2 ||
+        entry_point == EntryPoint::UNCOMPRESS2) {
+      return IAA;
+    }
+    if (entry_point == EntryPoint::GZWRITE ||
+        entry_point == EntryPoint::GZREAD) {
+      return QAT;
+    }
+    uint32_t iaa_percentage = operation == Operation::COMPRESS
+                                  ? configs[IAA_COMPRESS_PERCENTAGE]
+                                  : configs[IAA_UNCOMPRESS_PERCENTAGE];
+    return FastRandom() % 100 < iaa_percentage ? IAA : QAT;
+  } else if (iaa_available) {
+    return IAA;
+  } else if (qat_available) {
+    return QAT;
+  }
+  return ZLIB;
+}
+
+uint64_t GetTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
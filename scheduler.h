@@ -0,0 +1,68 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <cstdint>
+
+#include "routing_policy.h"
+#include "zlib_accel.h"
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Adaptive selection of the execution path (adaptive_scheduling option).
+// For each operation, path and input size range, the scheduler keeps moving
+// averages of the latency per KB and of the failure rate. Calls are routed to
+// the path with the lowest expected completion time, where a failed call is
+// assumed to be completed by zlib.
+// The averages are shared by all threads and updated without locks. Updates
+// racing with each other may be lost, which only slows down convergence.
+
+enum class Operation { COMPRESS, UNCOMPRESS };
+
+VISIBLE_FOR_TESTING ExecutionPath SchedulePath(Operation operation,
+                                               bool iaa_available,
+                                               bool qat_available,
+                                               bool zlib_available,
+                                               uint32_t input_length);
+
+VISIBLE_FOR_TESTING void RecordPathResult(Operation operation,
+                                          ExecutionPath path,
+                                          uint32_t input_length,
+                                          uint64_t latency_ns, bool success);
+
+VISIBLE_FOR_TESTING void ResetScheduler();
+
+// Selects the path for one call, given the accelerators that support it.
+// Accelerators skipped by their circuit breaker, or for deflate and compress2
+// downgraded by the ratio guard, are not available.
+// - if a routing rule applies, the engine is selected from the rule
+// - with adaptive_scheduling, zlib is a candidate too, except for gzwrite and
+//   gzread
+// - if both accelerators are available, with occupancy_routing, the
+//   accelerator with fewer jobs in flight is selected (join-shortest-queue)
+// - otherwise, or if both have the same number of jobs, compress2 and
+//   uncompress2 prefer IAA, gzwrite and gzread prefer QAT, and deflate and
+//   inflate apply the configured percentage
+VISIBLE_FOR_TESTING ExecutionPath SelectPath(EntryPoint entry_point,
+                                             int window_bits,
+                                             bool iaa_available,
+                                             bool qat_available,
+                                             uint32_t input_length);
+
+// Counts a job in flight on an accelerator for its lifetime. Used by the
+// accelerator wrappers, for occupancy_routing.
+class VISIBLE_FOR_TESTING InFlightJob {
+ public:
+  explicit InFlightJob(ExecutionPath path);
+  ~InFlightJob();
+  InFlightJob(const InFlightJob&) = delete;
+  InFlightJob& operator=(const InFlightJob&) = delete;
+
+ private:
+  ExecutionPath path_;
+};
+
+VISIBLE_FOR_TESTING uint32_t GetInFlightJobs(ExecutionPath path);
+
+uint64_t GetTimeNs();
@@ -0,0 +1,172 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+
+#include "utils.h"
+
+// Allocator of the per-stream objects of the shim (deflate and inflate
+// settings, gzip files), created and freed by every init and end call.
+//
+// Objects are carved from 64kB slabs owned by a per-thread arena, and rounded
+// up to whole cache lines, so that objects used by different threads do not
+// share a cache line. An object freed by the thread that owns its arena goes
+// to the arena's free list without atomic operations. An object freed by
+// another thread (e.g., a stream ended on another thread) is pushed to the
+// arena's return queue, which the owner takes back in one operation when its
+// free list is empty.
+//
+// Slabs are not returned to the system. When a thread exits, its arena is
+// adopted by the next thread that allocates, with its free objects.
+
+template <typename T>
+class SlabAllocator {
+ public:
+  static void* Allocate(size_t size) {
+    if (size > OBJECT_SIZE) {
+      throw std::bad_alloc();
+    }
+    Arena* arena = thread_arena_;
+    if (arena == nullptr) {
+      arena = AcquireArena();
+    }
+    if (arena == ExitedThread()) {
+      // Thread-local destructors of an exiting thread allocate from a shared
+      // arena
+      std::lock_guard<std::mutex> lock(shared_mutex_);
+      return AllocateFrom(&shared_arena_);
+    }
+    return AllocateFrom(arena);
+  }
+
+  static void Free(void* ptr) {
+    if (ptr == nullptr) {
+      return;
+    }
+    Slab* slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(ptr) &
+                                         ~(SLAB_SIZE - 1));
+    Arena* arena = slab->arena;
+    FreeObject* object = static_cast<FreeObject*>(ptr);
+    if (arena == thread_arena_) {
+      object->next = arena->local_free;
+      arena->local_free = object;
+      return;
+    }
+    object->next = arena->returned.load(std::memory_order_relaxed);
+    while (!arena->returned.compare_exchange_weak(object->next, object,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed)) {
+    }
+  }
+
+ private:
+  static constexpr size_t SLAB_SIZE = 64 << 10;
+  static constexpr size_t OBJECT_ALIGNMENT =
+      alignof(T) > CACHE_LINE_SIZE ? alignof(T) : CACHE_LINE_SIZE;
+  static constexpr size_t OBJECT_SIZE =
+      (sizeof(T) + OBJECT_ALIGNMENT - 1) / OBJECT_ALIGNMENT * OBJECT_ALIGNMENT;
+  static_assert(OBJECT_SIZE * 2 <= SLAB_SIZE, "Object too large for a slab");
+
+  struct FreeObject {
+    FreeObject* next;
+  };
+
+  struct Arena {
+    // Used only by the owner thread
+    FreeObject* local_free = nullptr;
+    // Part of the last slab not carved yet
+    char* slab_next = nullptr;
+    char* slab_end = nullptr;
+    Arena* next_orphan = nullptr;
+    // Objects freed by other threads
+    alignas(CACHE_LINE_SIZE) std::atomic<FreeObject*> returned{nullptr};
+  };
+
+  // Header in the first object slot of a slab
+  struct Slab {
+    Arena* arena;
+  };
+
+  // Orphans the arena of the thread when it exits
+  struct ThreadArenaOwner {
+    ~ThreadArenaOwner() {
+      Arena* arena = thread_arena_;
+      thread_arena_ = ExitedThread();
+      if (arena != nullptr && arena != ExitedThread()) {
+        std::lock_guard<std::mutex> lock(orphans_mutex_);
+        arena->next_orphan = orphans_;
+        orphans_ = arena;
+      }
+    }
+    void Register() {}
+  };
+
+  // Arena of a thread whose thread-local destructors are running
+  static Arena* ExitedThread() { return reinterpret_cast<Arena*>(1); }
+
+  static Arena* AcquireArena() {
+    thread_arena_owner_.Register();
+    Arena* arena = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(orphans_mutex_);
+      if (orphans_ != nullptr) {
+        arena = orphans_;
+        orphans_ = arena->next_orphan;
+        arena->next_orphan = nullptr;
+      }
+    }
+    if (arena == nullptr) {
+      arena = new Arena;
+    }
+    thread_arena_ = arena;
+    return arena;
+  }
+
+  static void* AllocateFrom(Arena* arena) {
+    if (arena->local_free == nullptr) {
+      arena->local_free =
+          arena->returned.exchange(nullptr, std::memory_order_acquire);
+    }
+    if (arena->local_free != nullptr) {
+      FreeObject* object = arena->local_free;
+      arena->local_free = object->next;
+      return object;
+    }
+    if (arena->slab_next == arena->slab_end) {
+      void* memory = std::aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+      if (memory == nullptr) {
+        throw std::bad_alloc();
+      }
+      static_cast<Slab*>(memory)->arena = arena;
+      char* slab = static_cast<char*>(memory);
+      arena->slab_next = slab + OBJECT_SIZE;
+      arena->slab_end = slab + SLAB_SIZE / OBJECT_SIZE * OBJECT_SIZE;
+    }
+    void* object = arena->slab_next;
+    arena->slab_next += OBJECT_SIZE;
+    return object;
+  }
+
+  inline static thread_local Arena* thread_arena_ = nullptr;
+  inline static thread_local ThreadArenaOwner thread_arena_owner_;
+  inline static std::mutex orphans_mutex_;
+  inline static Arena* orphans_ = nullptr;
+  inline static std::mutex shared_mutex_;
+  inline static Arena shared_arena_;
+};
+
+// Base class of objects allocated by SlabAllocator
+template <typename T>
+struct SlabAllocated {
+  static void* operator new(size_t size) {
+    return SlabAllocator<T>::Allocate(size);
+  }
+  static void operator delete(void* ptr) { SlabAllocator<T>::Free(ptr); }
+};
@@ -8,16 +8,25 @@
 #include <sstream>
 #include <thread>
 
+#include "circuit_breaker.h"
 #include "config/config.h"
 #include "logging.h"
+#include "result_cache.h"
 using namespace config;
 
 const std::array<const char*, STATS_COUNT> stat_names{
     {"deflate_count", "deflate_error_count", "deflate_qat_count",
      "deflate_qat_error_count", "deflate_iaa_count", "deflate_iaa_error_count",
-     "deflate_zlib_count", "inflate_count", "inflate_error_count",
-     "inflate_qat_count", "inflate_qat_error_count", "inflate_iaa_count",
-     "inflate_iaa_error_count", "inflate_zlib_count"}};
+     "deflate_zlib_count", "deflate_stored_count", "inflate_count",
+     "inflate_error_count", "inflate_qat_count", "inflate_qat_error_count",
+     "inflate_iaa_count", "inflate_iaa_error_count", "inflate_zlib_count",
+     "circuit_breaker_open_count", "circuit_breaker_skip_count",
+     "hedge_timeout_count", "inflate_size_skip_count",
+     "inflate_predicted_skip_count", "inflate_predicted_buffer_count",
+     "ratio_guard_sample_count", "ratio_guard_downgrade_count",
+     "ratio_guard_skip_count", "result_cache_hit_count",
+     "result_cache_miss_count", "result_cache_insert_count",
+     "result_cache_evict_count", "zlib_state_reuse_count"}};
 
 thread_local std::array<uint64_t, STATS_COUNT> stats{};
 
@@ -32,5 +41,7 @@ void PrintStats() {
   for (size_t i = 0; i < stats.size(); ++i) {
     LogStats(stat_names[i], " = ", stats[i], "\n");
   }
+  LogStats("open_circuit_breakers = ", GetOpenCircuitBreakers(), "\n");
+  LogStats("result_cache_bytes = ", GetResultCacheBytes(), "\n");
 }
 #endif
@@ -18,6 +18,7 @@ enum class Statistic : size_t {
   DEFLATE_IAA_COUNT,
   DEFLATE_IAA_ERROR_COUNT,
   DEFLATE_ZLIB_COUNT,
+  DEFLATE_STORED_COUNT,
   INFLATE_COUNT,
   INFLATE_ERROR_COUNT,
   INFLATE_QAT_COUNT,
@@ -25,6 +26,20 @@ enum class Statistic : size_t {
   INFLATE_IAA_COUNT,
   INFLATE_IAA_ERROR_COUNT,
   INFLATE_ZLIB_COUNT,
+  CIRCUIT_BREAKER_OPEN_COUNT,
+  CIRCUIT_BREAKER_SKIP_COUNT,
+  HEDGE_TIMEOUT_COUNT,
+  INFLATE_SIZE_SKIP_COUNT,
+  INFLATE_PREDICTED_SKIP_COUNT,
+  INFLATE_PREDICTED_BUFFER_COUNT,
+  RATIO_GUARD_SAMPLE_COUNT,
+  RATIO_GUARD_DOWNGRADE_COUNT,
+  RATIO_GUARD_SKIP_COUNT,
+  RESULT_CACHE_HIT_COUNT,
+  RESULT_CACHE_MISS_COUNT,
+  RESULT_CACHE_INSERT_COUNT,
+  RESULT_CACHE_EVICT_COUNT,
+  ZLIB_STATE_REUSE_COUNT,
   STATS_COUNT
 };
 
@@ -0,0 +1,373 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "utils.h"
+
+// Table of the shim state of streams and gzip files, looked up on every
+// deflate, inflate, gzwrite and gzread call.
+//
+// Lookups do not take a lock. Set and Unset, called by the init and end
+// functions, are serialized by a mutex. The table uses open addressing with
+// linear probing over buckets of one cache line, so that a lookup usually
+// reads a single cache line. When the table is rehashed, readers may still be
+// reading the old table; it is freed once no reader holds a hazard pointer to
+// it.
+//
+// In front of the table, each thread caches the last lookup of each table. The
+// cached result is used as long as the version of the key's stripe is
+// unchanged, i.e., no key of the stripe was set or unset since. Repeated calls
+// for the same stream then skip the lookup.
+//
+// As with zlib streams, a value must not be used by a thread while another
+// thread unsets its key. Null keys are not stored.
+
+// Hazard pointer of a thread, published while it reads a table
+struct alignas(CACHE_LINE_SIZE) HazardRecord {
+  std::atomic<const void*> table{nullptr};
+  std::atomic<bool> in_use{false};
+  HazardRecord* next = nullptr;
+};
+
+// Records are never freed. A record released by a thread that exits is reused
+// by the next thread.
+class HazardRecords {
+ public:
+  static HazardRecord* Acquire() {
+    for (HazardRecord* record = head_.load(std::memory_order_acquire);
+         record != nullptr; record = record->next) {
+      bool in_use = false;
+      if (!record->in_use.load(std::memory_order_relaxed) &&
+          record->in_use.compare_exchange_strong(in_use, true)) {
+        return record;
+      }
+    }
+    HazardRecord* record = new HazardRecord;
+    record->in_use.store(true, std::memory_order_relaxed);
+    record->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(record->next, record)) {
+    }
+    return record;
+  }
+
+  static void Release(HazardRecord* record) {
+    record->table.store(nullptr, std::memory_order_relaxed);
+    record->in_use.store(false, std::memory_order_release);
+  }
+
+  static bool IsProtected(const void* table) {
+    for (HazardRecord* record = head_.load(std::memory_order_acquire);
+         record != nullptr; record = record->next) {
+      if (record->table.load() == table) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  inline static std::atomic<HazardRecord*> head_{nullptr};
+};
+
+class ThreadHazardRecord {
+ public:
+  ~ThreadHazardRecord() {
+    if (record_ != nullptr) {
+      HazardRecords::Release(record_);
+    }
+  }
+
+  HazardRecord* Get() {
+    if (record_ == nullptr) {
+      record_ = HazardRecords::Acquire();
+    }
+    return record_;
+  }
+
+ private:
+  HazardRecord* record_ = nullptr;
+};
+
+inline thread_local ThreadHazardRecord thread_hazard_record;
+
+template <typename Key, typename Value>
+class StreamTable {
+  static_assert(std::is_pointer<Key>::value, "Keys are stream pointers");
+
+ public:
+  StreamTable()
+      : id_(next_id_.fetch_add(1, std::memory_order_relaxed)),
+        table_(new Table(MIN_BUCKET_BITS)) {}
+
+  ~StreamTable() {
+    Table* table = table_.load(std::memory_order_relaxed);
+    for (size_t slot = 0; slot <= table->slot_mask; slot++) {
+      delete table->ValueAt(slot).load(std::memory_order_relaxed);
+    }
+    delete table;
+    for (Table* retired : retired_) {
+      delete retired;
+    }
+  }
+
+  StreamTable(const StreamTable&) = delete;
+  StreamTable& operator=(const StreamTable&) = delete;
+
+  Value* Get(Key key) {
+    uintptr_t slot_key = reinterpret_cast<uintptr_t>(key);
+    uint64_t version = GetStripe(slot_key).load(std::memory_order_acquire);
+    LastHit& hit = last_hit_;
+    if (hit.table_id == id_ && hit.key == slot_key && hit.version == version) {
+      return hit.value;
+    }
+    Value* value = Find(slot_key);
+    hit = {id_, slot_key, version, value};
+    return value;
+  }
+
+  // Returns the stored value, or nullptr for a null key
+  Value* Set(Key key, std::unique_ptr<Value>&& value) {
+    uintptr_t slot_key = reinterpret_cast<uintptr_t>(key);
+    if (slot_key == EMPTY || slot_key == TOMBSTONE) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    Table* table = table_.load(std::memory_order_relaxed);
+    size_t slot;
+    Value* stored = value.release();
+    if (Locate(table, slot_key, &slot)) {
+      delete table->ValueAt(slot).exchange(stored, std::memory_order_acq_rel);
+    } else {
+      if (table->KeyAt(slot).load(std::memory_order_relaxed) == EMPTY) {
+        if (used_ + 1 > MaxUsed(table)) {
+          table = Rehash(live_ + 1);
+          Locate(table, slot_key, &slot);
+        }
+        used_++;
+      }
+      table->ValueAt(slot).store(stored, std::memory_order_relaxed);
+      table->KeyAt(slot).store(slot_key, std::memory_order_release);
+      live_++;
+    }
+    GetStripe(slot_key).fetch_add(1, std::memory_order_release);
+    return stored;
+  }
+
+  void Unset(Key key) {
+    uintptr_t slot_key = reinterpret_cast<uintptr_t>(key);
+    if (slot_key == EMPTY || slot_key == TOMBSTONE) {
+      return;
+    }
+    Value* value;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Table* table = table_.load(std::memory_order_relaxed);
+      size_t slot;
+      if (!Locate(table, slot_key, &slot)) {
+        return;
+      }
+      value = table->ValueAt(slot).load(std::memory_order_relaxed);
+      table->KeyAt(slot).store(TOMBSTONE, std::memory_order_release);
+      table->ValueAt(slot).store(nullptr, std::memory_order_relaxed);
+      live_--;
+      // Tombstones at the end of a probe sequence are cleared. Lookups stop at
+      // the next empty slot anyway, so no key is hidden by clearing them.
+      if (table->KeyAt(Next(table, slot)).load(std::memory_order_relaxed) ==
+          EMPTY) {
+        while (table->KeyAt(slot).load(std::memory_order_relaxed) ==
+               TOMBSTONE) {
+          table->KeyAt(slot).store(EMPTY, std::memory_order_release);
+          used_--;
+          slot = Previous(table, slot);
+        }
+      }
+      GetStripe(slot_key).fetch_add(1, std::memory_order_release);
+    }
+    delete value;
+  }
+
+  // Number of slots, for testing
+  size_t GetCapacity() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return table_.load(std::memory_order_relaxed)->slot_mask + 1;
+  }
+
+ private:
+  static constexpr uintptr_t EMPTY = 0;
+  static constexpr uintptr_t TOMBSTONE = 1;
+  static constexpr size_t SLOTS_PER_BUCKET = 4;
+  static constexpr int MIN_BUCKET_BITS = 4;
+  static constexpr size_t VERSION_STRIPES = 64;
+
+  struct alignas(CACHE_LINE_SIZE) Bucket {
+    std::atomic<uintptr_t> keys[SLOTS_PER_BUCKET];
+    std::atomic<Value*> values[SLOTS_PER_BUCKET];
+  };
+
+  struct Table {
+    explicit Table(int _bucket_bits)
+        : buckets(new Bucket[size_t{1} << _bucket_bits]()),
+          bucket_bits(_bucket_bits),
+          slot_mask((SLOTS_PER_BUCKET << _bucket_bits) - 1) {}
+
+    std::atomic<uintptr_t>& KeyAt(size_t slot) {
+      return buckets[slot / SLOTS_PER_BUCKET].keys[slot % SLOTS_PER_BUCKET];
+    }
+
+    std::atomic<Value*>& ValueAt(size_t slot) {
+      return buckets[slot / SLOTS_PER_BUCKET].values[slot % SLOTS_PER_BUCKET];
+    }
+
+    // First slot of the bucket of a key (Fibonacci hashing)
+    size_t Home(uintptr_t key) const {
+      uint64_t hash = static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL;
+      return (hash >> (64 - bucket_bits)) * SLOTS_PER_BUCKET;
+    }
+
+    std::unique_ptr<Bucket[]> buckets;
+    int bucket_bits;
+    size_t slot_mask;
+  };
+
+  struct alignas(CACHE_LINE_SIZE) Stripe {
+    std::atomic<uint64_t> version{0};
+  };
+
+  // Tables are identified by an id rather than their address, which may be
+  // reused by another table
+  struct LastHit {
+    uint64_t table_id;
+    uintptr_t key;
+    uint64_t version;
+    Value* value;
+  };
+
+  static size_t Next(const Table* table, size_t slot) {
+    return (slot + 1) & table->slot_mask;
+  }
+
+  static size_t Previous(const Table* table, size_t slot) {
+    return (slot - 1) & table->slot_mask;
+  }
+
+  // Slots are used (live or tombstone) up to a load factor of 3/4
+  static size_t MaxUsed(const Table* table) {
+    return (table->slot_mask + 1) / 4 * 3;
+  }
+
+  std::atomic<uint64_t>& GetStripe(uintptr_t key) {
+    return stripes_[(key >> 4) % VERSION_STRIPES].version;
+  }
+
+  Value* Find(uintptr_t key) {
+    if (key == EMPTY || key == TOMBSTONE) {
+      return nullptr;
+    }
+    HazardRecord* record = thread_hazard_record.Get();
+    Table* table = table_.load(std::memory_order_acquire);
+    while (true) {
+      record->table.store(table);
+      Table* current = table_.load();
+      if (current == table) {
+        break;
+      }
+      table = current;
+    }
+    Value* value = nullptr;
+    for (size_t slot = table->Home(key);; slot = Next(table, slot)) {
+      uintptr_t slot_key = table->KeyAt(slot).load(std::memory_order_acquire);
+      if (slot_key == key) {
+        value = table->ValueAt(slot).load(std::memory_order_acquire);
+        break;
+      }
+      if (slot_key == EMPTY) {
+        break;
+      }
+    }
+    record->table.store(nullptr, std::memory_order_release);
+    return value;
+  }
+
+  // Returns true and the slot of key if present. Otherwise, returns false and
+  // the slot where key should be inserted.
+  static bool Locate(Table* table, uintptr_t key, size_t* slot) {
+    bool tombstone_found = false;
+    for (size_t i = table->Home(key);; i = Next(table, i)) {
+      uintptr_t slot_key = table->KeyAt(i).load(std::memory_order_relaxed);
+      if (slot_key == key) {
+        *slot = i;
+        return true;
+      }
+      if (slot_key == TOMBSTONE && !tombstone_found) {
+        tombstone_found = true;
+        *slot = i;
+      }
+      if (slot_key == EMPTY) {
+        if (!tombstone_found) {
+          *slot = i;
+        }
+        return false;
+      }
+    }
+  }
+
+  // Moves the keys to a new table sized for twice the number of live keys.
+  // The old table is freed when no reader uses it.
+  Table* Rehash(size_t live) {
+    int bucket_bits = MIN_BUCKET_BITS;
+    while ((SLOTS_PER_BUCKET << bucket_bits) < live * 2) {
+      bucket_bits++;
+    }
+    Table* old_table = table_.load(std::memory_order_relaxed);
+    Table* table = new Table(bucket_bits);
+    for (size_t i = 0; i <= old_table->slot_mask; i++) {
+      uintptr_t key = old_table->KeyAt(i).load(std::memory_order_relaxed);
+      if (key == EMPTY || key == TOMBSTONE) {
+        continue;
+      }
+      size_t slot;
+      Locate(table, key, &slot);
+      table->ValueAt(slot).store(
+          old_table->ValueAt(i).load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+      table->KeyAt(slot).store(key, std::memory_order_relaxed);
+    }
+    used_ = live_;
+    table_.store(table);
+
+    retired_.push_back(old_table);
+    size_t kept = 0;
+    for (Table* retired : retired_) {
+      if (HazardRecords::IsProtected(retired)) {
+        retired_[kept++] = retired;
+      } else {
+        delete retired;
+      }
+    }
+    retired_.resize(kept);
+    return table;
+  }
+
+  inline static std::atomic<uint64_t> next_id_{1};
+  inline static thread_local LastHit last_hit_{};
+
+  // Written only by Set and Unset
+  alignas(CACHE_LINE_SIZE) const uint64_t id_;
+  std::atomic<Table*> table_;
+  Stripe stripes_[VERSION_STRIPES];
+
+  alignas(CACHE_LINE_SIZE) std::mutex mutex_;
+  // Live keys and tombstones
+  size_t used_ = 0;
+  size_t live_ = 0;
+  std::vector<Table*> retired_;
+};
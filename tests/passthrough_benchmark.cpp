@@ -0,0 +1,222 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// Overhead of the shim on calls passed to zlib. Small messages are compressed
+// and decompressed one at a time with Z_SYNC_FLUSH on long-lived raw deflate
+// streams, as in RPC and websocket compression, with:
+// - zlib: zlib functions called directly, bypassing the shim
+// - passthrough: the shim with all engines off (passthrough mode)
+// - pinned: the shim with passthrough mode disabled by the result cache, on
+//   streams pinned to zlib by a dictionary
+
+#include <dlfcn.h>
+#include <zlib.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../config/config.h"
+
+using namespace config;
+
+inline constexpr int MESSAGES = 200000;
+inline constexpr int EMPTY_CALLS = 10000000;
+inline constexpr uInt MESSAGE_SIZE = 256;
+inline constexpr uInt DICTIONARY_SIZE = 1024;
+
+// zlib functions used by the benchmark
+struct ZlibFunctions {
+  decltype(&deflateInit2_) deflate_init;
+  decltype(&deflateSetDictionary) deflate_set_dictionary;
+  int (*deflate_call)(z_streamp, int);
+  decltype(&deflateEnd) deflate_end;
+  decltype(&inflateInit2_) inflate_init;
+  decltype(&inflateSetDictionary) inflate_set_dictionary;
+  int (*inflate_call)(z_streamp, int);
+  decltype(&inflateEnd) inflate_end;
+};
+
+template <typename Function>
+static bool LoadFunction(void* handle, const char* name, Function* function) {
+  *function = reinterpret_cast<Function>(dlsym(handle, name));
+  return *function != nullptr;
+}
+
+// Functions of zlib itself, looked up in libz rather than in the shim
+static bool LoadZlib(ZlibFunctions* functions) {
+  void* handle = dlopen("libz.so.1", RTLD_NOW | RTLD_NOLOAD);
+  return handle != nullptr &&
+         LoadFunction(handle, "deflateInit2_", &functions->deflate_init) &&
+         LoadFunction(handle, "deflateSetDictionary",
+                      &functions->deflate_set_dictionary) &&
+         LoadFunction(handle, "deflate", &functions->deflate_call) &&
+         LoadFunction(handle, "deflateEnd", &functions->deflate_end) &&
+         LoadFunction(handle, "inflateInit2_", &functions->inflate_init) &&
+         LoadFunction(handle, "inflateSetDictionary",
+                      &functions->inflate_set_dictionary) &&
+         LoadFunction(handle, "inflate", &functions->inflate_call) &&
+         LoadFunction(handle, "inflateEnd", &functions->inflate_end);
+}
+
+static void InitStreams(const ZlibFunctions& zlib,
+                        const std::vector<Bytef>& dictionary,
+                        z_stream* deflate_stream, z_stream* inflate_stream) {
+  memset(deflate_stream, 0, sizeof(z_stream));
+  memset(inflate_stream, 0, sizeof(z_stream));
+  if (zlib.deflate_init(deflate_stream, 1, Z_DEFLATED, -15, 8,
+                        Z_DEFAULT_STRATEGY, ZLIB_VERSION,
+                        sizeof(z_stream)) != Z_OK ||
+      zlib.deflate_set_dictionary(deflate_stream, dictionary.data(),
+                                  dictionary.size()) != Z_OK ||
+      zlib.inflate_init(inflate_stream, -15, ZLIB_VERSION,
+                        sizeof(z_stream)) != Z_OK ||
+      zlib.inflate_set_dictionary(inflate_stream, dictionary.data(),
+                                  dictionary.size()) != Z_OK) {
+    fprintf(stderr, "Stream initialization failed\n");
+    exit(1);
+  }
+}
+
+// Returns the time per message in ns, for one deflate and one inflate call
+static double RunMessages(const ZlibFunctions& zlib,
+                          const std::vector<Bytef>& messages,
+                          const std::vector<Bytef>& dictionary) {
+  z_stream deflate_stream;
+  z_stream inflate_stream;
+  InitStreams(zlib, dictionary, &deflate_stream, &inflate_stream);
+  std::vector<Bytef> compressed(MESSAGE_SIZE * 2);
+  std::vector<Bytef> uncompressed(MESSAGE_SIZE);
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < MESSAGES; i++) {
+    const Bytef* message = &messages[(i % 64) * MESSAGE_SIZE];
+    deflate_stream.next_in = const_cast<Bytef*>(message);
+    deflate_stream.avail_in = MESSAGE_SIZE;
+    deflate_stream.next_out = compressed.data();
+    deflate_stream.avail_out = compressed.size();
+    int ret = zlib.deflate_call(&deflate_stream, Z_SYNC_FLUSH);
+    inflate_stream.next_in = compressed.data();
+    inflate_stream.avail_in = compressed.size() - deflate_stream.avail_out;
+    inflate_stream.next_out = uncompressed.data();
+    inflate_stream.avail_out = uncompressed.size();
+    int ret2 = zlib.inflate_call(&inflate_stream, Z_SYNC_FLUSH);
+    if (ret != Z_OK || ret2 != Z_OK || inflate_stream.avail_out != 0 ||
+        memcmp(uncompressed.data(), message, MESSAGE_SIZE) != 0) {
+      fprintf(stderr, "Message %d failed\n", i);
+      exit(1);
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  zlib.deflate_end(&deflate_stream);
+  zlib.inflate_end(&inflate_stream);
+  return elapsed.count() / MESSAGES;
+}
+
+// Returns the time in ns of one deflate and one inflate call without input,
+// which zlib returns from at once: the cost of the call itself
+static double RunEmptyCalls(const ZlibFunctions& zlib,
+                            const std::vector<Bytef>& dictionary) {
+  z_stream deflate_stream;
+  z_stream inflate_stream;
+  InitStreams(zlib, dictionary, &deflate_stream, &inflate_stream);
+  Bytef output[16];
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < EMPTY_CALLS; i++) {
+    deflate_stream.avail_in = 0;
+    deflate_stream.next_out = output;
+    deflate_stream.avail_out = sizeof(output);
+    int ret = zlib.deflate_call(&deflate_stream, Z_NO_FLUSH);
+    inflate_stream.avail_in = 0;
+    inflate_stream.next_out = output;
+    inflate_stream.avail_out = sizeof(output);
+    int ret2 = zlib.inflate_call(&inflate_stream, Z_NO_FLUSH);
+    if ((ret != Z_OK && ret != Z_BUF_ERROR) ||
+        (ret2 != Z_OK && ret2 != Z_BUF_ERROR)) {
+      fprintf(stderr, "Call %d failed\n", i);
+      exit(1);
+    }
+  }
+  std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  zlib.deflate_end(&deflate_stream);
+  zlib.inflate_end(&inflate_stream);
+  return elapsed.count() / EMPTY_CALLS;
+}
+
+int main() {
+  ZlibFunctions zlib;
+  if (!LoadZlib(&zlib)) {
+    fprintf(stderr, "Failed to load zlib functions\n");
+    return 1;
+  }
+  ZlibFunctions shim;
+  shim.deflate_init = deflateInit2_;
+  shim.deflate_set_dictionary = deflateSetDictionary;
+  shim.deflate_call = deflate;
+  shim.deflate_end = deflateEnd;
+  shim.inflate_init = inflateInit2_;
+  shim.inflate_set_dictionary = inflateSetDictionary;
+  shim.inflate_call = inflate;
+  shim.inflate_end = inflateEnd;
+
+  // Messages made of words from a small vocabulary, also used as dictionary
+  const char* words[] = {"id",     "name",  "value", "status", "time",
+                         "type",   "user",  "error", "count",  "request",
+                         "result", "data",  "key",   "true",   "false",
+                         "null",   "items", "code",  "path",   "size"};
+  std::vector<Bytef> messages(64 * MESSAGE_SIZE);
+  std::vector<Bytef> dictionary(DICTIONARY_SIZE);
+  srand(1);
+  for (auto* buffer : {&messages, &dictionary}) {
+    size_t pos = 0;
+    while (pos < buffer->size()) {
+      const char* word = words[rand() % 20];
+      for (size_t i = 0; word[i] != '\0' && pos < buffer->size(); i++) {
+        (*buffer)[pos++] = word[i];
+      }
+      if (pos < buffer->size()) {
+        (*buffer)[pos++] = rand() % 2 ? ':' : ',';
+      }
+    }
+  }
+
+  SetConfig(USE_QAT_COMPRESS, 0);
+  SetConfig(USE_QAT_UNCOMPRESS, 0);
+  SetConfig(USE_IAA_COMPRESS, 0);
+  SetConfig(USE_IAA_UNCOMPRESS, 0);
+  SetConfig(USE_ZLIB_COMPRESS, 1);
+  SetConfig(USE_ZLIB_UNCOMPRESS, 1);
+  SetConfig(LOG_LEVEL, 2);
+  // Statistics are not printed during the runs
+  SetConfig(LOG_STATS_SAMPLES, 1 << 30);
+  SetConfig(RESULT_CACHE_SIZE_MB, 0);
+
+  if (!IsCompressPassthrough()) {
+    fprintf(stderr, "Passthrough mode not enabled\n");
+    return 1;
+  }
+  const char* modes[] = {"zlib", "passthrough", "pinned"};
+  double message_ns[3];
+  double call_ns[3];
+  for (int mode = 0; mode < 3; mode++) {
+    const ZlibFunctions& functions = mode == 0 ? zlib : shim;
+    // The result cache disables passthrough mode
+    SetConfig(RESULT_CACHE_SIZE_MB, mode == 2 ? 1 : 0);
+    // Warm-up
+    RunMessages(functions, messages, dictionary);
+    message_ns[mode] = RunMessages(functions, messages, dictionary);
+    call_ns[mode] = RunEmptyCalls(functions, dictionary);
+  }
+  SetConfig(RESULT_CACHE_SIZE_MB, 0);
+
+  printf("%-12s %12s %12s %18s\n", "mode", "ns/message", "ns/call pair",
+         "overhead ns/call");
+  for (int mode = 0; mode < 3; mode++) {
+    printf("%-12s %12.1f %12.1f %18.1f\n", modes[mode], message_ns[mode],
+           call_ns[mode], (call_ns[mode] - call_ns[0]) / 2);
+  }
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+// Contention benchmark of the stream state table (StreamTable) against the
+// previous sharded map (ShardedMap). The table holds 100k live streams. Each
+// thread looks up streams of its own slice, several times in a row as deflate
+// and inflate loops do, and replaces one stream in every CHURN_PERIOD lookups
+// as init and end calls do.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../stream_table.h"
+
+inline constexpr size_t LIVE_STREAMS = 100000;
+inline constexpr int CALLS_PER_STREAM = 4;
+inline constexpr int CHURN_PERIOD = 1000;
+inline constexpr auto DURATION = std::chrono::milliseconds(300);
+
+struct Settings {
+  explicit Settings(size_t _id) : id(_id) {}
+  size_t id;
+};
+
+// Map of stream settings used by the shim before StreamTable: a hash map per
+// shard, each behind a reader-writer lock
+template <typename Key, typename Value>
+class ShardedMap {
+ public:
+  auto Get(Key key) -> decltype(std::declval<Value>().get()) {
+    unsigned int shard = GetShard(key);
+    std::shared_lock<std::shared_mutex> lock(shard_mutexes[shard]);
+    auto it = map[shard].find(key);
+    if (it == map[shard].end()) {
+      return nullptr;
+    }
+    return it->second.get();
+  }
+
+  void Set(Key key, Value&& value) {
+    unsigned int shard = GetShard(key);
+    std::unique_lock<std::shared_mutex> lock(shard_mutexes[shard]);
+    map[shard][key] = std::move(value);
+  }
+
+  void Unset(Key key) {
+    unsigned int shard = GetShard(key);
+    std::unique_lock<std::shared_mutex> lock(shard_mutexes[shard]);
+    map[shard].erase(key);
+  }
+
+ private:
+  static constexpr int SHARDS = 64;
+
+  unsigned int GetShard(Key key) { return std::hash<Key>{}(key) % SHARDS; }
+  std::unordered_map<Key, Value> map[SHARDS];
+  std::shared_mutex shard_mutexes[SHARDS];
+};
+
+static int* StreamKey(size_t i) { return reinterpret_cast<int*>((i + 1) * 64); }
+
+// Common interface of the two maps
+struct StreamTableMap {
+  Settings* Get(int* key) { return table.Get(key); }
+  void Set(int* key, size_t id) {
+    table.Set(key, std::make_unique<Settings>(id));
+  }
+  void Unset(int* key) { table.Unset(key); }
+  StreamTable<int*, Settings> table;
+};
+
+struct ShardedMapMap {
+  Settings* Get(int* key) { return map.Get(key); }
+  void Set(int* key, size_t id) {
+    map.Set(key, std::make_unique<Settings>(id));
+  }
+  void Unset(int* key) { map.Unset(key); }
+  ShardedMap<int*, std::unique_ptr<Settings>> map;
+};
+
+template <typename Map>
+static double Run(int thread_count) {
+  Map map;
+  for (size_t i = 0; i < LIVE_STREAMS; i++) {
+    map.Set(StreamKey(i), i);
+  }
+  std::atomic<bool> start{false};
+  std::atomic<bool> stop{false};
+  std::vector<uint64_t> counts(thread_count);
+  // Keeps the lookups from being optimized out
+  std::atomic<uint64_t> checksum{0};
+  std::vector<std::thread> threads;
+  size_t slice = LIVE_STREAMS / thread_count;
+  for (int t = 0; t < thread_count; t++) {
+    threads.emplace_back([&, t]() {
+      size_t first = t * slice;
+      uint64_t state = t + 1;
+      uint64_t count = 0;
+      uint64_t sum = 0;
+      while (!start.load(std::memory_order_acquire)) {
+      }
+      while (!stop.load(std::memory_order_relaxed)) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        size_t stream = first + (state >> 33) % slice;
+        for (int call = 0; call < CALLS_PER_STREAM; call++) {
+          Settings* settings = map.Get(StreamKey(stream));
+          if (settings == nullptr || settings->id != stream) {
+            fprintf(stderr, "Lookup failed for stream %zu\n", stream);
+            abort();
+          }
+          sum += settings->id;
+        }
+        count += CALLS_PER_STREAM;
+        if (count % CHURN_PERIOD < CALLS_PER_STREAM) {
+          map.Unset(StreamKey(stream));
+          map.Set(StreamKey(stream), stream);
+        }
+      }
+      counts[t] = count;
+      checksum += sum;
+    });
+  }
+  auto begin = std::chrono::steady_clock::now();
+  start.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(DURATION);
+  stop.store(true);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - begin;
+  uint64_t total = 0;
+  for (uint64_t count : counts) {
+    total += count;
+  }
+  return total / elapsed.count() / 1e6;
+}
+
+int main(int argc, char* argv[]) {
+  int max_threads = argc > 1 ? atoi(argv[1]) : 256;
+  printf("%8s %18s %18s\n", "threads", "ShardedMap Mops/s",
+         "StreamTable Mops/s");
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    double sharded_map = Run<ShardedMapMap>(threads);
+    double stream_table = Run<StreamTableMap>(threads);
+    printf("%8d %18.1f %18.1f\n", threads, sharded_map, stream_table);
+  }
+  return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "test_utils.h"
 
+#include <algorithm>
 #include <iostream>
 
 #ifdef DEBUG_LOG
@@ -43,6 +44,51 @@ int ZlibCompress(const char* input, size_t input_length, std::string* output,
   return st;
 }
 
+int ZlibCompressStreaming(const char* input, size_t input_length,
+                          std::string* output, int window_bits, int flush,
+                          size_t input_chunk_size, size_t output_chunk_size,
+                          ExecutionPath* execution_path) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+
+  int st =
+      deflateInit2(&stream, -1, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+  if (st != Z_OK) {
+    deflateEnd(&stream);
+    return st;
+  }
+
+  output->clear();
+  std::string output_chunk(output_chunk_size, 0);
+  size_t input_pos = 0;
+  do {
+    size_t input_chunk_length =
+        std::min(input_chunk_size, input_length - input_pos);
+    stream.next_in = (Bytef*)(input + input_pos);
+    stream.avail_in = static_cast<unsigned int>(input_chunk_length);
+    input_pos += input_chunk_length;
+    int chunk_flush = input_pos == input_length ? Z_FINISH : flush;
+
+    do {
+      stream.next_out = reinterpret_cast<Bytef*>(&output_chunk[0]);
+      stream.avail_out = static_cast<unsigned int>(output_chunk_size);
+      st = deflate(&stream, chunk_flush);
+      if (st != Z_OK && st != Z_STREAM_END && st != Z_BUF_ERROR) {
+        deflateEnd(&stream);
+        return st;
+      }
+      output->append(output_chunk, 0, output_chunk_size - stream.avail_out);
+    } while (stream.avail_out == 0 || (chunk_flush == Z_FINISH && st == Z_OK));
+  } while (input_pos < input_length);
+  *execution_path = GetDeflateExecutionPath(&stream);
+
+  if (stream.total_in != input_length || stream.total_out != output->size()) {
+    st = Z_DATA_ERROR;
+  }
+  deflateEnd(&stream);
+  return st;
+}
+
 int ZlibUncompress(const char* input, size_t input_length, size_t output_length,
                    char** uncompressed, size_t* uncompressed_length,
                    size_t* input_consumed, int window_bits, int flush,
@@ -18,6 +18,13 @@ int ZlibCompress(const char* input, size_t input_length, std::string* output,
                  int window_bits, int flush, size_t* output_upper_bound,
                  ExecutionPath* execution_path);
 
+// Compresses with multiple deflate calls, passing input and output in chunks
+// of the given sizes. The last call uses Z_FINISH, the others use flush.
+int ZlibCompressStreaming(const char* input, size_t input_length,
+                          std::string* output, int window_bits, int flush,
+                          size_t input_chunk_size, size_t output_chunk_size,
+                          ExecutionPath* execution_path);
+
 int ZlibUncompress(const char* input, size_t input_length, size_t output_length,
                    char** uncompressed, size_t* uncompressed_length,
                    size_t* input_consumed, int window_bits, int flush,
@@ -5,7 +5,10 @@
 
 #include <gtest/gtest.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -19,12 +22,21 @@
 #include <tuple>
 #include <vector>
 
+#include "../circuit_breaker.h"
 #include "../config/config.h"
+#include "../expansion_predictor.h"
+#include "../hedge.h"
 #include "../iaa.h"
 #include "../qat.h"
-#include "../sharded_map.h"
+#include "../ratio_guard.h"
+#include "../result_cache.h"
+#include "../routing_policy.h"
+#include "../scheduler.h"
+#include "../slab_allocator.h"
 #include "../statistics.h"
+#include "../stream_table.h"
 #include "../utils.h"
+#include "../worker_pool.h"
 #include "test_utils.h"
 
 using namespace config;
@@ -437,22 +449,10 @@ bool ZlibUncompressExpectFallback(TestParam test_param, size_t input_length,
       fallback_expected = true;
       accelerator_tried_val = true;
     } else if (input_length > QAT_HW_BUFF_SZ &&
-               test_param.execution_path_compress == QAT &&
-               ((GetCompressedFormat(window_bits_uncompress) ==
-                     CompressedFormat::ZLIB &&
-                 test_param.block_type == incompressible_block) ||
-                GetCompressedFormat(window_bits_uncompress) ==
-                    CompressedFormat::DEFLATE_RAW ||
-                !test_param.qat_compression_allow_chunking)) {
+               test_param.execution_path_compress == QAT) {
       // If data was compressed with QAT, it was chunked during compression
-      // (if chunking is allowed)
-      // - gzip format: QAT decompression always possible (stream boundaries
-      // detected before decompression)
-      // - zlib format: QAT decompression possible if compressed
-      // data fits in HW buffer size (it does not happen with incompressible
-      // data).
-      // - deflate raw: chunking during compression doesn't close the stream.
-      // Decompression not possible.
+      // into blocks of one stream, for all formats. The stream does not end
+      // within the first chunk, so decompression is not possible.
       fallback_expected = true;
       accelerator_tried_val = true;
     } else if (test_param.input_chunks_uncompress > 1) {
@@ -682,25 +682,8 @@ TEST_P(ZlibTest, CompressDecompress) {
   }
 
   if (!error_expected) {
-#ifdef USE_QAT
-    if (test_param.execution_path_compress == QAT &&
-        input_length > QAT_HW_BUFF_SZ &&
-        test_param.qat_compression_allow_chunking &&
-        GetCompressedFormat(window_bits_uncompress) !=
-            CompressedFormat::DEFLATE_RAW) {
-      // For data compressed by qzCompress, data is
-      // made of multiple streams of hardware buffer size
-      // (if chunking is allowed)
-      ASSERT_TRUE(uncompressed_length <= QAT_HW_BUFF_SZ);
-      ASSERT_TRUE(memcmp(uncompressed, input, uncompressed_length) == 0);
-    } else {
-      ASSERT_EQ(uncompressed_length, input_length);
-      ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
-    }
-#else
     ASSERT_EQ(uncompressed_length, input_length);
     ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
-#endif
   }
 
   // In case of QAT stateless overflow errors with zlib format, in some cases
@@ -1224,271 +1207,2654 @@ INSTANTIATE_TEST_SUITE_P(
         testing::Values(false),  /* iaa_prepend_empty_block */
         testing::Values(true))); /* qat_compression_allow_chunking */
 
-class ConfigLoaderTest : public ::testing::Test {};
-
-void CreateAndWriteTempConfigFile(const char* file_path) {
-  std::ofstream temp_file(file_path);
-  temp_file << "use_qat_compress=5000\n";
-  temp_file << "use_qat_uncompress=aaaa\n";
-  temp_file << "use_iaa_compress=!0\n";
-  temp_file << "use_iaa_compress=!0\n";
-  temp_file << "use_zlib_compress=!0222\n";
-  temp_file << "use_zlib_uncompress=AB23\n";
-  temp_file << "log_level=10\n";
-  temp_file << "log_stats_samples=4294967296\n";
-  temp_file.close();
-}
+class ZlibStreamingTest
+    : public testing::TestWithParam<
+          std::tuple<ExecutionPath, int, int, size_t, size_t, size_t,
+                     BlockCompressibilityType>> {};
+
+TEST_P(ZlibStreamingTest, CompressDecompressStreaming) {
+  ExecutionPath execution_path_compress = std::get<0>(GetParam());
+  int window_bits = std::get<1>(GetParam());
+  int flush = std::get<2>(GetParam());
+  size_t input_chunk_size = std::get<3>(GetParam());
+  size_t output_chunk_size = std::get<4>(GetParam());
+  size_t input_length = std::get<5>(GetParam());
+  BlockCompressibilityType block_type = std::get<6>(GetParam());
+
+  // Chunks that cannot be offloaded are compressed with zlib, so the stream
+  // framing is exercised even without accelerators
+  SetCompressPath(execution_path_compress, true, false, false);
+  SetConfig(DEFLATE_STREAMING, 1);
 
-TEST_F(ConfigLoaderTest, LoadInvalidConfig) {
-  std::string file_content;
-  uint32_t DEFAULT_QAT_COMPRESS = GetConfig(USE_QAT_COMPRESS);
-  uint32_t DEFAULT_QAT_UNCOMPRESS = GetConfig(USE_QAT_UNCOMPRESS);
-  uint32_t DEFAULT_IAA_COMPRESS = GetConfig(USE_IAA_COMPRESS);
-  uint32_t DEFAULT_IAA_UNCOMPRESS = GetConfig(USE_IAA_UNCOMPRESS);
-  uint32_t DEFAULT_ZLIB_COMPRESS = GetConfig(USE_ZLIB_COMPRESS);
-  uint32_t DEFAULT_ZLIB_UNCOMPRESS = GetConfig(USE_ZLIB_UNCOMPRESS);
-  uint32_t DEFAULT_LOG_LEVEL = GetConfig(LOG_LEVEL);
-  uint32_t DEFAULT_LOG_STATS_SAMPLES = GetConfig(LOG_STATS_SAMPLES);
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
 
-  CreateAndWriteTempConfigFile("/tmp/invalid_config");
-  EXPECT_TRUE(LoadConfigFile(file_content, "/tmp/invalid_config"));
-  EXPECT_EQ(GetConfig(USE_QAT_COMPRESS), DEFAULT_QAT_COMPRESS);
-  EXPECT_EQ(GetConfig(USE_QAT_UNCOMPRESS), DEFAULT_QAT_UNCOMPRESS);
-  EXPECT_EQ(GetConfig(USE_IAA_COMPRESS), DEFAULT_IAA_COMPRESS);
-  EXPECT_EQ(GetConfig(USE_IAA_UNCOMPRESS), DEFAULT_IAA_UNCOMPRESS);
-  EXPECT_EQ(GetConfig(USE_ZLIB_COMPRESS), DEFAULT_ZLIB_COMPRESS);
-  EXPECT_EQ(GetConfig(USE_ZLIB_UNCOMPRESS), DEFAULT_ZLIB_UNCOMPRESS);
-  EXPECT_EQ(GetConfig(LOG_LEVEL), DEFAULT_LOG_LEVEL);
-  EXPECT_EQ(GetConfig(LOG_STATS_SAMPLES), DEFAULT_LOG_STATS_SAMPLES);
-  std::remove("/tmp/invalid_config");
-  // Restore config from official config file
-  LoadConfigFile(file_content);
-}
+  std::string compressed;
+  ExecutionPath execution_path = UNDEFINED;
+  int ret = ZlibCompressStreaming(input, input_length, &compressed,
+                                  window_bits, flush, input_chunk_size,
+                                  output_chunk_size, &execution_path);
+  SetConfig(DEFLATE_STREAMING, 0);
+  ASSERT_EQ(ret, Z_STREAM_END);
 
-TEST_F(ConfigLoaderTest, LoadValidConfig) {
-  std::string file_content;
-  EXPECT_TRUE(LoadConfigFile(file_content, "../../config/default_config"));
-  EXPECT_EQ(GetConfig(USE_QAT_COMPRESS), 1);
-  EXPECT_EQ(GetConfig(USE_QAT_UNCOMPRESS), 1);
-  EXPECT_EQ(GetConfig(USE_IAA_COMPRESS), 0);
-  EXPECT_EQ(GetConfig(USE_IAA_UNCOMPRESS), 0);
-  EXPECT_EQ(GetConfig(USE_ZLIB_COMPRESS), 1);
-  EXPECT_EQ(GetConfig(USE_ZLIB_UNCOMPRESS), 1);
-  EXPECT_EQ(GetConfig(LOG_LEVEL), 2);
-  LoadConfigFile(file_content);
-}
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ret = ZlibUncompress(compressed.c_str(), compressed.length(),
+                       input_length + 1, &uncompressed, &uncompressed_length,
+                       &input_consumed, window_bits, Z_NO_FLUSH, 1,
+                       &execution_path);
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(input_consumed, compressed.length());
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
 
-TEST_F(ConfigLoaderTest, SymbolicLinkTest) {
-  std::string file_content;
-  std::filesystem::path target_path = "/tmp/target_file_path";
-  std::filesystem::path symlink_path = "symlink_to_target";
-  // create a real/target file
-  std::ofstream target_file(target_path);
-  target_file.close();
-  // create a symlink for the target file
-  std::filesystem::create_symlink(target_path, symlink_path);
-  EXPECT_FALSE(LoadConfigFile(file_content, symlink_path.c_str()));
-  std::filesystem::remove(symlink_path);
-  std::filesystem::remove(target_path);
+  delete[] uncompressed;
+  DestroyBlock(input);
 }
 
-class ShardedMapTest : public ::testing::Test {};
-
-TEST_F(ShardedMapTest, BasicSetAndGet) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
+INSTANTIATE_TEST_SUITE_P(
+    CompressDecompressStreaming, ZlibStreamingTest,
+    testing::Combine(testing::Values(QAT, IAA), testing::Values(-15, 15, 31),
+                     testing::Values(Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FULL_FLUSH),
+                     testing::Values(4096, 100000, 1048576),
+                     testing::Values(1000, 1048576),
+                     testing::Values(1, 1024, 262144, 1000000),
+                     testing::Values(compressible_block,
+                                     incompressible_block)));
+
+TEST(ZlibStreamingResetTest, ResetAndReuseStream) {
+  SetCompressPath(QAT, true, false, false);
+  SetConfig(DEFLATE_STREAMING, 1);
+  SetUncompressPath(ZLIB, true, false);
+
+  size_t input_length = 300000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+  std::string compressed(input_length * 2, 0);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, -1, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  for (int i = 0; i < 2; i++) {
+    stream.next_in = reinterpret_cast<Bytef*>(input);
+    stream.avail_in = static_cast<unsigned int>(input_length / 2);
+    stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    stream.avail_out = static_cast<unsigned int>(compressed.size());
+    ASSERT_EQ(deflate(&stream, Z_NO_FLUSH), Z_OK);
+    if (i == 0) {
+      // Abandon the first stream halfway
+      ASSERT_EQ(deflateReset(&stream), Z_OK);
+    }
+  }
+  stream.avail_in = static_cast<unsigned int>(input_length - input_length / 2);
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  size_t compressed_length = stream.total_out;
+  ASSERT_EQ(stream.total_in, input_length);
+  ASSERT_EQ(stream.adler, crc32(0, reinterpret_cast<Bytef*>(input),
+                                static_cast<unsigned int>(input_length)));
+  deflateEnd(&stream);
+  SetConfig(DEFLATE_STREAMING, 0);
 
-  std::string key = "test_key";
-  auto value = std::make_unique<int>(42);
-  int* raw_ptr = value.get();
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibUncompress(compressed.c_str(), compressed_length, input_length,
+                           &uncompressed, &uncompressed_length,
+                           &input_consumed, 31, Z_NO_FLUSH, 1, &execution_path),
+            Z_STREAM_END);
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
 
-  map.Set(key, std::move(value));
+  delete[] uncompressed;
+  DestroyBlock(input);
+}
 
-  int* retrieved = map.Get(key);
-  ASSERT_NE(retrieved, nullptr);
-  EXPECT_EQ(*retrieved, 42);
-  EXPECT_EQ(retrieved, raw_ptr);
+class ZlibStreamingFlushTest : public testing::TestWithParam<int> {};
+
+TEST_P(ZlibStreamingFlushTest, FlushPerMessage) {
+  int flush = GetParam();
+  SetCompressPath(QAT, true, false, false);
+  SetConfig(DEFLATE_STREAMING, 1);
+  SetUncompressPath(ZLIB, true, false);
+
+  z_stream deflate_stream;
+  memset(&deflate_stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&deflate_stream, -1, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY),
+            Z_OK);
+  z_stream inflate_stream;
+  memset(&inflate_stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit2(&inflate_stream, -15), Z_OK);
+
+  // An empty message is only flushed at the start, as flushing again without
+  // new input is an error
+  for (size_t message_length : {0, 100, 5000, 1, 300000, 20000}) {
+    char* message = GenerateBlock(message_length + 1, compressible_block);
+    ASSERT_NE(message, nullptr);
+
+    std::string compressed(message_length * 2 + 1024, 0);
+    deflate_stream.next_in = reinterpret_cast<Bytef*>(message);
+    deflate_stream.avail_in = static_cast<unsigned int>(message_length);
+    deflate_stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+    deflate_stream.avail_out = static_cast<unsigned int>(compressed.size());
+    ASSERT_EQ(deflate(&deflate_stream, flush), Z_OK);
+    ASSERT_EQ(deflate_stream.avail_in, 0u);
+    uInt compressed_length =
+        static_cast<uInt>(compressed.size()) - deflate_stream.avail_out;
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(compressed.data());
+    ASSERT_TRUE(EndsWithSyncMarker(data, compressed_length));
+
+    // Flushing again without new input produces nothing
+    ASSERT_EQ(deflate(&deflate_stream, flush), Z_BUF_ERROR);
+    ASSERT_EQ(static_cast<uInt>(compressed.size()) - deflate_stream.avail_out,
+              compressed_length);
+
+    // After a full flush, the data can be decompressed without history
+    if (flush == Z_FULL_FLUSH) {
+      ASSERT_EQ(inflateReset(&inflate_stream), Z_OK);
+    }
+    std::string uncompressed(message_length + 1, 0);
+    inflate_stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+    inflate_stream.avail_in = compressed_length;
+    inflate_stream.next_out = reinterpret_cast<Bytef*>(&uncompressed[0]);
+    inflate_stream.avail_out = static_cast<unsigned int>(uncompressed.size());
+    int ret = inflate(&inflate_stream, Z_SYNC_FLUSH);
+    ASSERT_TRUE(ret == Z_OK || ret == Z_BUF_ERROR);
+    ASSERT_EQ(inflate_stream.avail_in, 0u);
+    ASSERT_EQ(uncompressed.size() - inflate_stream.avail_out, message_length);
+    ASSERT_TRUE(memcmp(uncompressed.data(), message, message_length) == 0);
+
+    DestroyBlock(message);
+  }
 
-  map.Unset(key);
+  deflateEnd(&deflate_stream);
+  inflateEnd(&inflate_stream);
+  SetConfig(DEFLATE_STREAMING, 0);
 }
 
-TEST_F(ShardedMapTest, GetNonExistentKey) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
-  EXPECT_EQ(map.Get("non_existent"), nullptr);
-}
+INSTANTIATE_TEST_SUITE_P(FlushPerMessage, ZlibStreamingFlushTest,
+                         testing::Values(Z_SYNC_FLUSH, Z_FULL_FLUSH));
 
-TEST_F(ShardedMapTest, SetOverwritesExistingKey) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
+class ZlibBufferedDeflateTest
+    : public testing::TestWithParam<std::tuple<
+          ExecutionPath, int, size_t, size_t, BlockCompressibilityType>> {};
 
-  std::string key = "test_key";
-  auto value1 = std::make_unique<int>(100);
-  auto value2 = std::make_unique<int>(200);
-  int* raw_ptr2 = value2.get();
+TEST_P(ZlibBufferedDeflateTest, CompressWithSmallOutputBuffer) {
+  ExecutionPath execution_path_compress = std::get<0>(GetParam());
+  int window_bits = std::get<1>(GetParam());
+  size_t output_chunk_size = std::get<2>(GetParam());
+  size_t input_length = std::get<3>(GetParam());
+  BlockCompressibilityType block_type = std::get<4>(GetParam());
 
-  map.Set(key, std::move(value1));
-  map.Set(key, std::move(value2));
+  SetCompressPath(execution_path_compress, true, false, false);
+  SetConfig(DEFLATE_BUFFER_OUTPUT, 1);
 
-  int* retrieved = map.Get(key);
-  ASSERT_NE(retrieved, nullptr);
-  EXPECT_EQ(*retrieved, 200);
-  EXPECT_EQ(retrieved, raw_ptr2);
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
 
-  map.Unset(key);
-}
+  // All input is passed in one Z_FINISH call
+  std::string compressed;
+  ExecutionPath execution_path = UNDEFINED;
+  int ret = ZlibCompressStreaming(input, input_length, &compressed,
+                                  window_bits, Z_NO_FLUSH, input_length,
+                                  output_chunk_size, &execution_path);
+  SetConfig(DEFLATE_BUFFER_OUTPUT, 0);
+  ASSERT_EQ(ret, Z_STREAM_END);
 
-TEST_F(ShardedMapTest, UnsetRemovesKey) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ret = ZlibUncompress(compressed.c_str(), compressed.length(),
+                       input_length + 1, &uncompressed, &uncompressed_length,
+                       &input_consumed, window_bits, Z_NO_FLUSH, 1,
+                       &execution_path);
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(input_consumed, compressed.length());
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
 
-  std::string key = "test_key";
-  auto value = std::make_unique<int>(42);
+  delete[] uncompressed;
+  DestroyBlock(input);
+}
 
-  map.Set(key, std::move(value));
+INSTANTIATE_TEST_SUITE_P(
+    CompressWithSmallOutputBuffer, ZlibBufferedDeflateTest,
+    testing::Combine(testing::Values(QAT, IAA), testing::Values(-15, 15, 31),
+                     testing::Values(100, 65536),
+                     testing::Values(1024, 100000, 1000000),
+                     testing::Values(compressible_block,
+                                     incompressible_block)));
+
+class ZlibStoredBlocksTest
+    : public testing::TestWithParam<
+          std::tuple<int, size_t, BlockCompressibilityType>> {};
 
-  int* retrieved_before = map.Get(key);
-  ASSERT_NE(retrieved_before, nullptr);
+TEST_P(ZlibStoredBlocksTest, CompressIncompressibleData) {
+  int window_bits = std::get<0>(GetParam());
+  size_t input_length = std::get<1>(GetParam());
+  BlockCompressibilityType block_type = std::get<2>(GetParam());
 
-  map.Unset(key);
+  SetCompressPath(ZLIB, true, false, false);
+  SetConfig(INCOMPRESSIBLE_CHECK, 1);
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  int ret = ZlibCompress(input, input_length, &compressed, window_bits,
+                         Z_FINISH, &output_upper_bound, &execution_path);
+  SetConfig(INCOMPRESSIBLE_CHECK, 0);
+  ASSERT_EQ(ret, Z_STREAM_END);
+
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  uint64_t stored_length = GetHeaderLength(format) +
+                           StoredBlocksBound(input_length) +
+                           GetTrailerLength(format);
+  if (block_type == incompressible_block) {
+    ASSERT_EQ(compressed.length(), stored_length);
+  } else {
+    ASSERT_LT(compressed.length(), input_length);
+  }
 
-  EXPECT_EQ(map.Get(key), nullptr);
-}
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ret = ZlibUncompress(compressed.c_str(), compressed.length(), input_length,
+                       &uncompressed, &uncompressed_length, &input_consumed,
+                       window_bits, Z_NO_FLUSH, 1, &execution_path);
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(input_consumed, compressed.length());
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
 
-TEST_F(ShardedMapTest, UnsetNonExistentKey) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
-  EXPECT_NO_THROW(map.Unset("non_existent"));
+  delete[] uncompressed;
+  DestroyBlock(input);
 }
 
-TEST_F(ShardedMapTest, MultipleKeys) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
-
-  for (int i = 0; i < 10; i++) {
-    std::string key = "key_" + std::to_string(i);
-    auto value = std::make_unique<int>(i * 10);
-    map.Set(key, std::move(value));
-  }
+TEST_P(ZlibStoredBlocksTest, Compress2IncompressibleData) {
+  size_t input_length = std::get<1>(GetParam());
+  BlockCompressibilityType block_type = std::get<2>(GetParam());
 
-  for (int i = 0; i < 10; i++) {
-    std::string key = "key_" + std::to_string(i);
-    int* value = map.Get(key);
-    ASSERT_NE(value, nullptr);
-    EXPECT_EQ(*value, i * 10);
+  SetCompressPath(ZLIB, true, false, false);
+  SetConfig(INCOMPRESSIBLE_CHECK, 1);
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  int ret = ZlibCompressUtility2(input, input_length, &compressed,
+                                 &output_upper_bound);
+  SetConfig(INCOMPRESSIBLE_CHECK, 0);
+  ASSERT_EQ(ret, Z_OK);
+  if (block_type == incompressible_block) {
+    CompressedFormat format = CompressedFormat::ZLIB;
+    ASSERT_EQ(compressed.length(), GetHeaderLength(format) +
+                                       StoredBlocksBound(input_length) +
+                                       GetTrailerLength(format));
   }
 
-  for (int i = 0; i < 10; i++) {
-    std::string key = "key_" + std::to_string(i);
-    map.Unset(key);
-  }
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  ret = ZlibUncompressUtility2(compressed.c_str(), compressed.length(),
+                               input_length, &uncompressed,
+                               &uncompressed_length);
+  ASSERT_EQ(ret, Z_OK);
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
 
-  EXPECT_EQ(map.Get("key_5"), nullptr);
+  delete[] uncompressed;
+  DestroyBlock(input);
 }
 
-TEST_F(ShardedMapTest, DifferentShards) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
-
-  std::vector<std::string> keys = {"key1",        "key2", "key3", "another_key",
-                                   "yet_another", "test", "data", "value"};
-
-  for (size_t i = 0; i < keys.size(); i++) {
-    auto value = std::make_unique<int>(i * 100);
-    map.Set(keys[i], std::move(value));
+INSTANTIATE_TEST_SUITE_P(
+    CompressIncompressibleData, ZlibStoredBlocksTest,
+    testing::Combine(testing::Values(-15, 15, 31),
+                     testing::Values(1024, 100000, 1000000),
+                     testing::Values(compressible_block, incompressible_block,
+                                     zero_block)));
+
+// compress2 of an input larger than 4GB. The input is mapped without backing
+// memory: its first PREFIX_LENGTH bytes are random, the rest is zeros.
+class Compress2LargeInputTest : public ::testing::Test {
+ protected:
+  static constexpr uLong PREFIX_LENGTH = 2 << 20;
+  static constexpr uLong INPUT_LENGTH = (1ULL << 32) + PREFIX_LENGTH;
+  static constexpr uLong OUTPUT_LENGTH = 64 << 20;
+
+  void SetUp() override {
+    void* input = mmap(nullptr, INPUT_LENGTH, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT_NE(input, MAP_FAILED);
+    input_ = static_cast<uint8_t*>(input);
+    char* prefix = GenerateBlock(PREFIX_LENGTH, incompressible_block);
+    ASSERT_NE(prefix, nullptr);
+    memcpy(input_, prefix, PREFIX_LENGTH);
+    DestroyBlock(prefix);
+    SetCompressPath(ZLIB, true, false, false);
+    SetUncompressPath(ZLIB, true, false);
   }
 
-  for (size_t i = 0; i < keys.size(); i++) {
-    int* value = map.Get(keys[i]);
-    ASSERT_NE(value, nullptr);
-    EXPECT_EQ(*value, static_cast<int>(i * 100));
+  void TearDown() override {
+    if (input_ != nullptr) {
+      munmap(input_, INPUT_LENGTH);
+    }
   }
 
-  for (const auto& key : keys) {
-    map.Unset(key);
+  // Compresses the whole input with compress2 and checks that it decompresses
+  // to the whole input
+  void CompressAndVerify() {
+    std::vector<uint8_t> compressed(OUTPUT_LENGTH);
+    uLong compressed_length = OUTPUT_LENGTH;
+    ASSERT_EQ(compress2(compressed.data(), &compressed_length, input_,
+                        INPUT_LENGTH, Z_BEST_SPEED),
+              Z_OK);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(z_stream));
+    ASSERT_EQ(inflateInit(&stream), Z_OK);
+    stream.next_in = compressed.data();
+    stream.avail_in = compressed_length;
+    std::vector<uint8_t> output(16 << 20);
+    int ret = Z_OK;
+    while (ret == Z_OK) {
+      uLong offset = stream.total_out;
+      stream.next_out = output.data();
+      stream.avail_out = output.size();
+      ret = inflate(&stream, Z_NO_FLUSH);
+      uLong produced = stream.total_out - offset;
+      ASSERT_LE(offset + produced, INPUT_LENGTH);
+      ASSERT_EQ(memcmp(output.data(), input_ + offset, produced), 0);
+    }
+    inflateEnd(&stream);
+    ASSERT_EQ(ret, Z_STREAM_END);
+    ASSERT_EQ(stream.total_out, INPUT_LENGTH);
   }
+
+  uint8_t* input_ = nullptr;
+};
+
+// Stored blocks, parallel compression and parallel zlib are all enabled: each
+// is skipped for an input above 4GB, which zlib compresses whole. Takes about
+// 20s, so it only runs with --gtest_also_run_disabled_tests.
+TEST_F(Compress2LargeInputTest, DISABLED_AllPaths) {
+  SetConfig(INCOMPRESSIBLE_CHECK, 1);
+  SetConfig(PARALLEL_COMPRESSION_THRESHOLD, 1 << 20);
+  SetConfig(ZLIB_PARALLEL_THRESHOLD, 1 << 20);
+  CompressAndVerify();
+  SetConfig(INCOMPRESSIBLE_CHECK, 0);
+  SetConfig(PARALLEL_COMPRESSION_THRESHOLD, 0);
+  SetConfig(ZLIB_PARALLEL_THRESHOLD, 0);
 }
 
-TEST_F(ShardedMapTest, ConcurrentOperations) {
-  ShardedMap<std::string, std::unique_ptr<int>> map;
+TEST(EngineLengthTest, Supported) {
+  ASSERT_TRUE(EngineLengthSupported(0));
+  ASSERT_TRUE(EngineLengthSupported(UINT32_MAX));
+  ASSERT_FALSE(EngineLengthSupported(static_cast<uint64_t>(UINT32_MAX) + 1));
+  ASSERT_FALSE(EngineLengthSupported(1ULL << 40));
+}
 
-  for (int i = 0; i < 50; i++) {
-    std::string key = "key_" + std::to_string(i);
-    auto value = std::make_unique<int>(i);
-    map.Set(key, std::move(value));
+TEST(HeaderDetectionTest, DetectWindowBits) {
+  std::string input(10000, 'a');
+  for (int window_bits : {12, 15, 31}) {
+    std::string compressed;
+    size_t output_upper_bound;
+    ExecutionPath execution_path = UNDEFINED;
+    SetCompressPath(ZLIB, true, false, false);
+    ASSERT_EQ(ZlibCompress(input.c_str(), input.length(), &compressed,
+                           window_bits, Z_FINISH, &output_upper_bound,
+                           &execution_path),
+              Z_STREAM_END);
+    uint8_t* data = (uint8_t*)compressed.c_str();
+    // The window size of the zlib header is used only with 32
+    ASSERT_EQ(DetectWindowBits(47, data, compressed.length()),
+              window_bits == 31 ? 31 : 15);
+    ASSERT_EQ(DetectWindowBits(32, data, compressed.length()), window_bits);
+    // Not automatic header detection
+    ASSERT_EQ(DetectWindowBits(window_bits, data, compressed.length()),
+              window_bits);
+    ASSERT_EQ(DetectWindowBits(47, data, 1), 47);
+
+    // Decompression with automatic header detection, in one or two calls
+    SetUncompressPath(ZLIB, true, false);
+    for (int input_chunks : {1, 2}) {
+      char* uncompressed = nullptr;
+      size_t uncompressed_length;
+      size_t input_consumed;
+      ASSERT_EQ(ZlibUncompress(compressed.c_str(), compressed.length(),
+                               input.length(), &uncompressed,
+                               &uncompressed_length, &input_consumed, 47,
+                               Z_NO_FLUSH, input_chunks, &execution_path),
+                Z_STREAM_END);
+      ASSERT_EQ(uncompressed_length, input.length());
+      ASSERT_TRUE(memcmp(uncompressed, input.c_str(), input.length()) == 0);
+      delete[] uncompressed;
+    }
   }
 
-  std::vector<std::thread> threads;
+  // Window larger than requested, rejected by zlib
+  uint8_t zlib_header[2] = {0x78, 0x9C};
+  ASSERT_EQ(DetectWindowBits(32 + 12, zlib_header, 2), 32 + 12);
+  uint8_t not_a_header[2] = {0x12, 0x34};
+  ASSERT_EQ(DetectWindowBits(47, not_a_header, 2), 47);
+}
 
-  // Reader threads
-  for (int t = 0; t < 5; t++) {
-    threads.emplace_back([&map]() {
-      for (int i = 0; i < 100; i++) {
-        std::string key = "key_" + std::to_string(i % 50);
-        int* val = map.Get(key);
-        ASSERT_NE(val, nullptr);
-      }
-    });
-  }
+TEST(SizePredictionTest, PredictFromGzipStream) {
+  size_t input_length = 100000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  SetCompressPath(ZLIB, true, false, false);
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, 31, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+  uint8_t* data = (uint8_t*)compressed.data();
+  ASSERT_EQ(PredictUncompressedSize(CompressedFormat::GZIP, data,
+                                    compressed.length()),
+            input_length);
+  // Data past the member, with an impossible size in the last bytes
+  compressed.append(8, '\xFF');
+  data = (uint8_t*)compressed.data();
+  ASSERT_EQ(PredictUncompressedSize(CompressedFormat::GZIP, data,
+                                    compressed.length()),
+            0);
+  ASSERT_EQ(PredictUncompressedSize(CompressedFormat::ZLIB, data,
+                                    compressed.length()),
+            0);
+
+  // QZ extended header, with the sizes of the first member
+  uint8_t gzip_ext[64] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 3, 12, 0, 'Q', 'Z', 8};
+  *(uint32_t*)(gzip_ext + 16) = 5000;
+  *(uint32_t*)(gzip_ext + 20) = 10;
+  ASSERT_EQ(PredictUncompressedSize(CompressedFormat::GZIP, gzip_ext,
+                                    sizeof(gzip_ext)),
+            5000);
+  ASSERT_EQ(PredictUncompressedSize(CompressedFormat::GZIP, gzip_ext, 30), 0);
+
+  // A stream that does not fit in the output buffer is not offloaded
+  ResetStats();
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ASSERT_EQ(ZlibUncompress(compressed.c_str(), compressed.length() - 8,
+                           input_length - 1, &uncompressed,
+                           &uncompressed_length, &input_consumed, 31,
+                           Z_NO_FLUSH, 1, &execution_path),
+            Z_OK);
+  delete[] uncompressed;
+  VerifyStatIncremented(Statistic::INFLATE_SIZE_SKIP_COUNT);
+  DestroyBlock(input);
+}
 
-  // Writer threads
-  for (int t = 0; t < 5; t++) {
-    threads.emplace_back([&map, t]() {
-      for (int i = 0; i < 20; i++) {
-        std::string key = "new_key_" + std::to_string(t * 20 + i);
-        auto value = std::make_unique<int>(1000 + t * 20 + i);
-        map.Set(key, std::move(value));
+TEST(ExpansionPredictorTest, PredictFromObservedRatios) {
+  SetConfig(INFLATE_EXPANSION_PREDICTION, 1);
+  ResetExpansionPredictor();
+  CompressedFormat format = CompressedFormat::ZLIB;
+  for (int i = 0; i < 3; i++) {
+    RecordExpansion(format, 1000, 10000);
+    ASSERT_EQ(PredictExpandedSize(format, 1000), 0);
+  }
+  RecordExpansion(format, 1000, 10000);
+  ASSERT_EQ(PredictExpandedSize(format, 2000), 20000);
+  ASSERT_EQ(PredictExpandedSize(CompressedFormat::GZIP, 2000), 0);
+  ASSERT_TRUE(PredictOutputOverflow(format, 2000, 10000));
+  ASSERT_FALSE(PredictOutputOverflow(format, 2000, 16000));
+
+  // Streams that do not fit in the output buffer go straight to zlib
+  size_t input_length = 100000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  SetCompressPath(ZLIB, true, false, false);
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, 15, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+  SetUncompressPath(ZLIB, true, false);
+  for (size_t output_length : {input_length, input_length / 10}) {
+    ResetExpansionPredictor();
+    for (int i = 0; i < 4; i++) {
+      RecordExpansion(format, compressed.length(), input_length);
+    }
+    ResetStats();
+    char* uncompressed = nullptr;
+    size_t uncompressed_length;
+    size_t input_consumed;
+    int ret = ZlibUncompress(compressed.c_str(), compressed.length(),
+                             output_length, &uncompressed,
+                             &uncompressed_length, &input_consumed, 15,
+                             Z_NO_FLUSH, 1, &execution_path);
+    delete[] uncompressed;
+    if (output_length == input_length) {
+      ASSERT_EQ(ret, Z_STREAM_END);
+      if (AreStatsEnabled()) {
+        ASSERT_EQ(GetStat(Statistic::INFLATE_PREDICTED_SKIP_COUNT), 0);
       }
-    });
+    } else {
+      ASSERT_EQ(ret, Z_OK);
+      VerifyStatIncremented(Statistic::INFLATE_PREDICTED_SKIP_COUNT);
+    }
   }
+  SetConfig(INFLATE_EXPANSION_PREDICTION, 0);
+  ResetExpansionPredictor();
+  DestroyBlock(input);
+}
 
-  for (auto& thread : threads) {
-    thread.join();
+TEST(IncompressibilityTest, DetectRandomData) {
+  size_t input_length = 100000;
+  char* incompressible = GenerateBlock(input_length, incompressible_block);
+  char* compressible = GenerateBlock(input_length, compressible_block);
+  char* zero = GenerateBlock(input_length, zero_block);
+  ASSERT_TRUE(IsLikelyIncompressible(
+      reinterpret_cast<uint8_t*>(incompressible), input_length));
+  ASSERT_FALSE(IsLikelyIncompressible(reinterpret_cast<uint8_t*>(compressible),
+                                      input_length));
+  ASSERT_FALSE(
+      IsLikelyIncompressible(reinterpret_cast<uint8_t*>(zero), input_length));
+  // Too small to be sampled
+  ASSERT_FALSE(IsLikelyIncompressible(
+      reinterpret_cast<uint8_t*>(incompressible), 1000));
+
+  // Random data repeated at a short distance is compressible
+  for (size_t i = 0; i + 256 <= input_length; i += 256) {
+    memcpy(incompressible + i + 128, incompressible + i, 128);
   }
+  ASSERT_FALSE(IsLikelyIncompressible(
+      reinterpret_cast<uint8_t*>(incompressible), input_length));
 
-  // Original data should still be intact
-  for (int i = 0; i < 50; i++) {
-    std::string key = "key_" + std::to_string(i);
-    int* value = map.Get(key);
-    ASSERT_NE(value, nullptr);
-    EXPECT_EQ(*value, i);
-  }
+  DestroyBlock(incompressible);
+  DestroyBlock(compressible);
+  DestroyBlock(zero);
+}
 
-  // Verify new data was written
-  for (int t = 0; t < 5; t++) {
-    for (int i = 0; i < 20; i++) {
-      std::string key = "new_key_" + std::to_string(t * 20 + i);
-      int* value = map.Get(key);
-      ASSERT_NE(value, nullptr);
-      EXPECT_EQ(*value, 1000 + t * 20 + i);
-    }
-  }
+class ZlibParallelCompressionTest
+    : public testing::TestWithParam<
+          std::tuple<int, int, size_t, BlockCompressibilityType>> {};
 
-  for (int i = 0; i < 50; i++) {
-    std::string key = "key_" + std::to_string(i);
-    map.Unset(key);
+TEST_P(ZlibParallelCompressionTest, CompressSingleStream) {
+  int window_bits = std::get<0>(GetParam());
+  int threads = std::get<1>(GetParam());
+  size_t input_length = std::get<2>(GetParam());
+  BlockCompressibilityType block_type = std::get<3>(GetParam());
+
+  SetCompressPath(ZLIB, true, false, false);
+  SetConfig(PARALLEL_COMPRESSION_THRESHOLD, 1 << 20);
+  SetConfig(PARALLEL_COMPRESSION_THREADS, threads);
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
+
+  // The output is returned over multiple deflate calls
+  std::string compressed;
+  ExecutionPath execution_path = UNDEFINED;
+  int ret = ZlibCompressStreaming(input, input_length, &compressed,
+                                  window_bits, Z_NO_FLUSH, input_length,
+                                  100000, &execution_path);
+  std::string compressed2;
+  size_t output_upper_bound;
+  int ret2 = Z_OK;
+  if (window_bits == 15) {
+    ret2 = ZlibCompressUtility2(input, input_length, &compressed2,
+                                &output_upper_bound);
   }
-  for (int t = 0; t < 5; t++) {
-    for (int i = 0; i < 20; i++) {
-      std::string key = "new_key_" + std::to_string(t * 20 + i);
-      map.Unset(key);
-    }
+  SetConfig(PARALLEL_COMPRESSION_THRESHOLD, 0);
+  SetConfig(PARALLEL_COMPRESSION_THREADS, 4);
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(ret2, Z_OK);
+
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ret = ZlibUncompress(compressed.c_str(), compressed.length(),
+                       input_length + 1, &uncompressed, &uncompressed_length,
+                       &input_consumed, window_bits, Z_NO_FLUSH, 1,
+                       &execution_path);
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(input_consumed, compressed.length());
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+  delete[] uncompressed;
+
+  if (window_bits == 15) {
+    ret = ZlibUncompressUtility2(compressed2.c_str(), compressed2.length(),
+                                 input_length, &uncompressed,
+                                 &uncompressed_length);
+    ASSERT_EQ(ret, Z_OK);
+    ASSERT_EQ(uncompressed_length, input_length);
+    ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+    delete[] uncompressed;
   }
+  DestroyBlock(input);
 }
 
-TEST_F(ShardedMapTest, IntegerKeys) {
-  ShardedMap<int, std::unique_ptr<int>> map;
+INSTANTIATE_TEST_SUITE_P(
+    CompressSingleStream, ZlibParallelCompressionTest,
+    testing::Combine(testing::Values(-15, 15, 31), testing::Values(1, 4),
+                     testing::Values(1 << 20, 3000017),
+                     testing::Values(compressible_block,
+                                     incompressible_block)));
+
+TEST(ZlibParallelEngineTest, CompressCloseToSingleStream) {
+  SetCompressPath(ZLIB, true, false, false);
+  size_t input_length = 4 << 20;
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+  std::string single_stream;
+  size_t output_upper_bound;
+  ASSERT_EQ(ZlibCompressUtility2(input, input_length, &single_stream,
+                                 &output_upper_bound),
+            Z_OK);
 
-  for (int i = 0; i < 20; i++) {
-    auto value = std::make_unique<int>(i * 5);
-    map.Set(i, std::move(value));
-  }
+  // Without accelerators, large inputs go to the parallel software engine
+  SetConfig(ZLIB_PARALLEL_THRESHOLD, 1 << 20);
+  std::string compressed;
+  int ret = ZlibCompressUtility2(input, input_length, &compressed,
+                                 &output_upper_bound);
+  std::string compressed_deflate;
+  ExecutionPath execution_path = UNDEFINED;
+  int ret2 = ZlibCompressStreaming(input, input_length, &compressed_deflate,
+                                   15, Z_NO_FLUSH, input_length, 100000,
+                                   &execution_path);
+  SetConfig(ZLIB_PARALLEL_THRESHOLD, 0);
+  ASSERT_EQ(ret, Z_OK);
+  ASSERT_EQ(ret2, Z_STREAM_END);
+  ASSERT_EQ(compressed, compressed_deflate);
+  ASSERT_NE(compressed, single_stream);
+  // Chunks are primed with the preceding window, so only the flush markers
+  // are added
+  ASSERT_LE(compressed.length(), single_stream.length() * 101 / 100);
+
+  SetUncompressPath(ZLIB, true, false);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  ret = ZlibUncompressUtility2(compressed.c_str(), compressed.length(),
+                               input_length, &uncompressed,
+                               &uncompressed_length);
+  ASSERT_EQ(ret, Z_OK);
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+  delete[] uncompressed;
+  DestroyBlock(input);
+}
 
-  for (int i = 0; i < 20; i++) {
-    int* value = map.Get(i);
-    ASSERT_NE(value, nullptr);
-    EXPECT_EQ(*value, i * 5);
+TEST(WorkerPoolTest, RunAllTasks) {
+  for (int threads : {1, 2, 8}) {
+    std::vector<std::atomic<int>> runs(100);
+    std::vector<std::function<void()>> tasks;
+    for (auto& run : runs) {
+      tasks.push_back([&run] { run++; });
+    }
+    RunTasks(tasks, threads);
+    for (auto& run : runs) {
+      ASSERT_EQ(run, 1);
+    }
   }
+}
 
-  for (int i = 0; i < 20; i++) {
-    map.Unset(i);
-  }
+class ZlibBufferedInflateTest
+    : public testing::TestWithParam<std::tuple<ExecutionPath, int, int, size_t,
+                                               BlockCompressibilityType>> {};
 
-  // Verify cleanup
-  EXPECT_EQ(map.Get(10), nullptr);
+TEST_P(ZlibBufferedInflateTest, UncompressInChunks) {
+  ExecutionPath execution_path_uncompress = std::get<0>(GetParam());
+  int window_bits = std::get<1>(GetParam());
+  int input_chunks = std::get<2>(GetParam());
+  size_t input_length = std::get<3>(GetParam());
+  BlockCompressibilityType block_type = std::get<4>(GetParam());
+
+  SetCompressPath(ZLIB, true, false, false);
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, window_bits,
+                         Z_FINISH, &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+
+  // Streams that cannot be decompressed by an accelerator are passed to zlib
+  // after buffering, so buffering is exercised even without accelerators
+  SetUncompressPath(execution_path_uncompress, true, false);
+  SetConfig(INFLATE_BUFFER_INPUT, 1);
+  char* uncompressed = nullptr;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  int ret = ZlibUncompress(compressed.c_str(), compressed.length(),
+                           input_length, &uncompressed, &uncompressed_length,
+                           &input_consumed, window_bits, Z_NO_FLUSH,
+                           input_chunks, &execution_path);
+  SetConfig(INFLATE_BUFFER_INPUT, 0);
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(input_consumed, compressed.length());
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+
+  delete[] uncompressed;
+  DestroyBlock(input);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    UncompressInChunks, ZlibBufferedInflateTest,
+    testing::Combine(testing::Values(QAT, IAA), testing::Values(-15, 15, 31),
+                     testing::Values(2, 10, 100),
+                     testing::Values(1024, 100000, 3000000),
+                     testing::Values(compressible_block,
+                                     incompressible_block)));
+
+TEST(ZlibBufferedInflateTrailingDataTest, ReturnsInputAfterStream) {
+  SetCompressPath(ZLIB, true, false, false);
+  size_t input_length = 50000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, 31, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+  size_t compressed_length = compressed.length();
+  compressed.append("trailing data");
+
+  SetUncompressPath(QAT, true, false);
+  SetConfig(INFLATE_BUFFER_INPUT, 1);
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit2(&stream, 31), Z_OK);
+  std::string uncompressed(input_length, 0);
+  stream.next_out = reinterpret_cast<Bytef*>(&uncompressed[0]);
+  stream.avail_out = static_cast<unsigned int>(uncompressed.size());
+  size_t half = compressed_length / 2;
+  stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_in = static_cast<unsigned int>(half);
+  ASSERT_EQ(inflate(&stream, Z_NO_FLUSH), Z_OK);
+  ASSERT_EQ(stream.avail_in, 0u);
+  stream.avail_in = static_cast<unsigned int>(compressed.length() - half);
+  ASSERT_EQ(inflate(&stream, Z_NO_FLUSH), Z_STREAM_END);
+  SetConfig(INFLATE_BUFFER_INPUT, 0);
+
+  ASSERT_EQ(stream.total_in, compressed_length);
+  ASSERT_EQ(stream.avail_in, strlen("trailing data"));
+  ASSERT_EQ(stream.total_out, input_length);
+  ASSERT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+  inflateEnd(&stream);
+  DestroyBlock(input);
+}
+
+class ZlibBufferedInflateOutputTest
+    : public testing::TestWithParam<
+          std::tuple<ExecutionPath, int, bool, size_t, size_t>> {};
+
+TEST_P(ZlibBufferedInflateOutputTest, UncompressWithSmallOutputBuffer) {
+  ExecutionPath execution_path_uncompress = std::get<0>(GetParam());
+  int window_bits = std::get<1>(GetParam());
+  bool buffer_input = std::get<2>(GetParam());
+  size_t output_chunk_size = std::get<3>(GetParam());
+  size_t input_length = std::get<4>(GetParam());
+
+  SetCompressPath(ZLIB, true, false, false);
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, window_bits,
+                         Z_FINISH, &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+
+  SetUncompressPath(execution_path_uncompress, true, false);
+  SetConfig(INFLATE_BUFFER_INPUT, buffer_input);
+  SetConfig(INFLATE_BUFFER_OUTPUT, 1);
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit2(&stream, window_bits), Z_OK);
+  // Input is passed in two parts, output in chunks
+  size_t half = compressed.length() / 2;
+  stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_in = static_cast<unsigned int>(buffer_input ? half : 0);
+  std::string uncompressed;
+  std::string output_chunk(output_chunk_size, 0);
+  int ret = Z_OK;
+  while (ret == Z_OK || ret == Z_BUF_ERROR) {
+    if (stream.avail_in == 0 && stream.total_in < compressed.length()) {
+      stream.avail_in =
+          static_cast<unsigned int>(compressed.length() - stream.total_in);
+    }
+    stream.next_out = reinterpret_cast<Bytef*>(&output_chunk[0]);
+    stream.avail_out = static_cast<unsigned int>(output_chunk_size);
+    ret = inflate(&stream, Z_NO_FLUSH);
+    uncompressed.append(output_chunk, 0, output_chunk_size - stream.avail_out);
+    ASSERT_LE(uncompressed.size(), input_length);
+  }
+  SetConfig(INFLATE_BUFFER_INPUT, 0);
+  SetConfig(INFLATE_BUFFER_OUTPUT, 0);
+
+  ASSERT_EQ(ret, Z_STREAM_END);
+  ASSERT_EQ(stream.total_in, compressed.length());
+  ASSERT_EQ(stream.total_out, input_length);
+  ASSERT_EQ(uncompressed.size(), input_length);
+  ASSERT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+  inflateEnd(&stream);
+  DestroyBlock(input);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    UncompressWithSmallOutputBuffer, ZlibBufferedInflateOutputTest,
+    testing::Combine(testing::Values(QAT, IAA), testing::Values(-15, 15, 31),
+                     testing::Values(false, true),
+                     testing::Values(1000, 65536),
+                     testing::Values(10000, 500000)));
+
+class StreamParserTest : public testing::TestWithParam<int> {};
+
+TEST_P(StreamParserTest, FindEndOfStream) {
+  int window_bits = GetParam();
+  SetCompressPath(ZLIB, true, false, false);
+  size_t input_length = 20000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  ASSERT_NE(input, nullptr);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, -1, Z_DEFLATED, window_bits, 8,
+                         Z_DEFAULT_STRATEGY),
+            Z_OK);
+  // Optional gzip header fields
+  gz_header header;
+  memset(&header, 0, sizeof(gz_header));
+  Bytef extra[] = {'A', 'B', 2, 0, 'x', 'y'};
+  header.extra = extra;
+  header.extra_len = sizeof(extra);
+  header.name = reinterpret_cast<Bytef*>(const_cast<char*>("name"));
+  header.comment = reinterpret_cast<Bytef*>(const_cast<char*>("comment"));
+  header.hcrc = 1;
+  if (GetCompressedFormat(window_bits) == CompressedFormat::GZIP) {
+    ASSERT_EQ(deflateSetHeader(&stream, &header), Z_OK);
+  }
+  std::string compressed(deflateBound(&stream, input_length) + 64, 0);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = static_cast<unsigned int>(input_length);
+  stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_out = static_cast<unsigned int>(compressed.size());
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  uint32_t compressed_length = static_cast<uint32_t>(stream.total_out);
+  deflateEnd(&stream);
+  DestroyBlock(input);
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(compressed.data());
+  StreamParser parser(window_bits);
+  for (uint32_t len = 0; len < compressed_length; len++) {
+    ASSERT_EQ(parser.Parse(data, len), DeflateParser::Status::NEED_MORE_INPUT)
+        << "len " << len;
+  }
+  ASSERT_EQ(parser.Parse(data, compressed_length + 10),
+            DeflateParser::Status::END_OF_STREAM);
+  ASSERT_EQ(parser.GetStreamLength(), compressed_length);
+
+  // Corrupted header
+  if (GetCompressedFormat(window_bits) != CompressedFormat::DEFLATE_RAW) {
+    compressed[1] ^= 0x1;
+    StreamParser invalid_parser(window_bits);
+    ASSERT_EQ(invalid_parser.Parse(data, compressed_length),
+              DeflateParser::Status::ERROR);
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(FindEndOfStream, StreamParserTest,
+                         testing::Values(-15, 9, 15, 31));
+
+class DeflateParserTest
+    : public testing::TestWithParam<
+          std::tuple<int, int, size_t, BlockCompressibilityType>> {};
+
+TEST_P(DeflateParserTest, ParseRawStream) {
+  int level = std::get<0>(GetParam());
+  int strategy = std::get<1>(GetParam());
+  size_t input_length = std::get<2>(GetParam());
+  BlockCompressibilityType block_type = std::get<3>(GetParam());
+  SetCompressPath(ZLIB, true, false, false);
+
+  char* input = GenerateBlock(input_length, block_type);
+  ASSERT_NE(input, nullptr);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, level, Z_DEFLATED, -15, 8, strategy), Z_OK);
+  std::string compressed(deflateBound(&stream, input_length) + 16, 0);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = static_cast<unsigned int>(input_length);
+  stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_out = static_cast<unsigned int>(compressed.size());
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  uint32_t compressed_length = static_cast<uint32_t>(stream.total_out);
+  deflateEnd(&stream);
+  DestroyBlock(input);
+
+  // Trailing data must be ignored
+  compressed[compressed_length] = 0x5A;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(compressed.data());
+
+  DeflateParser parser;
+  ASSERT_EQ(parser.Parse(data, compressed_length + 1),
+            DeflateParser::Status::END_OF_STREAM);
+  ASSERT_EQ(parser.GetEndByte(), compressed_length);
+
+  // Parse incrementally, resuming from the last complete block
+  parser.Reset();
+  uint32_t step = compressed_length / 7 + 1;
+  for (uint32_t len = 0; len < compressed_length; len += step) {
+    ASSERT_EQ(parser.Parse(data, len), DeflateParser::Status::NEED_MORE_INPUT);
+  }
+  ASSERT_EQ(parser.Parse(data, compressed_length),
+            DeflateParser::Status::END_OF_STREAM);
+  ASSERT_EQ(parser.GetEndByte(), compressed_length);
+
+  parser.Reset();
+  ASSERT_EQ(parser.Parse(data, compressed_length - 1),
+            DeflateParser::Status::NEED_MORE_INPUT);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    ParseRawStream, DeflateParserTest,
+    testing::Combine(testing::Values(0, 1, 6, 9),
+                     testing::Values(Z_DEFAULT_STRATEGY, Z_FIXED),
+                     testing::Values(1, 1024, 100000),
+                     testing::Values(compressible_block, incompressible_block,
+                                     zero_block)));
+
+TEST(DeflateParserInvalidTest, InvalidBlocks) {
+  DeflateParser parser;
+  // Reserved block type
+  const uint8_t reserved_type[] = {0x07, 0x00};
+  ASSERT_EQ(parser.Parse(reserved_type, sizeof(reserved_type)),
+            DeflateParser::Status::ERROR);
+
+  // Stored block with LEN not matching NLEN
+  parser.Reset();
+  const uint8_t stored[] = {0x01, 0x01, 0x00, 0xFF, 0xFF, 0x00};
+  ASSERT_EQ(parser.Parse(stored, sizeof(stored)), DeflateParser::Status::ERROR);
+
+  // Empty stored block followed by the final empty block
+  parser.Reset();
+  const uint8_t empty[] = {0x00, 0x00, 0x00, 0xFF, 0xFF, 0x03, 0x00};
+  ASSERT_EQ(parser.Parse(empty, sizeof(empty)),
+            DeflateParser::Status::END_OF_STREAM);
+  ASSERT_EQ(parser.GetFinalBlockBit(), 40u);
+  ASSERT_EQ(parser.GetEndByte(), sizeof(empty));
+}
+
+TEST(StreamFramingTest, ConvertToNonFinalSegment) {
+  SetCompressPath(ZLIB, true, false, false);
+  SetUncompressPath(ZLIB, true, false);
+
+  // Different lengths end the final block at different bit offsets
+  for (size_t input_length = 1; input_length < 200; input_length += 7) {
+    char* input = GenerateBlock(input_length * 2, compressible_block);
+    ASSERT_NE(input, nullptr);
+
+    std::string segments;
+    for (int i = 0; i < 2; i++) {
+      z_stream stream;
+      memset(&stream, 0, sizeof(z_stream));
+      ASSERT_EQ(deflateInit2(&stream, -1, Z_DEFLATED, -15, 8,
+                             Z_DEFAULT_STRATEGY),
+                Z_OK);
+      std::string compressed(deflateBound(&stream, input_length) +
+                                 EMPTY_STORED_BLOCK_SIZE,
+                             0);
+      stream.next_in = reinterpret_cast<Bytef*>(input + i * input_length);
+      stream.avail_in = static_cast<unsigned int>(input_length);
+      stream.next_out = reinterpret_cast<Bytef*>(&compressed[0]);
+      stream.avail_out = static_cast<unsigned int>(compressed.size());
+      ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+      uint32_t compressed_length = static_cast<uint32_t>(stream.total_out);
+      deflateEnd(&stream);
+
+      if (i == 0) {
+        uint8_t* data = reinterpret_cast<uint8_t*>(&compressed[0]);
+        ASSERT_TRUE(ConvertToNonFinalSegment(data, &compressed_length));
+        ASSERT_TRUE(EndsWithSyncMarker(data, compressed_length));
+      }
+      segments.append(compressed, 0, compressed_length);
+    }
+
+    char* uncompressed = nullptr;
+    size_t uncompressed_length;
+    size_t input_consumed;
+    ExecutionPath execution_path = UNDEFINED;
+    ASSERT_EQ(ZlibUncompress(segments.c_str(), segments.length(),
+                             input_length * 2, &uncompressed,
+                             &uncompressed_length, &input_consumed, -15,
+                             Z_NO_FLUSH, 1, &execution_path),
+              Z_STREAM_END);
+    ASSERT_EQ(uncompressed_length, input_length * 2);
+    ASSERT_TRUE(memcmp(uncompressed, input, input_length * 2) == 0);
+
+    delete[] uncompressed;
+    DestroyBlock(input);
+  }
+}
+
+#ifdef USE_QAT
+TEST(CompressionLevelMappingTest, QATSessionSettings) {
+  SetConfig(QAT_COMPRESSION_LEVEL, 2);
+  QATSessionSettings settings = GetQATSessionSettings(9, Z_FIXED);
+  EXPECT_EQ(settings.level, 2);
+  EXPECT_FALSE(settings.static_huffman);
+
+  SetConfig(COMPRESSION_LEVEL_MAPPING, 1);
+  EXPECT_EQ(GetQATSessionSettings(Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY)
+                .level,
+            2);
+  EXPECT_EQ(GetQATSessionSettings(1, Z_DEFAULT_STRATEGY).level, 1);
+  EXPECT_EQ(GetQATSessionSettings(9, Z_DEFAULT_STRATEGY).level, 9);
+  EXPECT_EQ(GetQATSessionSettings(9, Z_HUFFMAN_ONLY).level, 1);
+  EXPECT_EQ(GetQATSessionSettings(6, Z_RLE).level, 1);
+  settings = GetQATSessionSettings(6, Z_FIXED);
+  EXPECT_EQ(settings.level, 6);
+  EXPECT_TRUE(settings.static_huffman);
+  SetConfig(COMPRESSION_LEVEL_MAPPING, 0);
+  SetConfig(QAT_COMPRESSION_LEVEL, 1);
+}
+#endif
+
+#ifdef USE_IAA
+TEST(CompressionLevelMappingTest, IAAJobSettings) {
+  IAAJobSettings settings = GetIAAJobSettings(9, Z_FIXED);
+  EXPECT_EQ(settings.level, qpl_default_level);
+  EXPECT_FALSE(settings.fixed_huffman);
+
+  SetConfig(COMPRESSION_LEVEL_MAPPING, 1);
+  EXPECT_EQ(GetIAAJobSettings(Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY).level,
+            qpl_default_level);
+  EXPECT_EQ(GetIAAJobSettings(6, Z_DEFAULT_STRATEGY).level, qpl_default_level);
+  EXPECT_EQ(GetIAAJobSettings(9, Z_DEFAULT_STRATEGY).level, qpl_high_level);
+  EXPECT_EQ(GetIAAJobSettings(9, Z_HUFFMAN_ONLY).level, qpl_default_level);
+  settings = GetIAAJobSettings(1, Z_FIXED);
+  EXPECT_EQ(settings.level, qpl_default_level);
+  EXPECT_TRUE(settings.fixed_huffman);
+  SetConfig(COMPRESSION_LEVEL_MAPPING, 0);
+}
+#endif
+
+TEST(StreamFramingTest, HeaderMatchesZlib) {
+  SetCompressPath(ZLIB, true, false, false);
+  for (int window_bits : {9, 12, 15, 25, 31}) {
+    for (int level : {-1, 1, 2, 6, 9}) {
+      for (int strategy : {Z_DEFAULT_STRATEGY, Z_HUFFMAN_ONLY}) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(z_stream));
+        ASSERT_EQ(deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8,
+                               strategy),
+                  Z_OK);
+        uint8_t expected[64];
+        stream.next_in = Z_NULL;
+        stream.avail_in = 0;
+        stream.next_out = expected;
+        stream.avail_out = sizeof(expected);
+        ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+        deflateEnd(&stream);
+
+        uint8_t header[MAX_HEADER_SIZE];
+        CompressedFormat format = GetCompressedFormat(window_bits);
+        uint32_t header_length =
+            WriteStreamHeader(header, format, window_bits, level, strategy);
+        ASSERT_EQ(header_length,
+                  static_cast<uint32_t>(GetHeaderLength(format)));
+        ASSERT_TRUE(memcmp(header, expected, header_length) == 0)
+            << "window_bits " << window_bits << " level " << level;
+      }
+    }
+  }
+}
+
+class SchedulerTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ResetScheduler(); }
+  void TearDown() override { ResetScheduler(); }
+};
+
+TEST_F(SchedulerTest, SingleCandidate) {
+  EXPECT_EQ(SchedulePath(Operation::COMPRESS, false, false, false, 1000), ZLIB);
+  EXPECT_EQ(SchedulePath(Operation::COMPRESS, false, true, false, 1000), QAT);
+  EXPECT_EQ(SchedulePath(Operation::UNCOMPRESS, true, false, false, 1000),
+            IAA);
+}
+
+TEST_F(SchedulerTest, UnexploredPathsFirst) {
+  EXPECT_EQ(SchedulePath(Operation::COMPRESS, true, true, true, 100000), IAA);
+  RecordPathResult(Operation::COMPRESS, IAA, 100000, 10000, true);
+  EXPECT_EQ(SchedulePath(Operation::COMPRESS, true, true, true, 100000), QAT);
+  RecordPathResult(Operation::COMPRESS, QAT, 100000, 10000, true);
+  EXPECT_EQ(SchedulePath(Operation::COMPRESS, true, true, true, 100000),
+            ZLIB);
+}
+
+TEST_F(SchedulerTest, FastestPathSelected) {
+  // Results are kept per operation and size range
+  for (int i = 0; i < 10; i++) {
+    RecordPathResult(Operation::COMPRESS, QAT, 100000, 20000, true);
+    RecordPathResult(Operation::COMPRESS, ZLIB, 100000, 500000, true);
+    RecordPathResult(Operation::COMPRESS, QAT, 1000, 20000, true);
+    RecordPathResult(Operation::COMPRESS, ZLIB, 1000, 5000, true);
+    RecordPathResult(Operation::UNCOMPRESS, QAT, 100000, 50000, true);
+    RecordPathResult(Operation::UNCOMPRESS, ZLIB, 100000, 30000, true);
+  }
+
+  std::map<ExecutionPath, int> large_compress;
+  std::map<ExecutionPath, int> small_compress;
+  std::map<ExecutionPath, int> large_uncompress;
+  for (int i = 0; i < 1000; i++) {
+    large_compress[SchedulePath(Operation::COMPRESS, false, true, true,
+                                100000)]++;
+    small_compress[SchedulePath(Operation::COMPRESS, false, true, true,
+                                1000)]++;
+    large_uncompress[SchedulePath(Operation::UNCOMPRESS, false, true, true,
+                                  100000)]++;
+  }
+  // A few calls are sent to other paths to keep estimates up to date
+  EXPECT_GT(large_compress[QAT], 900);
+  EXPECT_GT(small_compress[ZLIB], 900);
+  EXPECT_GT(large_uncompress[ZLIB], 900);
+}
+
+TEST_F(SchedulerTest, FailuresIncludeRetryCost) {
+  for (int i = 0; i < 50; i++) {
+    RecordPathResult(Operation::COMPRESS, IAA, 100000, 20000, false);
+    RecordPathResult(Operation::COMPRESS, QAT, 100000, 40000, true);
+    RecordPathResult(Operation::COMPRESS, ZLIB, 100000, 500000, true);
+  }
+
+  std::map<ExecutionPath, int> paths;
+  for (int i = 0; i < 1000; i++) {
+    paths[SchedulePath(Operation::COMPRESS, true, true, true, 100000)]++;
+  }
+  EXPECT_GT(paths[QAT], 900);
+}
+
+TEST_F(SchedulerTest, CompressDecompress) {
+  // All paths are candidates
+  SetCompressPath(QAT, true, false, false);
+  SetUncompressPath(QAT, true, false);
+  SetConfig(USE_IAA_COMPRESS, 1);
+  SetConfig(USE_IAA_UNCOMPRESS, 1);
+  SetConfig(ADAPTIVE_SCHEDULING, 1);
+
+  size_t input_lengths[] = {100, 10000, 300000};
+  for (int i = 0; i < 20; i++) {
+    for (size_t input_length : input_lengths) {
+      char* input = GenerateBlock(input_length, compressible_block);
+      ASSERT_NE(input, nullptr);
+      std::string compressed;
+      size_t output_upper_bound;
+      ExecutionPath execution_path = UNDEFINED;
+      ASSERT_EQ(ZlibCompress(input, input_length, &compressed, 31, Z_FINISH,
+                             &output_upper_bound, &execution_path),
+                Z_STREAM_END);
+
+      char* uncompressed = nullptr;
+      size_t uncompressed_length;
+      size_t input_consumed;
+      ASSERT_EQ(ZlibUncompress(compressed.c_str(), compressed.length(),
+                               input_length, &uncompressed,
+                               &uncompressed_length, &input_consumed, 31,
+                               Z_NO_FLUSH, 1, &execution_path),
+                Z_STREAM_END);
+      ASSERT_EQ(uncompressed_length, input_length);
+      ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+      delete[] uncompressed;
+      DestroyBlock(input);
+    }
+  }
+  SetConfig(ADAPTIVE_SCHEDULING, 0);
+  SetConfig(USE_IAA_COMPRESS, 0);
+  SetConfig(USE_IAA_UNCOMPRESS, 0);
+}
+
+TEST_F(SchedulerTest, InFlightJobs) {
+  EXPECT_EQ(GetInFlightJobs(QAT), 0u);
+  {
+    InFlightJob job1(QAT);
+    InFlightJob job2(QAT);
+    InFlightJob job3(IAA);
+    EXPECT_EQ(GetInFlightJobs(QAT), 2u);
+    EXPECT_EQ(GetInFlightJobs(IAA), 1u);
+  }
+  EXPECT_EQ(GetInFlightJobs(QAT), 0u);
+  EXPECT_EQ(GetInFlightJobs(IAA), 0u);
+}
+
+TEST_F(SchedulerTest, OccupancyRouting) {
+  SetConfig(OCCUPANCY_ROUTING, 1);
+  EXPECT_EQ(SelectPath(EntryPoint::GZWRITE, 31, true, true, 1000), QAT);
+  {
+    InFlightJob job(QAT);
+    EXPECT_EQ(SelectPath(EntryPoint::GZWRITE, 31, true, true, 1000), IAA);
+    InFlightJob job1(IAA);
+    InFlightJob job2(IAA);
+    EXPECT_EQ(SelectPath(EntryPoint::UNCOMPRESS2, 15, true, true, 1000), QAT);
+  }
+  // Only accelerators that are available are selected
+  {
+    InFlightJob job(QAT);
+    EXPECT_EQ(SelectPath(EntryPoint::DEFLATE, 15, false, true, 1000), QAT);
+  }
+  SetConfig(OCCUPANCY_ROUTING, 0);
+}
+
+// Mock backends where QAT jobs take longer than IAA jobs. With occupancy
+// routing, most jobs go to the backend that completes them faster.
+TEST_F(SchedulerTest, OccupancyRoutingMockBackends) {
+  SetConfig(OCCUPANCY_ROUTING, 1);
+  std::atomic<int> iaa_jobs{0};
+  std::atomic<int> qat_jobs{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 50; i++) {
+        ExecutionPath path =
+            SelectPath(EntryPoint::DEFLATE, 15, true, true, 100000);
+        InFlightJob job(path);
+        if (path == QAT) {
+          qat_jobs++;
+          std::this_thread::sleep_for(std::chrono::microseconds(2000));
+        } else {
+          iaa_jobs++;
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  SetConfig(OCCUPANCY_ROUTING, 0);
+
+  EXPECT_EQ(iaa_jobs + qat_jobs, 400);
+  EXPECT_GT(iaa_jobs, qat_jobs);
+  EXPECT_EQ(GetInFlightJobs(QAT), 0u);
+  EXPECT_EQ(GetInFlightJobs(IAA), 0u);
+}
+
+class CircuitBreakerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ResetCircuitBreakers();
+    SetConfig(CIRCUIT_BREAKER_THRESHOLD, 3);
+    SetConfig(CIRCUIT_BREAKER_BACKOFF_MS, 20);
+  }
+  void TearDown() override {
+    SetConfig(CIRCUIT_BREAKER_THRESHOLD, 0);
+    SetConfig(CIRCUIT_BREAKER_BACKOFF_MS, 100);
+    ResetCircuitBreakers();
+  }
+
+  void RecordFailures(ExecutionPath path, CompressedFormat format, int count) {
+    for (int i = 0; i < count; i++) {
+      RecordCircuitBreakerResult(path, Operation::COMPRESS, format, false);
+    }
+  }
+};
+
+TEST_F(CircuitBreakerTest, OpenAfterConsecutiveFailures) {
+  CompressedFormat format = CompressedFormat::GZIP;
+  RecordFailures(QAT, format, 2);
+  RecordCircuitBreakerResult(QAT, Operation::COMPRESS, format, true);
+  RecordFailures(QAT, format, 2);
+  EXPECT_EQ(GetCircuitState(QAT, Operation::COMPRESS, format),
+            CircuitState::CLOSED);
+  EXPECT_TRUE(CircuitBreakerAllows(QAT, Operation::COMPRESS, format));
+
+  RecordFailures(QAT, format, 1);
+  EXPECT_EQ(GetCircuitState(QAT, Operation::COMPRESS, format),
+            CircuitState::OPEN);
+  EXPECT_FALSE(CircuitBreakerAllows(QAT, Operation::COMPRESS, format));
+
+  // Breakers of other engines, operations and formats are not affected
+  EXPECT_TRUE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+  EXPECT_TRUE(CircuitBreakerAllows(QAT, Operation::UNCOMPRESS, format));
+  EXPECT_TRUE(
+      CircuitBreakerAllows(QAT, Operation::COMPRESS, CompressedFormat::ZLIB));
+
+  // Disabled
+  SetConfig(CIRCUIT_BREAKER_THRESHOLD, 0);
+  EXPECT_TRUE(CircuitBreakerAllows(QAT, Operation::COMPRESS, format));
+}
+
+TEST_F(CircuitBreakerTest, ProbeWithBackoff) {
+  CompressedFormat format = CompressedFormat::DEFLATE_RAW;
+  RecordFailures(IAA, format, 3);
+  EXPECT_FALSE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+
+  // A single probe is let through after the backoff time
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  EXPECT_EQ(GetCircuitState(IAA, Operation::COMPRESS, format),
+            CircuitState::HALF_OPEN);
+  EXPECT_TRUE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+  EXPECT_FALSE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+
+  // A failed probe doubles the backoff time
+  auto probe_time = std::chrono::steady_clock::now();
+  RecordFailures(IAA, format, 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  if (std::chrono::steady_clock::now() - probe_time <
+      std::chrono::milliseconds(40)) {
+    EXPECT_FALSE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_TRUE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+
+  // A successful probe closes the breaker
+  RecordCircuitBreakerResult(IAA, Operation::COMPRESS, format, true);
+  EXPECT_EQ(GetCircuitState(IAA, Operation::COMPRESS, format),
+            CircuitState::CLOSED);
+  EXPECT_TRUE(CircuitBreakerAllows(IAA, Operation::COMPRESS, format));
+  EXPECT_EQ(GetOpenCircuitBreakers(), "none");
+}
+
+TEST_F(CircuitBreakerTest, LateFailuresIgnoredWhileOpen) {
+  CompressedFormat format = CompressedFormat::ZLIB;
+  RecordFailures(QAT, format, 3);
+  // Calls that were running when the breaker opened fail too
+  RecordFailures(QAT, format, 5);
+
+  // The backoff time is not doubled by these failures
+  std::this_thread::sleep_for(std::chrono::milliseconds(25));
+  EXPECT_EQ(GetCircuitState(QAT, Operation::COMPRESS, format),
+            CircuitState::HALF_OPEN);
+  EXPECT_TRUE(CircuitBreakerAllows(QAT, Operation::COMPRESS, format));
+
+  // Only the failed probe doubles it
+  auto probe_time = std::chrono::steady_clock::now();
+  RecordFailures(QAT, format, 1);
+  RecordFailures(QAT, format, 3);
+  std::this_thread::sleep_for(std::chrono::milliseconds(45));
+  if (std::chrono::steady_clock::now() - probe_time <
+      std::chrono::milliseconds(80)) {
+    EXPECT_TRUE(CircuitBreakerAllows(QAT, Operation::COMPRESS, format));
+  }
+}
+
+TEST_F(CircuitBreakerTest, SkipOpenEngine) {
+  RecordFailures(IAA, CompressedFormat::ZLIB, 3);
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, 15, true, true, 1000), QAT);
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, -15, true, true, 1000), IAA);
+  RecordFailures(QAT, CompressedFormat::ZLIB, 3);
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, 15, true, true, 1000), ZLIB);
+  EXPECT_EQ(GetOpenCircuitBreakers(),
+            "qat.compress.zlib(open) iaa.compress.zlib(open)");
+}
+
+class RatioGuardTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ResetRatioGuard();
+    SetConfig(RATIO_GUARD_SAMPLE_PERCENTAGE, 100);
+    SetConfig(RATIO_GUARD_FLOOR, 90);
+  }
+  void TearDown() override {
+    SetConfig(RATIO_GUARD_SAMPLE_PERCENTAGE, 0);
+    SetConfig(RATIO_GUARD_FLOOR, 90);
+    ResetRatioGuard();
+  }
+
+  void RecordSizes(ExecutionPath path, CompressedFormat format,
+                   uint32_t output_length) {
+    for (int i = 0; i < 64; i++) {
+      RecordCompressedSize(path, format, 100000, output_length);
+    }
+  }
+};
+
+TEST_F(RatioGuardTest, DowngradeBelowFloor) {
+  CompressedFormat format = CompressedFormat::ZLIB;
+  RecordSizes(QAT, format, 30000);
+  EXPECT_FALSE(IsRatioGuardDowngraded(QAT, format, 100000));
+
+  // QAT output is 20% larger than zlib output
+  RecordSizes(ZLIB, format, 25000);
+  EXPECT_TRUE(IsRatioGuardDowngraded(QAT, format, 100000));
+  EXPECT_TRUE(SampleRatioBaseline(QAT, format, 100000));
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, 15, true, true, 100000), IAA);
+  EXPECT_EQ(SelectPath(EntryPoint::DEFLATE, 15, false, true, 100000), ZLIB);
+
+  // Other formats, sizes, engines and entry points are not affected
+  EXPECT_FALSE(IsRatioGuardDowngraded(IAA, format, 100000));
+  EXPECT_FALSE(IsRatioGuardDowngraded(QAT, CompressedFormat::GZIP, 100000));
+  EXPECT_FALSE(IsRatioGuardDowngraded(QAT, format, 1000));
+  EXPECT_EQ(SelectPath(EntryPoint::GZWRITE, 31, false, true, 100000), QAT);
+
+  // Within the floor
+  RecordSizes(ZLIB, format, 28000);
+  EXPECT_FALSE(IsRatioGuardDowngraded(QAT, format, 100000));
+
+  // Disabled
+  RecordSizes(ZLIB, format, 25000);
+  SetConfig(RATIO_GUARD_SAMPLE_PERCENTAGE, 0);
+  EXPECT_TRUE(RatioGuardAllows(QAT, format, 100000));
+  EXPECT_FALSE(SampleRatioBaseline(QAT, format, 100000));
+}
+
+TEST_F(RatioGuardTest, ProbeDowngradedEngine) {
+  CompressedFormat format = CompressedFormat::GZIP;
+  RecordSizes(ZLIB, format, 25000);
+  RecordSizes(IAA, format, 40000);
+  int allowed = 0;
+  for (int i = 0; i < 128; i++) {
+    allowed += RatioGuardAllows(IAA, format, 100000) ? 1 : 0;
+  }
+  EXPECT_EQ(allowed, 2);
+
+  // Probes that compress as well as zlib restore the engine
+  RecordSizes(IAA, format, 25000);
+  EXPECT_FALSE(IsRatioGuardDowngraded(IAA, format, 100000));
+  EXPECT_TRUE(RatioGuardAllows(IAA, format, 100000));
+}
+
+class ResultCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ResetResultCache();
+    SetConfig(RESULT_CACHE_SIZE_MB, 1);
+  }
+  void TearDown() override {
+    SetConfig(RESULT_CACHE_SIZE_MB, 0);
+    ResetResultCache();
+  }
+};
+
+TEST_F(ResultCacheTest, InsertLookupEvict) {
+  uint8_t input[1000];
+  uint8_t output[100];
+  memset(input, 'a', sizeof(input));
+  memset(output, 'b', sizeof(output));
+  ResultCacheKey key = GetResultCacheKey(EntryPoint::DEFLATE, 15, 6, 8,
+                                         Z_DEFAULT_STRATEGY, input, 1000);
+  EXPECT_EQ(LookupResult(key, input), nullptr);
+  InsertResult(key, input, 1000, output, 100, 1234);
+  EXPECT_EQ(GetResultCacheBytes(), 1000u + 100u + 128u);
+
+  std::shared_ptr<const CachedResult> result = LookupResult(key, input);
+  ASSERT_NE(result, nullptr);
+  EXPECT_EQ(result->output_length, 100u);
+  EXPECT_EQ(result->checksum, 1234u);
+  EXPECT_TRUE(memcmp(result->output.get(), output, 100) == 0);
+
+  // Other parameters and entry points have their own entries
+  EXPECT_EQ(LookupResult(GetResultCacheKey(EntryPoint::DEFLATE, 15, 1, 8,
+                                           Z_DEFAULT_STRATEGY, input, 1000),
+                         input),
+            nullptr);
+  EXPECT_EQ(LookupResult(GetResultCacheKey(EntryPoint::COMPRESS2, 15, 6, 8,
+                                           Z_DEFAULT_STRATEGY, input, 1000),
+                         input),
+            nullptr);
+
+  // Input that does not match the stored input is a miss
+  uint8_t other[1000];
+  memset(other, 'c', sizeof(other));
+  EXPECT_EQ(LookupResult(key, other), nullptr);
+
+  // Inputs larger than a quarter of a shard are not cached
+  EXPECT_TRUE(UseResultCache(10000));
+  EXPECT_FALSE(UseResultCache(1 << 20));
+
+  // Filling the cache evicts the least recently used entries
+  for (int i = 0; i < 2000; i++) {
+    memcpy(other, &i, sizeof(i));
+    InsertResult(GetResultCacheKey(EntryPoint::DEFLATE, 15, 6, 8,
+                                   Z_DEFAULT_STRATEGY, other, 1000),
+                 other, 1000, output, 100, 0);
+  }
+  EXPECT_LE(GetResultCacheBytes(), 1u << 20);
+  EXPECT_EQ(LookupResult(key, input), nullptr);
+  // The result stays valid after eviction
+  EXPECT_EQ(result->output_length, 100u);
+
+  SetConfig(RESULT_CACHE_SIZE_MB, 0);
+  EXPECT_FALSE(UseResultCache(1000));
+}
+
+TEST_F(ResultCacheTest, CompressUncompressHit) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  uLong bound = compressBound(input_length);
+  std::vector<Bytef> compressed1(bound);
+  std::vector<Bytef> compressed2(bound);
+  uLongf compressed_length1 = bound;
+  uLongf compressed_length2 = bound;
+  ASSERT_EQ(compress2(compressed1.data(), &compressed_length1,
+                      reinterpret_cast<Bytef*>(input), input_length, 6),
+            Z_OK);
+  ResetStats();
+  ASSERT_EQ(compress2(compressed2.data(), &compressed_length2,
+                      reinterpret_cast<Bytef*>(input), input_length, 6),
+            Z_OK);
+  VerifyStatIncremented(Statistic::RESULT_CACHE_HIT_COUNT);
+  ASSERT_EQ(compressed_length1, compressed_length2);
+  ASSERT_TRUE(memcmp(compressed1.data(), compressed2.data(),
+                     compressed_length1) == 0);
+
+  std::vector<Bytef> uncompressed(input_length);
+  for (int i = 0; i < 2; i++) {
+    ResetStats();
+    uLongf uncompressed_length = input_length;
+    uLong source_length = compressed_length1;
+    ASSERT_EQ(uncompress2(uncompressed.data(), &uncompressed_length,
+                          compressed1.data(), &source_length),
+              Z_OK);
+    ASSERT_EQ(uncompressed_length, input_length);
+    ASSERT_EQ(source_length, compressed_length1);
+    ASSERT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+  }
+  VerifyStatIncremented(Statistic::RESULT_CACHE_HIT_COUNT);
+
+  // A hit whose output does not fit falls through to the engines
+  uLongf short_length = 10;
+  ASSERT_EQ(compress2(compressed2.data(), &short_length,
+                      reinterpret_cast<Bytef*>(input), input_length, 6),
+            Z_BUF_ERROR);
+  DestroyBlock(input);
+}
+
+TEST_F(ResultCacheTest, DeflateInflateHit) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::string compressed1;
+  std::string compressed2;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed1, 31, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+  ResetStats();
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed2, 31, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+  VerifyStatIncremented(Statistic::RESULT_CACHE_HIT_COUNT);
+  ASSERT_EQ(compressed1, compressed2);
+
+  for (int i = 0; i < 2; i++) {
+    ResetStats();
+    char* uncompressed;
+    size_t uncompressed_length;
+    size_t input_consumed;
+    ASSERT_EQ(ZlibUncompress(compressed1.c_str(), compressed1.length(),
+                             input_length, &uncompressed, &uncompressed_length,
+                             &input_consumed, 31, Z_SYNC_FLUSH, 1,
+                             &execution_path),
+              Z_STREAM_END);
+    ASSERT_EQ(uncompressed_length, input_length);
+    ASSERT_EQ(input_consumed, compressed1.length());
+    ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+    delete[] uncompressed;
+  }
+  VerifyStatIncremented(Statistic::RESULT_CACHE_HIT_COUNT);
+  DestroyBlock(input);
+}
+
+TEST_F(ResultCacheTest, ChecksumOnHit) {
+  uInt input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  Bytef* data = reinterpret_cast<Bytef*>(input);
+  for (int window_bits : {15, 31}) {
+    uLong checksum = window_bits == 15 ? adler32(adler32(0, Z_NULL, 0), data,
+                                                 input_length)
+                                       : crc32(crc32(0, Z_NULL, 0), data,
+                                               input_length);
+    std::vector<Bytef> compressed(compressBound(input_length) + 100);
+    uInt compressed_length = 0;
+    for (int i = 0; i < 2; i++) {
+      ResetStats();
+      z_stream stream;
+      memset(&stream, 0, sizeof(z_stream));
+      ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, window_bits, 8,
+                             Z_DEFAULT_STRATEGY),
+                Z_OK);
+      stream.next_in = data;
+      stream.avail_in = input_length;
+      stream.next_out = compressed.data();
+      stream.avail_out = compressed.size();
+      ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+      EXPECT_EQ(stream.adler, checksum);
+      compressed_length = stream.total_out;
+      deflateEnd(&stream);
+    }
+    VerifyStatIncremented(Statistic::RESULT_CACHE_HIT_COUNT);
+
+    std::vector<Bytef> uncompressed(input_length);
+    for (int i = 0; i < 2; i++) {
+      ResetStats();
+      z_stream stream;
+      memset(&stream, 0, sizeof(z_stream));
+      ASSERT_EQ(inflateInit2(&stream, window_bits), Z_OK);
+      stream.next_in = compressed.data();
+      stream.avail_in = compressed_length;
+      stream.next_out = uncompressed.data();
+      stream.avail_out = input_length;
+      ASSERT_EQ(inflate(&stream, Z_FINISH), Z_STREAM_END);
+      EXPECT_EQ(stream.adler, checksum);
+      inflateEnd(&stream);
+    }
+    VerifyStatIncremented(Statistic::RESULT_CACHE_HIT_COUNT);
+  }
+  DestroyBlock(input);
+}
+
+// The gzip header given with deflateSetHeader is written by zlib, and never
+// taken from or stored in the cache
+TEST_F(ResultCacheTest, DeflateSetHeader) {
+  uInt input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  const char* names[] = {"first.txt", "second.txt", nullptr};
+  std::vector<Bytef> compressed[3];
+  for (int i = 0; i < 3; i++) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(z_stream));
+    ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+              Z_OK);
+    gz_header header;
+    memset(&header, 0, sizeof(gz_header));
+    if (names[i] != nullptr) {
+      header.name = reinterpret_cast<Bytef*>(const_cast<char*>(names[i]));
+      header.time = 1000 + i;
+      ASSERT_EQ(deflateSetHeader(&stream, &header), Z_OK);
+    }
+    compressed[i].resize(compressBound(input_length) + 100);
+    stream.next_in = reinterpret_cast<Bytef*>(input);
+    stream.avail_in = input_length;
+    stream.next_out = compressed[i].data();
+    stream.avail_out = compressed[i].size();
+    ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+    compressed[i].resize(stream.total_out);
+    deflateEnd(&stream);
+  }
+  for (int i = 0; i < 2; i++) {
+    // FNAME flag, then the name after the 10-byte header
+    ASSERT_GT(compressed[i].size(), 10 + strlen(names[i]));
+    EXPECT_EQ(compressed[i][3] & 0x08, 0x08);
+    EXPECT_EQ(memcmp(&compressed[i][10], names[i], strlen(names[i]) + 1), 0);
+  }
+  EXPECT_EQ(compressed[2][3] & 0x08, 0);
+
+  // The header is kept after deflateReset, as in zlib
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  gz_header header;
+  memset(&header, 0, sizeof(gz_header));
+  header.name = reinterpret_cast<Bytef*>(const_cast<char*>(names[0]));
+  header.time = 1000;
+  ASSERT_EQ(deflateSetHeader(&stream, &header), Z_OK);
+  ASSERT_EQ(deflateReset(&stream), Z_OK);
+  std::vector<Bytef> output(compressBound(input_length) + 100);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = input_length;
+  stream.next_out = output.data();
+  stream.avail_out = output.size();
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  output.resize(stream.total_out);
+  EXPECT_EQ(output, compressed[0]);
+  deflateEnd(&stream);
+  DestroyBlock(input);
+}
+
+class PassthroughTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    use_qat_compress = GetConfig(USE_QAT_COMPRESS);
+    use_iaa_compress = GetConfig(USE_IAA_COMPRESS);
+    SetConfig(USE_QAT_COMPRESS, 0);
+    SetConfig(USE_IAA_COMPRESS, 0);
+    SetConfig(USE_ZLIB_COMPRESS, 1);
+  }
+  void TearDown() override {
+    SetConfig(USE_QAT_COMPRESS, use_qat_compress);
+    SetConfig(USE_IAA_COMPRESS, use_iaa_compress);
+    SetConfig(RESULT_CACHE_SIZE_MB, 0);
+    ResetResultCache();
+  }
+
+  uint32_t use_qat_compress;
+  uint32_t use_iaa_compress;
+};
+
+TEST_F(PassthroughTest, EnabledWithoutEngines) {
+  EXPECT_TRUE(IsCompressPassthrough());
+  SetConfig(RESULT_CACHE_SIZE_MB, 1);
+  EXPECT_FALSE(IsCompressPassthrough());
+  SetConfig(RESULT_CACHE_SIZE_MB, 0);
+  SetConfig(USE_ZLIB_COMPRESS, 0);
+  EXPECT_FALSE(IsCompressPassthrough());
+  SetConfig(USE_ZLIB_COMPRESS, 1);
+#ifdef USE_QAT
+  SetConfig(USE_QAT_COMPRESS, 1);
+  EXPECT_FALSE(IsCompressPassthrough());
+#endif
+}
+
+TEST_F(PassthroughTest, StreamCreatedInPassthroughMode) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> compressed(compressBound(input_length));
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  // The stream stays on zlib when passthrough mode is disabled
+  SetConfig(RESULT_CACHE_SIZE_MB, 1);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = input_length;
+  stream.next_out = compressed.data();
+  stream.avail_out = compressed.size();
+  ResetStats();
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  VerifyStatIncremented(Statistic::DEFLATE_ZLIB_COUNT);
+  EXPECT_EQ(GetDeflateExecutionPath(&stream), ZLIB);
+  size_t compressed_length = stream.total_out;
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+  if (AreStatsEnabled()) {
+    EXPECT_EQ(GetStat(Statistic::RESULT_CACHE_INSERT_COUNT), 0u);
+  }
+
+  char* uncompressed;
+  size_t uncompressed_length;
+  size_t input_consumed;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibUncompress(reinterpret_cast<char*>(compressed.data()),
+                           compressed_length, input_length, &uncompressed,
+                           &uncompressed_length, &input_consumed, 31,
+                           Z_SYNC_FLUSH, 1, &execution_path),
+            Z_STREAM_END);
+  ASSERT_EQ(uncompressed_length, input_length);
+  ASSERT_TRUE(memcmp(uncompressed, input, input_length) == 0);
+  delete[] uncompressed;
+  DestroyBlock(input);
+}
+
+TEST_F(PassthroughTest, StreamPinnedToZlib) {
+  SetConfig(RESULT_CACHE_SIZE_MB, 1);
+  ASSERT_FALSE(IsCompressPassthrough());
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> compressed(compressBound(input_length));
+  const char dictionary[] = "dictionary";
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  ASSERT_EQ(deflateSetDictionary(&stream,
+                                 reinterpret_cast<const Bytef*>(dictionary),
+                                 sizeof(dictionary)),
+            Z_OK);
+  EXPECT_EQ(GetDeflateExecutionPath(&stream), ZLIB);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = input_length;
+  stream.next_out = compressed.data();
+  stream.avail_out = compressed.size();
+  ResetStats();
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  VerifyStatIncremented(Statistic::DEFLATE_COUNT);
+  VerifyStatIncremented(Statistic::DEFLATE_ZLIB_COUNT);
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+
+  std::vector<char> uncompressed(input_length);
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit2(&stream, 15), Z_OK);
+  stream.next_in = compressed.data();
+  stream.avail_in = compressed.size();
+  stream.next_out = reinterpret_cast<Bytef*>(uncompressed.data());
+  stream.avail_out = input_length;
+  ASSERT_EQ(inflate(&stream, Z_NO_FLUSH), Z_NEED_DICT);
+  ASSERT_EQ(inflateSetDictionary(&stream,
+                                 reinterpret_cast<const Bytef*>(dictionary),
+                                 sizeof(dictionary)),
+            Z_OK);
+  ASSERT_EQ(inflate(&stream, Z_NO_FLUSH), Z_STREAM_END);
+  ASSERT_EQ(stream.total_out, input_length);
+  ASSERT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+  ASSERT_EQ(inflateEnd(&stream), Z_OK);
+  DestroyBlock(input);
+}
+
+class LazyZlibInitTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SetConfig(LAZY_ZLIB_INIT, 1);
+    // Streams are not registered in passthrough mode
+    SetConfig(RESULT_CACHE_SIZE_MB, 1);
+  }
+  void TearDown() override {
+    SetConfig(LAZY_ZLIB_INIT, 0);
+    SetConfig(RESULT_CACHE_SIZE_MB, 0);
+    ResetResultCache();
+  }
+};
+
+TEST_F(LazyZlibInitTest, DeflateInitDeferred) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> compressed(compressBound(input_length) + 32);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  EXPECT_EQ(stream.state, nullptr);
+  EXPECT_EQ(stream.adler, crc32(0L, Z_NULL, 0));
+  uLong bound = deflateBound(&stream, input_length);
+  EXPECT_EQ(stream.state, nullptr);
+
+  for (int i = 0; i < 2; i++) {
+    stream.next_in = reinterpret_cast<Bytef*>(input);
+    stream.avail_in = input_length;
+    stream.next_out = compressed.data();
+    stream.avail_out = compressed.size();
+    ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+    EXPECT_NE(stream.state, nullptr);
+    EXPECT_LE(stream.total_out, bound);
+    EXPECT_EQ(stream.adler, crc32(0L, reinterpret_cast<Bytef*>(input),
+                                  input_length));
+    ASSERT_EQ(deflateReset(&stream), Z_OK);
+  }
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+
+  // The bound without a zlib state covers the gzip wrapper
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  SetConfig(LAZY_ZLIB_INIT, 0);
+  z_stream eager_stream;
+  memset(&eager_stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&eager_stream, 6, Z_DEFLATED, 31, 8,
+                         Z_DEFAULT_STRATEGY),
+            Z_OK);
+  EXPECT_NE(eager_stream.state, nullptr);
+  EXPECT_GE(deflateBound(&stream, input_length),
+            deflateBound(&eager_stream, input_length));
+  // Streams never used by zlib are ended without a zlib state
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+  ASSERT_EQ(deflateEnd(&eager_stream), Z_OK);
+  DestroyBlock(input);
+}
+
+// zlib functions other than deflate allocate the state of the stream first
+TEST_F(LazyZlibInitTest, DeflateParamsBeforeData) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> compressed(compressBound(input_length) + 32);
+  std::vector<Bytef> expected(compressed.size());
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  EXPECT_EQ(stream.state, nullptr);
+  ASSERT_EQ(deflateParams(&stream, 1, Z_DEFAULT_STRATEGY), Z_OK);
+  EXPECT_NE(stream.state, nullptr);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = input_length;
+  stream.next_out = compressed.data();
+  stream.avail_out = compressed.size();
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  compressed.resize(stream.total_out);
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+
+  // Same output as a stream created with level 1
+  uLongf expected_length = expected.size();
+  ASSERT_EQ(compress2(expected.data(), &expected_length,
+                      reinterpret_cast<Bytef*>(input), input_length, 1),
+            Z_OK);
+  expected.resize(expected_length);
+  EXPECT_EQ(compressed, expected);
+  DestroyBlock(input);
+}
+
+TEST_F(LazyZlibInitTest, InflateGetHeaderBeforeData) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> compressed(compressBound(input_length) + 64);
+  const char* name = "data.bin";
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  gz_header header;
+  memset(&header, 0, sizeof(gz_header));
+  header.name = reinterpret_cast<Bytef*>(const_cast<char*>(name));
+  ASSERT_EQ(deflateSetHeader(&stream, &header), Z_OK);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = input_length;
+  stream.next_out = compressed.data();
+  stream.avail_out = compressed.size();
+  ASSERT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+  compressed.resize(stream.total_out);
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+
+  std::vector<Bytef> uncompressed(input_length);
+  Bytef read_name[32];
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit2(&stream, 31), Z_OK);
+  EXPECT_EQ(stream.state, nullptr);
+  memset(&header, 0, sizeof(gz_header));
+  header.name = read_name;
+  header.name_max = sizeof(read_name);
+  ASSERT_EQ(inflateGetHeader(&stream, &header), Z_OK);
+  EXPECT_NE(stream.state, nullptr);
+  stream.next_in = compressed.data();
+  stream.avail_in = compressed.size();
+  stream.next_out = uncompressed.data();
+  stream.avail_out = uncompressed.size();
+  ASSERT_EQ(inflate(&stream, Z_FINISH), Z_STREAM_END);
+  EXPECT_EQ(header.done, 1);
+  EXPECT_STREQ(reinterpret_cast<char*>(read_name), name);
+  EXPECT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+  ASSERT_EQ(inflateEnd(&stream), Z_OK);
+  DestroyBlock(input);
+}
+
+TEST_F(LazyZlibInitTest, InvalidParametersRejected) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  EXPECT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 7, 8, Z_DEFAULT_STRATEGY),
+            Z_STREAM_ERROR);
+  EXPECT_EQ(deflateInit2(&stream, 10, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY),
+            Z_STREAM_ERROR);
+  deflateEnd(&stream);
+  memset(&stream, 0, sizeof(z_stream));
+  EXPECT_EQ(inflateInit2(&stream, 7), Z_STREAM_ERROR);
+  inflateEnd(&stream);
+}
+
+TEST_F(LazyZlibInitTest, InflateInitDeferred) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, 15, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+
+  std::vector<char> uncompressed(input_length);
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit2(&stream, 47), Z_OK);
+  EXPECT_EQ(stream.state, nullptr);
+  EXPECT_EQ(stream.adler, 1u);
+  for (int i = 0; i < 2; i++) {
+    stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+    stream.avail_in = compressed.size();
+    stream.next_out = reinterpret_cast<Bytef*>(uncompressed.data());
+    stream.avail_out = input_length;
+    ASSERT_EQ(inflate(&stream, Z_NO_FLUSH), Z_STREAM_END);
+    ASSERT_EQ(stream.total_out, input_length);
+    ASSERT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+    ASSERT_EQ(inflateReset(&stream), Z_OK);
+  }
+  ASSERT_EQ(inflateEnd(&stream), Z_OK);
+
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(inflateInit(&stream), Z_OK);
+  EXPECT_EQ(stream.state, nullptr);
+  ASSERT_EQ(inflateEnd(&stream), Z_OK);
+  DestroyBlock(input);
+}
+
+class ZlibStatePoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SetConfig(ZLIB_STATE_POOL_SIZE, 4);
+    ClearZlibStatePools();
+  }
+  void TearDown() override {
+    SetConfig(ZLIB_STATE_POOL_SIZE, 0);
+    ClearZlibStatePools();
+  }
+};
+
+static int DeflateWholeStream(z_streamp stream, char* input,
+                              size_t input_length, std::vector<Bytef>* output) {
+  stream->next_in = reinterpret_cast<Bytef*>(input);
+  stream->avail_in = input_length;
+  stream->next_out = output->data();
+  stream->avail_out = output->size();
+  return deflate(stream, Z_FINISH);
+}
+
+TEST_F(ZlibStatePoolTest, DeflateStateReused) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> expected(compressBound(input_length) + 32);
+  std::vector<Bytef> compressed(expected.size());
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  ASSERT_EQ(DeflateWholeStream(&stream, input, input_length, &expected),
+            Z_STREAM_END);
+  expected.resize(stream.total_out);
+  // Parameters changed on a stream are not kept by the pooled state
+  ASSERT_EQ(deflateReset(&stream), Z_OK);
+  ASSERT_EQ(deflateParams(&stream, 1, Z_HUFFMAN_ONLY), Z_OK);
+  void* state = stream.state;
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+  EXPECT_EQ(stream.state, nullptr);
+
+  ResetStats();
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 6, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  EXPECT_EQ(stream.state, state);
+  EXPECT_EQ(stream.total_in, 0u);
+  EXPECT_EQ(stream.adler, crc32(0L, Z_NULL, 0));
+  if (AreStatsEnabled()) {
+    EXPECT_EQ(GetStat(Statistic::ZLIB_STATE_REUSE_COUNT), 1u);
+  }
+  ASSERT_EQ(DeflateWholeStream(&stream, input, input_length, &compressed),
+            Z_STREAM_END);
+  ASSERT_EQ(stream.total_out, expected.size());
+  EXPECT_TRUE(memcmp(compressed.data(), expected.data(), expected.size()) ==
+              0);
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+
+  // A state is only reused for the same parameters
+  ResetStats();
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit2(&stream, 1, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY),
+            Z_OK);
+  EXPECT_EQ(GetStat(Statistic::ZLIB_STATE_REUSE_COUNT), 0u);
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+  DestroyBlock(input);
+}
+
+TEST_F(ZlibStatePoolTest, UnfinishedDeflateStateFreed) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::vector<Bytef> compressed(compressBound(input_length) + 32);
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit(&stream, 6), Z_OK);
+  stream.next_in = reinterpret_cast<Bytef*>(input);
+  stream.avail_in = input_length;
+  stream.next_out = compressed.data();
+  stream.avail_out = compressed.size();
+  ASSERT_EQ(deflate(&stream, Z_NO_FLUSH), Z_OK);
+  // zlib reports the unfinished stream
+  EXPECT_EQ(deflateEnd(&stream), Z_DATA_ERROR);
+
+  ResetStats();
+  memset(&stream, 0, sizeof(z_stream));
+  ASSERT_EQ(deflateInit(&stream, 6), Z_OK);
+  EXPECT_EQ(GetStat(Statistic::ZLIB_STATE_REUSE_COUNT), 0u);
+  ASSERT_EQ(deflateEnd(&stream), Z_OK);
+  DestroyBlock(input);
+}
+
+static int custom_alloc_count = 0;
+
+static voidpf CountingAlloc(voidpf opaque, uInt items, uInt size) {
+  (void)opaque;
+  custom_alloc_count++;
+  return calloc(items, size);
+}
+
+static void CountingFree(voidpf opaque, voidpf address) {
+  (void)opaque;
+  free(address);
+}
+
+TEST_F(ZlibStatePoolTest, CustomAllocatorNotPooled) {
+  custom_alloc_count = 0;
+  for (int i = 0; i < 2; i++) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(z_stream));
+    stream.zalloc = CountingAlloc;
+    stream.zfree = CountingFree;
+    int alloc_count = custom_alloc_count;
+    ASSERT_EQ(deflateInit(&stream, 6), Z_OK);
+    EXPECT_GT(custom_alloc_count, alloc_count);
+    ASSERT_EQ(deflateEnd(&stream), Z_OK);
+  }
+}
+
+TEST_F(ZlibStatePoolTest, InflateStateReused) {
+  size_t input_length = 10000;
+  char* input = GenerateBlock(input_length, compressible_block);
+  std::string compressed;
+  size_t output_upper_bound;
+  ExecutionPath execution_path = UNDEFINED;
+  ASSERT_EQ(ZlibCompress(input, input_length, &compressed, 31, Z_FINISH,
+                         &output_upper_bound, &execution_path),
+            Z_STREAM_END);
+
+  std::vector<char> uncompressed(input_length);
+  void* state = nullptr;
+  for (int i = 0; i < 2; i++) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(z_stream));
+    ASSERT_EQ(inflateInit2(&stream, 31), Z_OK);
+    if (i == 1) {
+      EXPECT_EQ(stream.state, state);
+    }
+    EXPECT_EQ(stream.total_out, 0u);
+    stream.next_in =
+        reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+    stream.avail_in = compressed.size();
+    stream.next_out = reinterpret_cast<Bytef*>(uncompressed.data());
+    stream.avail_out = input_length;
+    ASSERT_EQ(inflate(&stream, Z_NO_FLUSH), Z_STREAM_END);
+    ASSERT_EQ(stream.total_out, input_length);
+    ASSERT_TRUE(memcmp(uncompressed.data(), input, input_length) == 0);
+    state = stream.state;
+    ASSERT_EQ(inflateEnd(&stream), Z_OK);
+  }
+  DestroyBlock(input);
+}
+
+class HedgeTest : public ::testing::Test {
+ protected:
+  void TearDown() override { LoadDeadlines({}); }
+};
+
+TEST_F(HedgeTest, DeadlinesPerSize) {
+  EXPECT_EQ(LoadDeadlines({{"deadline.compress.*", "1000"},
+                           {"deadline.compress.65536-", "5000"},
+                           {"deadline.uncompress.0-4095", "200"},
+                           {"deadline.decompress.*", "100"},
+                           {"deadline.uncompress.4096", "100"},
+                           {"deadline.uncompress.*", "-1"}}),
+            3);
+  EXPECT_EQ(GetDeadlineUs(Operation::COMPRESS, 4096), 1000u);
+  EXPECT_EQ(GetDeadlineUs(Operation::COMPRESS, 1 << 20), 5000u);
+  EXPECT_EQ(GetDeadlineUs(Operation::UNCOMPRESS, 1000), 200u);
+  EXPECT_EQ(GetDeadlineUs(Operation::UNCOMPRESS, 100000), 0u);
+}
+
+TEST_F(HedgeTest, CallFinishesBeforeDeadline) {
+  uint8_t input[100];
+  uint8_t output[100] = {};
+  memset(input, 'a', sizeof(input));
+  uint32_t input_length = sizeof(input);
+  uint32_t output_length = sizeof(output);
+  bool end_of_stream = false;
+  int ret = RunWithDeadline(
+      [](uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t* out_len,
+         bool* eos) {
+        memcpy(out, in, *in_len / 2);
+        *in_len /= 2;
+        *out_len = *in_len;
+        *eos = true;
+        return 0;
+      },
+      input, &input_length, output, &output_length, 0, &end_of_stream,
+      1000000);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(input_length, 50u);
+  ASSERT_EQ(output_length, 50u);
+  ASSERT_TRUE(end_of_stream);
+  ASSERT_TRUE(memcmp(input, output, 50) == 0);
+  ASSERT_EQ(output[50], 0);
+}
+
+TEST_F(HedgeTest, StalledCallAbandoned) {
+  std::vector<uint8_t> input(100, 'a');
+  std::vector<uint8_t> output(100, 0);
+  uint32_t input_length = 100;
+  uint32_t output_length = 100;
+  std::atomic<bool> call_done{false};
+  auto start = std::chrono::steady_clock::now();
+  int ret = RunWithDeadline(
+      [&call_done](uint8_t* in, uint32_t* in_len, uint8_t* out,
+                   uint32_t* out_len, bool*) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        memcpy(out, in, *in_len);
+        *out_len = *in_len;
+        call_done = true;
+        return 0;
+      },
+      input.data(), &input_length, output.data(), &output_length, 0, nullptr,
+      10000);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  ASSERT_EQ(ret, 1);
+  ASSERT_LT(elapsed, std::chrono::milliseconds(200));
+  ASSERT_EQ(output_length, 100u);
+
+  // The caller's buffers are not used by the abandoned call
+  input.clear();
+  input.shrink_to_fit();
+  while (!call_done) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(output, std::vector<uint8_t>(100, 0));
+}
+
+TEST_F(HedgeTest, OutputCopySizedToBound) {
+  uint8_t input[100];
+  std::vector<uint8_t> output(1 << 20);
+  memset(input, 'a', sizeof(input));
+  uint32_t input_length = sizeof(input);
+  uint32_t output_length = output.size();
+  uint32_t call_output_length = 0;
+  int ret = RunWithDeadline(
+      [&call_output_length](uint8_t* in, uint32_t* in_len, uint8_t* out,
+                            uint32_t* out_len, bool*) {
+        call_output_length = *out_len;
+        memcpy(out, in, *in_len);
+        *out_len = *in_len;
+        return 0;
+      },
+      input, &input_length, output.data(), &output_length, 200, nullptr,
+      1000000);
+  ASSERT_EQ(ret, 0);
+  ASSERT_EQ(call_output_length, 200u);
+  ASSERT_EQ(output_length, 100u);
+  ASSERT_TRUE(memcmp(input, output.data(), 100) == 0);
+}
+
+TEST_F(HedgeTest, BlockedWorkersReplaced) {
+  uint8_t input[100] = {};
+  uint8_t output[100];
+  std::atomic<bool> release{false};
+  std::atomic<int> running{0};
+  auto stalled_call = [&release, &running](uint8_t*, uint32_t*, uint8_t*,
+                                           uint32_t*, bool*) {
+    running++;
+    while (!release) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    running--;
+    return 0;
+  };
+  auto call = [](uint8_t*, uint32_t*, uint8_t*, uint32_t* out_len, bool*) {
+    *out_len = 0;
+    return 0;
+  };
+
+  // The 8 workers are replaced when blocked on hung calls, up to 16 workers,
+  // so that other calls still run with a deadline
+  uint32_t input_length = sizeof(input);
+  uint32_t output_length = sizeof(output);
+  for (int i = 0; i < 16; i++) {
+    ASSERT_EQ(RunWithDeadline(stalled_call, input, &input_length, output,
+                              &output_length, 0, nullptr, 1000),
+              1);
+    output_length = sizeof(output);
+    ASSERT_EQ(RunWithDeadline(call, input, &input_length, output,
+                              &output_length, 0, nullptr, 1000000),
+              i < 15 ? 0 : HEDGE_NOT_RUN);
+  }
+  // With all workers blocked, calls are not run, rather than counted as
+  // accelerator failures
+  ASSERT_EQ(RunWithDeadline(stalled_call, input, &input_length, output,
+                            &output_length, 0, nullptr, 1000),
+            HEDGE_NOT_RUN);
+
+  release = true;
+  while (running > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  // The workers that were replaced exit, and the others run calls again
+  output_length = sizeof(output);
+  ASSERT_EQ(RunWithDeadline(call, input, &input_length, output,
+                            &output_length, 0, nullptr, 1000000),
+            0);
+}
+
+class RoutingPolicyTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SetConfig(USE_ZLIB_COMPRESS, 1);
+    SetConfig(USE_ZLIB_UNCOMPRESS, 1);
+  }
+  void TearDown() override { LoadRoutingPolicy({}); }
+};
+
+TEST_F(RoutingPolicyTest, SelectFromRules) {
+  std::map<std::string, std::string> rules = {
+      {"route.compress.*.*.*", "qat"},
+      {"route.compress.deflate.gzip.0-4095", "zlib"},
+      {"route.compress.compress2.*.65536-", "iaa:1,qat:0"},
+      {"route.uncompress.inflate.zlib.*", "iaa, qat"},
+      // Invalid rules
+      {"route.compress.inflate.*.*", "qat"},
+      {"route.compress.deflate.*.10-5", "qat"},
+      {"route.compress.deflate.*.*", "gpu"},
+      {"route.compress.deflate.*", "qat"}};
+  EXPECT_EQ(LoadRoutingPolicy(rules), 4);
+
+  // More specific rules take precedence
+  EXPECT_EQ(SelectPath(EntryPoint::DEFLATE, 31, true, true, 1000), ZLIB);
+  EXPECT_EQ(SelectPath(EntryPoint::DEFLATE, 31, true, true, 4096), QAT);
+  EXPECT_EQ(SelectPath(EntryPoint::DEFLATE, -15, true, true, 1000), QAT);
+  EXPECT_EQ(SelectPath(EntryPoint::GZWRITE, 31, true, true, 1000), QAT);
+  // Only listed engines that support the call are selected
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, 15, true, true, 100000), IAA);
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, 15, false, true, 100000), ZLIB);
+  EXPECT_EQ(SelectPath(EntryPoint::COMPRESS2, 15, true, true, 1000), QAT);
+  EXPECT_EQ(SelectPath(EntryPoint::INFLATE, 15, true, true, 100), IAA);
+  EXPECT_EQ(SelectPath(EntryPoint::INFLATE, 15, false, true, 100), QAT);
+  EXPECT_EQ(SelectPath(EntryPoint::INFLATE, 15, false, false, 100), ZLIB);
+  // No rule
+  EXPECT_EQ(SelectPath(EntryPoint::UNCOMPRESS2, 15, true, true, 100), IAA);
+  EXPECT_EQ(SelectPath(EntryPoint::GZREAD, 31, true, true, 100), QAT);
+}
+
+TEST_F(RoutingPolicyTest, WeightedEngines) {
+  EXPECT_EQ(
+      LoadRoutingPolicy({{"route.compress.gzwrite.gzip.*", "qat:3,iaa:1"}}),
+      1);
+  std::map<ExecutionPath, int> paths;
+  for (int i = 0; i < 4000; i++) {
+    paths[SelectPath(EntryPoint::GZWRITE, 31, true, true, 100000)]++;
+  }
+  EXPECT_GT(paths[QAT], 2700);
+  EXPECT_LT(paths[QAT], 3300);
+  EXPECT_EQ(paths[QAT] + paths[IAA], 4000);
+}
+
+TEST_F(RoutingPolicyTest, LoadFromConfigFile) {
+  std::string config_path = "/tmp/zlib_accel_routing_config";
+  std::ofstream config_file(config_path);
+  config_file << "route.uncompress.* . * . 0-1023 = zlib\n";
+  config_file << "route.uncompress.*.*.1024- = qat  # comment\n";
+  config_file.close();
+
+  std::string file_content;
+  EXPECT_TRUE(LoadConfigFile(file_content, config_path.c_str()));
+  std::filesystem::remove(config_path);
+  EXPECT_EQ(SelectPath(EntryPoint::UNCOMPRESS2, 15, true, true, 1023), ZLIB);
+  EXPECT_EQ(SelectPath(EntryPoint::GZREAD, 31, true, true, 1024), QAT);
+}
+
+class ConfigLoaderTest : public ::testing::Test {};
+
+void CreateAndWriteTempConfigFile(const char* file_path) {
+  std::ofstream temp_file(file_path);
+  temp_file << "use_qat_compress=5000\n";
+  temp_file << "use_qat_uncompress=aaaa\n";
+  temp_file << "use_iaa_compress=!0\n";
+  temp_file << "use_iaa_compress=!0\n";
+  temp_file << "use_zlib_compress=!0222\n";
+  temp_file << "use_zlib_uncompress=AB23\n";
+  temp_file << "log_level=10\n";
+  temp_file << "log_stats_samples=4294967296\n";
+  temp_file.close();
+}
+
+TEST_F(ConfigLoaderTest, LoadInvalidConfig) {
+  std::string file_content;
+  uint32_t DEFAULT_QAT_COMPRESS = GetConfig(USE_QAT_COMPRESS);
+  uint32_t DEFAULT_QAT_UNCOMPRESS = GetConfig(USE_QAT_UNCOMPRESS);
+  uint32_t DEFAULT_IAA_COMPRESS = GetConfig(USE_IAA_COMPRESS);
+  uint32_t DEFAULT_IAA_UNCOMPRESS = GetConfig(USE_IAA_UNCOMPRESS);
+  uint32_t DEFAULT_ZLIB_COMPRESS = GetConfig(USE_ZLIB_COMPRESS);
+  uint32_t DEFAULT_ZLIB_UNCOMPRESS = GetConfig(USE_ZLIB_UNCOMPRESS);
+  uint32_t DEFAULT_LOG_LEVEL = GetConfig(LOG_LEVEL);
+  uint32_t DEFAULT_LOG_STATS_SAMPLES = GetConfig(LOG_STATS_SAMPLES);
+
+  CreateAndWriteTempConfigFile("/tmp/invalid_config");
+  EXPECT_TRUE(LoadConfigFile(file_content, "/tmp/invalid_config"));
+  EXPECT_EQ(GetConfig(USE_QAT_COMPRESS), DEFAULT_QAT_COMPRESS);
+  EXPECT_EQ(GetConfig(USE_QAT_UNCOMPRESS), DEFAULT_QAT_UNCOMPRESS);
+  EXPECT_EQ(GetConfig(USE_IAA_COMPRESS), DEFAULT_IAA_COMPRESS);
+  EXPECT_EQ(GetConfig(USE_IAA_UNCOMPRESS), DEFAULT_IAA_UNCOMPRESS);
+  EXPECT_EQ(GetConfig(USE_ZLIB_COMPRESS), DEFAULT_ZLIB_COMPRESS);
+  EXPECT_EQ(GetConfig(USE_ZLIB_UNCOMPRESS), DEFAULT_ZLIB_UNCOMPRESS);
+  EXPECT_EQ(GetConfig(LOG_LEVEL), DEFAULT_LOG_LEVEL);
+  EXPECT_EQ(GetConfig(LOG_STATS_SAMPLES), DEFAULT_LOG_STATS_SAMPLES);
+  std::remove("/tmp/invalid_config");
+  // Restore config from official config file
+  LoadConfigFile(file_content);
+}
+
+TEST_F(ConfigLoaderTest, LoadValidConfig) {
+  std::string file_content;
+  EXPECT_TRUE(LoadConfigFile(file_content, "../../config/default_config"));
+  EXPECT_EQ(GetConfig(USE_QAT_COMPRESS), 1);
+  EXPECT_EQ(GetConfig(USE_QAT_UNCOMPRESS), 1);
+  EXPECT_EQ(GetConfig(USE_IAA_COMPRESS), 0);
+  EXPECT_EQ(GetConfig(USE_IAA_UNCOMPRESS), 0);
+  EXPECT_EQ(GetConfig(USE_ZLIB_COMPRESS), 1);
+  EXPECT_EQ(GetConfig(USE_ZLIB_UNCOMPRESS), 1);
+  EXPECT_EQ(GetConfig(LOG_LEVEL), 2);
+  LoadConfigFile(file_content);
+}
+
+TEST_F(ConfigLoaderTest, SymbolicLinkTest) {
+  std::string file_content;
+  std::filesystem::path target_path = "/tmp/target_file_path";
+  std::filesystem::path symlink_path = "symlink_to_target";
+  // create a real/target file
+  std::ofstream target_file(target_path);
+  target_file.close();
+  // create a symlink for the target file
+  std::filesystem::create_symlink(target_path, symlink_path);
+  EXPECT_FALSE(LoadConfigFile(file_content, symlink_path.c_str()));
+  std::filesystem::remove(symlink_path);
+  std::filesystem::remove(target_path);
+}
+
+class StreamTableTest : public ::testing::Test {};
+
+// Distinct aligned keys, as stream pointers are
+static int* StreamKey(size_t i) {
+  return reinterpret_cast<int*>((i + 1) * 16);
+}
+
+TEST_F(StreamTableTest, SetGetUnset) {
+  StreamTable<int*, int> table;
+  EXPECT_EQ(table.Get(StreamKey(0)), nullptr);
+  int* value = table.Set(StreamKey(0), std::make_unique<int>(1));
+  ASSERT_NE(value, nullptr);
+  EXPECT_EQ(table.Get(StreamKey(0)), value);
+  EXPECT_EQ(*table.Get(StreamKey(0)), 1);
+
+  // Overwriting a key replaces the cached lookup too
+  table.Set(StreamKey(0), std::make_unique<int>(2));
+  EXPECT_EQ(*table.Get(StreamKey(0)), 2);
+
+  table.Unset(StreamKey(0));
+  EXPECT_EQ(table.Get(StreamKey(0)), nullptr);
+  table.Unset(StreamKey(0));
+
+  EXPECT_EQ(table.Set(nullptr, std::make_unique<int>(3)), nullptr);
+  EXPECT_EQ(table.Get(nullptr), nullptr);
+}
+
+TEST_F(StreamTableTest, GrowAndReuseTombstones) {
+  StreamTable<int*, int> table;
+  size_t initial_capacity = table.GetCapacity();
+  size_t count = 100000;
+  for (size_t i = 0; i < count; i++) {
+    table.Set(StreamKey(i), std::make_unique<int>(i));
+  }
+  EXPECT_GE(table.GetCapacity(), count);
+  for (size_t i = 0; i < count; i++) {
+    int* value = table.Get(StreamKey(i));
+    ASSERT_NE(value, nullptr);
+    ASSERT_EQ(*value, static_cast<int>(i));
+  }
+  for (size_t i = 0; i < count; i++) {
+    table.Unset(StreamKey(i));
+  }
+  for (size_t i = 0; i < count; i++) {
+    ASSERT_EQ(table.Get(StreamKey(i)), nullptr);
+  }
+
+  // Keys created and removed continuously do not grow the table
+  StreamTable<int*, int> churn_table;
+  for (size_t i = 0; i < count; i++) {
+    churn_table.Set(StreamKey(i), std::make_unique<int>(i));
+    if (i >= 10) {
+      churn_table.Unset(StreamKey(i - 10));
+    }
+  }
+  EXPECT_EQ(churn_table.GetCapacity(), initial_capacity);
+  for (size_t i = count - 10; i < count; i++) {
+    ASSERT_NE(churn_table.Get(StreamKey(i)), nullptr);
+  }
+}
+
+TEST_F(StreamTableTest, CachedLookupInvalidatedByOtherThread) {
+  StreamTable<int*, int> table;
+  table.Set(StreamKey(0), std::make_unique<int>(1));
+  EXPECT_EQ(*table.Get(StreamKey(0)), 1);
+
+  std::thread thread([&table]() {
+    table.Unset(StreamKey(0));
+    table.Set(StreamKey(0), std::make_unique<int>(2));
+  });
+  thread.join();
+  EXPECT_EQ(*table.Get(StreamKey(0)), 2);
+
+  // Lookups are cached per table
+  StreamTable<int*, int> other_table;
+  EXPECT_EQ(other_table.Get(StreamKey(0)), nullptr);
+}
+
+TEST_F(StreamTableTest, ConcurrentOperations) {
+  StreamTable<int*, int> table;
+  size_t keys_per_thread = 2000;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 8; t++) {
+    threads.emplace_back([&table, t, keys_per_thread]() {
+      size_t first = t * keys_per_thread;
+      for (int round = 0; round < 5; round++) {
+        for (size_t i = first; i < first + keys_per_thread; i++) {
+          table.Set(StreamKey(i), std::make_unique<int>(i + round));
+        }
+        for (size_t i = first; i < first + keys_per_thread; i++) {
+          int* value = table.Get(StreamKey(i));
+          ASSERT_NE(value, nullptr);
+          ASSERT_EQ(*value, static_cast<int>(i) + round);
+        }
+        for (size_t i = first; i < first + keys_per_thread; i += 2) {
+          table.Unset(StreamKey(i));
+          ASSERT_EQ(table.Get(StreamKey(i)), nullptr);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < 8 * keys_per_thread; i++) {
+    int* value = table.Get(StreamKey(i));
+    if (i % 2 == 0) {
+      EXPECT_EQ(value, nullptr);
+    } else {
+      ASSERT_NE(value, nullptr);
+      EXPECT_EQ(*value, static_cast<int>(i) + 4);
+    }
+  }
+}
+
+class SlabAllocatorTest : public ::testing::Test {};
+
+// Each test uses its own type, so that it has its own arenas
+template <int N>
+struct SlabObject : SlabAllocated<SlabObject<N>> {
+  explicit SlabObject(int _value) : value(_value) {}
+  int value;
+  char data[100];
+};
+
+TEST_F(SlabAllocatorTest, ObjectsReused) {
+  std::vector<std::unique_ptr<SlabObject<0>>> objects;
+  for (int i = 0; i < 2000; i++) {
+    objects.push_back(std::make_unique<SlabObject<0>>(i));
+    // Objects are in separate cache lines
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(objects.back().get()) %
+                  CACHE_LINE_SIZE,
+              0u);
+  }
+  for (int i = 0; i < 2000; i++) {
+    EXPECT_EQ(objects[i]->value, i);
+  }
+  SlabObject<0>* freed = objects.back().get();
+  objects.pop_back();
+  auto object = std::make_unique<SlabObject<0>>(1);
+  EXPECT_EQ(object.get(), freed);
+}
+
+TEST_F(SlabAllocatorTest, FreedByOtherThread) {
+  auto object = std::make_unique<SlabObject<1>>(1);
+  SlabObject<1>* ptr = object.get();
+  std::thread thread([&object]() { object.reset(); });
+  thread.join();
+  // Returned to the arena of this thread
+  auto reused = std::make_unique<SlabObject<1>>(2);
+  EXPECT_EQ(reused.get(), ptr);
+  EXPECT_EQ(reused->value, 2);
+}
+
+TEST_F(SlabAllocatorTest, ArenaAdoptedAfterThreadExit) {
+  SlabObject<2>* ptr = nullptr;
+  std::thread thread([&ptr]() {
+    auto object = std::make_unique<SlabObject<2>>(1);
+    ptr = object.get();
+  });
+  thread.join();
+  std::unique_ptr<SlabObject<2>> reused;
+  std::thread other_thread(
+      [&reused]() { reused = std::make_unique<SlabObject<2>>(2); });
+  other_thread.join();
+  EXPECT_EQ(reused.get(), ptr);
+}
+
+TEST_F(SlabAllocatorTest, ConcurrentAllocateAndFree) {
+  // Objects are allocated by producers and freed by consumers
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<SlabObject<3>>> queue;
+  std::atomic<int> produced{0};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&]() {
+      for (int i = 0; i < 10000; i++) {
+        auto object = std::make_unique<SlabObject<3>>(i);
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(object));
+      }
+      produced++;
+    });
+    threads.emplace_back([&]() {
+      while (true) {
+        std::unique_ptr<SlabObject<3>> object;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (queue.empty()) {
+            if (produced == 4) {
+              return;
+            }
+            continue;
+          }
+          object = std::move(queue.back());
+          queue.pop_back();
+        }
+        ASSERT_GE(object->value, 0);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_TRUE(queue.empty());
 }
 
 int main(int argc, char* argv[]) {
@@ -3,6 +3,13 @@
 
 #include "utils.h"
 
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <new>
+
 CompressedFormat GetCompressedFormat(int window_bits) {
   if (window_bits >= -15 && window_bits <= -8) {
     return CompressedFormat::DEFLATE_RAW;
@@ -48,6 +55,25 @@ int GetWindowSizeFromZlibHeader(uint8_t* data, uint32_t len) {
   return 15;
 }
 
+int DetectWindowBits(int window_bits, const uint8_t* data, uint32_t len) {
+  int bits = window_bits - 32;
+  if ((bits != 0 && (bits < 8 || bits > 15)) || len < 2) {
+    return window_bits;
+  }
+  if (data[0] == 31 && data[1] == 139) {
+    return 16 + (bits == 0 ? 15 : bits);
+  }
+  if ((data[0] & 0x0F) == Z_DEFLATED && (data[0] >> 4) <= 7 &&
+      ((data[0] << 8) | data[1]) % 31 == 0) {
+    int header_bits = (data[0] >> 4) + 8;
+    // zlib rejects a window larger than requested
+    if (bits == 0 || header_bits <= bits) {
+      return bits == 0 ? header_bits : bits;
+    }
+  }
+  return window_bits;
+}
+
 bool DetectGzipExt(uint8_t* data, uint32_t len, uint32_t* src_size,
                    uint32_t* dest_size) {
   // Standard header
@@ -88,3 +114,814 @@ bool DetectGzipExt(uint8_t* data, uint32_t len, uint32_t* src_size,
   *dest_size = *(reinterpret_cast<uint32_t*>(data + 20));
   return true;
 }
+
+// Max expansion of deflate (258-byte matches coded on 2 bits)
+inline constexpr uint64_t MAX_DEFLATE_RATIO = 1032;
+
+uint32_t PredictUncompressedSize(CompressedFormat format, uint8_t* data,
+                                 uint32_t len) {
+  if (format != CompressedFormat::GZIP) {
+    return 0;
+  }
+  uint32_t src_size;
+  uint32_t dest_size;
+  if (DetectGzipExt(data, len, &src_size, &dest_size)) {
+    return static_cast<uint64_t>(dest_size) + GZIP_EXT_HDRFTR_SIZE <= len
+               ? src_size
+               : 0;
+  }
+
+  uint32_t header_length = GetHeaderLength(format);
+  uint32_t trailer_length = GetTrailerLength(format);
+  if (len < header_length + trailer_length || data[0] != 31 ||
+      data[1] != 139) {
+    return 0;
+  }
+  uint32_t isize = 0;
+  for (int i = 0; i < 4; i++) {
+    isize |= static_cast<uint32_t>(data[len - 4 + i]) << (8 * i);
+  }
+  // If data continues past the member, the last bytes are not the trailer.
+  // Sizes that the compressed data cannot decode to are discarded.
+  uint64_t payload_length = len - header_length - trailer_length;
+  if (payload_length > isize + (isize >> 10) + 64 ||
+      isize > payload_length * MAX_DEFLATE_RATIO + 64) {
+    return 0;
+  }
+  return isize;
+}
+
+int GetRawWindowBits(int window_bits) {
+  int bits;
+  switch (GetCompressedFormat(window_bits)) {
+    case CompressedFormat::ZLIB:
+      bits = window_bits;
+      break;
+    case CompressedFormat::GZIP:
+      bits = window_bits - 16;
+      break;
+    default:
+      return window_bits;
+  }
+  // zlib does not accept a window of 8 bits for raw deflate
+  return bits < 9 ? -9 : -bits;
+}
+
+bool EngineLengthSupported(uint64_t len) { return len <= UINT32_MAX; }
+
+uint32_t WriteStreamHeader(uint8_t* output, CompressedFormat format,
+                           int window_bits, int level, int strategy) {
+  if (level == Z_DEFAULT_COMPRESSION) {
+    level = 6;
+  }
+
+  // Same headers as written by zlib deflate()
+  switch (format) {
+    case CompressedFormat::ZLIB: {
+      int bits = window_bits < 9 ? 9 : window_bits;
+      uint32_t header = (Z_DEFLATED + ((bits - 8) << 4)) << 8;
+      uint32_t level_flags;
+      if (strategy >= Z_HUFFMAN_ONLY || level < 2) {
+        level_flags = 0;
+      } else if (level < 6) {
+        level_flags = 1;
+      } else if (level == 6) {
+        level_flags = 2;
+      } else {
+        level_flags = 3;
+      }
+      header |= (level_flags << 6);
+      header += 31 - (header % 31);
+      output[0] = static_cast<uint8_t>(header >> 8);
+      output[1] = static_cast<uint8_t>(header & 0xFF);
+      return 2;
+    }
+    case CompressedFormat::GZIP: {
+      output[0] = 31;  // ID1
+      output[1] = 139;  // ID2
+      output[2] = Z_DEFLATED;  // CM
+      output[3] = 0;  // FLG
+      output[4] = output[5] = output[6] = output[7] = 0;  // MTIME
+      if (level == 9) {
+        output[8] = 2;  // XFL
+      } else if (strategy >= Z_HUFFMAN_ONLY || level < 2) {
+        output[8] = 4;
+      } else {
+        output[8] = 0;
+      }
+      output[9] = 3;  // OS (Unix)
+      return 10;
+    }
+    default:
+      return 0;
+  }
+}
+
+uint32_t WriteStreamTrailer(uint8_t* output, CompressedFormat format,
+                            uint32_t checksum, uint32_t input_size) {
+  switch (format) {
+    case CompressedFormat::ZLIB:
+      // Adler-32, most significant byte first
+      output[0] = static_cast<uint8_t>(checksum >> 24);
+      output[1] = static_cast<uint8_t>(checksum >> 16);
+      output[2] = static_cast<uint8_t>(checksum >> 8);
+      output[3] = static_cast<uint8_t>(checksum);
+      return 4;
+    case CompressedFormat::GZIP:
+      // CRC-32 and ISIZE, least significant byte first
+      for (int i = 0; i < 4; i++) {
+        output[i] = static_cast<uint8_t>(checksum >> (8 * i));
+        output[i + 4] = static_cast<uint8_t>(input_size >> (8 * i));
+      }
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+uint32_t InitialChecksum(CompressedFormat format) {
+  if (format == CompressedFormat::ZLIB) {
+    return adler32(0, Z_NULL, 0);
+  } else if (format == CompressedFormat::GZIP) {
+    return crc32(0, Z_NULL, 0);
+  }
+  return 0;
+}
+
+uint32_t UpdateChecksum(CompressedFormat format, uint32_t checksum,
+                        const uint8_t* data, uint32_t len) {
+  if (format == CompressedFormat::ZLIB) {
+    return adler32(checksum, data, len);
+  } else if (format == CompressedFormat::GZIP) {
+    return crc32(checksum, data, len);
+  }
+  return checksum;
+}
+
+uint32_t CombineChecksum(CompressedFormat format, uint32_t checksum1,
+                         uint32_t checksum2, uint32_t len2) {
+  if (format == CompressedFormat::ZLIB) {
+    return adler32_combine(checksum1, checksum2, len2);
+  } else if (format == CompressedFormat::GZIP) {
+    return crc32_combine(checksum1, checksum2, len2);
+  }
+  return checksum1;
+}
+
+uint32_t WriteEmptyStoredBlock(uint8_t* output) {
+  // BFINAL = 0, BTYPE = 00, padding, LEN = 0, NLEN = 0xFFFF
+  output[0] = 0;
+  output[1] = 0;
+  output[2] = 0;
+  output[3] = 0xFF;
+  output[4] = 0xFF;
+  return EMPTY_STORED_BLOCK_SIZE;
+}
+
+uint32_t WriteFinalEmptyBlock(uint8_t* output) {
+  // BFINAL = 1, BTYPE = 01, end-of-block code (7 zero bits), padding
+  output[0] = 0x03;
+  output[1] = 0;
+  return FINAL_EMPTY_BLOCK_SIZE;
+}
+
+bool EndsWithSyncMarker(const uint8_t* data, uint32_t len) {
+  return len >= 4 && data[len - 4] == 0 && data[len - 3] == 0 &&
+         data[len - 2] == 0xFF && data[len - 1] == 0xFF;
+}
+
+// Max length of a stored block
+inline constexpr uint32_t MAX_STORED_BLOCK_LENGTH = 65535;
+inline constexpr uint32_t STORED_BLOCK_HEADER_SIZE = 5;
+
+uint64_t StoredBlocksBound(uint32_t len) {
+  uint64_t blocks = len / MAX_STORED_BLOCK_LENGTH + 1;
+  return len + blocks * STORED_BLOCK_HEADER_SIZE;
+}
+
+uint32_t WriteStoredBlocks(uint8_t* output, const uint8_t* input,
+                           uint32_t len) {
+  uint32_t pos = 0;
+  do {
+    uint32_t block_len = std::min(len, MAX_STORED_BLOCK_LENGTH);
+    len -= block_len;
+    // BFINAL, BTYPE = 00, padding, LEN, NLEN
+    output[pos++] = (len == 0) ? 1 : 0;
+    output[pos++] = block_len & 0xFF;
+    output[pos++] = (block_len >> 8) & 0xFF;
+    output[pos++] = ~block_len & 0xFF;
+    output[pos++] = (~block_len >> 8) & 0xFF;
+    memcpy(output + pos, input, block_len);
+    pos += block_len;
+    input += block_len;
+  } while (len > 0);
+  return pos;
+}
+
+// Entropy in bits per byte above which data is considered random. The entropy
+// estimated from a sample of uniformly random bytes is about 7.95.
+inline constexpr double INCOMPRESSIBLE_MIN_ENTROPY = 7.9;
+// Data is considered compressible if more than 1/64 of the 4-byte sequences in
+// the sample repeat a previous one
+inline constexpr uint32_t INCOMPRESSIBLE_MAX_MATCH_RATIO = 64;
+inline constexpr int SAMPLE_SEGMENTS = 8;
+inline constexpr int MATCH_HASH_BITS = 12;
+
+bool IsLikelyIncompressible(const uint8_t* data, uint32_t len) {
+  if (len < INCOMPRESSIBLE_SAMPLE_SIZE) {
+    return false;
+  }
+
+  // Segments spread over the whole input
+  uint8_t sample[INCOMPRESSIBLE_SAMPLE_SIZE];
+  const uint32_t segment_size = INCOMPRESSIBLE_SAMPLE_SIZE / SAMPLE_SEGMENTS;
+  const uint32_t stride = (len - segment_size) / (SAMPLE_SEGMENTS - 1);
+  for (int i = 0; i < SAMPLE_SEGMENTS; i++) {
+    memcpy(sample + i * segment_size, data + i * stride, segment_size);
+  }
+
+  // Separate histograms avoid dependencies between consecutive increments
+  uint32_t histograms[4][256] = {};
+  for (uint32_t i = 0; i < INCOMPRESSIBLE_SAMPLE_SIZE; i += 4) {
+    histograms[0][sample[i]]++;
+    histograms[1][sample[i + 1]]++;
+    histograms[2][sample[i + 2]]++;
+    histograms[3][sample[i + 3]]++;
+  }
+  double sum = 0;
+  for (int i = 0; i < 256; i++) {
+    uint32_t count = histograms[0][i] + histograms[1][i] + histograms[2][i] +
+                     histograms[3][i];
+    if (count > 0) {
+      sum += count * std::log2(static_cast<double>(count));
+    }
+  }
+  double entropy = std::log2(static_cast<double>(INCOMPRESSIBLE_SAMPLE_SIZE)) -
+                   sum / INCOMPRESSIBLE_SAMPLE_SIZE;
+  if (entropy < INCOMPRESSIBLE_MIN_ENTROPY) {
+    return false;
+  }
+
+  uint16_t positions[1 << MATCH_HASH_BITS] = {};
+  uint32_t matches = 0;
+  for (uint32_t i = 1; i + 4 <= INCOMPRESSIBLE_SAMPLE_SIZE; i++) {
+    uint32_t sequence;
+    memcpy(&sequence, sample + i, sizeof(sequence));
+    uint32_t hash = (sequence * 2654435761U) >> (32 - MATCH_HASH_BITS);
+    uint32_t candidate = positions[hash];
+    if (candidate > 0 && memcmp(sample + candidate, &sequence, 4) == 0) {
+      matches++;
+    }
+    positions[hash] = static_cast<uint16_t>(i);
+  }
+  return matches * INCOMPRESSIBLE_MAX_MATCH_RATIO < INCOMPRESSIBLE_SAMPLE_SIZE;
+}
+
+namespace {
+
+constexpr int MAX_CODE_BITS = 15;
+constexpr int FAST_BITS = 9;
+constexpr int MAX_LIT_LEN_CODES = 288;
+constexpr int MAX_DIST_CODES = 30;
+
+constexpr uint8_t kLengthExtraBits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                          1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                          4, 4, 4, 4, 5, 5, 5, 5, 0};
+constexpr uint8_t kDistExtraBits[30] = {0, 0, 0,  0,  1,  1,  2,  2,  3,  3,
+                                        4, 4, 5,  5,  6,  6,  7,  7,  8,  8,
+                                        9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Reads bits least significant first, as laid out in deflate streams
+class BitReader {
+ public:
+  BitReader(const uint8_t* data, uint32_t len, uint64_t pos)
+      : data_(data), len_(len), pos_(pos) {}
+
+  uint64_t Position() const { return pos_; }
+  bool Available(uint32_t bits) const {
+    return pos_ + bits <= static_cast<uint64_t>(len_) * 8;
+  }
+  void Skip(uint64_t bits) { pos_ += bits; }
+  void AlignToByte() { pos_ = (pos_ + 7) & ~static_cast<uint64_t>(7); }
+
+  // Returns the next bits (up to 32) without consuming them. Bits past the
+  // end of the data read as zero.
+  uint32_t Peek(uint32_t bits) const {
+    uint64_t byte = pos_ >> 3;
+    uint64_t value = 0;
+    if (byte + 8 <= len_) {
+      memcpy(&value, data_ + byte, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      value = __builtin_bswap64(value);
+#endif
+    } else {
+      for (uint64_t i = 0; byte + i < len_; i++) {
+        value |= static_cast<uint64_t>(data_[byte + i]) << (8 * i);
+      }
+    }
+    value >>= (pos_ & 7);
+    return static_cast<uint32_t>(value & ((1ULL << bits) - 1));
+  }
+
+  bool Read(uint32_t bits, uint32_t* value) {
+    if (!Available(bits)) {
+      return false;
+    }
+    *value = Peek(bits);
+    pos_ += bits;
+    return true;
+  }
+
+ private:
+  const uint8_t* data_;
+  uint32_t len_;
+  uint64_t pos_;
+};
+
+// Canonical Huffman code. Codes up to FAST_BITS long are decoded with a
+// lookup table, longer codes one bit at a time.
+struct HuffmanCode {
+  uint16_t count[MAX_CODE_BITS + 1];
+  uint16_t symbol[MAX_LIT_LEN_CODES];
+  // (symbol << 4) | code length, 0 if the code is longer than FAST_BITS
+  uint16_t fast[1 << FAST_BITS];
+};
+
+// Returns 0 for a complete code, > 0 for an incomplete code and < 0 for an
+// over-subscribed code
+int BuildHuffmanCode(HuffmanCode* code, const uint8_t* lengths, int n) {
+  memset(code->count, 0, sizeof(code->count));
+  for (int i = 0; i < n; i++) {
+    code->count[lengths[i]]++;
+  }
+  memset(code->fast, 0, sizeof(code->fast));
+  if (code->count[0] == n) {
+    return 0;
+  }
+
+  int left = 1;
+  for (int len = 1; len <= MAX_CODE_BITS; len++) {
+    left <<= 1;
+    left -= code->count[len];
+    if (left < 0) {
+      return left;
+    }
+  }
+
+  uint16_t offsets[MAX_CODE_BITS + 1];
+  offsets[1] = 0;
+  for (int len = 1; len < MAX_CODE_BITS; len++) {
+    offsets[len + 1] = offsets[len] + code->count[len];
+  }
+  for (int i = 0; i < n; i++) {
+    if (lengths[i] != 0) {
+      code->symbol[offsets[lengths[i]]++] = static_cast<uint16_t>(i);
+    }
+  }
+
+  uint32_t next_code = 0;
+  int index = 0;
+  for (int len = 1; len <= FAST_BITS; len++) {
+    for (int i = 0; i < code->count[len]; i++) {
+      uint32_t reversed = 0;
+      for (int bit = 0; bit < len; bit++) {
+        reversed |= ((next_code >> bit) & 1) << (len - 1 - bit);
+      }
+      uint16_t entry = static_cast<uint16_t>((code->symbol[index] << 4) | len);
+      for (uint32_t j = reversed; j < (1U << FAST_BITS); j += (1U << len)) {
+        code->fast[j] = entry;
+      }
+      next_code++;
+      index++;
+    }
+    next_code <<= 1;
+  }
+  return left;
+}
+
+// Returns the decoded symbol, -1 if more input is needed or -2 for an invalid
+// code
+int DecodeSymbol(BitReader* reader, const HuffmanCode* code) {
+  uint16_t entry = code->fast[reader->Peek(FAST_BITS)];
+  if (entry != 0) {
+    uint32_t len = entry & 0xF;
+    if (!reader->Available(len)) {
+      return -1;
+    }
+    reader->Skip(len);
+    return entry >> 4;
+  }
+
+  int bits = 0;
+  int first = 0;
+  int index = 0;
+  for (int len = 1; len <= MAX_CODE_BITS; len++) {
+    if (!reader->Available(len)) {
+      return -1;
+    }
+    bits |= (reader->Peek(len) >> (len - 1)) & 1;
+    int count = code->count[len];
+    if (bits - count < first) {
+      reader->Skip(len);
+      return code->symbol[index + (bits - first)];
+    }
+    index += count;
+    first += count;
+    first <<= 1;
+    bits <<= 1;
+  }
+  return -2;
+}
+
+// Block parsing helpers return 1 when the block is complete, 0 if more input
+// is needed and -1 for invalid data
+int ToParseResult(int symbol) { return symbol == -1 ? 0 : -1; }
+
+int SkipStoredBlock(BitReader* reader) {
+  reader->AlignToByte();
+  uint32_t len;
+  uint32_t nlen;
+  if (!reader->Read(16, &len) || !reader->Read(16, &nlen)) {
+    return 0;
+  }
+  if (len != (~nlen & 0xFFFF)) {
+    return -1;
+  }
+  if (!reader->Available(len * 8)) {
+    return 0;
+  }
+  reader->Skip(len * 8);
+  return 1;
+}
+
+int SkipCodes(BitReader* reader, const HuffmanCode* lit_len,
+              const HuffmanCode* dist) {
+  for (;;) {
+    int symbol = DecodeSymbol(reader, lit_len);
+    if (symbol < 0) {
+      return ToParseResult(symbol);
+    }
+    if (symbol < 256) {
+      continue;
+    }
+    if (symbol == 256) {
+      return 1;
+    }
+
+    symbol -= 257;
+    if (symbol >= 29) {
+      return -1;
+    }
+    uint32_t extra = kLengthExtraBits[symbol];
+    if (!reader->Available(extra)) {
+      return 0;
+    }
+    reader->Skip(extra);
+
+    symbol = DecodeSymbol(reader, dist);
+    if (symbol < 0) {
+      return ToParseResult(symbol);
+    }
+    if (symbol >= MAX_DIST_CODES) {
+      return -1;
+    }
+    extra = kDistExtraBits[symbol];
+    if (!reader->Available(extra)) {
+      return 0;
+    }
+    reader->Skip(extra);
+  }
+}
+
+struct FixedCodes {
+  FixedCodes() {
+    uint8_t lengths[MAX_LIT_LEN_CODES];
+    int i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < MAX_LIT_LEN_CODES; i++) lengths[i] = 8;
+    BuildHuffmanCode(&lit_len, lengths, MAX_LIT_LEN_CODES);
+    for (i = 0; i < MAX_DIST_CODES; i++) lengths[i] = 5;
+    BuildHuffmanCode(&dist, lengths, MAX_DIST_CODES);
+  }
+
+  HuffmanCode lit_len;
+  HuffmanCode dist;
+};
+
+int ReadDynamicCodes(BitReader* reader, HuffmanCode* lit_len,
+                     HuffmanCode* dist) {
+  static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                    11, 4,  12, 3, 13, 2, 14, 1, 15};
+  uint32_t nlen;
+  uint32_t ndist;
+  uint32_t ncode;
+  if (!reader->Read(5, &nlen) || !reader->Read(5, &ndist) ||
+      !reader->Read(4, &ncode)) {
+    return 0;
+  }
+  nlen += 257;
+  ndist += 1;
+  ncode += 4;
+  if (nlen > 286 || ndist > MAX_DIST_CODES) {
+    return -1;
+  }
+
+  uint8_t lengths[MAX_LIT_LEN_CODES + MAX_DIST_CODES];
+  uint32_t index;
+  for (index = 0; index < 19; index++) {
+    uint32_t len = 0;
+    if (index < ncode && !reader->Read(3, &len)) {
+      return 0;
+    }
+    lengths[order[index]] = static_cast<uint8_t>(len);
+  }
+  HuffmanCode len_code;
+  if (BuildHuffmanCode(&len_code, lengths, 19) != 0) {
+    return -1;
+  }
+
+  index = 0;
+  while (index < nlen + ndist) {
+    int symbol = DecodeSymbol(reader, &len_code);
+    if (symbol < 0) {
+      return ToParseResult(symbol);
+    }
+    if (symbol < 16) {
+      lengths[index++] = static_cast<uint8_t>(symbol);
+      continue;
+    }
+
+    uint8_t len = 0;
+    uint32_t repeat;
+    if (symbol == 16) {
+      if (index == 0) {
+        return -1;
+      }
+      len = lengths[index - 1];
+      if (!reader->Read(2, &repeat)) {
+        return 0;
+      }
+      repeat += 3;
+    } else if (symbol == 17) {
+      if (!reader->Read(3, &repeat)) {
+        return 0;
+      }
+      repeat += 3;
+    } else {
+      if (!reader->Read(7, &repeat)) {
+        return 0;
+      }
+      repeat += 11;
+    }
+    if (index + repeat > nlen + ndist) {
+      return -1;
+    }
+    while (repeat--) {
+      lengths[index++] = len;
+    }
+  }
+
+  if (lengths[256] == 0) {
+    return -1;
+  }
+  // Incomplete codes are only allowed if they have a single symbol
+  int err = BuildHuffmanCode(lit_len, lengths, nlen);
+  if (err < 0 || (err > 0 && nlen - lit_len->count[0] != 1)) {
+    return -1;
+  }
+  err = BuildHuffmanCode(dist, lengths + nlen, ndist);
+  if (err < 0 || (err > 0 && ndist - dist->count[0] != 1)) {
+    return -1;
+  }
+  return 1;
+}
+
+}  // namespace
+
+DeflateParser::Status DeflateParser::Parse(const uint8_t* data, uint32_t len) {
+  static const FixedCodes fixed_codes;
+  if (done_) {
+    return Status::END_OF_STREAM;
+  }
+
+  BitReader reader(data, len, block_bit_);
+  for (;;) {
+    uint64_t block_start = reader.Position();
+    uint32_t header;
+    if (!reader.Read(3, &header)) {
+      return Status::NEED_MORE_INPUT;
+    }
+
+    int ret;
+    switch (header >> 1) {
+      case 0:
+        ret = SkipStoredBlock(&reader);
+        break;
+      case 1:
+        ret = SkipCodes(&reader, &fixed_codes.lit_len, &fixed_codes.dist);
+        break;
+      case 2: {
+        HuffmanCode lit_len;
+        HuffmanCode dist;
+        ret = ReadDynamicCodes(&reader, &lit_len, &dist);
+        if (ret == 1) {
+          ret = SkipCodes(&reader, &lit_len, &dist);
+        }
+        break;
+      }
+      default:
+        return Status::ERROR;
+    }
+    if (ret < 0) {
+      return Status::ERROR;
+    } else if (ret == 0) {
+      return Status::NEED_MORE_INPUT;
+    }
+
+    block_bit_ = reader.Position();
+    if (header & 1) {
+      final_block_bit_ = block_start;
+      end_bit_ = reader.Position();
+      done_ = true;
+      return Status::END_OF_STREAM;
+    }
+  }
+}
+
+void DeflateParser::Reset() {
+  block_bit_ = 0;
+  final_block_bit_ = 0;
+  end_bit_ = 0;
+  done_ = false;
+}
+
+int GetStreamHeaderLength(const uint8_t* data, uint32_t len,
+                          int window_bits) {
+  switch (GetCompressedFormat(window_bits)) {
+    case CompressedFormat::DEFLATE_RAW:
+      return 0;
+    case CompressedFormat::ZLIB: {
+      if (len < 2) {
+        return 0;
+      }
+      // CM must be deflate, the window must not be larger than configured and
+      // FDICT must not be set
+      if ((data[0] & 0xF) != Z_DEFLATED ||
+          (data[0] >> 4) + 8 > window_bits ||
+          ((data[0] << 8) | data[1]) % 31 != 0 || (data[1] & 0x20) != 0) {
+        return -1;
+      }
+      return 2;
+    }
+    case CompressedFormat::GZIP: {
+      if (len < 10) {
+        return 0;
+      }
+      uint8_t flags = data[3];
+      if (data[0] != 31 || data[1] != 139 || data[2] != Z_DEFLATED ||
+          (flags & 0xE0) != 0) {
+        return -1;
+      }
+      uint32_t pos = 10;
+      if (flags & 0x4) {  // FEXTRA
+        if (len < pos + 2) {
+          return 0;
+        }
+        pos += 2 + (data[pos] | (data[pos + 1] << 8));
+      }
+      // FNAME and FCOMMENT are zero-terminated strings
+      const uint8_t string_flags[] = {0x8, 0x10};
+      for (uint8_t flag : string_flags) {
+        if (flags & flag) {
+          if (pos >= len) {
+            return 0;
+          }
+          const uint8_t* end =
+              static_cast<const uint8_t*>(memchr(data + pos, 0, len - pos));
+          if (end == nullptr) {
+            return 0;
+          }
+          pos = static_cast<uint32_t>(end - data) + 1;
+        }
+      }
+      if (flags & 0x2) {  // FHCRC
+        pos += 2;
+      }
+      return pos <= len ? static_cast<int>(pos) : 0;
+    }
+    default:
+      return -1;
+  }
+}
+
+DeflateParser::Status StreamParser::Parse(const uint8_t* data, uint32_t len) {
+  if (header_length_ < 0) {
+    int header_length = GetStreamHeaderLength(data, len, window_bits_);
+    if (header_length < 0) {
+      return DeflateParser::Status::ERROR;
+    } else if (header_length == 0 && GetCompressedFormat(window_bits_) !=
+                                         CompressedFormat::DEFLATE_RAW) {
+      return DeflateParser::Status::NEED_MORE_INPUT;
+    }
+    header_length_ = header_length;
+  }
+
+  DeflateParser::Status status =
+      deflate_parser_.Parse(data + header_length_, len - header_length_);
+  if (status != DeflateParser::Status::END_OF_STREAM) {
+    return status;
+  }
+  stream_length_ = header_length_ + deflate_parser_.GetEndByte() +
+                   GetTrailerLength(GetCompressedFormat(window_bits_));
+  if (len < stream_length_) {
+    return DeflateParser::Status::NEED_MORE_INPUT;
+  }
+  return DeflateParser::Status::END_OF_STREAM;
+}
+
+bool ConvertToNonFinalSegment(uint8_t* data, uint32_t* len) {
+  DeflateParser parser;
+  if (parser.Parse(data, *len) != DeflateParser::Status::END_OF_STREAM) {
+    return false;
+  }
+
+  uint64_t final_block_bit = parser.GetFinalBlockBit();
+  data[final_block_bit >> 3] &= ~(1 << (final_block_bit & 7));
+
+  // The 3 header bits of the empty stored block (all zero) are followed by
+  // padding to the next byte boundary. If they fit in the last byte of the
+  // stream, they overlap its zero padding.
+  uint32_t pos = static_cast<uint32_t>(parser.GetEndBit() >> 3);
+  uint32_t used_bits = static_cast<uint32_t>(parser.GetEndBit() & 7);
+  if (used_bits > 0) {
+    data[pos] &= (1 << used_bits) - 1;
+    pos++;
+  }
+  if (used_bits == 0 || used_bits > 5) {
+    data[pos++] = 0;
+  }
+  data[pos++] = 0;
+  data[pos++] = 0;
+  data[pos++] = 0xFF;
+  data[pos++] = 0xFF;
+  *len = pos;
+  return true;
+}
+
+uint8_t* StagingBuffer::Reserve(uint32_t length) {
+  size_t pending = end_ - start_;
+  if (end_ + length <= capacity_) {
+    return data_.get() + end_;
+  }
+
+  if (pending + length <= capacity_) {
+    memmove(data_.get(), data_.get() + start_, pending);
+  } else {
+    std::unique_ptr<uint8_t[]> data(new (std::nothrow)
+                                        uint8_t[pending + length]);
+    if (data == nullptr) {
+      return nullptr;
+    }
+    if (pending > 0) {
+      memcpy(data.get(), data_.get() + start_, pending);
+    }
+    data_ = std::move(data);
+    capacity_ = pending + length;
+  }
+  start_ = 0;
+  end_ = pending;
+  return data_.get() + end_;
+}
+
+uint32_t StagingBuffer::Drain(uint8_t* output, uint32_t output_length) {
+  uint32_t len = Pending() < output_length ? Pending() : output_length;
+  if (len > 0) {
+    memcpy(output, data_.get() + start_, len);
+    start_ += len;
+  }
+  if (start_ == end_) {
+    start_ = end_ = 0;
+  }
+  return len;
+}
+
+void StagingBuffer::Release() {
+  data_.reset();
+  capacity_ = 0;
+  start_ = end_ = 0;
+}
+
+uint32_t FastRandom() {
+  // xorshift32, seeded from the address of the per-thread state
+  thread_local uint32_t state = 0;
+  if (state == 0) {
+    uint64_t seed = reinterpret_cast<uintptr_t>(&state);
+    state = static_cast<uint32_t>(seed ^ (seed >> 32)) | 1;
+  }
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
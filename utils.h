@@ -3,16 +3,153 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <memory>
 
 #define GZIP_EXT_XHDR_SIZE 14
 #define GZIP_EXT_HDRFTR_SIZE 32  // size of header + footer for gzip ext format
 
+// Non-final empty stored block, as emitted by zlib for Z_SYNC_FLUSH when the
+// output is already byte-aligned
+#define EMPTY_STORED_BLOCK_SIZE 5
+// Final empty block with fixed Huffman codes, as emitted by zlib when
+// finishing a stream after a flush
+#define FINAL_EMPTY_BLOCK_SIZE 2
+#define MAX_HEADER_SIZE 10
+#define MAX_TRAILER_SIZE 8
+
+inline constexpr size_t CACHE_LINE_SIZE = 64;
+
 enum class CompressedFormat { DEFLATE_RAW, ZLIB, GZIP, INVALID };
 
 CompressedFormat GetCompressedFormat(int window_bits);
 int GetTrailerLength(CompressedFormat format);
 int GetHeaderLength(CompressedFormat format, bool gzip_ext = false);
 int GetWindowSizeFromZlibHeader(uint8_t* data, uint32_t len);
+// With automatic header detection (inflate window bits 32 + bits, or 32 to use
+// the window size from the zlib header), returns the window bits of the format
+// found in the header. Otherwise, or if the header is not recognized, returns
+// window_bits.
+int DetectWindowBits(int window_bits, const uint8_t* data, uint32_t len);
 bool DetectGzipExt(uint8_t* data, uint32_t len, uint32_t* src_size,
                    uint32_t* dest_size);
+// Predicts the decompressed size of the first stream in data, from the QZ
+// extended header, or from the ISIZE field of the gzip trailer if data holds a
+// whole gzip member. Returns 0 if the size cannot be predicted.
+uint32_t PredictUncompressedSize(CompressedFormat format, uint8_t* data,
+                                 uint32_t len);
+
+// Window bits selecting the raw deflate format with the same history window
+int GetRawWindowBits(int window_bits);
+
+// Engines of the shim take 32-bit lengths. Longer inputs are left to zlib.
+bool EngineLengthSupported(uint64_t len);
+
+// Helpers for streams framed by the shim: the header and trailer are written
+// here, while the payload is made of raw deflate segments.
+uint32_t WriteStreamHeader(uint8_t* output, CompressedFormat format,
+                           int window_bits, int level, int strategy);
+uint32_t WriteStreamTrailer(uint8_t* output, CompressedFormat format,
+                            uint32_t checksum, uint32_t input_size);
+uint32_t InitialChecksum(CompressedFormat format);
+uint32_t UpdateChecksum(CompressedFormat format, uint32_t checksum,
+                        const uint8_t* data, uint32_t len);
+// Checksum of the concatenation of two inputs, from their checksums
+uint32_t CombineChecksum(CompressedFormat format, uint32_t checksum1,
+                         uint32_t checksum2, uint32_t len2);
+uint32_t WriteEmptyStoredBlock(uint8_t* output);
+uint32_t WriteFinalEmptyBlock(uint8_t* output);
+bool EndsWithSyncMarker(const uint8_t* data, uint32_t len);
+
+// Max size of data written as stored blocks, and writes it. The last block has
+// BFINAL set.
+uint64_t StoredBlocksBound(uint32_t len);
+uint32_t WriteStoredBlocks(uint8_t* output, const uint8_t* input, uint32_t len);
+
+// Estimates from a sample of the data whether deflate would not reduce its
+// size: the byte distribution is close to uniform and 4-byte sequences do not
+// repeat. Inputs smaller than the sample size are not checked.
+inline constexpr uint32_t INCOMPRESSIBLE_SAMPLE_SIZE = 4096;
+bool IsLikelyIncompressible(const uint8_t* data, uint32_t len);
+
+// Parses the block structure of a raw deflate stream without producing the
+// decompressed data. Parsing can be resumed when the buffer grows: the data
+// passed to each call must start with the same bytes as in the previous call.
+// Distances are not checked against the history window.
+class DeflateParser {
+ public:
+  enum class Status { NEED_MORE_INPUT, END_OF_STREAM, ERROR };
+
+  Status Parse(const uint8_t* data, uint32_t len);
+  void Reset();
+
+  // Valid after END_OF_STREAM
+  uint64_t GetFinalBlockBit() const { return final_block_bit_; }
+  uint64_t GetEndBit() const { return end_bit_; }
+  uint32_t GetEndByte() const {
+    return static_cast<uint32_t>((end_bit_ + 7) / 8);
+  }
+
+ private:
+  // Bit offset of the first block not fully parsed yet
+  uint64_t block_bit_ = 0;
+  uint64_t final_block_bit_ = 0;
+  uint64_t end_bit_ = 0;
+  bool done_ = false;
+};
+
+// Returns the length of the zlib or gzip header at the start of data, 0 if the
+// header is not complete yet, or -1 if the header is invalid or requires a
+// preset dictionary.
+int GetStreamHeaderLength(const uint8_t* data, uint32_t len, int window_bits);
+
+// Detects the end of a zlib, gzip or raw deflate stream, including the
+// trailer. As for DeflateParser, parsing can be resumed when the buffer grows.
+class StreamParser {
+ public:
+  explicit StreamParser(int window_bits) : window_bits_(window_bits) {}
+
+  DeflateParser::Status Parse(const uint8_t* data, uint32_t len);
+
+  // Valid after END_OF_STREAM
+  uint32_t GetStreamLength() const { return stream_length_; }
+
+ private:
+  int window_bits_;
+  int header_length_ = -1;
+  DeflateParser deflate_parser_;
+  uint32_t stream_length_ = 0;
+};
+
+// Turns a complete raw deflate stream into a non-final, byte-aligned segment,
+// by clearing BFINAL in its last block and appending an empty stored block.
+// The buffer must have room for EMPTY_STORED_BLOCK_SIZE more bytes.
+bool ConvertToNonFinalSegment(uint8_t* data, uint32_t* len);
+
+// Buffer for data produced by the shim that does not fit in the caller's
+// buffer yet. Data is appended at the end and drained from the front.
+class StagingBuffer {
+ public:
+  // Returns a pointer to at least length writable bytes at the end of the
+  // buffer. Commit the bytes actually written.
+  uint8_t* Reserve(uint32_t length);
+  void Commit(uint32_t length) { end_ += length; }
+  uint32_t Drain(uint8_t* output, uint32_t output_length);
+  uint32_t Pending() const { return static_cast<uint32_t>(end_ - start_); }
+  const uint8_t* Data() const { return data_.get() + start_; }
+  // Drops data from the front or from the end of the buffer
+  void Consume(uint32_t length) { start_ += length; }
+  void Truncate(uint32_t length) { end_ = start_ + length; }
+  void Clear() { start_ = end_ = 0; }
+  void Release();
+
+ private:
+  std::unique_ptr<uint8_t[]> data_;
+  size_t capacity_ = 0;
+  size_t start_ = 0;
+  size_t end_ = 0;
+};
+
+// Per-thread pseudo-random numbers, without the lock taken by std::rand
+uint32_t FastRandom();
@@ -0,0 +1,123 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#include "worker_pool.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+// Tasks of one RunTasks call. Tasks are claimed in order by the calling thread
+// and by the workers that joined the batch. A worker may join after all tasks
+// are done and the caller has returned, so the tasks are not accessed once
+// they are all claimed.
+struct TaskBatch {
+  explicit TaskBatch(const std::vector<std::function<void()>>& _tasks)
+      : tasks(_tasks.data()), count(_tasks.size()) {}
+
+  // Runs tasks until none are left to claim
+  void RunAvailable() {
+    size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < count) {
+      tasks[i]();
+      if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.notify_all();
+      }
+    }
+  }
+
+  const std::function<void()>* tasks;
+  const size_t count;
+  std::atomic<size_t> next{0};
+  std::atomic<size_t> done{0};
+  std::mutex mutex;
+  std::condition_variable finished;
+};
+
+class WorkerPool {
+ public:
+  // Asks up to count idle or new workers to join the batch
+  void Join(const std::shared_ptr<TaskBatch>& batch, int count);
+
+ private:
+  void Work();
+
+  std::mutex mutex_;
+  std::condition_variable batch_queued_;
+  std::deque<std::shared_ptr<TaskBatch>> queue_;
+  int workers_ = 0;
+  int idle_workers_ = 0;
+  // Workers do not survive fork, so the pool is restarted in the child
+  pid_t pid_ = 0;
+};
+
+void WorkerPool::Join(const std::shared_ptr<TaskBatch>& batch, int count) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (pid_ != getpid()) {
+    pid_ = getpid();
+    workers_ = 0;
+    idle_workers_ = 0;
+    queue_.clear();
+  }
+  for (int i = 0; i < count; i++) {
+    if (idle_workers_ <= static_cast<int>(queue_.size())) {
+      if (workers_ == MAX_POOL_WORKERS) {
+        break;
+      }
+      try {
+        std::thread(&WorkerPool::Work, this).detach();
+      } catch (const std::system_error& e) {
+        break;
+      }
+      workers_++;
+      idle_workers_++;
+    }
+    queue_.push_back(batch);
+    batch_queued_.notify_one();
+  }
+}
+
+void WorkerPool::Work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    batch_queued_.wait(lock, [this] { return !queue_.empty(); });
+    std::shared_ptr<TaskBatch> batch = std::move(queue_.front());
+    queue_.pop_front();
+    idle_workers_--;
+    lock.unlock();
+
+    batch->RunAvailable();
+    batch.reset();
+
+    lock.lock();
+    idle_workers_++;
+  }
+}
+
+// Never destroyed, as workers may still be running at exit
+static WorkerPool* pool = new WorkerPool();
+
+void RunTasks(const std::vector<std::function<void()>>& tasks, int threads) {
+  if (tasks.empty()) {
+    return;
+  }
+  auto batch = std::make_shared<TaskBatch>(tasks);
+  int helpers = std::min(threads, static_cast<int>(tasks.size())) - 1;
+  if (helpers > 0) {
+    pool->Join(batch, helpers);
+  }
+  batch->RunAvailable();
+
+  std::unique_lock<std::mutex> lock(batch->mutex);
+  batch->finished.wait(lock, [&batch] {
+    return batch->done.load(std::memory_order_acquire) == batch->count;
+  });
+}
@@ -0,0 +1,18 @@
+// Copyright (C) 2025 Intel Corporation
+// SPDX-License-Identifier: Apache-2.0
+
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#define VISIBLE_FOR_TESTING __attribute__((visibility("default")))
+
+// Runs independent tasks on up to threads threads, including the calling
+// thread, and returns when all of them are done. Worker threads are shared by
+// all callers and started on first use, up to MAX_POOL_WORKERS. If all workers
+// are busy, the calling thread runs the tasks by itself.
+inline constexpr int MAX_POOL_WORKERS = 64;
+
+VISIBLE_FOR_TESTING void RunTasks(
+    const std::vector<std::function<void()>>& tasks, int threads);
@@ -8,17 +8,30 @@
 #include <sys/param.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
 #include <cstring>
 #include <functional>
 #include <iostream>
 #include <limits>
 #include <mutex>
+#include <new>
 #include <shared_mutex>
 #include <unordered_map>
+#include <vector>
 
+#include "circuit_breaker.h"
 #include "config/config.h"
+#include "expansion_predictor.h"
+#include "hedge.h"
 #include "logging.h"
-#include "sharded_map.h"
+#include "ratio_guard.h"
+#include "result_cache.h"
+#include "scheduler.h"
+#include "slab_allocator.h"
+#include "stream_table.h"
+#include "worker_pool.h"
 #ifdef USE_IAA
 #include "iaa.h"
 #endif
@@ -26,6 +39,7 @@
 #include "qat.h"
 #endif
 #include "statistics.h"
+#include "utils.h"
 
 using namespace config;
 // Disable cfi-icall as it makes calls to orig* functions fail
@@ -45,6 +59,13 @@ static int (*orig_deflateSetDictionary)(z_streamp strm, const Bytef* dictionary,
 static int (*orig_deflate)(z_streamp strm, int flush);
 static int (*orig_deflateEnd)(z_streamp strm);
 static int (*orig_deflateReset)(z_streamp strm);
+static uLong (*orig_deflateBound)(z_streamp strm, uLong sourceLen);
+static int (*orig_deflateParams)(z_streamp strm, int level, int strategy);
+static int (*orig_deflateSetHeader)(z_streamp strm, gz_headerp head);
+static int (*orig_deflatePrime)(z_streamp strm, int bits, int value);
+static int (*orig_deflateTune)(z_streamp strm, int good_length, int max_lazy,
+                               int nice_length, int max_chain);
+static int (*orig_deflateCopy)(z_streamp dest, z_streamp source);
 static int (*orig_inflateInit_)(z_streamp strm, const char* version,
                                 int stream_size);
 static int (*orig_inflateInit2_)(z_streamp strm, int window_bits,
@@ -54,6 +75,10 @@ static int (*orig_inflateSetDictionary)(z_streamp strm, const Bytef* dictionary,
 static int (*orig_inflate)(z_streamp strm, int flush);
 static int (*orig_inflateEnd)(z_streamp strm);
 static int (*orig_inflateReset)(z_streamp strm);
+static int (*orig_inflateReset2)(z_streamp strm, int window_bits);
+static int (*orig_inflateGetHeader)(z_streamp strm, gz_headerp head);
+static int (*orig_inflateSync)(z_streamp strm);
+static int (*orig_inflateCopy)(z_streamp dest, z_streamp source);
 static int (*orig_compress)(Bytef* dest, uLongf* destLen, const Bytef* source,
                             uLong sourceLen);
 static int (*orig_compress2)(Bytef* dest, uLongf* destLen, const Bytef* source,
@@ -111,6 +136,21 @@ static int init_zlib_accel(void) {
 
   LOAD_SYMBOL(orig_deflateReset, int (*)(z_streamp), "deflateReset");
 
+  LOAD_SYMBOL(orig_deflateBound, uLong(*)(z_streamp, uLong), "deflateBound");
+
+  LOAD_SYMBOL(orig_deflateParams, int (*)(z_streamp, int, int),
+              "deflateParams");
+
+  LOAD_SYMBOL(orig_deflateSetHeader, int (*)(z_streamp, gz_headerp),
+              "deflateSetHeader");
+
+  LOAD_SYMBOL(orig_deflatePrime, int (*)(z_streamp, int, int), "deflatePrime");
+
+  LOAD_SYMBOL(orig_deflateTune, int (*)(z_streamp, int, int, int, int),
+              "deflateTune");
+
+  LOAD_SYMBOL(orig_deflateCopy, int (*)(z_streamp, z_streamp), "deflateCopy");
+
   // Load inflate functions
   LOAD_SYMBOL(orig_inflateInit_, int (*)(z_streamp, const char*, int),
               "inflateInit_");
@@ -127,6 +167,15 @@ static int init_zlib_accel(void) {
 
   LOAD_SYMBOL(orig_inflateReset, int (*)(z_streamp), "inflateReset");
 
+  LOAD_SYMBOL(orig_inflateReset2, int (*)(z_streamp, int), "inflateReset2");
+
+  LOAD_SYMBOL(orig_inflateGetHeader, int (*)(z_streamp, gz_headerp),
+              "inflateGetHeader");
+
+  LOAD_SYMBOL(orig_inflateSync, int (*)(z_streamp), "inflateSync");
+
+  LOAD_SYMBOL(orig_inflateCopy, int (*)(z_streamp, z_streamp), "inflateCopy");
+
   // Load compress/uncompress functions
   LOAD_SYMBOL(orig_compress, int (*)(Bytef*, uLongf*, const Bytef*, uLong),
               "compress");
@@ -154,6 +203,7 @@ static int init_zlib_accel(void) {
   LOAD_SYMBOL(orig_gzeof, int (*)(gzFile), "gzeof");
 
   // Load configuration file
+  config::UpdatePassthrough();
   std::string config_file_content;
   if (!config::LoadConfigFile(config_file_content)) {
     Log(LogLevel::LOG_ERROR, "Error: Failed to load configuration file\n");
@@ -180,36 +230,138 @@ static void cleanup_zlib_accel(void) {
 // Avoid recursive call (e.g., if QATzip falls back to zlib internally)
 static thread_local bool in_call = false;
 
-struct DeflateSettings {
+// Input is compressed in chunks of this size when streaming. The size fits
+// both the QAT HW buffer and the IAA max buffer size.
+inline constexpr uint32_t STREAM_CHUNK_SIZE = 256 << 10;
+
+// Output buffer size for a compressed chunk, including the empty stored block
+// that makes it byte-aligned
+static uint32_t StreamChunkBound(uint32_t input_length) {
+  return input_length + (input_length >> 3) + 128;
+}
+
+// State of a deflate stream compressed in chunks (deflate_streaming option).
+// The shim writes the header and trailer, and each chunk is compressed as a
+// raw deflate segment.
+struct DeflateStreamState {
+  ~DeflateStreamState() {
+    if (zlib_stream_initialized) {
+      orig_deflateEnd(&zlib_stream);
+    }
+  }
+
+  CompressedFormat format = CompressedFormat::INVALID;
+  std::unique_ptr<uint8_t[]> input_buf;
+  uint32_t input_buf_content = 0;
+  // Compressed data not yet copied to the caller's buffer
+  StagingBuffer output;
+  uint32_t checksum = 0;
+  uint32_t input_size = 0;
+  // Set after a flush, until more input is received
+  bool flushed = false;
+  bool finished = false;
+
+  // Raw deflate stream for chunks compressed with zlib. Chunks compressed with
+  // zlib can refer to previous chunks only if these were compressed with zlib
+  // too.
+  z_stream zlib_stream;
+  bool zlib_stream_initialized = false;
+  bool zlib_history_valid = false;
+};
+
+// Settings objects are allocated from per-thread slabs, each in its own cache
+// lines. The fields read by every deflate and inflate call come first, in the
+// first cache line of the object.
+struct DeflateSettings : SlabAllocated<DeflateSettings> {
   DeflateSettings(int _level, int _method, int _window_bits, int _mem_level,
                   int _strategy)
-      : level(_level),
+      : window_bits(_window_bits),
+        level(_level),
+        strategy(_strategy),
         method(_method),
-        window_bits(_window_bits),
         mem_level(_mem_level),
-        strategy(_strategy) {}
+        init_level(_level),
+        init_strategy(_strategy) {}
 
+  ExecutionPath path = UNDEFINED;
+  int window_bits;
   int level;
+  int strategy;
+  std::unique_ptr<DeflateStreamState> stream;
   int method;
-  int window_bits;
   int mem_level;
-  int strategy;
-  ExecutionPath path = UNDEFINED;
+  // Level and strategy passed to deflateInit2. deflateParams changes level and
+  // strategy.
+  int init_level;
+  int init_strategy;
+  // Cleared while the zlib initialization of the stream is deferred
+  // (lazy_zlib_init option)
+  bool zlib_initialized = true;
+  const char* version = nullptr;
+  int stream_size = 0;
+  // Set if the zlib state is taken from and returned to the state pool
+  // (zlib_state_pool_size option)
+  bool pool_zlib_state = false;
+  // Set while zlib has compressed part of a stream without finishing it.
+  // deflateEnd then returns Z_DATA_ERROR, and the state is not pooled.
+  bool zlib_stream_open = false;
+  // Set once a gzip header is given with deflateSetHeader. Only zlib writes
+  // it, and zlib keeps it after deflateReset, so the stream stays on zlib.
+  bool custom_header = false;
 };
 
-struct InflateSettings {
-  InflateSettings(int _window_bits) : window_bits(_window_bits) {}
-  int window_bits;
+// Max compressed size buffered for a stream received over multiple inflate
+// calls (inflate_buffer_input option)
+inline constexpr uint32_t INFLATE_BUFFER_MAX_SIZE = 2 << 20;
+
+// Size of the buffer for decompressed data that may not fit in the caller's
+// buffer (inflate_buffer_output option), and the compression ratio assumed to
+// decide if it is needed
+inline constexpr uint32_t INFLATE_OUTPUT_BUFFER_SIZE = 2 << 20;
+inline constexpr uint32_t INFLATE_EXPANSION_ESTIMATE = 4;
+
+// State of an inflate stream whose input is buffered until the end of the
+// stream is received, or whose output is buffered until the caller provides
+// enough space
+struct InflateStreamState {
+  explicit InflateStreamState(int window_bits) : parser(window_bits) {}
+
+  StagingBuffer input;
+  StreamParser parser;
+  // Decompressed data not yet copied to the caller's buffer
+  StagingBuffer output;
+  // Set if the stream is decompressed with zlib. The buffered input is passed
+  // to zlib before any new input.
+  bool replay = false;
+  // Set once the stream is decompressed by an accelerator
+  bool done = false;
+};
+
+struct InflateSettings : SlabAllocated<InflateSettings> {
+  InflateSettings(int _window_bits)
+      : window_bits(_window_bits), init_window_bits(_window_bits) {}
   ExecutionPath path = UNDEFINED;
+  // With automatic header detection, resolved from the header of the stream
+  int window_bits;
+  // Window bits passed to inflateInit2
+  int init_window_bits;
+  std::unique_ptr<InflateStreamState> stream;
+  // Cleared while the zlib initialization of the stream is deferred
+  // (lazy_zlib_init option)
+  bool zlib_initialized = true;
+  const char* version = nullptr;
+  int stream_size = 0;
+  // Set if the zlib state is taken from and returned to the state pool
+  // (zlib_state_pool_size option)
+  bool pool_zlib_state = false;
 };
 
 class DeflateStreamSettings {
  public:
-  void Set(z_streamp strm, int level, int method, int window_bits,
-           int mem_level, int strategy) {
-    auto settings = std::make_unique<DeflateSettings>(
-        level, method, window_bits, mem_level, strategy);
-    map.Set(strm, std::move(settings));
+  DeflateSettings* Set(z_streamp strm, int level, int method, int window_bits,
+                       int mem_level, int strategy) {
+    return map.Set(strm, std::make_unique<DeflateSettings>(
+                             level, method, window_bits, mem_level, strategy));
   }
 
   void Unset(z_streamp strm) { map.Unset(strm); }
@@ -217,15 +369,14 @@ class DeflateStreamSettings {
   DeflateSettings* Get(z_streamp strm) { return map.Get(strm); }
 
  private:
-  ShardedMap<z_streamp, std::unique_ptr<DeflateSettings>> map;
+  StreamTable<z_streamp, DeflateSettings> map;
 };
 DeflateStreamSettings deflate_stream_settings;
 
 class InflateStreamSettings {
  public:
-  void Set(z_streamp strm, int window_bits) {
-    auto settings = std::make_unique<InflateSettings>(window_bits);
-    map.Set(strm, std::move(settings));
+  InflateSettings* Set(z_streamp strm, int window_bits) {
+    return map.Set(strm, std::make_unique<InflateSettings>(window_bits));
   }
 
   void Unset(z_streamp strm) { map.Unset(strm); }
@@ -233,31 +384,312 @@ class InflateStreamSettings {
   InflateSettings* Get(z_streamp strm) { return map.Get(strm); }
 
  private:
-  ShardedMap<z_streamp, std::unique_ptr<InflateSettings>> map;
+  StreamTable<z_streamp, InflateSettings> map;
 };
 InflateStreamSettings inflate_stream_settings;
 
+// In passthrough mode, streams are not registered: deflate and inflate calls
+// without settings are passed straight to zlib, even if the configuration
+// changes later.
+
+// With lazy_zlib_init, the zlib state of a stream (about 256KB for deflate and
+// 40KB for inflate) is allocated the first time zlib is needed for the stream,
+// rather than by deflateInit/inflateInit. Streams served by accelerators never
+// allocate it. Until then, the shim sets the fields of the z_stream that zlib
+// would set, and state is NULL. The other zlib functions that take the stream
+// are intercepted to allocate the state before calling zlib. Initialization is
+// not deferred for parameters that zlib rejects, so that the error is still
+// returned by the init call.
+
+// Set while the shim initializes the zlib state of a stream (deferred
+// initialization, or reuse of a pooled state). deflateInit2, inflateInit2 and
+// inflateReset2 in zlib call deflateReset and inflateReset, which may be
+// intercepted too.
+static thread_local bool in_zlib_init = false;
+
+static bool IsValidZlibVersion(const char* version, int stream_size) {
+  return version != nullptr && version[0] == ZLIB_VERSION[0] &&
+         stream_size == static_cast<int>(sizeof(z_stream));
+}
+
+// Returns whether deflateInit2 in zlib accepts the parameters
+static bool IsValidDeflateInit(z_streamp strm, int level, int method,
+                               int window_bits, int mem_level, int strategy,
+                               const char* version, int stream_size) {
+  int bits = window_bits < 0 ? -window_bits : window_bits & 15;
+  return strm != Z_NULL && IsValidZlibVersion(version, stream_size) &&
+         method == Z_DEFLATED &&
+         GetCompressedFormat(window_bits) != CompressedFormat::INVALID &&
+         bits >= 9 && level >= Z_DEFAULT_COMPRESSION && level <= 9 &&
+         mem_level >= 1 && mem_level <= MAX_MEM_LEVEL && strategy >= 0 &&
+         strategy <= Z_FIXED;
+}
+
+// Returns whether inflateInit2 in zlib accepts the parameters
+static bool IsValidInflateInit(z_streamp strm, int window_bits,
+                               const char* version, int stream_size) {
+  // Same checks as inflateReset2 in zlib
+  int bits = window_bits;
+  if (bits < 0) {
+    bits = bits < -15 ? -1 : -bits;
+  } else if (bits < 48) {
+    bits &= 15;
+  }
+  return strm != Z_NULL && IsValidZlibVersion(version, stream_size) &&
+         (bits == 0 || (bits >= 8 && bits <= 15));
+}
+
+// With zlib_state_pool_size, the zlib states of ended streams are kept in a
+// per-thread pool and given to new streams with the same parameters, instead
+// of being freed and allocated again. This saves the allocation and clearing
+// of the state for applications that create a stream per request. A pooled
+// state is reset by zlib before it is reused. Only streams using the default
+// zlib allocator are pooled, as a state must be freed with the allocator of
+// the stream that created it.
+
+// Level, window bits, memory level and strategy for deflate, and window bits
+// for inflate
+using ZlibStateKey = std::array<int, 4>;
+
+struct PooledZlibState {
+  ZlibStateKey key;
+  internal_state* state;
+  alloc_func zalloc;
+  free_func zfree;
+  voidpf opaque;
+};
+
+// Moves a pooled state to a stream. The first member of the deflate and inflate
+// states of zlib points back to the stream that owns the state, and zlib
+// checks it on every call.
+static void AttachZlibState(z_streamp strm, const PooledZlibState& pooled) {
+  strm->state = pooled.state;
+  strm->zalloc = pooled.zalloc;
+  strm->zfree = pooled.zfree;
+  strm->opaque = pooled.opaque;
+  *reinterpret_cast<z_streamp*>(strm->state) = strm;
+}
+
+class ZlibStatePool {
+ public:
+  explicit ZlibStatePool(int (*end)(z_streamp)) : end_(end) {}
+
+  ~ZlibStatePool() { Clear(); }
+
+  // Attaches a pooled state with this key to strm. The most recently pooled
+  // state is used first.
+  bool Take(const ZlibStateKey& key, z_streamp strm) {
+    for (auto it = states_.rbegin(); it != states_.rend(); ++it) {
+      if (it->key == key) {
+        AttachZlibState(strm, *it);
+        states_.erase(std::next(it).base());
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Moves the state of strm to the pool, unless the pool is full
+  bool Put(const ZlibStateKey& key, z_streamp strm) {
+    if (states_.size() >= configs[ZLIB_STATE_POOL_SIZE]) {
+      return false;
+    }
+    states_.push_back(
+        {key, strm->state, strm->zalloc, strm->zfree, strm->opaque});
+    strm->state = Z_NULL;
+    return true;
+  }
+
+  void Clear() {
+    for (const PooledZlibState& pooled : states_) {
+      z_stream strm{};
+      AttachZlibState(&strm, pooled);
+      end_(&strm);
+    }
+    states_.clear();
+  }
+
+ private:
+  int (*end_)(z_streamp);
+  std::vector<PooledZlibState> states_;
+};
+
+static ZlibStatePool& DeflateStatePool() {
+  static thread_local ZlibStatePool pool(orig_deflateEnd);
+  return pool;
+}
+
+static ZlibStatePool& InflateStatePool() {
+  static thread_local ZlibStatePool pool(orig_inflateEnd);
+  return pool;
+}
+
+void ClearZlibStatePools() {
+  DeflateStatePool().Clear();
+  InflateStatePool().Clear();
+}
+
+// A reused deflate state gets the level and strategy of the new stream with
+// deflateParams. Before zlib 1.2.12, deflateParams may compress pending data
+// even after deflateReset, so states are not pooled.
+static bool IsZlibStatePoolSupported() {
+  static const bool supported = [] {
+    int major = 0;
+    int minor = 0;
+    int revision = 0;
+    sscanf(zlibVersion(), "%d.%d.%d", &major, &minor, &revision);
+    return major > 1 ||
+           (major == 1 && (minor > 2 || (minor == 2 && revision >= 12)));
+  }();
+  return supported;
+}
+
+// Called by the init functions, before zlib sets the allocator of the stream
+static bool UseZlibStatePool(z_streamp strm) {
+  return configs[ZLIB_STATE_POOL_SIZE] != 0 && strm->zalloc == Z_NULL &&
+         strm->zfree == Z_NULL && IsZlibStatePoolSupported();
+}
+
+static ZlibStateKey GetZlibStateKey(const DeflateSettings* deflate_settings) {
+  return {deflate_settings->init_level, deflate_settings->window_bits,
+          deflate_settings->mem_level, deflate_settings->init_strategy};
+}
+
+static ZlibStateKey GetZlibStateKey(const InflateSettings* inflate_settings) {
+  return {inflate_settings->init_window_bits, 0, 0, 0};
+}
+
+// Initializes the zlib state of a stream with the parameters of its settings,
+// reusing a pooled state if possible
+static int InitZlibDeflate(z_streamp strm, DeflateSettings* deflate_settings) {
+  int ret;
+  in_zlib_init = true;
+  if (deflate_settings->pool_zlib_state &&
+      DeflateStatePool().Take(GetZlibStateKey(deflate_settings), strm)) {
+    ret = orig_deflateReset(strm);
+    if (ret == Z_OK) {
+      // Undoes deflateParams and deflateSetHeader calls on the previous stream
+      ret = orig_deflateParams(strm, deflate_settings->level,
+                               deflate_settings->strategy);
+      orig_deflateSetHeader(strm, Z_NULL);
+    }
+    INCREMENT_STAT(ZLIB_STATE_REUSE_COUNT);
+  } else {
+    ret = orig_deflateInit2_(
+        strm, deflate_settings->level, deflate_settings->method,
+        deflate_settings->window_bits, deflate_settings->mem_level,
+        deflate_settings->strategy, deflate_settings->version,
+        deflate_settings->stream_size);
+  }
+  in_zlib_init = false;
+  return ret;
+}
+
+// Moves the zlib state of an ended stream to the pool. Returns false if the
+// state must be freed by zlib.
+static bool PoolZlibDeflate(z_streamp strm, DeflateSettings* deflate_settings) {
+  return deflate_settings->pool_zlib_state &&
+         deflate_settings->zlib_initialized &&
+         !deflate_settings->zlib_stream_open && strm->state != Z_NULL &&
+         DeflateStatePool().Put(GetZlibStateKey(deflate_settings), strm);
+}
+
+static int InitZlibInflate(z_streamp strm, InflateSettings* inflate_settings) {
+  int ret;
+  in_zlib_init = true;
+  if (inflate_settings->pool_zlib_state &&
+      InflateStatePool().Take(GetZlibStateKey(inflate_settings), strm)) {
+    ret = orig_inflateReset2(strm, inflate_settings->init_window_bits);
+    INCREMENT_STAT(ZLIB_STATE_REUSE_COUNT);
+  } else {
+    ret = orig_inflateInit2_(strm, inflate_settings->init_window_bits,
+                             inflate_settings->version,
+                             inflate_settings->stream_size);
+  }
+  in_zlib_init = false;
+  return ret;
+}
+
+static bool PoolZlibInflate(z_streamp strm, InflateSettings* inflate_settings) {
+  return inflate_settings->pool_zlib_state &&
+         inflate_settings->zlib_initialized && strm->state != Z_NULL &&
+         InflateStatePool().Put(GetZlibStateKey(inflate_settings), strm);
+}
+
+// Sets the fields of a stream set by deflateReset
+static void ResetLazyDeflate(z_streamp strm,
+                             DeflateSettings* deflate_settings) {
+  strm->total_in = 0;
+  strm->total_out = 0;
+  strm->msg = Z_NULL;
+  strm->data_type = Z_UNKNOWN;
+  strm->adler =
+      GetCompressedFormat(deflate_settings->window_bits) ==
+              CompressedFormat::GZIP
+          ? crc32(0L, Z_NULL, 0)
+          : adler32(0L, Z_NULL, 0);
+}
+
+// Allocates the zlib state of a stream whose initialization was deferred. The
+// counters and checksum set by accelerator calls are kept.
+static int InitLazyDeflate(z_streamp strm, DeflateSettings* deflate_settings) {
+  if (deflate_settings->zlib_initialized) {
+    return Z_OK;
+  }
+  uLong total_in = strm->total_in;
+  uLong total_out = strm->total_out;
+  uLong adler = strm->adler;
+  int ret = InitZlibDeflate(strm, deflate_settings);
+  if (ret != Z_OK) {
+    return ret;
+  }
+  strm->total_in = total_in;
+  strm->total_out = total_out;
+  strm->adler = adler;
+  deflate_settings->zlib_initialized = true;
+  return Z_OK;
+}
+
 int ZEXPORT deflateInit_(z_streamp strm, int level, const char* version,
                          int stream_size) {
+  if (compress_passthrough) {
+    return orig_deflateInit_(strm, level, version, stream_size);
+  }
   Log(LogLevel::LOG_INFO, "deflateInit_ Line ", __LINE__, ", strm ",
       static_cast<void*>(strm), ", level ", level, "\n");
 
-  deflate_stream_settings.Set(strm, level, Z_DEFLATED, 15, 8,
-                              Z_DEFAULT_STRATEGY);
-  return orig_deflateInit_(strm, level, version, stream_size);
+  return deflateInit2_(strm, level, Z_DEFLATED, 15, 8, Z_DEFAULT_STRATEGY,
+                       version, stream_size);
 }
 
 int ZEXPORT deflateInit2_(z_streamp strm, int level, int method,
                           int window_bits, int mem_level, int strategy,
                           const char* version, int stream_size) {
+  if (compress_passthrough) {
+    return orig_deflateInit2_(strm, level, method, window_bits, mem_level,
+                              strategy, version, stream_size);
+  }
   Log(LogLevel::LOG_INFO, "deflateInit2_ Line ", __LINE__, ", strm ",
       static_cast<void*>(strm), ", level ", level, ", window_bits ",
       window_bits, " \n");
 
-  deflate_stream_settings.Set(strm, level, method, window_bits, mem_level,
-                              strategy);
-  return orig_deflateInit2_(strm, level, method, window_bits, mem_level,
-                            strategy, version, stream_size);
+  DeflateSettings* deflate_settings = deflate_stream_settings.Set(
+      strm, level, method, window_bits, mem_level, strategy);
+  if (!IsValidDeflateInit(strm, level, method, window_bits, mem_level,
+                          strategy, version, stream_size)) {
+    return orig_deflateInit2_(strm, level, method, window_bits, mem_level,
+                              strategy, version, stream_size);
+  }
+  deflate_settings->version = version;
+  deflate_settings->stream_size = stream_size;
+  deflate_settings->pool_zlib_state = UseZlibStatePool(strm);
+  if (configs[LAZY_ZLIB_INIT]) {
+    deflate_settings->zlib_initialized = false;
+    strm->state = Z_NULL;
+    ResetLazyDeflate(strm, deflate_settings);
+    return Z_OK;
+  }
+  return InitZlibDeflate(strm, deflate_settings);
 }
 
 int ZEXPORT deflateSetDictionary(z_streamp strm, const Bytef* dictionary,
@@ -265,166 +697,1712 @@ int ZEXPORT deflateSetDictionary(z_streamp strm, const Bytef* dictionary,
   Log(LogLevel::LOG_INFO, "deflateSetDictionary Line ", __LINE__, ", strm ",
       static_cast<void*>(strm), ", dictLength ", dictLength, "\n");
   DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
-  deflate_settings->path = ZLIB;
+  if (deflate_settings != nullptr) {
+    deflate_settings->path = ZLIB;
+    int ret = InitLazyDeflate(strm, deflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
   return orig_deflateSetDictionary(strm, dictionary, dictLength);
 }
 
-int ZEXPORT deflate(z_streamp strm, int flush) {
+// The new level and strategy apply to the rest of the stream and to the next
+// streams after deflateReset, as in zlib. They are also part of the result
+// cache key.
+int ZEXPORT deflateParams(z_streamp strm, int level, int strategy) {
+  Log(LogLevel::LOG_INFO, "deflateParams Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", level ", level, ", strategy ", strategy,
+      "\n");
   DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
-  INCREMENT_STAT(DEFLATE_COUNT);
-  PrintStats();
+  if (deflate_settings != nullptr) {
+    int ret = InitLazyDeflate(strm, deflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  int ret = orig_deflateParams(strm, level, strategy);
+  if (deflate_settings != nullptr && ret == Z_OK) {
+    deflate_settings->level = level;
+    deflate_settings->strategy = strategy;
+  }
+  return ret;
+}
 
-  Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), ", avail_in ", strm->avail_in, ", avail_out ",
-      strm->avail_out, ", flush ", flush, ", in_call ", in_call, ", path ",
-      static_cast<int>(deflate_settings->path), "\n");
+int ZEXPORT deflateSetHeader(z_streamp strm, gz_headerp head) {
+  Log(LogLevel::LOG_INFO, "deflateSetHeader Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), "\n");
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
+  if (deflate_settings != nullptr) {
+    int ret = InitLazyDeflate(strm, deflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  int ret = orig_deflateSetHeader(strm, head);
+  if (deflate_settings != nullptr && ret == Z_OK) {
+    deflate_settings->path = ZLIB;
+    deflate_settings->custom_header = true;
+  }
+  return ret;
+}
+
+// Bits inserted in the output by zlib: the stream stays on zlib until
+// deflateReset
+int ZEXPORT deflatePrime(z_streamp strm, int bits, int value) {
+  Log(LogLevel::LOG_INFO, "deflatePrime Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", bits ", bits, "\n");
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
+  if (deflate_settings != nullptr) {
+    int ret = InitLazyDeflate(strm, deflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  int ret = orig_deflatePrime(strm, bits, value);
+  if (deflate_settings != nullptr && ret == Z_OK) {
+    deflate_settings->path = ZLIB;
+  }
+  return ret;
+}
+
+int ZEXPORT deflateTune(z_streamp strm, int good_length, int max_lazy,
+                        int nice_length, int max_chain) {
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
+  if (deflate_settings != nullptr) {
+    int ret = InitLazyDeflate(strm, deflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  return orig_deflateTune(strm, good_length, max_lazy, nice_length, max_chain);
+}
+
+// The copy is not registered with the shim: its calls go to zlib
+int ZEXPORT deflateCopy(z_streamp dest, z_streamp source) {
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(source);
+  if (deflate_settings != nullptr) {
+    int ret = InitLazyDeflate(source, deflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  return orig_deflateCopy(dest, source);
+}
+
+// Starts timing a call for the adaptive scheduler
+static uint64_t StartTiming() {
+  return configs[ADAPTIVE_SCHEDULING] ? GetTimeNs() : 0;
+}
+
+// Reports the outcome of a call timed with StartTiming to the adaptive
+// scheduler
+static void RecordTiming(Operation operation, ExecutionPath path,
+                         uint32_t input_length, uint64_t start_ns,
+                         bool success) {
+  if (configs[ADAPTIVE_SCHEDULING]) {
+    RecordPathResult(operation, path, input_length, GetTimeNs() - start_ns,
+                     success);
+  }
+}
+
+// Reports the outcome of an accelerator call timed with StartTiming to the
+// adaptive scheduler and to the circuit breakers
+static void RecordAcceleratorResult(Operation operation, ExecutionPath path,
+                                    int window_bits, uint32_t input_length,
+                                    uint64_t start_ns, bool success) {
+  RecordTiming(operation, path, input_length, start_ns, success);
+  RecordCircuitBreakerResult(path, operation, GetCompressedFormat(window_bits),
+                             success);
+}
+
+// Runs an accelerator call, on a hedge worker if a deadline applies to it.
+// output_bound is the max output of the call, or 0 if unknown. Returns
+// HEDGE_NOT_RUN if the call could not be run on a worker.
+template <typename Call>
+static int CallAccelerator(Operation operation, const Call& call,
+                           uint8_t* input, uint32_t* input_length,
+                           uint8_t* output, uint32_t* output_length,
+                           uint32_t output_bound, bool* end_of_stream) {
+  uint32_t deadline_us = GetDeadlineUs(operation, *input_length);
+  if (deadline_us == 0) {
+    return call(input, input_length, output, output_length, end_of_stream);
+  }
+  // zlib calls made by the accelerator libraries on the worker thread must not
+  // be intercepted
+  return RunWithDeadline(
+      [call](uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t* out_len,
+             bool* eos) {
+        in_call = true;
+        int ret = call(in, in_len, out, out_len, eos);
+        in_call = false;
+        return ret;
+      },
+      input, input_length, output, output_length, output_bound, end_of_stream,
+      deadline_us);
+}
+
+static bool UseDeflateStreaming(DeflateSettings* deflate_settings, int flush) {
+  return configs[DEFLATE_STREAMING] &&
+         (flush == Z_NO_FLUSH || flush == Z_SYNC_FLUSH ||
+          flush == Z_FULL_FLUSH) &&
+         deflate_settings->path == UNDEFINED &&
+         (configs[USE_QAT_COMPRESS] || configs[USE_IAA_COMPRESS]) &&
+         deflate_settings->method == Z_DEFLATED &&
+         deflate_settings->level != 0 &&
+         GetCompressedFormat(deflate_settings->window_bits) !=
+             CompressedFormat::INVALID;
+}
+
+static int StartDeflateStream(DeflateSettings* deflate_settings) {
+  auto stream = std::make_unique<DeflateStreamState>();
+  stream->input_buf.reset(new (std::nothrow) uint8_t[STREAM_CHUNK_SIZE]);
+  if (stream->input_buf == nullptr) {
+    return Z_MEM_ERROR;
+  }
+  stream->format = GetCompressedFormat(deflate_settings->window_bits);
+  stream->checksum = InitialChecksum(stream->format);
+
+  uint8_t* header = stream->output.Reserve(MAX_HEADER_SIZE);
+  if (header == nullptr) {
+    return Z_MEM_ERROR;
+  }
+  stream->output.Commit(WriteStreamHeader(
+      header, stream->format, deflate_settings->window_bits,
+      deflate_settings->level, deflate_settings->strategy));
+
+  deflate_settings->stream = std::move(stream);
+  return Z_OK;
+}
 
+static int CompressStreamChunkZlib(DeflateSettings* deflate_settings,
+                                   uint8_t* input, uint32_t input_length,
+                                   uint8_t* output, uint32_t* output_length,
+                                   int flush) {
+  if (!configs[USE_ZLIB_COMPRESS]) {
+    return Z_DATA_ERROR;
+  }
+
+  bool last = (flush == Z_FINISH);
+  // Z_FULL_FLUSH also resets the history, other chunks end with a sync flush
+  int zlib_flush = (last || flush == Z_FULL_FLUSH) ? flush : Z_SYNC_FLUSH;
+
+  DeflateStreamState* stream = deflate_settings->stream.get();
+  z_streamp zlib_stream = &stream->zlib_stream;
+  int ret = Z_OK;
+  in_call = true;
+  if (!stream->zlib_stream_initialized) {
+    memset(zlib_stream, 0, sizeof(z_stream));
+    ret = orig_deflateInit2_(
+        zlib_stream, deflate_settings->level, deflate_settings->method,
+        GetRawWindowBits(deflate_settings->window_bits),
+        deflate_settings->mem_level, deflate_settings->strategy, ZLIB_VERSION,
+        (int)sizeof(z_stream));
+    stream->zlib_stream_initialized = (ret == Z_OK);
+  } else if (!stream->zlib_history_valid) {
+    ret = orig_deflateReset(zlib_stream);
+  }
+
+  if (ret == Z_OK) {
+    zlib_stream->next_in = input;
+    zlib_stream->avail_in = input_length;
+    zlib_stream->next_out = output;
+    zlib_stream->avail_out = *output_length;
+    ret = orig_deflate(zlib_stream, zlib_flush);
+    // The flush is complete only if there is space left in the output
+    if (ret == (last ? Z_STREAM_END : Z_OK) && zlib_stream->avail_in == 0 &&
+        zlib_stream->avail_out > 0) {
+      *output_length -= zlib_stream->avail_out;
+      ret = Z_OK;
+    } else {
+      ret = Z_STREAM_ERROR;
+    }
+  }
+  in_call = false;
+  INCREMENT_STAT(DEFLATE_ZLIB_COUNT);
+
+  stream->zlib_history_valid = (ret == Z_OK && !last);
+  return ret;
+}
+
+// Compresses a chunk as a raw deflate segment with an accelerator. Unless last
+// is set, the segment ends with an empty stored block, so that the next chunk
+// can be compressed independently. output_length is the size of the output
+// buffer, which must be at least StreamChunkBound(input_length). Returns the
+// accelerator used, or ZLIB if the chunk must be compressed with zlib.
+static ExecutionPath CompressSegmentAccelerator(EntryPoint entry_point,
+                                                int level, int window_bits,
+                                                int strategy, uint8_t* input,
+                                                uint32_t input_length,
+                                                uint8_t* output,
+                                                uint32_t* output_length,
+                                                bool last) {
+  int raw_window_bits = GetRawWindowBits(window_bits);
+#if !defined(USE_IAA) && !defined(USE_QAT)
+  (void)raw_window_bits;
+  (void)level;
+  (void)strategy;
+  (void)input;
+#endif
   int ret = 1;
+  uint32_t input_len = input_length;
+  // Leave space for the empty stored block appended to the segment
+  uint32_t output_len = *output_length - EMPTY_STORED_BLOCK_SIZE;
+
   bool iaa_available = false;
   bool qat_available = false;
-  if (!in_call && flush == Z_FINISH && deflate_settings->path != ZLIB) {
-    uint32_t input_len = strm->avail_in;
-    uint32_t output_len = strm->avail_out;
+#ifdef USE_IAA
+  iaa_available = configs[USE_IAA_COMPRESS] &&
+                  SupportedOptionsIAA(raw_window_bits, input_len, output_len);
+#endif
+#ifdef USE_QAT
+  qat_available = configs[USE_QAT_COMPRESS] &&
+                  SupportedOptionsQAT(raw_window_bits, input_len);
+#endif
+
+  ExecutionPath path_selected = SelectPath(
+      entry_point, window_bits, iaa_available, qat_available, input_length);
+  uint64_t start_ns = StartTiming();
+  if (path_selected == IAA) {
+#ifdef USE_IAA
+    in_call = true;
+    ret = CompressIAA(input, &input_len, output, &output_len,
+                      qpl_path_hardware, raw_window_bits, 0, false, level,
+                      strategy);
+    in_call = false;
+    INCREMENT_STAT(DEFLATE_IAA_COUNT);
+    INCREMENT_STAT_COND(ret != 0, DEFLATE_IAA_ERROR_COUNT);
+#endif  // USE_IAA
+  } else if (path_selected == QAT) {
+#ifdef USE_QAT
+    in_call = true;
+    ret = CompressQAT(input, &input_len, output, &output_len, raw_window_bits,
+                      false, level, strategy);
+    in_call = false;
+    INCREMENT_STAT(DEFLATE_QAT_COUNT);
+    INCREMENT_STAT_COND(ret != 0, DEFLATE_QAT_ERROR_COUNT);
+#endif  // USE_QAT
+  }
+  if (path_selected != ZLIB) {
+    RecordAcceleratorResult(Operation::COMPRESS, path_selected, window_bits,
+                            input_length, start_ns, ret == 0);
+  }
+
+  if (ret == 0 && input_len == input_length &&
+      (last || ConvertToNonFinalSegment(output, &output_len))) {
+    *output_length = output_len;
+    return path_selected;
+  }
+  return ZLIB;
+}
+
+// Compresses a chunk of a streamed deflate into the stream output. Unless flush
+// is Z_FINISH, the chunk is a non-final segment ending with an empty stored
+// block. This is also the output expected for Z_SYNC_FLUSH and Z_FULL_FLUSH.
+static int CompressStreamChunk(DeflateSettings* deflate_settings,
+                               uint8_t* input, uint32_t input_length,
+                               int flush) {
+  bool last = (flush == Z_FINISH);
+  DeflateStreamState* stream = deflate_settings->stream.get();
+  uint32_t max_output_length = StreamChunkBound(input_length);
+  uint8_t* output = stream->output.Reserve(max_output_length);
+  if (output == nullptr) {
+    return Z_MEM_ERROR;
+  }
+
+  uint32_t output_len = max_output_length;
+  ExecutionPath path_selected = CompressSegmentAccelerator(
+      EntryPoint::DEFLATE, deflate_settings->level,
+      deflate_settings->window_bits, deflate_settings->strategy, input,
+      input_length, output, &output_len, last);
+  if (path_selected != ZLIB) {
+    stream->zlib_history_valid = false;
+  } else {
+    output_len = max_output_length;
+    uint64_t start_ns = StartTiming();
+    int ret = CompressStreamChunkZlib(deflate_settings, input, input_length,
+                                      output, &output_len, flush);
+    if (ret != Z_OK) {
+      return ret;
+    }
+    RecordTiming(Operation::COMPRESS, ZLIB, input_length, start_ns, true);
+  }
+
+  Log(LogLevel::LOG_INFO, "CompressStreamChunk Line ", __LINE__,
+      ", input_length ", input_length, ", output_length ", output_len,
+      ", flush ", flush, ", path ", static_cast<int>(path_selected), "\n");
+
+  stream->output.Commit(output_len);
+  deflate_settings->path = path_selected;
+  return Z_OK;
+}
+
+static int FinishDeflateStream(DeflateSettings* deflate_settings) {
+  DeflateStreamState* stream = deflate_settings->stream.get();
+  if (stream->input_buf_content > 0) {
+    int ret = CompressStreamChunk(deflate_settings, stream->input_buf.get(),
+                                  stream->input_buf_content, Z_FINISH);
+    if (ret != Z_OK) {
+      return ret;
+    }
+    stream->input_buf_content = 0;
+  } else {
+    uint8_t* block = stream->output.Reserve(FINAL_EMPTY_BLOCK_SIZE);
+    if (block == nullptr) {
+      return Z_MEM_ERROR;
+    }
+    stream->output.Commit(WriteFinalEmptyBlock(block));
+  }
+
+  uint8_t* trailer = stream->output.Reserve(MAX_TRAILER_SIZE);
+  if (trailer == nullptr) {
+    return Z_MEM_ERROR;
+  }
+  stream->output.Commit(WriteStreamTrailer(trailer, stream->format,
+                                           stream->checksum,
+                                           stream->input_size));
+  stream->finished = true;
+  return Z_OK;
+}
+
+// Z_PARTIAL_FLUSH and Z_BLOCK are handled as Z_SYNC_FLUSH, which also makes all
+// input available to the decompressor
+static int FlushDeflateStream(DeflateSettings* deflate_settings, int flush) {
+  DeflateStreamState* stream = deflate_settings->stream.get();
+  if (flush != Z_FULL_FLUSH) {
+    flush = Z_SYNC_FLUSH;
+  }
+
+  if (stream->input_buf_content > 0) {
+    int ret = CompressStreamChunk(deflate_settings, stream->input_buf.get(),
+                                  stream->input_buf_content, flush);
+    if (ret != Z_OK) {
+      return ret;
+    }
+    stream->input_buf_content = 0;
+  } else {
+    // Same as zlib, which emits an empty stored block even if the output is
+    // already byte-aligned
+    uint8_t* block = stream->output.Reserve(EMPTY_STORED_BLOCK_SIZE);
+    if (block == nullptr) {
+      return Z_MEM_ERROR;
+    }
+    stream->output.Commit(WriteEmptyStoredBlock(block));
+    if (flush == Z_FULL_FLUSH) {
+      stream->zlib_history_valid = false;
+    }
+  }
+  stream->flushed = true;
+  return Z_OK;
+}
+
+// Deflate for streams compressed in chunks. Input is buffered until a chunk is
+// full, a flush is requested or the stream is finished. Compressed data is kept
+// in the stream until it fits in the caller's buffer. No more input is consumed
+// while there is compressed data pending, so memory use is bounded.
+static int DeflateStream(z_streamp strm, DeflateSettings* deflate_settings,
+                         int flush) {
+  DeflateStreamState* stream = deflate_settings->stream.get();
+  bool progress = false;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    uint32_t output_len = stream->output.Drain(strm->next_out, strm->avail_out);
+    strm->next_out += output_len;
+    strm->avail_out -= output_len;
+    strm->total_out += output_len;
+    progress |= (output_len > 0);
+    if (stream->output.Pending() > 0 || stream->finished) {
+      break;
+    }
+
+    uint32_t input_len = std::min(
+        strm->avail_in, STREAM_CHUNK_SIZE - stream->input_buf_content);
+    if (input_len > 0) {
+      memcpy(stream->input_buf.get() + stream->input_buf_content,
+             strm->next_in, input_len);
+      stream->checksum = UpdateChecksum(stream->format, stream->checksum,
+                                        strm->next_in, input_len);
+      stream->input_buf_content += input_len;
+      stream->input_size += input_len;
+      strm->next_in += input_len;
+      strm->avail_in -= input_len;
+      strm->total_in += input_len;
+      stream->flushed = false;
+      progress = true;
+    }
+
+    if (strm->avail_in == 0 && flush == Z_FINISH) {
+      ret = FinishDeflateStream(deflate_settings);
+    } else if (strm->avail_in == 0 && flush != Z_NO_FLUSH &&
+               !stream->flushed) {
+      // As in zlib, repeating a flush without new input produces no output
+      ret = FlushDeflateStream(deflate_settings, flush);
+    } else if (stream->input_buf_content == STREAM_CHUNK_SIZE) {
+      ret = CompressStreamChunk(deflate_settings, stream->input_buf.get(),
+                                stream->input_buf_content, Z_NO_FLUSH);
+      stream->input_buf_content = 0;
+    } else {
+      break;
+    }
+  }
+  strm->adler = stream->checksum;
+
+  if (ret == Z_OK) {
+    if (stream->finished && stream->output.Pending() == 0) {
+      ret = Z_STREAM_END;
+    } else if (!progress) {
+      ret = Z_BUF_ERROR;
+    }
+  }
+
+  Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", streaming return code ", ret,
+      ", avail_in ", strm->avail_in, ", avail_out ", strm->avail_out,
+      ", path ", static_cast<int>(deflate_settings->path), "\n");
+
+  INCREMENT_STAT_COND(ret < 0 && ret != Z_BUF_ERROR, DEFLATE_ERROR_COUNT);
+  return ret;
+}
+
+// Data that deflate would not compress is written as stored blocks by the shim
+// (incompressible_check option), saving a compression pass
+static bool UseStoredBlocks(int level, const uint8_t* input,
+                            uint32_t input_length) {
+  return configs[INCOMPRESSIBLE_CHECK] && level != 0 &&
+         IsLikelyIncompressible(input, input_length);
+}
+
+static uint64_t StoredStreamBound(uint32_t input_length) {
+  return MAX_HEADER_SIZE + StoredBlocksBound(input_length) + MAX_TRAILER_SIZE;
+}
+
+// Writes a complete stream made of stored blocks. The output must have room for
+// StoredStreamBound(input_length) bytes.
+static uint32_t WriteStoredStream(uint8_t* output, const uint8_t* input,
+                                  uint32_t input_length, int window_bits,
+                                  int level, int strategy,
+                                  uint32_t* checksum) {
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  uint32_t pos =
+      WriteStreamHeader(output, format, window_bits, level, strategy);
+  pos += WriteStoredBlocks(output + pos, input, input_length);
+  *checksum =
+      UpdateChecksum(format, InitialChecksum(format), input, input_length);
+  pos += WriteStreamTrailer(output + pos, format, *checksum, input_length);
+  return pos;
+}
+
+// Compresses all input of a deflate call as stored blocks. If the output does
+// not fit in the caller's buffer, it is kept in the stream state and returned
+// over the next calls. Returns 0 on success.
+static int DeflateStored(z_streamp strm, DeflateSettings* deflate_settings) {
+  uint64_t max_output_len = StoredStreamBound(strm->avail_in);
+  if (max_output_len > std::numeric_limits<uint32_t>::max()) {
+    return 1;
+  }
+  auto stream = std::make_unique<DeflateStreamState>();
+  uint8_t* output = strm->next_out;
+  bool buffered = strm->avail_out < max_output_len;
+  if (buffered) {
+    output = stream->output.Reserve(static_cast<uint32_t>(max_output_len));
+    if (output == nullptr) {
+      return 1;
+    }
+  }
+
+  uint32_t output_len = WriteStoredStream(
+      output, strm->next_in, strm->avail_in, deflate_settings->window_bits,
+      deflate_settings->level, deflate_settings->strategy, &stream->checksum);
+  strm->next_in += strm->avail_in;
+  strm->total_in += strm->avail_in;
+  strm->avail_in = 0;
+  if (buffered) {
+    stream->output.Commit(output_len);
+  } else {
+    strm->next_out += output_len;
+    strm->avail_out -= output_len;
+    strm->total_out += output_len;
+  }
+  stream->finished = true;
+  deflate_settings->stream = std::move(stream);
+  deflate_settings->path = ZLIB;
+  INCREMENT_STAT(DEFLATE_STORED_COUNT);
+  return 0;
+}
+
+// Inputs of at least parallel_compression_threshold bytes are split into chunks
+// compressed concurrently, each on the engine selected for its size
+static bool UseParallelCompression(int level, int method, int window_bits,
+                                   uint32_t input_length) {
+  return configs[PARALLEL_COMPRESSION_THRESHOLD] != 0 &&
+         input_length >= configs[PARALLEL_COMPRESSION_THRESHOLD] &&
+         input_length > STREAM_CHUNK_SIZE && level != 0 &&
+         method == Z_DEFLATED &&
+         GetCompressedFormat(window_bits) != CompressedFormat::INVALID;
+}
+
+// Inputs of at least zlib_parallel_threshold bytes for which no accelerator
+// was selected, or the accelerator failed, are compressed by the parallel
+// software engine: the chunks are all compressed with zlib
+static bool UseParallelZlib(int level, int method, int window_bits,
+                            uint32_t input_length) {
+  return configs[ZLIB_PARALLEL_THRESHOLD] != 0 &&
+         input_length >= configs[ZLIB_PARALLEL_THRESHOLD] &&
+         input_length > STREAM_CHUNK_SIZE && level != 0 &&
+         method == Z_DEFLATED &&
+         GetCompressedFormat(window_bits) != CompressedFormat::INVALID;
+}
+
+struct ParallelChunk {
+  uint8_t* input;
+  uint32_t input_length;
+  // Input preceding the chunk, up to the window size
+  const uint8_t* dictionary;
+  uint32_t dictionary_length;
+  std::unique_ptr<uint8_t[]> output;
+  uint32_t output_length = 0;
+  uint32_t checksum = 0;
+  int ret = Z_OK;
+};
+
+// Compresses a chunk as an independent raw deflate segment with zlib. If a
+// dictionary is given, matches can refer to it, as if the segment followed it
+// in the same stream.
+static int CompressSegmentZlib(int level, int window_bits, int mem_level,
+                               int strategy, const uint8_t* dictionary,
+                               uint32_t dictionary_length, uint8_t* input,
+                               uint32_t input_length, uint8_t* output,
+                               uint32_t* output_length, bool last) {
+  z_stream zlib_stream;
+  memset(&zlib_stream, 0, sizeof(z_stream));
+  int ret = orig_deflateInit2_(&zlib_stream, level, Z_DEFLATED,
+                               GetRawWindowBits(window_bits), mem_level,
+                               strategy, ZLIB_VERSION, (int)sizeof(z_stream));
+  if (ret != Z_OK) {
+    return ret;
+  }
+  if (dictionary_length > 0) {
+    ret = orig_deflateSetDictionary(&zlib_stream, dictionary,
+                                    dictionary_length);
+    if (ret != Z_OK) {
+      orig_deflateEnd(&zlib_stream);
+      return ret;
+    }
+  }
+  zlib_stream.next_in = input;
+  zlib_stream.avail_in = input_length;
+  zlib_stream.next_out = output;
+  zlib_stream.avail_out = *output_length;
+  ret = orig_deflate(&zlib_stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+  if (ret == (last ? Z_STREAM_END : Z_OK) && zlib_stream.avail_in == 0 &&
+      zlib_stream.avail_out > 0) {
+    *output_length -= zlib_stream.avail_out;
+    ret = Z_OK;
+  } else {
+    ret = Z_STREAM_ERROR;
+  }
+  orig_deflateEnd(&zlib_stream);
+  INCREMENT_STAT(DEFLATE_ZLIB_COUNT);
+  return ret;
+}
+
+// Size of the input prefix compressed again with zlib by the ratio guard. The
+// sample runs on the caller's thread, so its cost is bounded regardless of the
+// input size.
+inline constexpr uint32_t RATIO_BASELINE_SAMPLE_SIZE = 128 << 10;
+
+// Reports the size of a whole stream compressed by an accelerator to the ratio
+// guard. For sampled calls, a prefix of the input is compressed again with
+// zlib, and the zlib size of the whole input is extrapolated from it.
+static void RecordAcceleratorRatio(ExecutionPath path, int level,
+                                   int window_bits, int mem_level,
+                                   int strategy, uint8_t* input,
+                                   uint32_t input_length,
+                                   uint32_t output_length) {
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  RecordCompressedSize(path, format, input_length, output_length);
+  if (!SampleRatioBaseline(path, format, input_length)) {
+    return;
+  }
+  uint32_t sample_length = std::min(input_length, RATIO_BASELINE_SAMPLE_SIZE);
+  uint32_t baseline_length = StreamChunkBound(sample_length);
+  std::unique_ptr<uint8_t[]> baseline(new (std::nothrow)
+                                          uint8_t[baseline_length]);
+  if (baseline == nullptr ||
+      CompressSegmentZlib(level, window_bits, mem_level, strategy, nullptr, 0,
+                          input, sample_length, baseline.get(),
+                          &baseline_length, true) != Z_OK) {
+    return;
+  }
+  uint64_t zlib_length =
+      static_cast<uint64_t>(baseline_length) * input_length / sample_length +
+      GetHeaderLength(format) + GetTrailerLength(format);
+  INCREMENT_STAT(RATIO_GUARD_SAMPLE_COUNT);
+  RecordCompressedSize(
+      ZLIB, format, input_length,
+      static_cast<uint32_t>(std::min<uint64_t>(
+          zlib_length, std::numeric_limits<uint32_t>::max())));
+}
+
+// Compresses one chunk of a parallel compression, on a worker or the calling
+// thread. Without use_accelerators, the chunk is compressed with zlib.
+static void CompressParallelChunk(EntryPoint entry_point, bool use_accelerators,
+                                  int level, int window_bits, int mem_level,
+                                  int strategy, ParallelChunk* chunk,
+                                  bool last) {
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  chunk->checksum = UpdateChecksum(format, InitialChecksum(format),
+                                   chunk->input, chunk->input_length);
+
+  uint32_t max_output_length = StreamChunkBound(chunk->input_length);
+  chunk->output.reset(new (std::nothrow) uint8_t[max_output_length]);
+  if (chunk->output == nullptr) {
+    chunk->ret = Z_MEM_ERROR;
+    return;
+  }
+  chunk->output_length = max_output_length;
+  if (use_accelerators &&
+      CompressSegmentAccelerator(entry_point, level, window_bits, strategy,
+                                 chunk->input, chunk->input_length,
+                                 chunk->output.get(), &chunk->output_length,
+                                 last) != ZLIB) {
+    return;
+  }
+
+  if (!configs[USE_ZLIB_COMPRESS]) {
+    chunk->ret = Z_DATA_ERROR;
+    return;
+  }
+  chunk->output_length = max_output_length;
+  uint64_t start_ns = StartTiming();
+  chunk->ret = CompressSegmentZlib(
+      level, window_bits, mem_level, strategy, chunk->dictionary,
+      chunk->dictionary_length, chunk->input, chunk->input_length,
+      chunk->output.get(), &chunk->output_length, last);
+  RecordTiming(Operation::COMPRESS, ZLIB, chunk->input_length, start_ns,
+               chunk->ret == Z_OK);
+}
+
+// Compresses input as a single stream made of chunks compressed concurrently
+// (parallel_compression_threshold and zlib_parallel_threshold options). Chunks
+// compressed with zlib are primed with the preceding window of input, so that
+// the compression ratio is close to that of a single zlib stream. The stream
+// is appended to output.
+static int CompressParallel(EntryPoint entry_point, bool use_accelerators,
+                            int level, int window_bits, int mem_level,
+                            int strategy, uint8_t* input,
+                            uint32_t input_length, StagingBuffer* output,
+                            uint32_t* checksum) {
+  uint32_t window_size = 1U << -GetRawWindowBits(window_bits);
+  std::vector<ParallelChunk> chunks((input_length - 1) / STREAM_CHUNK_SIZE +
+                                    1);
+  std::vector<std::function<void()>> tasks;
+  tasks.reserve(chunks.size());
+  for (size_t i = 0; i < chunks.size(); i++) {
+    ParallelChunk* chunk = &chunks[i];
+    chunk->input = input + i * STREAM_CHUNK_SIZE;
+    chunk->input_length =
+        std::min(input_length - static_cast<uint32_t>(i * STREAM_CHUNK_SIZE),
+                 STREAM_CHUNK_SIZE);
+    chunk->dictionary_length =
+        std::min(static_cast<uint32_t>(i * STREAM_CHUNK_SIZE), window_size);
+    chunk->dictionary = chunk->input - chunk->dictionary_length;
+    bool last = (i == chunks.size() - 1);
+    tasks.push_back([=] {
+      CompressParallelChunk(entry_point, use_accelerators, level, window_bits,
+                            mem_level, strategy, chunk, last);
+    });
+  }
+  RunTasks(tasks, configs[PARALLEL_COMPRESSION_THREADS]);
+
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  uint64_t output_length = MAX_HEADER_SIZE + MAX_TRAILER_SIZE;
+  *checksum = InitialChecksum(format);
+  for (const ParallelChunk& chunk : chunks) {
+    if (chunk.ret != Z_OK) {
+      return chunk.ret;
+    }
+    output_length += chunk.output_length;
+    *checksum = CombineChecksum(format, *checksum, chunk.checksum,
+                                chunk.input_length);
+  }
+  if (output_length > std::numeric_limits<uint32_t>::max()) {
+    return Z_BUF_ERROR;
+  }
+
+  uint8_t* data = output->Reserve(static_cast<uint32_t>(output_length));
+  if (data == nullptr) {
+    return Z_MEM_ERROR;
+  }
+  uint32_t pos = WriteStreamHeader(data, format, window_bits, level, strategy);
+  for (const ParallelChunk& chunk : chunks) {
+    memcpy(data + pos, chunk.output.get(), chunk.output_length);
+    pos += chunk.output_length;
+  }
+  pos += WriteStreamTrailer(data + pos, format, *checksum, input_length);
+  output->Commit(pos);
+
+  Log(LogLevel::LOG_INFO, "CompressParallel Line ", __LINE__,
+      ", input_length ", input_length, ", chunks ", chunks.size(),
+      ", output_length ", pos, "\n");
+  return Z_OK;
+}
+
+// Compresses all input of a deflate call with CompressParallel. The output is
+// kept in the stream state and returned over the next calls.
+static int DeflateParallel(z_streamp strm, DeflateSettings* deflate_settings,
+                           bool use_accelerators) {
+  auto stream = std::make_unique<DeflateStreamState>();
+  int ret = CompressParallel(
+      EntryPoint::DEFLATE, use_accelerators, deflate_settings->level,
+      deflate_settings->window_bits, deflate_settings->mem_level,
+      deflate_settings->strategy, strm->next_in, strm->avail_in,
+      &stream->output, &stream->checksum);
+  if (ret != Z_OK) {
+    return ret;
+  }
+  strm->next_in += strm->avail_in;
+  strm->total_in += strm->avail_in;
+  strm->avail_in = 0;
+  stream->finished = true;
+  deflate_settings->stream = std::move(stream);
+  deflate_settings->path = ZLIB;
+  return Z_OK;
+}
+
+// Worst-case compressed size for the selected accelerator, or 0 if unknown
+static uint32_t CompressBound(ExecutionPath path, int level, int window_bits,
+                              int strategy, uint32_t input_length) {
+#ifndef USE_QAT
+  (void)level;
+  (void)window_bits;
+  (void)strategy;
+#ifndef USE_IAA
+  (void)input_length;
+#endif
+#endif
+  if (path == IAA) {
+#ifdef USE_IAA
+    return std::min(CompressBoundIAA(input_length), MAX_BUFFER_SIZE);
+#endif
+  } else if (path == QAT) {
+#ifdef USE_QAT
+    return CompressBoundQAT(input_length, window_bits, false, level,
+                            strategy);
+#endif
+  }
+  return 0;
+}
+
+// If the caller's buffer may be too small for the accelerator output, the
+// stream is compressed into a buffer owned by the shim (deflate_buffer_output
+// option), so that the output never has to be discarded
+static bool UseDeflateOutputBuffer(uint32_t output_length, uint32_t bound) {
+  return configs[DEFLATE_BUFFER_OUTPUT] && bound > 0 && output_length < bound;
+}
+
+// Single-shot deflate calls (whole stream in one Z_FINISH call) are looked up
+// in the result cache (result_cache_size_mb option)
+static bool UseDeflateResultCache(z_streamp strm,
+                                  DeflateSettings* deflate_settings,
+                                  int flush) {
+  return !in_call && flush == Z_FINISH && deflate_settings->path == UNDEFINED &&
+         deflate_settings->stream == nullptr && strm->total_in == 0 &&
+         deflate_settings->method == Z_DEFLATED &&
+         GetCompressedFormat(deflate_settings->window_bits) !=
+             CompressedFormat::INVALID &&
+         UseResultCache(strm->avail_in);
+}
+
+// Returns the cached output of a deflate call. Output that does not fit in the
+// caller's buffer is kept in the stream state and returned over the next
+// calls. Returns 0 on a hit.
+static int DeflateCached(z_streamp strm, DeflateSettings* deflate_settings,
+                         const ResultCacheKey& key) {
+  std::shared_ptr<const CachedResult> result =
+      LookupResult(key, strm->next_in);
+  if (result == nullptr) {
+    return 1;
+  }
+  auto stream = std::make_unique<DeflateStreamState>();
+  if (result->output_length <= strm->avail_out) {
+    memcpy(strm->next_out, result->output.get(), result->output_length);
+    strm->next_out += result->output_length;
+    strm->avail_out -= result->output_length;
+    strm->total_out += result->output_length;
+  } else {
+    uint8_t* output = stream->output.Reserve(result->output_length);
+    if (output == nullptr) {
+      return 1;
+    }
+    memcpy(output, result->output.get(), result->output_length);
+    stream->output.Commit(result->output_length);
+  }
+  strm->next_in += strm->avail_in;
+  strm->total_in += strm->avail_in;
+  strm->avail_in = 0;
+  stream->checksum = result->checksum;
+  stream->finished = true;
+  deflate_settings->stream = std::move(stream);
+  deflate_settings->path = ZLIB;
+  return 0;
+}
+
+// Checksum of a whole stream for the result cache, computed from the
+// uncompressed data, as accelerator paths do not update strm->adler. zlib
+// leaves strm->adler unchanged for formats without a checksum (raw deflate).
+static uint32_t CachedStreamChecksum(z_streamp strm, int window_bits,
+                                     const uint8_t* data, uint32_t length) {
+  CompressedFormat format = GetCompressedFormat(window_bits);
+  if (format != CompressedFormat::ZLIB && format != CompressedFormat::GZIP) {
+    return static_cast<uint32_t>(strm->adler);
+  }
+  return UpdateChecksum(format, InitialChecksum(format), data, length);
+}
+
+// Caches the output of a deflate call kept in the stream state
+static void CacheDeflateStream(DeflateSettings* deflate_settings,
+                               const ResultCacheKey& key,
+                               const uint8_t* input) {
+  DeflateStreamState* stream = deflate_settings->stream.get();
+  InsertResult(key, input, key.input_length, stream->output.Data(),
+               stream->output.Pending(), stream->checksum);
+}
+
+// Passes a deflate call straight to zlib, for streams created in passthrough
+// mode and streams compressed by zlib
+static int DeflatePassthrough(z_streamp strm, int flush) {
+  INCREMENT_STAT(DEFLATE_COUNT);
+  INCREMENT_STAT(DEFLATE_ZLIB_COUNT);
+  PrintStats();
+  int ret = orig_deflate(strm, flush);
+  INCREMENT_STAT_COND(ret < 0, DEFLATE_ERROR_COUNT);
+  return ret;
+}
+
+// A stream compressed by zlib (e.g., with a dictionary) stays on zlib until
+// deflateReset, so none of the shim features apply to its next calls
+static bool IsDeflatePinnedToZlib(DeflateSettings* deflate_settings) {
+  return deflate_settings->path == ZLIB &&
+         deflate_settings->stream == nullptr &&
+         deflate_settings->zlib_initialized && configs[USE_ZLIB_COMPRESS];
+}
+
+int ZEXPORT deflate(z_streamp strm, int flush) {
+  if (compress_passthrough) {
+    return DeflatePassthrough(strm, flush);
+  }
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
+  if (deflate_settings == nullptr) {
+    return DeflatePassthrough(strm, flush);
+  }
+  if (IsDeflatePinnedToZlib(deflate_settings)) {
+    int ret = DeflatePassthrough(strm, flush);
+    deflate_settings->zlib_stream_open = ret != Z_STREAM_END;
+    return ret;
+  }
+  INCREMENT_STAT(DEFLATE_COUNT);
+  PrintStats();
+
+  Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", avail_in ", strm->avail_in, ", avail_out ",
+      strm->avail_out, ", flush ", flush, ", in_call ", in_call, ", path ",
+      static_cast<int>(deflate_settings->path), "\n");
+
+  const uint8_t* cache_input = strm->next_in;
+  bool cache_result = UseDeflateResultCache(strm, deflate_settings, flush);
+  ResultCacheKey cache_key{};
+  if (cache_result) {
+    cache_key = GetResultCacheKey(
+        EntryPoint::DEFLATE, deflate_settings->window_bits,
+        deflate_settings->level, deflate_settings->mem_level,
+        deflate_settings->strategy, strm->next_in, strm->avail_in);
+    if (DeflateCached(strm, deflate_settings, cache_key) == 0) {
+      return DeflateStream(strm, deflate_settings, flush);
+    }
+  }
+
+  if (!in_call && deflate_settings->stream == nullptr &&
+      UseDeflateStreaming(deflate_settings, flush)) {
+    // If the stream state cannot be allocated, the call continues without
+    // streaming, as other calls that cannot be offloaded
+    int stream_ret = StartDeflateStream(deflate_settings);
+    if (stream_ret != Z_OK) {
+      Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
+          static_cast<void*>(strm), ", streaming not started, return code ",
+          stream_ret, "\n");
+    }
+  }
+  if (!in_call && deflate_settings->stream != nullptr) {
+    return DeflateStream(strm, deflate_settings, flush);
+  }
+
+  if (!in_call && flush == Z_FINISH && deflate_settings->path == UNDEFINED &&
+      strm->total_in == 0 && deflate_settings->method == Z_DEFLATED &&
+      GetCompressedFormat(deflate_settings->window_bits) !=
+          CompressedFormat::INVALID &&
+      UseStoredBlocks(deflate_settings->level, strm->next_in, strm->avail_in) &&
+      DeflateStored(strm, deflate_settings) == 0) {
+    return DeflateStream(strm, deflate_settings, flush);
+  }
+
+  if (!in_call && flush == Z_FINISH && deflate_settings->path == UNDEFINED &&
+      strm->total_in == 0 &&
+      UseParallelCompression(deflate_settings->level, deflate_settings->method,
+                             deflate_settings->window_bits, strm->avail_in) &&
+      DeflateParallel(strm, deflate_settings, true) == Z_OK) {
+    if (cache_result) {
+      CacheDeflateStream(deflate_settings, cache_key, cache_input);
+    }
+    return DeflateStream(strm, deflate_settings, flush);
+  }
+
+  int ret = 1;
+  bool iaa_available = false;
+  bool qat_available = false;
+  if (!in_call && flush == Z_FINISH && deflate_settings->path != ZLIB) {
+    uint32_t input_len = strm->avail_in;
+    uint32_t output_len = strm->avail_out;
+
+#ifdef USE_IAA
+    iaa_available = configs[USE_IAA_COMPRESS] &&
+                    SupportedOptionsIAA(deflate_settings->window_bits,
+                                        input_len, output_len);
+#endif
+#ifdef USE_QAT
+    qat_available =
+        configs[USE_QAT_COMPRESS] &&
+        SupportedOptionsQAT(deflate_settings->window_bits, input_len);
+#endif
+
+    ExecutionPath path_selected =
+        SelectPath(EntryPoint::DEFLATE, deflate_settings->window_bits,
+                   iaa_available, qat_available, input_len);
+
+    uint8_t* output = strm->next_out;
+    std::unique_ptr<DeflateStreamState> stream;
+    uint32_t bound =
+        CompressBound(path_selected, deflate_settings->level,
+                      deflate_settings->window_bits,
+                      deflate_settings->strategy, input_len);
+    if (UseDeflateOutputBuffer(output_len, bound)) {
+      stream = std::make_unique<DeflateStreamState>();
+      output = stream->output.Reserve(bound);
+      if (output != nullptr) {
+        output_len = bound;
+      } else {
+        stream.reset();
+        output = strm->next_out;
+      }
+    }
+
+    uint64_t start_ns = StartTiming();
+    if (path_selected == IAA) {
+#ifdef USE_IAA
+      in_call = true;
+      // Casting to uint32_t is safe, as IAA is not used for any blocks larger
+      // than 2MB. The bound is not needed when the output is buffered.
+      uint32_t max_compressed_size =
+          stream ? 0 : (uint32_t)deflateBound(strm, input_len);
+      int level = deflate_settings->level;
+      int window_bits = deflate_settings->window_bits;
+      int strategy = deflate_settings->strategy;
+      ret = CallAccelerator(
+          Operation::COMPRESS,
+          [=](uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t* out_len,
+              bool*) {
+            return CompressIAA(in, in_len, out, out_len, qpl_path_hardware,
+                               window_bits, max_compressed_size, false, level,
+                               strategy);
+          },
+          strm->next_in, &input_len, output, &output_len,
+          CompressBound(IAA, level, window_bits, strategy, input_len),
+          nullptr);
+      deflate_settings->path = IAA;
+      in_call = false;
+      INCREMENT_STAT(DEFLATE_IAA_COUNT);
+      INCREMENT_STAT_COND(ret != 0 && ret != HEDGE_NOT_RUN,
+                          DEFLATE_IAA_ERROR_COUNT);
+#endif  // USE_IAA
+    } else if (path_selected == QAT) {
+#ifdef USE_QAT
+      in_call = true;
+      int level = deflate_settings->level;
+      int window_bits = deflate_settings->window_bits;
+      int strategy = deflate_settings->strategy;
+      ret = CallAccelerator(
+          Operation::COMPRESS,
+          [=](uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t* out_len,
+              bool*) {
+            return CompressQAT(in, in_len, out, out_len, window_bits, false,
+                               level, strategy);
+          },
+          strm->next_in, &input_len, output, &output_len,
+          CompressBound(QAT, level, window_bits, strategy, input_len),
+          nullptr);
+      deflate_settings->path = QAT;
+      in_call = false;
+      INCREMENT_STAT(DEFLATE_QAT_COUNT);
+      INCREMENT_STAT_COND(ret != 0 && ret != HEDGE_NOT_RUN,
+                          DEFLATE_QAT_ERROR_COUNT);
+#endif  // USE_QAT
+    }
+    // A call not run by the hedge workers is not an accelerator failure
+    if (path_selected != ZLIB && ret != HEDGE_NOT_RUN) {
+      RecordAcceleratorResult(Operation::COMPRESS, path_selected,
+                              deflate_settings->window_bits, strm->avail_in,
+                              start_ns, ret == 0);
+    }
+
+    // The buffered output is returned as a finished stream. Partial output is
+    // not buffered, as the rest of the input would need to be compressed as
+    // another stream.
+    if (ret == 0 && input_len == strm->avail_in && strm->total_in == 0) {
+      RecordAcceleratorRatio(path_selected, deflate_settings->level,
+                             deflate_settings->window_bits,
+                             deflate_settings->mem_level,
+                             deflate_settings->strategy, strm->next_in,
+                             input_len, output_len);
+    }
+
+    if (ret == 0 && stream != nullptr) {
+      if (input_len == strm->avail_in) {
+        strm->next_in += input_len;
+        strm->avail_in -= input_len;
+        strm->total_in += input_len;
+        stream->output.Commit(output_len);
+        stream->checksum = static_cast<uint32_t>(strm->adler);
+        if (cache_result) {
+          stream->checksum =
+              CachedStreamChecksum(strm, deflate_settings->window_bits,
+                                   cache_input, input_len);
+        }
+        stream->finished = true;
+        deflate_settings->stream = std::move(stream);
+        if (cache_result) {
+          CacheDeflateStream(deflate_settings, cache_key, cache_input);
+        }
+        return DeflateStream(strm, deflate_settings, flush);
+      }
+      ret = 1;
+    }
+
+    if (ret == 0) {
+      strm->next_in += input_len;
+      strm->avail_in -= input_len;
+      strm->total_in += input_len;
+      strm->next_out += output_len;
+      strm->avail_out -= output_len;
+      strm->total_out += output_len;
+      if (strm->avail_in == 0) {
+        ret = Z_STREAM_END;
+        if (cache_result) {
+          strm->adler = CachedStreamChecksum(
+              strm, deflate_settings->window_bits, cache_input, input_len);
+          InsertResult(cache_key, cache_input, input_len,
+                       strm->next_out - output_len, output_len,
+                       static_cast<uint32_t>(strm->adler));
+        }
+      } else {
+        ret = Z_BUF_ERROR;
+      }
+
+      Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
+          static_cast<void*>(strm), ", accelerator return code ", ret,
+          ", avail_in ", strm->avail_in, ", avail_out ", strm->avail_out,
+          ", path ", static_cast<int>(deflate_settings->path), "\n");
+      return ret;
+    }
+  }
+
+  // A stream with a dictionary is always compressed by zlib (path ZLIB)
+  if (!in_call && flush == Z_FINISH && strm->total_in == 0 &&
+      deflate_settings->path != ZLIB && configs[USE_ZLIB_COMPRESS] &&
+      UseParallelZlib(deflate_settings->level, deflate_settings->method,
+                      deflate_settings->window_bits, strm->avail_in) &&
+      DeflateParallel(strm, deflate_settings, false) == Z_OK) {
+    if (cache_result) {
+      CacheDeflateStream(deflate_settings, cache_key, cache_input);
+    }
+    return DeflateStream(strm, deflate_settings, flush);
+  }
+
+  if (in_call || configs[USE_ZLIB_COMPRESS]) {
+    // Only calls compressing a whole stream are timed for the scheduler
+    bool timed = !in_call && flush == Z_FINISH && strm->total_in == 0;
+    uint64_t start_ns = timed ? StartTiming() : 0;
+    ret = InitLazyDeflate(strm, deflate_settings);
+    if (ret == Z_OK) {
+      ret = orig_deflate(strm, flush);
+      INCREMENT_STAT(DEFLATE_ZLIB_COUNT);
+      deflate_settings->zlib_stream_open = ret != Z_STREAM_END;
+    }
+    if (!in_call) {
+      deflate_settings->path = ZLIB;
+    }
+    if (timed && ret == Z_STREAM_END) {
+      RecordTiming(Operation::COMPRESS, ZLIB,
+                   static_cast<uint32_t>(strm->total_in), start_ns, true);
+      RecordCompressedSize(ZLIB,
+                           GetCompressedFormat(deflate_settings->window_bits),
+                           static_cast<uint32_t>(strm->total_in),
+                           static_cast<uint32_t>(strm->total_out));
+    }
+    if (cache_result && ret == Z_STREAM_END) {
+      InsertResult(cache_key, cache_input,
+                   static_cast<uint32_t>(strm->total_in),
+                   strm->next_out - strm->total_out,
+                   static_cast<uint32_t>(strm->total_out),
+                   static_cast<uint32_t>(strm->adler));
+    }
+  } else {
+    ret = Z_DATA_ERROR;
+  }
+
+  Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", zlib return code ", ret, ", avail_in ",
+      strm->avail_in, ", avail_out ", strm->avail_out, ", path ",
+      static_cast<int>(deflate_settings->path), "\n");
+
+  INCREMENT_STAT_COND(ret < 0, DEFLATE_ERROR_COUNT);
+  return ret;
+}
+
+int ZEXPORT deflateEnd(z_streamp strm) {
+  Log(LogLevel::LOG_INFO, "deflateEnd Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), "\n");
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
+  bool zlib_initialized =
+      deflate_settings == nullptr || deflate_settings->zlib_initialized;
+  bool pooled =
+      deflate_settings != nullptr && PoolZlibDeflate(strm, deflate_settings);
+  deflate_stream_settings.Unset(strm);
+  if (!zlib_initialized || pooled) {
+    return Z_OK;
+  }
+  return orig_deflateEnd(strm);
+}
+
+int ZEXPORT deflateReset(z_streamp strm) {
+  if (in_zlib_init) {
+    return orig_deflateReset(strm);
+  }
+  Log(LogLevel::LOG_INFO, "deflateReset Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), "\n");
+  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
+  if (deflate_settings != nullptr) {
+    deflate_settings->path = deflate_settings->custom_header ? ZLIB : UNDEFINED;
+    deflate_settings->stream.reset();
+    deflate_settings->zlib_stream_open = false;
+    if (!deflate_settings->zlib_initialized) {
+      ResetLazyDeflate(strm, deflate_settings);
+      return Z_OK;
+    }
+  }
+
+  return orig_deflateReset(strm);
+}
+
+// Streams whose zlib initialization is deferred have no zlib state yet. The
+// bound is computed from the stream settings instead.
+uLong ZEXPORT deflateBound(z_streamp strm, uLong sourceLen) {
+  DeflateSettings* deflate_settings =
+      compress_passthrough ? nullptr : deflate_stream_settings.Get(strm);
+  if (deflate_settings == nullptr || deflate_settings->zlib_initialized) {
+    return orig_deflateBound(strm, sourceLen);
+  }
+  // Without a zlib state, zlib returns a bound for any settings with a zlib
+  // wrapper
+  CompressedFormat format = GetCompressedFormat(deflate_settings->window_bits);
+  return orig_deflateBound(Z_NULL, sourceLen) -
+         (GetHeaderLength(CompressedFormat::ZLIB) +
+          GetTrailerLength(CompressedFormat::ZLIB)) +
+         GetHeaderLength(format) + GetTrailerLength(format);
+}
+
+// Sets the fields of a stream set by inflateReset
+static void ResetLazyInflate(z_streamp strm,
+                             InflateSettings* inflate_settings) {
+  int window_bits = inflate_settings->init_window_bits;
+  strm->total_in = 0;
+  strm->total_out = 0;
+  strm->msg = Z_NULL;
+  if (window_bits >= 0) {
+    // zlib sets adler to 0 for gzip only, and to 1 for zlib or automatic
+    // header detection
+    strm->adler = window_bits >= 16 && window_bits < 32 ? 0 : 1;
+  }
+}
+
+// Allocates the zlib state of a stream whose initialization was deferred. The
+// counters and checksum set by accelerator calls are kept.
+static int InitLazyInflate(z_streamp strm, InflateSettings* inflate_settings) {
+  if (inflate_settings->zlib_initialized) {
+    return Z_OK;
+  }
+  uLong total_in = strm->total_in;
+  uLong total_out = strm->total_out;
+  uLong adler = strm->adler;
+  int ret = InitZlibInflate(strm, inflate_settings);
+  if (ret != Z_OK) {
+    return ret;
+  }
+  strm->total_in = total_in;
+  strm->total_out = total_out;
+  strm->adler = adler;
+  inflate_settings->zlib_initialized = true;
+  return Z_OK;
+}
+
+int ZEXPORT inflateInit_(z_streamp strm, const char* version, int stream_size) {
+  if (uncompress_passthrough) {
+    return orig_inflateInit_(strm, version, stream_size);
+  }
+  Log(LogLevel::LOG_INFO, "inflateInit_ Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), "\n");
+
+  return inflateInit2_(strm, 15, version, stream_size);
+}
+
+int ZEXPORT inflateInit2_(z_streamp strm, int window_bits, const char* version,
+                          int stream_size) {
+  if (uncompress_passthrough) {
+    return orig_inflateInit2_(strm, window_bits, version, stream_size);
+  }
+  InflateSettings* inflate_settings =
+      inflate_stream_settings.Set(strm, window_bits);
+  Log(LogLevel::LOG_INFO, "inflateInit2_ Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", window_bits ", window_bits, "\n");
+
+  if (!IsValidInflateInit(strm, window_bits, version, stream_size)) {
+    return orig_inflateInit2_(strm, window_bits, version, stream_size);
+  }
+  inflate_settings->version = version;
+  inflate_settings->stream_size = stream_size;
+  inflate_settings->pool_zlib_state = UseZlibStatePool(strm);
+  if (configs[LAZY_ZLIB_INIT]) {
+    inflate_settings->zlib_initialized = false;
+    strm->state = Z_NULL;
+    ResetLazyInflate(strm, inflate_settings);
+    return Z_OK;
+  }
+  return InitZlibInflate(strm, inflate_settings);
+}
+
+int ZEXPORT inflateSetDictionary(z_streamp strm, const Bytef* dictionary,
+                                 uInt dictLength) {
+  Log(LogLevel::LOG_INFO, "inflateSetDictionary Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", dictLength ", dictLength, "\n");
+  InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
+  if (inflate_settings != nullptr) {
+    inflate_settings->path = ZLIB;
+    int ret = InitLazyInflate(strm, inflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  return orig_inflateSetDictionary(strm, dictionary, dictLength);
+}
+
+// Attempts decompression with an accelerator. Returns 0 on success.
+static int UncompressAccelerator(InflateSettings* inflate_settings,
+                                 uint8_t* input, uint32_t* input_length,
+                                 uint8_t* output, uint32_t* output_length,
+                                 bool* end_of_stream) {
+  int ret = 1;
+  bool iaa_available = false;
+  bool qat_available = false;
+#if !defined(USE_IAA) && !defined(USE_QAT)
+  (void)output;
+#endif
+
+  // If the output is known or predicted not to fit, no accelerator is tried
+  CompressedFormat format = GetCompressedFormat(inflate_settings->window_bits);
+  uint32_t predicted_length =
+      PredictUncompressedSize(format, input, *input_length);
+  if (predicted_length > *output_length) {
+    INCREMENT_STAT(INFLATE_SIZE_SKIP_COUNT);
+    return 1;
+  }
+  if (predicted_length == 0 &&
+      PredictOutputOverflow(format, *input_length, *output_length)) {
+    INCREMENT_STAT(INFLATE_PREDICTED_SKIP_COUNT);
+    return 1;
+  }
+
+#ifdef USE_IAA
+  // With a predicted size, the output buffer is only limited by the size of
+  // the decompressed data
+  uint32_t iaa_output_length =
+      predicted_length > 0 ? predicted_length : *output_length;
+  iaa_available =
+      configs[USE_IAA_UNCOMPRESS] &&
+      SupportedOptionsIAA(inflate_settings->window_bits, *input_length,
+                          iaa_output_length) &&
+      IsIAADecompressible(input, *input_length, inflate_settings->window_bits);
+
+#endif
+#ifdef USE_QAT
+  qat_available =
+      configs[USE_QAT_UNCOMPRESS] &&
+      SupportedOptionsQAT(inflate_settings->window_bits, *input_length);
+#endif
+
+  ExecutionPath path_selected =
+      SelectPath(EntryPoint::INFLATE, inflate_settings->window_bits,
+                 iaa_available, qat_available, *input_length);
+  uint32_t input_len = *input_length;
+  uint64_t start_ns = StartTiming();
+  if (path_selected == IAA) {
+#ifdef USE_IAA
+    in_call = true;
+    int window_bits = inflate_settings->window_bits;
+    *output_length = std::min(*output_length, MAX_BUFFER_SIZE);
+    ret = CallAccelerator(
+        Operation::UNCOMPRESS,
+        [=](uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t* out_len,
+            bool* eos) {
+          return UncompressIAA(in, in_len, out, out_len, qpl_path_hardware,
+                               window_bits, eos);
+        },
+        input, input_length, output, output_length, predicted_length,
+        end_of_stream);
+    inflate_settings->path = IAA;
+    in_call = false;
+    INCREMENT_STAT(INFLATE_IAA_COUNT);
+    INCREMENT_STAT_COND(ret != 0 && ret != HEDGE_NOT_RUN,
+                        INFLATE_IAA_ERROR_COUNT);
+#endif  // USE_IAA
+  } else if (path_selected == QAT) {
+#ifdef USE_QAT
+    in_call = true;
+    int window_bits = inflate_settings->window_bits;
+    ret = CallAccelerator(
+        Operation::UNCOMPRESS,
+        [=](uint8_t* in, uint32_t* in_len, uint8_t* out, uint32_t* out_len,
+            bool* eos) {
+          return UncompressQAT(in, in_len, out, out_len, window_bits, eos);
+        },
+        input, input_length, output, output_length, predicted_length,
+        end_of_stream);
+    inflate_settings->path = QAT;
+    // QATzip does not support stateful decompression
+    // Fall back to zlib if end-of-stream not reached in one call
+    if (ret == 0 && !*end_of_stream) {
+      ret = 1;
+    }
+    in_call = false;
+    INCREMENT_STAT(INFLATE_QAT_COUNT);
+    INCREMENT_STAT_COND(ret != 0 && ret != HEDGE_NOT_RUN,
+                        INFLATE_QAT_ERROR_COUNT);
+#endif  // USE_QAT
+  }
+  // A call not run by the hedge workers is not an accelerator failure
+  if (path_selected != ZLIB && ret != HEDGE_NOT_RUN) {
+    RecordAcceleratorResult(Operation::UNCOMPRESS, path_selected,
+                            inflate_settings->window_bits, input_len, start_ns,
+                            ret == 0);
+  }
+  if (ret == 0 && *end_of_stream) {
+    RecordExpansion(format, *input_length, *output_length);
+  }
+  return ret;
+}
+
+// The decompressed size is predicted from the stream if possible, otherwise
+// estimated from the compressed size
+static bool UseInflateOutputBuffer(InflateSettings* inflate_settings,
+                                   uint8_t* input, uint32_t input_length,
+                                   uint32_t output_length) {
+  if (!configs[INFLATE_BUFFER_OUTPUT] || output_length == 0 ||
+      output_length >= INFLATE_OUTPUT_BUFFER_SIZE) {
+    return false;
+  }
+  CompressedFormat format = GetCompressedFormat(inflate_settings->window_bits);
+  uint32_t predicted_length =
+      PredictUncompressedSize(format, input, input_length);
+  if (predicted_length > 0) {
+    return predicted_length > output_length &&
+           predicted_length <= INFLATE_OUTPUT_BUFFER_SIZE;
+  }
+  if (PredictExpandedSize(format, input_length) > 0) {
+    bool use_buffer =
+        PredictOutputOverflow(format, input_length, output_length) &&
+        !PredictOutputOverflow(format, input_length,
+                               INFLATE_OUTPUT_BUFFER_SIZE);
+    INCREMENT_STAT_COND(use_buffer, INFLATE_PREDICTED_BUFFER_COUNT);
+    return use_buffer;
+  }
+  return static_cast<uint64_t>(input_length) * INFLATE_EXPANSION_ESTIMATE >
+         output_length;
+}
+
+// Decompresses a complete stream with an accelerator into the stream's output
+// buffer, to be copied to the caller's buffer over the next calls. Returns 0
+// on success.
+static int UncompressToOutputBuffer(InflateSettings* inflate_settings,
+                                    uint8_t* input, uint32_t* input_length) {
+  if (inflate_settings->stream == nullptr) {
+    inflate_settings->stream = std::make_unique<InflateStreamState>(
+        inflate_settings->window_bits);
+  }
+  InflateStreamState* stream = inflate_settings->stream.get();
+  uint8_t* output = stream->output.Reserve(INFLATE_OUTPUT_BUFFER_SIZE);
+  if (output == nullptr) {
+    return 1;
+  }
+
+  uint32_t output_len = INFLATE_OUTPUT_BUFFER_SIZE;
+  bool end_of_stream = false;
+  int ret = UncompressAccelerator(inflate_settings, input, input_length,
+                                  output, &output_len, &end_of_stream);
+  if (ret == 0 && end_of_stream) {
+    stream->output.Commit(output_len);
+    stream->done = true;
+    return 0;
+  }
+  stream->output.Release();
+  return 1;
+}
 
-#ifdef USE_IAA
-    iaa_available = configs[USE_IAA_COMPRESS] &&
-                    SupportedOptionsIAA(deflate_settings->window_bits,
-                                        input_len, output_len);
-#endif
-#ifdef USE_QAT
-    qat_available =
-        configs[USE_QAT_COMPRESS] &&
-        SupportedOptionsQAT(deflate_settings->window_bits, input_len);
-#endif
+// Buffering is only needed if the first call does not have the whole stream
+static bool UseInflateBuffering(z_streamp strm,
+                                InflateSettings* inflate_settings) {
+  if (!configs[INFLATE_BUFFER_INPUT] || inflate_settings->path != UNDEFINED ||
+      strm->avail_in == 0 ||
+      (!configs[USE_QAT_UNCOMPRESS] && !configs[USE_IAA_UNCOMPRESS]) ||
+      GetCompressedFormat(inflate_settings->window_bits) ==
+          CompressedFormat::INVALID) {
+    return false;
+  }
+  StreamParser parser(inflate_settings->window_bits);
+  return parser.Parse(strm->next_in, strm->avail_in) ==
+         DeflateParser::Status::NEED_MORE_INPUT;
+}
 
-    // If both accelerators are enabled, send configured ratio of requests to
-    // one or the other
-    ExecutionPath path_selected = ZLIB;
-    if (iaa_available && qat_available) {
-      if (static_cast<uint32_t>(std::rand() % 100) <
-          configs[IAA_COMPRESS_PERCENTAGE]) {
-        path_selected = IAA;
-      } else {
-        path_selected = QAT;
-      }
-    } else if (iaa_available) {
-      path_selected = IAA;
-    } else if (qat_available) {
-      path_selected = QAT;
+// Passes the buffered input to zlib, then the caller's input. The buffered
+// input is already included in total_in.
+static int InflateReplay(z_streamp strm, InflateSettings* inflate_settings,
+                         int flush) {
+  InflateStreamState* stream = inflate_settings->stream.get();
+  inflate_settings->path = ZLIB;
+  if (!configs[USE_ZLIB_UNCOMPRESS]) {
+    return Z_DATA_ERROR;
+  }
+
+  int ret = InitLazyInflate(strm, inflate_settings);
+  if (ret != Z_OK) {
+    return ret;
+  }
+  bool progress = false;
+  if (stream->input.Pending() > 0) {
+    z_const Bytef* next_in = strm->next_in;
+    uInt avail_in = strm->avail_in;
+    uLong total_in = strm->total_in;
+    uLong total_out = strm->total_out;
+    strm->next_in = const_cast<Bytef*>(stream->input.Data());
+    strm->avail_in = stream->input.Pending();
+    ret = orig_inflate(strm, flush);
+    INCREMENT_STAT(INFLATE_ZLIB_COUNT);
+    stream->input.Consume(stream->input.Pending() - strm->avail_in);
+    progress = (strm->total_in != total_in || strm->total_out != total_out);
+    strm->next_in = next_in;
+    strm->avail_in = avail_in;
+    strm->total_in = total_in;
+    if (ret != Z_OK || stream->input.Pending() > 0) {
+      return ret;
     }
+  }
 
-    if (path_selected == IAA) {
-#ifdef USE_IAA
-      in_call = true;
-      // Casting to uint32_t is safe, as IAA is not used for any blocks larger
-      // than 2MB
-      uint32_t max_compressed_size = (uint32_t)deflateBound(strm, input_len);
-      ret = CompressIAA(strm->next_in, &input_len, strm->next_out, &output_len,
-                        qpl_path_hardware, deflate_settings->window_bits,
-                        max_compressed_size);
-      deflate_settings->path = IAA;
-      in_call = false;
-      INCREMENT_STAT(DEFLATE_IAA_COUNT);
-      INCREMENT_STAT_COND(ret != 0, DEFLATE_IAA_ERROR_COUNT);
-#endif  // USE_IAA
-    } else if (path_selected == QAT) {
-#ifdef USE_QAT
-      in_call = true;
-      ret = CompressQAT(strm->next_in, &input_len, strm->next_out, &output_len,
-                        deflate_settings->window_bits);
-      deflate_settings->path = QAT;
-      in_call = false;
-      INCREMENT_STAT(DEFLATE_QAT_COUNT);
-      INCREMENT_STAT_COND(ret != 0, DEFLATE_QAT_ERROR_COUNT);
-#endif  // USE_QAT
+  // All buffered input was consumed, continue with zlib only
+  inflate_settings->stream.reset();
+  if (strm->avail_in > 0 && strm->avail_out > 0) {
+    ret = orig_inflate(strm, flush);
+    INCREMENT_STAT(INFLATE_ZLIB_COUNT);
+    if (ret == Z_BUF_ERROR && progress) {
+      ret = Z_OK;
     }
+  }
+  return ret;
+}
 
-    if (ret == 0) {
+// Inflate for streams not received in one call (inflate_buffer_input option).
+// Input is buffered until the end of the stream is found, then the stream is
+// decompressed in one accelerator job. If this is not possible, the buffered
+// input is passed to zlib.
+static int InflateStream(z_streamp strm, InflateSettings* inflate_settings,
+                         int flush) {
+  InflateStreamState* stream = inflate_settings->stream.get();
+  int ret = Z_OK;
+  bool progress = false;
+  if (!stream->done && !stream->replay) {
+    uint32_t input_len = strm->avail_in;
+    uint8_t* buf = nullptr;
+    if (input_len > 0 &&
+        stream->input.Pending() + static_cast<uint64_t>(input_len) <=
+            INFLATE_BUFFER_MAX_SIZE) {
+      buf = stream->input.Reserve(input_len);
+    }
+    DeflateParser::Status status = DeflateParser::Status::ERROR;
+    if (buf != nullptr) {
+      memcpy(buf, strm->next_in, input_len);
+      stream->input.Commit(input_len);
       strm->next_in += input_len;
       strm->avail_in -= input_len;
       strm->total_in += input_len;
-      strm->next_out += output_len;
-      strm->avail_out -= output_len;
-      strm->total_out += output_len;
-      if (strm->avail_in == 0) {
-        ret = Z_STREAM_END;
+      progress = true;
+      status =
+          stream->parser.Parse(stream->input.Data(), stream->input.Pending());
+    } else if (input_len == 0) {
+      status = DeflateParser::Status::NEED_MORE_INPUT;
+    }
+
+    if (status == DeflateParser::Status::NEED_MORE_INPUT) {
+      ret = input_len > 0 ? Z_OK : Z_BUF_ERROR;
+    } else if (status == DeflateParser::Status::END_OF_STREAM) {
+      // Return input past the end of the stream to the caller. It was all
+      // received in this call, as the stream was not complete before.
+      uint32_t stream_len = stream->parser.GetStreamLength();
+      uint32_t excess = stream->input.Pending() - stream_len;
+      stream->input.Truncate(stream_len);
+      strm->next_in -= excess;
+      strm->avail_in += excess;
+      strm->total_in -= excess;
+
+      uint8_t* input = const_cast<uint8_t*>(stream->input.Data());
+      if (UseInflateOutputBuffer(inflate_settings, input, stream_len,
+                                 strm->avail_out)) {
+        ret = UncompressToOutputBuffer(inflate_settings, input, &stream_len);
       } else {
-        ret = Z_BUF_ERROR;
+        uint32_t output_len = strm->avail_out;
+        bool end_of_stream = false;
+        ret = UncompressAccelerator(inflate_settings, input, &stream_len,
+                                    strm->next_out, &output_len,
+                                    &end_of_stream);
+        if (ret == 0 && end_of_stream) {
+          strm->next_out += output_len;
+          strm->avail_out -= output_len;
+          strm->total_out += output_len;
+          stream->done = true;
+        } else {
+          ret = 1;
+        }
       }
-
-      Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
-          static_cast<void*>(strm), ", accelerator return code ", ret,
-          ", avail_in ", strm->avail_in, ", avail_out ", strm->avail_out,
-          ", path ", static_cast<int>(deflate_settings->path), "\n");
-      return ret;
+      if (ret == 0) {
+        stream->input.Release();
+      } else {
+        stream->replay = true;
+      }
+    } else {
+      stream->replay = true;
     }
   }
 
-  if (in_call || configs[USE_ZLIB_COMPRESS]) {
-    ret = orig_deflate(strm, flush);
-    INCREMENT_STAT(DEFLATE_ZLIB_COUNT);
-    if (!in_call) {
-      deflate_settings->path = ZLIB;
+  if (stream->done) {
+    uint32_t output_len = stream->output.Drain(strm->next_out, strm->avail_out);
+    strm->next_out += output_len;
+    strm->avail_out -= output_len;
+    strm->total_out += output_len;
+    progress |= (output_len > 0);
+    if (stream->output.Pending() == 0) {
+      stream->output.Release();
+      ret = Z_STREAM_END;
+    } else {
+      ret = progress ? Z_OK : Z_BUF_ERROR;
     }
-  } else {
-    ret = Z_DATA_ERROR;
+  } else if (stream->replay) {
+    ret = InflateReplay(strm, inflate_settings, flush);
   }
 
-  Log(LogLevel::LOG_INFO, "deflate Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), ", zlib return code ", ret, ", avail_in ",
-      strm->avail_in, ", avail_out ", strm->avail_out, ", path ",
-      static_cast<int>(deflate_settings->path), "\n");
+  Log(LogLevel::LOG_INFO, "inflate Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", buffered input return code ", ret,
+      ", avail_in ", strm->avail_in, ", avail_out ", strm->avail_out,
+      ", path ", static_cast<int>(inflate_settings->path), "\n");
 
-  INCREMENT_STAT_COND(ret < 0, DEFLATE_ERROR_COUNT);
+  INCREMENT_STAT_COND(ret < 0 && ret != Z_BUF_ERROR, INFLATE_ERROR_COUNT);
   return ret;
 }
 
-int ZEXPORT deflateEnd(z_streamp strm) {
-  Log(LogLevel::LOG_INFO, "deflateEnd Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), "\n");
-  deflate_stream_settings.Unset(strm);
-  return orig_deflateEnd(strm);
+// Single-shot inflate calls (first call of the stream) are looked up in the
+// result cache (result_cache_size_mb option)
+static bool UseInflateResultCache(z_streamp strm,
+                                  InflateSettings* inflate_settings) {
+  return !in_call && inflate_settings->path == UNDEFINED &&
+         inflate_settings->stream == nullptr && strm->total_in == 0 &&
+         UseResultCache(strm->avail_in);
 }
 
-int ZEXPORT deflateReset(z_streamp strm) {
-  Log(LogLevel::LOG_INFO, "deflateReset Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), "\n");
-  DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
-  if (deflate_settings != nullptr) {
-    deflate_settings->path = UNDEFINED;
+// Returns the cached output of an inflate call. Output that does not fit in the
+// caller's buffer is kept in the stream state and returned over the next
+// calls. Returns 0 on a hit.
+static int InflateCached(z_streamp strm, InflateSettings* inflate_settings,
+                         const ResultCacheKey& key) {
+  std::shared_ptr<const CachedResult> result =
+      LookupResult(key, strm->next_in);
+  if (result == nullptr) {
+    return 1;
   }
-
-  return orig_deflateReset(strm);
-}
-
-int ZEXPORT inflateInit_(z_streamp strm, const char* version, int stream_size) {
-  inflate_stream_settings.Set(strm, 15);
-  Log(LogLevel::LOG_INFO, "inflateInit_ Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), "\n");
-
-  return orig_inflateInit_(strm, version, stream_size);
+  auto stream =
+      std::make_unique<InflateStreamState>(inflate_settings->window_bits);
+  if (result->output_length <= strm->avail_out) {
+    memcpy(strm->next_out, result->output.get(), result->output_length);
+    strm->next_out += result->output_length;
+    strm->avail_out -= result->output_length;
+    strm->total_out += result->output_length;
+  } else {
+    uint8_t* output = stream->output.Reserve(result->output_length);
+    if (output == nullptr) {
+      return 1;
+    }
+    memcpy(output, result->output.get(), result->output_length);
+    stream->output.Commit(result->output_length);
+  }
+  strm->next_in += result->input_consumed;
+  strm->avail_in -= result->input_consumed;
+  strm->total_in += result->input_consumed;
+  strm->adler = result->checksum;
+  stream->done = true;
+  inflate_settings->stream = std::move(stream);
+  return 0;
 }
 
-int ZEXPORT inflateInit2_(z_streamp strm, int window_bits, const char* version,
-                          int stream_size) {
-  inflate_stream_settings.Set(strm, window_bits);
-  Log(LogLevel::LOG_INFO, "inflateInit2_ Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), ", window_bits ", window_bits, "\n");
-
-  return orig_inflateInit2_(strm, window_bits, version, stream_size);
+// Passes an inflate call straight to zlib, for streams created in passthrough
+// mode
+static int InflatePassthrough(z_streamp strm, int flush) {
+  INCREMENT_STAT(INFLATE_COUNT);
+  INCREMENT_STAT(INFLATE_ZLIB_COUNT);
+  PrintStats();
+  int ret = orig_inflate(strm, flush);
+  INCREMENT_STAT_COND(ret < 0, INFLATE_ERROR_COUNT);
+  return ret;
 }
 
-int ZEXPORT inflateSetDictionary(z_streamp strm, const Bytef* dictionary,
-                                 uInt dictLength) {
-  Log(LogLevel::LOG_INFO, "inflateSetDictionary Line ", __LINE__, ", strm ",
-      static_cast<void*>(strm), ", dictLength ", dictLength, "\n");
-  InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
-  inflate_settings->path = ZLIB;
-  return orig_inflateSetDictionary(strm, dictionary, dictLength);
+// Passes an inflate call of a stream decompressed by zlib (e.g., with a
+// dictionary) straight to zlib. The stream stays on zlib until inflateReset.
+// Its expansion ratio is still recorded for inflate_expansion_prediction.
+static int InflatePinned(z_streamp strm, InflateSettings* inflate_settings,
+                         int flush) {
+  int ret = InflatePassthrough(strm, flush);
+  if (!in_call && ret == Z_STREAM_END) {
+    RecordExpansion(GetCompressedFormat(inflate_settings->window_bits),
+                    static_cast<uint32_t>(strm->total_in),
+                    static_cast<uint32_t>(strm->total_out));
+  }
+  return ret;
 }
 
 int ZEXPORT inflate(z_streamp strm, int flush) {
+  if (uncompress_passthrough) {
+    return InflatePassthrough(strm, flush);
+  }
   InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
+  if (inflate_settings == nullptr) {
+    return InflatePassthrough(strm, flush);
+  }
+  if (inflate_settings->path == ZLIB && inflate_settings->stream == nullptr &&
+      inflate_settings->zlib_initialized && configs[USE_ZLIB_UNCOMPRESS]) {
+    return InflatePinned(strm, inflate_settings, flush);
+  }
   INCREMENT_STAT(INFLATE_COUNT);
   PrintStats();
 
@@ -432,74 +2410,68 @@ int ZEXPORT inflate(z_streamp strm, int flush) {
       static_cast<void*>(strm), ", avail_in ", strm->avail_in, ", avail_out ",
       strm->avail_out, ", flush ", flush, ", in_call ", in_call, ", path ",
       static_cast<int>(inflate_settings->path), "\n");
+
+  // The format is resolved on the first call of the stream, so that streams
+  // initialized with automatic header detection can be offloaded. zlib
+  // still detects the header itself if the stream falls back to it.
+  if (!in_call && inflate_settings->path == UNDEFINED &&
+      strm->total_in == 0) {
+    inflate_settings->window_bits = DetectWindowBits(
+        inflate_settings->init_window_bits, strm->next_in, strm->avail_in);
+  }
   PrintDeflateBlockHeader(LogLevel::LOG_INFO, strm->next_in, strm->avail_in,
                           inflate_settings->window_bits);
 
+  const uint8_t* cache_input = strm->next_in;
+  bool cache_result = UseInflateResultCache(strm, inflate_settings);
+  ResultCacheKey cache_key{};
+  if (cache_result) {
+    cache_key = GetResultCacheKey(EntryPoint::INFLATE,
+                                  inflate_settings->init_window_bits, 0, 0, 0,
+                                  strm->next_in, strm->avail_in);
+    if (InflateCached(strm, inflate_settings, cache_key) == 0) {
+      return InflateStream(strm, inflate_settings, flush);
+    }
+  }
+
+  if (!in_call && inflate_settings->stream == nullptr &&
+      UseInflateBuffering(strm, inflate_settings)) {
+    inflate_settings->stream = std::make_unique<InflateStreamState>(
+        inflate_settings->window_bits);
+  }
+  if (!in_call && inflate_settings->stream != nullptr) {
+    return InflateStream(strm, inflate_settings, flush);
+  }
+
   int ret = 1;
   bool end_of_stream = true;
-  bool iaa_available = false;
-  bool qat_available = false;
   if (!in_call && strm->avail_in > 0 && inflate_settings->path != ZLIB) {
     uint32_t input_len = strm->avail_in;
     uint32_t output_len = strm->avail_out;
-
-#ifdef USE_IAA
-    iaa_available = configs[USE_IAA_UNCOMPRESS] &&
-                    SupportedOptionsIAA(inflate_settings->window_bits,
-                                        input_len, output_len) &&
-                    IsIAADecompressible(strm->next_in, input_len,
-                                        inflate_settings->window_bits);
-
-#endif
-#ifdef USE_QAT
-    qat_available =
-        configs[USE_QAT_UNCOMPRESS] &&
-        SupportedOptionsQAT(inflate_settings->window_bits, input_len);
-#endif
-
-    // If both accelerators are enabled, send configured ratio of requests to
-    // one or the other
-    ExecutionPath path_selected = ZLIB;
-    if (iaa_available && qat_available) {
-      if (static_cast<uint32_t>(std::rand()) % 100 <
-          configs[IAA_UNCOMPRESS_PERCENTAGE]) {
-        path_selected = IAA;
-      } else {
-        path_selected = QAT;
-      }
-    } else if (iaa_available) {
-      path_selected = IAA;
-    } else if (qat_available) {
-      path_selected = QAT;
-    }
-
-    if (path_selected == IAA) {
-#ifdef USE_IAA
-      in_call = true;
-      ret = UncompressIAA(strm->next_in, &input_len, strm->next_out,
-                          &output_len, qpl_path_hardware,
-                          inflate_settings->window_bits, &end_of_stream);
-      inflate_settings->path = IAA;
-      in_call = false;
-      INCREMENT_STAT(INFLATE_IAA_COUNT);
-      INCREMENT_STAT_COND(ret != 0, INFLATE_IAA_ERROR_COUNT);
-#endif  // USE_IAA
-    } else if (path_selected == QAT) {
-#ifdef USE_QAT
-      in_call = true;
-      ret =
-          UncompressQAT(strm->next_in, &input_len, strm->next_out, &output_len,
-                        inflate_settings->window_bits, &end_of_stream);
-      inflate_settings->path = QAT;
-      // QATzip does not support stateful decompression
-      // Fall back to zlib if end-of-stream not reached in one call
-      if (!end_of_stream) {
-        ret = 1;
+    if (UseInflateOutputBuffer(inflate_settings, strm->next_in, input_len,
+                               output_len)) {
+      ret = UncompressToOutputBuffer(inflate_settings, strm->next_in,
+                                     &input_len);
+      if (ret == 0) {
+        strm->next_in += input_len;
+        strm->avail_in -= input_len;
+        strm->total_in += input_len;
+        if (cache_result) {
+          InflateStreamState* stream = inflate_settings->stream.get();
+          strm->adler = CachedStreamChecksum(
+              strm, inflate_settings->window_bits, stream->output.Data(),
+              stream->output.Pending());
+          InsertResult(cache_key, cache_input, input_len,
+                       stream->output.Data(), stream->output.Pending(),
+                       static_cast<uint32_t>(strm->adler));
+        }
+        return InflateStream(strm, inflate_settings, flush);
       }
-      in_call = false;
-      INCREMENT_STAT(INFLATE_QAT_COUNT);
-      INCREMENT_STAT_COND(ret != 0, INFLATE_QAT_ERROR_COUNT);
-#endif  // USE_QAT
+      inflate_settings->stream.reset();
+    } else {
+      ret = UncompressAccelerator(inflate_settings, strm->next_in, &input_len,
+                                  strm->next_out, &output_len,
+                                  &end_of_stream);
     }
 
     if (ret == 0) {
@@ -512,6 +2484,14 @@ int ZEXPORT inflate(z_streamp strm, int flush) {
       if (input_len > 0 || output_len > 0) {
         if (end_of_stream) {
           ret = Z_STREAM_END;
+          if (cache_result) {
+            strm->adler = CachedStreamChecksum(
+                strm, inflate_settings->window_bits,
+                strm->next_out - output_len, output_len);
+            InsertResult(cache_key, cache_input, input_len,
+                         strm->next_out - output_len, output_len,
+                         static_cast<uint32_t>(strm->adler));
+          }
         } else {
           ret = Z_OK;
         }
@@ -529,11 +2509,33 @@ int ZEXPORT inflate(z_streamp strm, int flush) {
   }
 
   if (in_call || configs[USE_ZLIB_UNCOMPRESS]) {
-    ret = orig_inflate(strm, flush);
-    INCREMENT_STAT(INFLATE_ZLIB_COUNT);
+    // Only calls decompressing a whole stream are timed for the scheduler
+    bool timed = !in_call && strm->total_in == 0;
+    uint64_t start_ns = timed ? StartTiming() : 0;
+    ret = InitLazyInflate(strm, inflate_settings);
+    if (ret == Z_OK) {
+      ret = orig_inflate(strm, flush);
+      INCREMENT_STAT(INFLATE_ZLIB_COUNT);
+    }
     if (!in_call) {
       inflate_settings->path = ZLIB;
     }
+    if (timed && ret == Z_STREAM_END) {
+      RecordTiming(Operation::UNCOMPRESS, ZLIB,
+                   static_cast<uint32_t>(strm->total_in), start_ns, true);
+    }
+    if (!in_call && ret == Z_STREAM_END) {
+      RecordExpansion(GetCompressedFormat(inflate_settings->window_bits),
+                      static_cast<uint32_t>(strm->total_in),
+                      static_cast<uint32_t>(strm->total_out));
+    }
+    if (cache_result && ret == Z_STREAM_END) {
+      InsertResult(cache_key, cache_input,
+                   static_cast<uint32_t>(strm->total_in),
+                   strm->next_out - strm->total_out,
+                   static_cast<uint32_t>(strm->total_out),
+                   static_cast<uint32_t>(strm->adler));
+    }
   } else {
     ret = Z_DATA_ERROR;
   }
@@ -550,30 +2552,151 @@ int ZEXPORT inflate(z_streamp strm, int flush) {
 int ZEXPORT inflateEnd(z_streamp strm) {
   Log(LogLevel::LOG_INFO, "inflateEnd Line ", __LINE__, ", strm ",
       static_cast<void*>(strm), "\n");
+  InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
+  bool zlib_initialized =
+      inflate_settings == nullptr || inflate_settings->zlib_initialized;
+  bool pooled =
+      inflate_settings != nullptr && PoolZlibInflate(strm, inflate_settings);
   inflate_stream_settings.Unset(strm);
+  if (!zlib_initialized || pooled) {
+    return Z_OK;
+  }
   return orig_inflateEnd(strm);
 }
 
 int ZEXPORT inflateReset(z_streamp strm) {
+  if (in_zlib_init) {
+    return orig_inflateReset(strm);
+  }
   Log(LogLevel::LOG_INFO, "inflateReset Line ", __LINE__, ", strm ",
       static_cast<void*>(strm), "\n");
   InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
   if (inflate_settings != nullptr) {
     inflate_settings->path = UNDEFINED;
+    inflate_settings->window_bits = inflate_settings->init_window_bits;
+    inflate_settings->stream.reset();
+    if (!inflate_settings->zlib_initialized) {
+      ResetLazyInflate(strm, inflate_settings);
+      return Z_OK;
+    }
   }
 
   return orig_inflateReset(strm);
 }
 
-int ZEXPORT compress2(Bytef* dest, uLongf* destLen, const Bytef* source,
-                      uLong sourceLen, int level) {
+int ZEXPORT inflateReset2(z_streamp strm, int window_bits) {
+  if (in_zlib_init) {
+    return orig_inflateReset2(strm, window_bits);
+  }
+  Log(LogLevel::LOG_INFO, "inflateReset2 Line ", __LINE__, ", strm ",
+      static_cast<void*>(strm), ", window_bits ", window_bits, "\n");
+  InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
+  if (inflate_settings != nullptr) {
+    int ret = InitLazyInflate(strm, inflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  int ret = orig_inflateReset2(strm, window_bits);
+  if (inflate_settings != nullptr && ret == Z_OK) {
+    inflate_settings->path = UNDEFINED;
+    inflate_settings->init_window_bits = window_bits;
+    inflate_settings->window_bits = window_bits;
+    inflate_settings->stream.reset();
+  }
+  return ret;
+}
+
+// The gzip header is filled by zlib: the stream stays on zlib until
+// inflateReset
+int ZEXPORT inflateGetHeader(z_streamp strm, gz_headerp head) {
+  InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
+  if (inflate_settings != nullptr) {
+    int ret = InitLazyInflate(strm, inflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  int ret = orig_inflateGetHeader(strm, head);
+  if (inflate_settings != nullptr && ret == Z_OK) {
+    inflate_settings->path = ZLIB;
+  }
+  return ret;
+}
+
+int ZEXPORT inflateSync(z_streamp strm) {
+  InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
+  if (inflate_settings != nullptr) {
+    int ret = InitLazyInflate(strm, inflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  return orig_inflateSync(strm);
+}
+
+// The copy is not registered with the shim: its calls go to zlib
+int ZEXPORT inflateCopy(z_streamp dest, z_streamp source) {
+  InflateSettings* inflate_settings = inflate_stream_settings.Get(source);
+  if (inflate_settings != nullptr) {
+    int ret = InitLazyInflate(source, inflate_settings);
+    if (ret != Z_OK) {
+      return ret;
+    }
+  }
+  return orig_inflateCopy(dest, source);
+}
+
+// Compresses a compress2 input with CompressParallel. Returns Z_OK if the
+// stream fits in the destination buffer.
+static int Compress2Parallel(bool use_accelerators, Bytef* dest,
+                             uLongf* destLen, const Bytef* source,
+                             uint32_t source_length, int level) {
+  StagingBuffer output;
+  uint32_t checksum;
+  int ret = CompressParallel(EntryPoint::COMPRESS2, use_accelerators, level,
+                             15, 8, Z_DEFAULT_STRATEGY,
+                             const_cast<uint8_t*>(source), source_length,
+                             &output, &checksum);
+  if (ret != Z_OK || output.Pending() > *destLen) {
+    return Z_BUF_ERROR;
+  }
+  *destLen = output.Drain(dest, output.Pending());
+  return Z_OK;
+}
+
+// compress2, without the result cache
+static int CompressWithEngines(Bytef* dest, uLongf* destLen,
+                               const Bytef* source, uLong sourceLen,
+                               int level) {
   Log(LogLevel::LOG_INFO, "compress2 Line ", __LINE__, ", sourceLen ",
       sourceLen, ", destLen ", *destLen, "\n");
 
   int ret = 1;
   uint32_t input_len = sourceLen;
-  (void)input_len;
   uint32_t output_len = *destLen;
+  bool length_supported = EngineLengthSupported(sourceLen);
+
+  if (length_supported && UseStoredBlocks(level, source, input_len) &&
+      StoredStreamBound(input_len) <= *destLen) {
+    uint32_t checksum;
+    *destLen = WriteStoredStream(dest, source, input_len, 15, level,
+                                 Z_DEFAULT_STRATEGY, &checksum);
+    INCREMENT_STAT(DEFLATE_STORED_COUNT);
+    Log(LogLevel::LOG_INFO, "compress2 Line ", __LINE__,
+        ", stored blocks, sourceLen ", sourceLen, ", destLen ", *destLen,
+        "\n");
+    return Z_OK;
+  }
+
+  if (!in_call && length_supported &&
+      UseParallelCompression(level, Z_DEFLATED, 15, input_len) &&
+      Compress2Parallel(true, dest, destLen, source, input_len, level) ==
+          Z_OK) {
+    Log(LogLevel::LOG_INFO, "compress2 Line ", __LINE__,
+        ", parallel, sourceLen ", sourceLen, ", destLen ", *destLen, "\n");
+    return Z_OK;
+  }
 
   bool iaa_available = false;
   bool qat_available = false;
@@ -586,43 +2709,63 @@ int ZEXPORT compress2(Bytef* dest, uLongf* destLen, const Bytef* source,
       configs[USE_QAT_COMPRESS] && SupportedOptionsQAT(15, input_len);
 #endif
 
-  ExecutionPath path_selected = ZLIB;
-  if (iaa_available) {
-    path_selected = IAA;
-  } else if (qat_available) {
-    path_selected = QAT;
-  }
+  ExecutionPath path_selected =
+      SelectPath(EntryPoint::COMPRESS2, 15, iaa_available, qat_available,
+                 input_len);
 
+  uint64_t start_ns = StartTiming();
   if (path_selected == IAA) {
 #ifdef USE_IAA
     in_call = true;
     ret = CompressIAA(const_cast<uint8_t*>(source), &input_len, dest,
-                      &output_len, qpl_path_hardware, 15);
+                      &output_len, qpl_path_hardware, 15, 0, false, level);
     in_call = false;
 #endif  // USE_IAA
   } else if (path_selected == QAT) {
 #ifdef USE_QAT
     in_call = true;
     ret = CompressQAT(const_cast<uint8_t*>(source), &input_len, dest,
-                      &output_len, 15);
+                      &output_len, 15, false, level);
     in_call = false;
 #endif  // USE_QAT
   }
+  if (path_selected != ZLIB) {
+    RecordAcceleratorResult(Operation::COMPRESS, path_selected, 15, sourceLen,
+                            start_ns, ret == 0);
+  }
 
   if (ret == 0) {
     *destLen = output_len;
     ret = Z_OK;
+    if (input_len == sourceLen) {
+      RecordAcceleratorRatio(path_selected, level, 15, 8, Z_DEFAULT_STRATEGY,
+                             const_cast<uint8_t*>(source), input_len,
+                             output_len);
+    }
 
     Log(LogLevel::LOG_INFO, "compress2 Line ", __LINE__,
         ", accelerator return code ", ret, ", sourceLen ", sourceLen,
         ", destLen ", *destLen, "\n");
+  } else if (configs[USE_ZLIB_COMPRESS] && !in_call && length_supported &&
+             UseParallelZlib(level, Z_DEFLATED, 15, input_len) &&
+             Compress2Parallel(false, dest, destLen, source, input_len,
+                               level) == Z_OK) {
+    ret = Z_OK;
+    Log(LogLevel::LOG_INFO, "compress2 Line ", __LINE__,
+        ", parallel zlib, sourceLen ", sourceLen, ", destLen ", *destLen,
+        "\n");
   } else if (configs[USE_ZLIB_COMPRESS]) {
     // compress2 in zlib calls deflate. It was observed that deflate is
     // sometimes intercepted by the shim. in_call prevents deflate from using
     // accelerators.
     in_call = true;
+    start_ns = StartTiming();
     ret = orig_compress2(dest, destLen, source, sourceLen, level);
     in_call = false;
+    RecordTiming(Operation::COMPRESS, ZLIB, sourceLen, start_ns, ret == Z_OK);
+    if (ret == Z_OK) {
+      RecordCompressedSize(ZLIB, CompressedFormat::ZLIB, sourceLen, *destLen);
+    }
     Log(LogLevel::LOG_INFO, "compress2 Line ", __LINE__, ", zlib return code ",
         ret, ", sourceLen ", sourceLen, ", destLen ", *destLen, "\n");
   } else {
@@ -631,19 +2774,47 @@ int ZEXPORT compress2(Bytef* dest, uLongf* destLen, const Bytef* source,
   return ret;
 }
 
+int ZEXPORT compress2(Bytef* dest, uLongf* destLen, const Bytef* source,
+                      uLong sourceLen, int level) {
+  if (compress_passthrough) {
+    return orig_compress2(dest, destLen, source, sourceLen, level);
+  }
+  if (in_call || sourceLen > std::numeric_limits<uint32_t>::max() ||
+      !UseResultCache(sourceLen)) {
+    return CompressWithEngines(dest, destLen, source, sourceLen, level);
+  }
+  ResultCacheKey key =
+      GetResultCacheKey(EntryPoint::COMPRESS2, 15, level, 8,
+                        Z_DEFAULT_STRATEGY, source, sourceLen);
+  std::shared_ptr<const CachedResult> result = LookupResult(key, source);
+  if (result != nullptr && result->output_length <= *destLen) {
+    memcpy(dest, result->output.get(), result->output_length);
+    *destLen = result->output_length;
+    return Z_OK;
+  }
+  int ret = CompressWithEngines(dest, destLen, source, sourceLen, level);
+  if (ret == Z_OK) {
+    InsertResult(key, source, sourceLen, dest, *destLen, 0);
+  }
+  return ret;
+}
+
 int ZEXPORT compress(Bytef* dest, uLongf* destLen, const Bytef* source,
                      uLong sourceLen) {
   return compress2(dest, destLen, source, sourceLen, Z_DEFAULT_COMPRESSION);
 }
 
-int ZEXPORT uncompress2(Bytef* dest, uLongf* destLen, const Bytef* source,
-                        uLong* sourceLen) {
+// uncompress2, without the result cache
+static int UncompressWithEngines(Bytef* dest, uLongf* destLen,
+                                 const Bytef* source, uLong* sourceLen) {
   Log(LogLevel::LOG_INFO, "uncompress2 Line ", __LINE__, ", sourceLen ",
       *sourceLen, ", destLen ", *destLen, "\n");
 
   int ret = 1;
   bool end_of_stream = true;
+#if !defined(USE_IAA) && !defined(USE_QAT)
   (void)end_of_stream;
+#endif
   uint32_t input_len = *sourceLen;
   uint32_t output_len = *destLen;
 
@@ -660,13 +2831,11 @@ int ZEXPORT uncompress2(Bytef* dest, uLongf* destLen, const Bytef* source,
       configs[USE_QAT_UNCOMPRESS] && SupportedOptionsQAT(15, input_len);
 #endif
 
-  ExecutionPath path_selected = ZLIB;
-  if (iaa_available) {
-    path_selected = IAA;
-  } else if (qat_available) {
-    path_selected = QAT;
-  }
+  ExecutionPath path_selected =
+      SelectPath(EntryPoint::UNCOMPRESS2, 15, iaa_available, qat_available,
+                 input_len);
 
+  uint64_t start_ns = StartTiming();
   if (path_selected == IAA) {
 #ifdef USE_IAA
     in_call = true;
@@ -682,6 +2851,10 @@ int ZEXPORT uncompress2(Bytef* dest, uLongf* destLen, const Bytef* source,
     in_call = false;
 #endif  // USE_QAT
   }
+  if (path_selected != ZLIB) {
+    RecordAcceleratorResult(Operation::UNCOMPRESS, path_selected, 15,
+                            *sourceLen, start_ns, ret == 0);
+  }
 
   if (ret == 0) {
     *sourceLen = input_len;
@@ -693,9 +2866,13 @@ int ZEXPORT uncompress2(Bytef* dest, uLongf* destLen, const Bytef* source,
         ", destLen ", *destLen, "\n");
   } else if (configs[USE_ZLIB_UNCOMPRESS]) {
     // refer to comment in compress2
+    uint32_t source_len = *sourceLen;
     in_call = true;
+    start_ns = StartTiming();
     ret = orig_uncompress2(dest, destLen, source, sourceLen);
     in_call = false;
+    RecordTiming(Operation::UNCOMPRESS, ZLIB, source_len, start_ns,
+                 ret == Z_OK);
     Log(LogLevel::LOG_INFO, "uncompress2 Line ", __LINE__,
         ", zlib return code ", ret, ", sourceLen ", *sourceLen, ", destLen ",
         *destLen, "\n");
@@ -705,25 +2882,53 @@ int ZEXPORT uncompress2(Bytef* dest, uLongf* destLen, const Bytef* source,
   return ret;
 }
 
+int ZEXPORT uncompress2(Bytef* dest, uLongf* destLen, const Bytef* source,
+                        uLong* sourceLen) {
+  if (uncompress_passthrough) {
+    return orig_uncompress2(dest, destLen, source, sourceLen);
+  }
+  if (in_call || *sourceLen > std::numeric_limits<uint32_t>::max() ||
+      !UseResultCache(*sourceLen)) {
+    return UncompressWithEngines(dest, destLen, source, sourceLen);
+  }
+  ResultCacheKey key =
+      GetResultCacheKey(EntryPoint::UNCOMPRESS2, 15, 0, 0, 0, source,
+                        static_cast<uint32_t>(*sourceLen));
+  std::shared_ptr<const CachedResult> result = LookupResult(key, source);
+  if (result != nullptr && result->output_length <= *destLen) {
+    memcpy(dest, result->output.get(), result->output_length);
+    *destLen = result->output_length;
+    *sourceLen = result->input_consumed;
+    return Z_OK;
+  }
+  int ret = UncompressWithEngines(dest, destLen, source, sourceLen);
+  if (ret == Z_OK) {
+    InsertResult(key, source, static_cast<uint32_t>(*sourceLen), dest,
+                 *destLen, 0);
+  }
+  return ret;
+}
+
 int ZEXPORT uncompress(Bytef* dest, uLongf* destLen, const Bytef* source,
                        uLong sourceLen) {
   uLong srcLen = sourceLen;
   return uncompress2(dest, destLen, source, &srcLen);
 }
 
+// Streams created in passthrough mode are always processed by zlib
 ExecutionPath GetDeflateExecutionPath(z_streamp strm) {
   DeflateSettings* deflate_settings = deflate_stream_settings.Get(strm);
-  return deflate_settings->path;
+  return deflate_settings != nullptr ? deflate_settings->path : ZLIB;
 }
 
 ExecutionPath GetInflateExecutionPath(z_streamp strm) {
   InflateSettings* inflate_settings = inflate_stream_settings.Get(strm);
-  return inflate_settings->path;
+  return inflate_settings != nullptr ? inflate_settings->path : ZLIB;
 }
 
 enum class FileMode { NONE, READ, WRITE, APPEND };
 
-struct GzipFile {
+struct GzipFile : SlabAllocated<GzipFile> {
   GzipFile() { Reset(); }
 
   GzipFile(int _fd, FileMode file_mode) : fd(_fd), mode(file_mode) { Reset(); }
@@ -735,8 +2940,12 @@ struct GzipFile {
     if (io_buf != nullptr) {
       delete[] io_buf;
     }
-    orig_deflateEnd(&deflate_stream);
-    orig_inflateEnd(&inflate_stream);
+    if (deflate_stream_initialized) {
+      orig_deflateEnd(&deflate_stream);
+    }
+    if (inflate_stream_initialized) {
+      orig_inflateEnd(&inflate_stream);
+    }
   }
 
   void Reset() {
@@ -748,13 +2957,31 @@ struct GzipFile {
     data_buf_content = 0;
     io_buf_pos = 0;
     io_buf_content = 0;
+  }
 
+  // The zlib streams are initialized on first use, as a file is either read or
+  // written, and accelerators may process all of its data
+  int InitDeflateStream() {
+    if (deflate_stream_initialized) {
+      return Z_OK;
+    }
     memset(&deflate_stream, 0, sizeof(z_stream));
-    orig_deflateInit2_(&deflate_stream, -1, Z_DEFLATED, 31, 8,
-                       Z_DEFAULT_STRATEGY, ZLIB_VERSION, (int)sizeof(z_stream));
+    int ret = orig_deflateInit2_(&deflate_stream, -1, Z_DEFLATED, 31, 8,
+                                 Z_DEFAULT_STRATEGY, ZLIB_VERSION,
+                                 (int)sizeof(z_stream));
+    deflate_stream_initialized = (ret == Z_OK);
+    return ret;
+  }
+
+  int InitInflateStream() {
+    if (inflate_stream_initialized) {
+      return Z_OK;
+    }
     memset(&inflate_stream, 0, sizeof(z_stream));
-    orig_inflateInit2_(&inflate_stream, 31, ZLIB_VERSION,
-                       (int)sizeof(z_stream));
+    int ret = orig_inflateInit2_(&inflate_stream, 31, ZLIB_VERSION,
+                                 (int)sizeof(z_stream));
+    inflate_stream_initialized = (ret == Z_OK);
+    return ret;
   }
 
   void AllocateBuffers() {
@@ -805,6 +3032,8 @@ struct GzipFile {
   // Stream to use zlib in case of accelerator errors
   z_stream deflate_stream;
   z_stream inflate_stream;
+  bool deflate_stream_initialized = false;
+  bool inflate_stream_initialized = false;
 };
 
 class GzipFiles {
@@ -819,7 +3048,7 @@ class GzipFiles {
   GzipFile* Get(gzFile file) { return map.Get(file); }
 
  private:
-  ShardedMap<gzFile, std::unique_ptr<GzipFile>> map;
+  StreamTable<gzFile, GzipFile> map;
 };
 GzipFiles gzip_files;
 
@@ -931,13 +3160,11 @@ static int GzwriteAcceleratorCompress(GzipFile* gz, uint8_t* input,
       configs[USE_QAT_COMPRESS] && SupportedOptionsQAT(31, *input_length);
 #endif
 
-  ExecutionPath path_selected = ZLIB;
-  if (qat_available) {
-    path_selected = QAT;
-  } else if (iaa_available) {
-    path_selected = IAA;
-  }
+  ExecutionPath path_selected = SelectPath(
+      EntryPoint::GZWRITE, 31, iaa_available, qat_available, *input_length);
 
+  uint32_t input_len = *input_length;
+  uint64_t start_ns = StartTiming();
   if (path_selected == IAA) {
 #ifdef USE_IAA
     in_call = true;
@@ -954,6 +3181,10 @@ static int GzwriteAcceleratorCompress(GzipFile* gz, uint8_t* input,
     in_call = false;
 #endif  // USE_QAT
   }
+  if (path_selected != ZLIB) {
+    RecordAcceleratorResult(Operation::COMPRESS, path_selected, 31, input_len,
+                            start_ns, ret == 0);
+  }
   return ret;
 }
 
@@ -982,13 +3213,11 @@ static int GzreadAcceleratorUncompress(GzipFile* gz, uint8_t* input,
       configs[USE_QAT_UNCOMPRESS] && SupportedOptionsQAT(31, *input_length);
 #endif
 
-  ExecutionPath path_selected = ZLIB;
-  if (qat_available) {
-    path_selected = QAT;
-  } else if (iaa_available) {
-    path_selected = IAA;
-  }
+  ExecutionPath path_selected = SelectPath(
+      EntryPoint::GZREAD, 31, iaa_available, qat_available, *input_length);
 
+  uint32_t input_len = *input_length;
+  uint64_t start_ns = StartTiming();
   if (path_selected == IAA) {
 #ifdef USE_IAA
     in_call = true;
@@ -1006,6 +3235,10 @@ static int GzreadAcceleratorUncompress(GzipFile* gz, uint8_t* input,
     in_call = false;
 #endif  // USE_QAT
   }
+  if (path_selected != ZLIB) {
+    RecordAcceleratorResult(Operation::UNCOMPRESS, path_selected, 31,
+                            input_len, start_ns, ret == 0);
+  }
   return ret;
 }
 
@@ -1045,6 +3278,9 @@ static int CompressAndWrite(gzFile file, GzipFile* gz) {
   if (ret == 0) {
     gz->data_buf_pos = input_len;
   } else {
+    if (gz->InitDeflateStream() != Z_OK) {
+      return 1;
+    }
     gz->deflate_stream.next_in = (Bytef*)(gz->data_buf);
     gz->deflate_stream.avail_in =
         static_cast<unsigned int>(gz->data_buf_content);
@@ -1231,6 +3467,10 @@ int ZEXPORT gzread(gzFile file, voidp buf, unsigned len) {
           }
 
           if (gz->use_zlib_for_decompression) {
+            if (gz->InitInflateStream() != Z_OK) {
+              read_bytes = -1;
+              goto gzread_end;
+            }
             gz->inflate_stream.next_in = (Bytef*)(gz->io_buf);
             gz->inflate_stream.avail_in =
                 static_cast<unsigned int>(gz->io_buf_content);
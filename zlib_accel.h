@@ -10,5 +10,7 @@
 enum ExecutionPath { UNDEFINED, ZLIB, QAT, IAA };
 ExecutionPath GetDeflateExecutionPath(z_streamp strm);
 ExecutionPath GetInflateExecutionPath(z_streamp strm);
+// Frees the zlib states pooled by the calling thread (zlib_state_pool_size)
+void ClearZlibStatePools();
 
 #pragma GCC visibility pop